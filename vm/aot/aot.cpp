@@ -0,0 +1,712 @@
+// Ahead-of-time translator from a BytecodeModule .bin to C++.
+//
+// usage: aot input.bin output.cpp [--header output.hpp] [--namespace name]
+//
+// Everything reachable from the exports becomes one function made of labelled
+// basic blocks, with `return` dispatching over the known return sites. Each
+// export gets a wrapper taking a vm::Machine, which runs the translation
+// against the module's memory through Machine::execute_native(). extern_call
+// goes through Machine::call_extern(), to system modules as usual or to other
+// bytecode modules on the interpreter, so translated programs can replace the
+// interpreter wherever the engine is available.
+//
+// Translated code doesn't bounds check the stacks, so it only runs when the
+// module verifies and the stacks have room for the export (see Verifier.hpp),
+// otherwise execute_native() runs the export on the interpreter. Verification
+// needs the system modules' stack effects, which are only known at runtime,
+// so it happens there rather than here. Loads and stores are checked against
+// the module like on the engines.
+//
+// Self-modifying code is not supported: a store that hits translated code, or
+// a return to a pc that isn't a return site, ends the call with
+// Error::NotTranslated.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "DecodedCode.hpp"
+
+namespace {
+
+constexpr std::string_view handler_names[] = {
+   "unknown",
+   "decode",
+   "eof",
+#define HANDLER_NAME(_name) #_name,
+   DECODED_HANDLERS(HANDLER_NAME)
+#undef HANDLER_NAME
+};
+
+std::string lowercase(std::string_view text) {
+   std::string out(text);
+   std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) {
+      return std::tolower(c);
+   });
+   return out;
+}
+
+/// @brief turn an export or module name in to a C++ identifier
+std::string identifier(std::string_view name) {
+   std::string out;
+   for(auto c : name) {
+      out += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+   }
+   if(out.empty() || std::isdigit(static_cast<unsigned char>(out[0]))) {
+      out = "_" + out;
+   }
+   return out;
+}
+
+bool falls_through(vm::Handler handler) {
+   switch(handler) {
+   case vm::H_JUMP_IMM:
+   case vm::H_RETURN:
+   case vm::H_UNKNOWN:
+   case vm::H_EOF:
+      return false;
+   default:
+      return true;
+   }
+}
+
+/// @brief Code reachable from the exports, and which pcs need a label
+class ControlFlow {
+public:
+   ControlFlow(
+      std::span<unsigned char const> code, std::span<int const> roots
+   ) :
+      visited(code.size() + 1, false),
+      leader(code.size() + 1, false),
+      m_code(code) {
+      int code_size = code.size();
+      std::vector<int> worklist;
+      for(auto root : roots) {
+         if(root >= 0 && root <= code_size) {
+            leader[root] = true;
+            worklist.push_back(root);
+         }
+      }
+
+      while(!worklist.empty()) {
+         auto pc = worklist.back();
+         worklist.pop_back();
+         if(visited[pc]) {
+            continue;
+         }
+         visited[pc] = true;
+
+         auto instr = decode(pc);
+         auto next = pc + instr.length;
+         switch(instr.handler) {
+         case vm::H_JUMP_IMM:
+         case vm::H_BTRUE_IMM:
+         case vm::H_BFALSE_IMM:
+            leader[instr.operand] = true;
+            worklist.push_back(instr.operand);
+            break;
+         case vm::H_CALL_IMM:
+            leader[instr.operand] = true;
+            worklist.push_back(instr.operand);
+            leader[next] = true;
+            return_sites.push_back(next);
+            break;
+         default:
+            break;
+         }
+         if(falls_through(instr.handler)) {
+            worklist.push_back(next);
+         }
+      }
+
+      std::sort(return_sites.begin(), return_sites.end());
+      return_sites.erase(
+         std::unique(return_sites.begin(), return_sites.end()),
+         return_sites.end()
+      );
+
+      // anything not reached by falling out of the previous instruction
+      // needs a label to goto
+      int previous = -1;
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(!visited[pc]) {
+            continue;
+         }
+         if(previous >= 0 && previous + decode(previous).length != pc) {
+            leader[pc] = true;
+         }
+         previous = pc;
+      }
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(visited[pc]) {
+            auto instr = decode(pc);
+            auto next = pc + instr.length;
+            if(falls_through(instr.handler) && next_visited(pc) != next) {
+               leader[next] = true;
+            }
+         }
+      }
+   }
+
+   vm::DecodedInstr decode(int pc) const {
+      return vm::DecodedCode::decode_one(m_code, pc);
+   }
+
+   /// @brief the instruction emitted after pc, or -1
+   int next_visited(int pc) const {
+      for(int i = pc + 1; i < visited.size(); ++i) {
+         if(visited[i]) {
+            return i;
+         }
+      }
+      return -1;
+   }
+
+   std::vector<bool> visited;
+   std::vector<bool> leader;
+   std::vector<int> return_sites;
+
+private:
+   std::span<unsigned char const> m_code;
+};
+
+// Statement for every handler that doesn't need the instruction's operand.
+// The macros are defined in the generated preamble.
+std::string_view statement(vm::Handler handler) {
+   switch(handler) {
+   case vm::H_NOP:
+      return "";
+   case vm::H_ADD:
+      return "BINARY_OP(+);";
+   case vm::H_SUB:
+      return "BINARY_OP(-);";
+   case vm::H_MUL:
+      return "BINARY_OP(*);";
+   case vm::H_DIV:
+      return "BINARY_OP(/);";
+   case vm::H_MOD:
+      return "BINARY_OP(%);";
+   case vm::H_SHR:
+      return "BINARY_OP(>>);";
+   case vm::H_SHL:
+      return "BINARY_OP(<<);";
+   case vm::H_GT:
+      return "COMPARISON_OP(>);";
+   case vm::H_LT:
+      return "COMPARISON_OP(<);";
+   case vm::H_GE:
+      return "COMPARISON_OP(>=);";
+   case vm::H_LE:
+      return "COMPARISON_OP(<=);";
+   case vm::H_EQ:
+      return "COMPARISON_OP(==);";
+   case vm::H_NEQ:
+      return "COMPARISON_OP(!=);";
+   case vm::H_RETURN:
+      return "RETURN();";
+   case vm::H_LOAD_MODULE:
+      return "LOAD_MODULE();";
+   case vm::H_EXTERN_CALL:
+      return "EXTERN_CALL();";
+   case vm::H_LOAD_WORD:
+      return "LOAD_WORD();";
+   case vm::H_STORE_WORD:
+      return "STORE_WORD();";
+   case vm::H_DUP:
+      return "DUP();";
+   case vm::H_SWAP:
+      return "SWAP();";
+   case vm::H_DROP:
+      return "--sp;";
+   case vm::H_OVER:
+      return "OVER();";
+   case vm::H_ROT:
+      return "ROT();";
+   case vm::H_PICK:
+      return "PICK();";
+   case vm::H_RPUSH:
+      return "RPUSH(POP());";
+   case vm::H_RPOP:
+      return "PUSH(RPOP());";
+   case vm::H_RCOPY:
+      return "PUSH(RPEEK(0));";
+   case vm::H_INC:
+      return "PEEK(0) += 1;";
+   case vm::H_DEC:
+      return "PEEK(0) -= 1;";
+   case vm::H_RCOPY2:
+      return "RCOPY2();";
+   case vm::H_LOAD_BYTE:
+      return "LOAD_BYTE();";
+   case vm::H_STORE_BYTE:
+      return "STORE_BYTE();";
+   case vm::H_EOF:
+      return "EXIT(vm::Error::EofWithoutReturn);";
+   default:
+      // unknown opcode, the interpreter just stops
+      return "EXIT(std::nullopt);";
+   }
+}
+
+constexpr std::string_view preamble = R"(
+using vm::StackWord;
+
+constexpr int RETURN_STACK_SIZE = 0x100;
+
+// The data stack is kept in sp while translated code runs, and only synced
+// with machine.stack() around system calls and on exit.
+#define PUSH(_value) (*sp++ = static_cast<StackWord>(_value))
+#define POP() (*--sp)
+#define PEEK(_n) (sp[-1 - (_n)])
+#define RPUSH(_value) (*rsp++ = static_cast<StackWord>(_value))
+#define RPOP() (*--rsp)
+#define RPEEK(_n) (rsp[-1 - (_n)])
+
+#define EXIT(_result)                                                          \
+   do {                                                                        \
+      stack.set_item_count(sp - stack.data());                                 \
+      return _result;                                                          \
+   } while(0)
+
+#define BINARY_OP(_op)                                                         \
+   do {                                                                        \
+      auto r = POP();                                                          \
+      auto l = POP();                                                          \
+      PUSH(l _op r);                                                           \
+   } while(0)
+
+#define COMPARISON_OP(_op)                                                     \
+   do {                                                                        \
+      auto r = POP();                                                          \
+      auto l = POP();                                                          \
+      PUSH((l _op r) ? vm::Machine::TRUE_WORD : vm::Machine::FALSE_WORD);      \
+   } while(0)
+
+#define RETURN()                                                               \
+   do {                                                                        \
+      if(rsp == rstack) {                                                      \
+         EXIT(std::nullopt);                                                   \
+      }                                                                        \
+      goto return_dispatch;                                                    \
+   } while(0)
+
+// Verification doesn't bound addresses, so loads and stores are checked
+// against the module before they pop, same as the engines.
+#define CHECK_ADDRESS(_address, _length)                                       \
+   do {                                                                        \
+      auto first = static_cast<std::size_t>(_address);                         \
+      if(first >= CODE_SIZE || first + (_length) > CODE_SIZE) {                \
+         EXIT(vm::Error::AddressOutOfRange);                                   \
+      }                                                                        \
+   } while(0)
+
+#define LOAD_MODULE()                                                          \
+   do {                                                                        \
+      CHECK_ADDRESS(PEEK(0), 1);                                               \
+      auto name_end = std::find(memory + PEEK(0), memory + CODE_SIZE, '\0');   \
+      CHECK_ADDRESS(PEEK(0), name_end - (memory + PEEK(0)) + 1);               \
+      auto name_ptr = POP();                                                   \
+      auto index = machine.get_or_load_module(                                 \
+         reinterpret_cast<char const*>(&memory[name_ptr])                      \
+      );                                                                       \
+      if(index < 0) {                                                          \
+         EXIT(vm::Error::ModuleNotFound);                                      \
+      }                                                                        \
+      PUSH(index);                                                             \
+   } while(0)
+
+#define PUSH_MODULE(_import)                                                   \
+   do {                                                                        \
+      auto id = machine.import_module_id(_import);                             \
+      if(id < 0) {                                                             \
+         EXIT(vm::Error::ModuleNotFound);                                      \
+      }                                                                        \
+      PUSH(id);                                                                \
+   } while(0)
+
+#define EXTERN_CALL()                                                          \
+   do {                                                                        \
+      auto fn_id = POP();                                                      \
+      auto module_id = POP();                                                  \
+      stack.set_item_count(sp - stack.data());                                 \
+      auto error = machine.call_extern(module_id, fn_id);                      \
+      sp = stack.data() + stack.item_count();                                  \
+      if(error.has_value()) {                                                  \
+         EXIT(error);                                                          \
+      }                                                                        \
+   } while(0)
+
+#define LOAD_WORD()                                                            \
+   do {                                                                        \
+      CHECK_ADDRESS(PEEK(0), 2);                                               \
+      auto address = POP();                                                    \
+      PUSH(memory[address] | (memory[address + 1] << 8));                      \
+   } while(0)
+
+#define LOAD_BYTE()                                                            \
+   do {                                                                        \
+      CHECK_ADDRESS(PEEK(0), 1);                                               \
+      auto address = POP();                                                    \
+      PUSH(memory[address]);                                                   \
+   } while(0)
+
+#define STORE_WORD()                                                           \
+   do {                                                                        \
+      CHECK_ADDRESS(PEEK(0), 2);                                               \
+      auto address = POP();                                                    \
+      auto value = POP();                                                      \
+      memory[address] = value & 0xff;                                          \
+      memory[address + 1] = value >> 8;                                        \
+      if(hits_translated(address, 2)) {                                        \
+         EXIT(vm::Error::NotTranslated);                                       \
+      }                                                                        \
+   } while(0)
+
+#define STORE_BYTE()                                                           \
+   do {                                                                        \
+      CHECK_ADDRESS(PEEK(0), 1);                                               \
+      auto address = POP();                                                    \
+      memory[address] = POP() & 0xff;                                          \
+      if(hits_translated(address, 1)) {                                        \
+         EXIT(vm::Error::NotTranslated);                                       \
+      }                                                                        \
+   } while(0)
+
+#define DUP()                                                                  \
+   do {                                                                        \
+      auto top = PEEK(0);                                                      \
+      PUSH(top);                                                               \
+   } while(0)
+
+#define OVER()                                                                 \
+   do {                                                                        \
+      auto second = PEEK(1);                                                   \
+      PUSH(second);                                                            \
+   } while(0)
+
+#define SWAP()                                                                 \
+   do {                                                                        \
+      auto a = POP();                                                          \
+      auto b = POP();                                                          \
+      PUSH(a);                                                                 \
+      PUSH(b);                                                                 \
+   } while(0)
+
+#define ROT()                                                                  \
+   do {                                                                        \
+      auto c = POP();                                                          \
+      auto b = POP();                                                          \
+      auto a = POP();                                                          \
+      PUSH(b);                                                                 \
+      PUSH(c);                                                                 \
+      PUSH(a);                                                                 \
+   } while(0)
+
+#define PICK()                                                                 \
+   do {                                                                        \
+      auto index = POP();                                                      \
+      auto value = PEEK(index);                                                \
+      PUSH(value);                                                             \
+   } while(0)
+
+#define RCOPY2()                                                               \
+   do {                                                                        \
+      auto top = RPEEK(0);                                                     \
+      auto second = RPEEK(1);                                                  \
+      PUSH(second);                                                            \
+      PUSH(top);                                                               \
+   } while(0)
+
+[[maybe_unused]] bool hits_translated(int address, int length) {
+   for(int i = address; i < address + length; ++i) {
+      if(i >= 0 && i < CODE_SIZE && ((translated[i >> 3] >> (i & 7)) & 1)) {
+         return true;
+      }
+   }
+   return false;
+}
+)";
+
+class Translator {
+public:
+   Translator(vm::BytecodeModule& module, std::string ns) :
+      m_module(module),
+      m_code(module.code()),
+      m_namespace(std::move(ns)),
+      m_flow(m_code, roots(module)) {}
+
+   void write_header(std::ostream& out) const {
+      out << "// Generated by vm/aot, do not edit.\n\n"
+          << "#pragma once\n\n"
+          << "#include <optional>\n\n"
+          << "#include \"BytecodeModule.hpp\"\n"
+          << "#include \"Machine.hpp\"\n\n"
+          << "namespace " << m_namespace << " {\n\n"
+          << "/// @brief copy of the translated module, add it to the Machine "
+             "before\n/// calling an export\n"
+          << "vm::BytecodeModule load_module();\n\n";
+      for(auto const& exp : exports()) {
+         out << "std::optional<vm::Error> " << identifier(exp.name)
+             << "(vm::Machine& machine);\n";
+      }
+      out << "\n} // namespace " << m_namespace << "\n";
+   }
+
+   void write_source(
+      std::ostream& out, std::string_view input, std::string_view header
+   ) const {
+      out << "// Generated by vm/aot from " << input << ", do not edit.\n\n";
+      if(!header.empty()) {
+         out << "#include \"" << header << "\"\n";
+      }
+      out << "#include \"Machine.hpp\"\n\n"
+          << "#include <algorithm>\n"
+          << "#include <cstddef>\n"
+          << "#include <iterator>\n"
+          << "#include <optional>\n"
+          << "#include <span>\n"
+          << "#include <vector>\n\n"
+          << "namespace {\n\n";
+
+      write_bytes(out);
+      out << preamble << "\n";
+      write_run(out);
+
+      for(auto const& exp : exports()) {
+         out << "std::optional<vm::Error> run_" << identifier(exp.name)
+             << "(\n   vm::Machine& machine, std::span<unsigned char> memory\n"
+             << ") {\n   return run(machine, memory, ENTRY_"
+             << identifier(exp.name) << ");\n}\n\n";
+      }
+      out << "} // namespace\n\n"
+          << "namespace " << m_namespace << " {\n\n"
+          << "vm::BytecodeModule load_module() {\n"
+          << "   std::vector<unsigned char> bytes(\n"
+          << "      std::begin(module_bytes), std::end(module_bytes)\n"
+          << "   );\n"
+          << "   return vm::BytecodeModule::load(bytes).value();\n"
+          << "}\n\n";
+      for(auto const& exp : exports()) {
+         out << "std::optional<vm::Error> " << identifier(exp.name)
+             << "(vm::Machine& machine) {\n"
+             << "   return machine.execute_native(\n      \"" << m_module.name()
+             << "\", \"" << exp.name << "\", run_" << identifier(exp.name)
+             << "\n   );\n}\n\n";
+      }
+      out << "} // namespace " << m_namespace << "\n";
+   }
+
+   /// @brief whole .bin, header included, so load_module() needs no file
+   std::vector<unsigned char> bytes;
+
+private:
+   vm::BytecodeModule& m_module;
+   std::span<unsigned char const> m_code;
+   std::string m_namespace;
+   ControlFlow m_flow;
+
+   static std::vector<int> roots(vm::BytecodeModule& module) {
+      std::vector<int> out;
+      for(int i = 0; auto exp = module.nth_export(i); ++i) {
+         out.push_back(exp->bytecode_offset);
+      }
+      return out;
+   }
+
+   std::vector<vm::BytecodeModule::ExportFunction> exports() const {
+      std::vector<vm::BytecodeModule::ExportFunction> out;
+      for(int i = 0; auto exp = m_module.nth_export(i); ++i) {
+         out.push_back(*exp);
+      }
+      return out;
+   }
+
+   static void write_byte_array(
+      std::ostream& out, std::string_view name,
+      std::vector<unsigned char> const& data
+   ) {
+      out << "constexpr unsigned char " << name << "[] = {";
+      for(int i = 0; i < data.size(); ++i) {
+         out << (i % 16 == 0 ? "\n   " : " ");
+         char hex[8];
+         std::snprintf(hex, sizeof(hex), "0x%02x,", data[i]);
+         out << hex;
+      }
+      out << "\n};\n\n";
+   }
+
+   void write_bytes(std::ostream& out) const {
+      write_byte_array(out, "module_bytes", bytes);
+
+      std::vector<unsigned char> translated((m_code.size() + 8) / 8, 0);
+      for(int pc = 0; pc < m_code.size(); ++pc) {
+         if(!m_flow.visited[pc]) {
+            continue;
+         }
+         auto length = std::max<int>(m_flow.decode(pc).length, 1);
+         for(int i = pc; i < pc + length && i < m_code.size(); ++i) {
+            translated[i >> 3] |= 1 << (i & 7);
+         }
+      }
+      out << "constexpr int CODE_SIZE = " << m_code.size() << ";\n\n"
+          << "/// @brief one bit per code byte that was translated\n";
+      write_byte_array(out, "translated", translated);
+   }
+
+   void write_run(std::ostream& out) const {
+      auto exports = this->exports();
+      out << "enum Entry {\n";
+      for(auto const& exp : exports) {
+         out << "   ENTRY_" << identifier(exp.name) << ",\n";
+      }
+      out << "};\n\n"
+          << "std::optional<vm::Error> run(\n"
+          << "   vm::Machine& machine, std::span<unsigned char> memory_span,\n"
+          << "   Entry entry\n"
+          << ") {\n"
+          << "   auto& stack = machine.stack();\n"
+          << "   StackWord* sp = stack.data() + stack.item_count();\n"
+          << "   StackWord rstack[RETURN_STACK_SIZE];\n"
+          << "   StackWord* rsp = rstack;\n"
+          << "   auto memory = memory_span.data();\n\n"
+          << "   switch(entry) {\n";
+      int code_size = m_code.size();
+      for(auto const& exp : exports) {
+         auto pc = std::clamp(exp.bytecode_offset, 0, code_size);
+         out << "   case ENTRY_" << identifier(exp.name) << ":\n"
+             << "      goto pc_" << pc << ";\n";
+      }
+      out << "   }\n\n";
+
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(!m_flow.visited[pc]) {
+            continue;
+         }
+         if(m_flow.leader[pc]) {
+            out << "pc_" << pc << ":\n";
+         }
+         write_instr(out, pc);
+      }
+
+      out << "return_dispatch:\n"
+          << "   switch(RPOP()) {\n";
+      for(auto site : m_flow.return_sites) {
+         out << "   case " << site << ":\n      goto pc_" << site << ";\n";
+      }
+      out << "   default:\n"
+          << "      EXIT(vm::Error::NotTranslated);\n"
+          << "   }\n"
+          << "}\n\n";
+   }
+
+   void write_instr(std::ostream& out, int pc) const {
+      auto instr = m_flow.decode(pc);
+      auto name = lowercase(handler_names[instr.handler]);
+      auto next = pc + instr.length;
+      switch(instr.handler) {
+      case vm::H_PUSH_IMM:
+         out << "   PUSH(" << instr.operand << "); // " << name << "\n";
+         break;
+      case vm::H_PUSH_MODULE:
+         out << "   PUSH_MODULE(" << instr.operand << "); // " << name << "\n";
+         break;
+      case vm::H_JUMP_IMM:
+         out << "   goto pc_" << instr.operand << "; // " << name << "\n";
+         break;
+      case vm::H_CALL_IMM:
+         out << "   RPUSH(" << next << "); // " << name << "\n"
+             << "   goto pc_" << instr.operand << ";\n";
+         break;
+      case vm::H_BTRUE_IMM:
+         out << "   if(POP()) { // " << name << "\n"
+             << "      goto pc_" << instr.operand << ";\n   }\n";
+         break;
+      case vm::H_BFALSE_IMM:
+         out << "   if(!POP()) { // " << name << "\n"
+             << "      goto pc_" << instr.operand << ";\n   }\n";
+         break;
+      default: {
+         auto text = statement(instr.handler);
+         out << "   " << text << (text.empty() ? "" : " ") << "// " << name
+             << "\n";
+      } break;
+      }
+
+      if(falls_through(instr.handler) && m_flow.next_visited(pc) != next) {
+         out << "   goto pc_" << next << ";\n";
+      }
+   }
+};
+
+std::vector<unsigned char> read_file(char const* filename) {
+   std::ifstream file(filename, std::ios::binary);
+   return {std::istreambuf_iterator<char>(file), {}};
+}
+
+void usage() {
+   std::printf(
+      "usage: aot input.bin output.cpp [--header output.hpp] "
+      "[--namespace name]\n"
+   );
+   std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+   char const* input = nullptr;
+   char const* output = nullptr;
+   char const* header = nullptr;
+   std::string ns;
+   for(int i = 1; i < argc; ++i) {
+      auto arg = std::string_view(argv[i]);
+      if(arg == "--header" && i + 1 < argc) {
+         header = argv[++i];
+      } else if(arg == "--namespace" && i + 1 < argc) {
+         ns = argv[++i];
+      } else if(!input) {
+         input = argv[i];
+      } else if(!output) {
+         output = argv[i];
+      } else {
+         usage();
+      }
+   }
+   if(!input || !output) {
+      usage();
+   }
+
+   auto bytes = read_file(input);
+   auto module = vm::BytecodeModule::load(bytes);
+   if(!module.has_value()) {
+      std::printf("%s: %s\n", input, vm::error_to_str(module.error()).data());
+      return 1;
+   }
+   if(ns.empty()) {
+      ns = identifier(module->name());
+   }
+
+   auto translator = Translator(*module, ns);
+   translator.bytes = bytes;
+
+   std::string header_name;
+   if(header) {
+      header_name = std::filesystem::path(header).filename().string();
+      std::ofstream out(header);
+      translator.write_header(out);
+   }
+   std::ofstream out(output);
+   translator.write_source(
+      out, std::filesystem::path(input).filename().string(), header_name
+   );
+   return out ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 #!/usr/bin/python3
 from enum import Enum
 import argparse
+import os
 
 
 class Token(Enum):
@@ -252,12 +253,26 @@ OPCODES = {
     "storebyte": 45,
     "!b": 45,
     "pick": 46,
+    "push_module": 47,
 }
 
+# header version with an import table, older headers start with the name
+HEADER_IMPORTS = 2
+# header version with a code/data/bss size table after the version byte
+HEADER_SEGMENTS = 3
+# version flag for 32-bit word modules: 4 byte immediates and export offsets
+HEADER_WIDE = 0x80
+
 
 class Module:
-    def __init__(self, text: str):
-        self.program = bytearray()
+    def __init__(self, text: str, word_size=2):
+        self.word_size = word_size
+        self.code = bytearray()
+        self.data = bytearray()
+        self.bss_size = 0
+        # segment being assembled, $data switches to the data segment
+        self.segment = "code"
+        self.program = self.code
         self.tracetext = ""
         self.labels = {}
         self.patchups = {}
@@ -265,6 +280,7 @@ class Module:
         self.module_name = None
         self.exports = []
         self.resolved_exports = {}
+        self.imports = []
 
         lexer = Lexer(text)
         self.compile_lexer_contents(Lexer(text))
@@ -274,11 +290,24 @@ class Module:
         print("labels", self.labels)
         print("patchups", self.patchups)
 
-        for patchup_location, labelname in self.patchups.items():
+        # segments are laid out code, data, bss
+        segment_base = {
+            "code": 0,
+            "data": len(self.code),
+            "bss": len(self.code) + len(self.data),
+        }
+        segment_program = {"code": self.code, "data": self.data}
+
+        def address_of(labelname):
+            segment, offset = self.labels[labelname]
+            return segment_base[segment] + offset
+
+        for (segment, patchup_location), labelname in self.patchups.items():
             if labelname in self.labels:
-                location = self.labels[labelname]
-                self.program[patchup_location] = location & 0xFF
-                self.program[patchup_location + 1] = (location >> 8) & 0xFF
+                location = address_of(labelname)
+                program = segment_program[segment]
+                for i in range(self.word_size):
+                    program[patchup_location + i] = (location >> (8 * i)) & 0xFF
             else:
                 print(f"undefined label {labelname}")
                 exit(1)
@@ -286,14 +315,15 @@ class Module:
         # look up the final resting place of our declared exported symbols
         for export in self.exports:
             if export in self.labels:
-                self.resolved_exports[export] = self.labels[export]
+                self.resolved_exports[export] = address_of(export)
             else:
                 print(f"undefined label for export: {labelname}")
                 exit(1)
 
     def bytecode(self) -> bytearray:
         bytecode = self.generate_header()
-        bytecode.extend(self.program)
+        bytecode.extend(self.code)
+        bytecode.extend(self.data)
         return bytecode
 
     def compile_lexer_contents(self, lexer: Lexer):
@@ -331,8 +361,16 @@ class Module:
                 self.module_name_macro(lexer)
             elif data == "export":
                 self.export_macro(lexer)
+            elif data == "import":
+                self.import_macro(lexer)
+            elif data == "modid":
+                self.modid_macro(lexer)
             elif data == "zeros":
                 self.zeros_macro(lexer)
+            elif data == "data":
+                self.data_macro(lexer)
+            elif data == "bss":
+                self.bss_macro(lexer)
             else:
                 print(f"unknown macro {data}")
                 exit(1)
@@ -342,7 +380,7 @@ class Module:
             # push immediate label value
             self.emit_opcode("push_imm")
             self.register_patch_of_resolved_label_here(data)
-            self.emit_short(f"add_of_word: {data}")
+            self.emit_word(f"add_of_word: {data}")
         elif tok == Token.DATA_BLOCK:
             self.trace(f"DATA_BLOCK: {data.hex()}", len(data))
             self.program.extend(data)
@@ -363,7 +401,7 @@ class Module:
         try:
             intword = int(word, 0)
             self.emit_opcode("push_imm")
-            self.emit_short(f"short_imm: {intword}", value=intword)
+            self.emit_word(f"short_imm: {intword}", value=intword)
             return
         except ValueError:
             pass
@@ -371,7 +409,7 @@ class Module:
         if word in self.labels:
             self.emit_opcode("call_imm")
             self.register_patch_of_resolved_label_here(word)
-            self.emit_short(f"call_target: {word}")
+            self.emit_word(f"call_target: {word}")
             return
 
         print(f"undefined word {word}")
@@ -388,18 +426,59 @@ class Module:
         self.trace("ALLOC ZEROS", proglen=nzeros)
         self.program.extend([0] * nzeros)
 
+    def data_macro(self, lexer: Lexer):
+        # assemble the block in to the data segment, after all the code
+        tok, block_lexer = lexer.next_token()
+        assert tok == Token.BLOCK
+        outer = self.segment, self.program
+        self.segment, self.program = "data", self.data
+        self.trace("DATA SEGMENT")
+        self.compile_lexer_contents(block_lexer)
+        self.segment, self.program = outer
+
+    def bss_macro(self, lexer: Lexer):
+        # label nbytes of zeros after the data, allocated on load
+        tok, label_name = lexer.next_token()
+        assert tok == Token.WORD
+        tok, nbytes = lexer.next_token()
+        assert tok == Token.SHORT_IMM
+        self.tracetext += f"bss {self.bss_size}: {label_name} {nbytes}\n"
+        self.labels[label_name] = ("bss", self.bss_size)
+        self.bss_size += nbytes
+
     def export_macro(self, lexer: Lexer):
         tok, data = lexer.next_token()
         assert tok == Token.WORD
         self.exports.append(data)
 
+    def import_macro(self, lexer: Lexer):
+        tok, data = lexer.next_token()
+        assert tok == Token.WORD
+        self.import_index(data)
+
+    def modid_macro(self, lexer: Lexer):
+        # push the id of an imported module, importing it if needed
+        tok, data = lexer.next_token()
+        assert tok == Token.WORD
+        index = self.import_index(data)
+        self.emit_opcode("push_module")
+        self.emit_word(f"import: {data}", value=index)
+
+    def import_index(self, module_name):
+        if module_name not in self.imports:
+            if len(self.imports) == 255:
+                print("too many imports")
+                exit(1)
+            self.imports.append(module_name)
+        return self.imports.index(module_name)
+
     def if_macro(self, lexer: Lexer):
         ifblock_tok, ifblock_lexer = lexer.next_token()
         assert ifblock_tok == Token.BLOCK
         end_label = self.generate_label_name("end")
         self.emit_opcode("bfalse_imm")
         self.register_patch_of_resolved_label_here(end_label)
-        self.emit_short(f"branch_target: {end_label}")
+        self.emit_word(f"branch_target: {end_label}")
 
         # paste if block
         self.compile_lexer_contents(ifblock_lexer)
@@ -421,7 +500,7 @@ class Module:
         # branch false to else branch
         self.emit_opcode("bfalse_imm")
         self.register_patch_of_resolved_label_here(else_label)
-        self.emit_short(f"branch_target: {else_label}")
+        self.emit_word(f"branch_target: {else_label}")
 
         # paste if block
         self.compile_lexer_contents(ifblock_lexer)
@@ -429,7 +508,7 @@ class Module:
         # at end of if block, jump over else block
         self.emit_opcode("jump_imm")
         self.register_patch_of_resolved_label_here(end_label)
-        self.emit_short(f"branch_target: {end_label}")
+        self.emit_word(f"branch_target: {end_label}")
 
         # paste else block
         self.register_label_here(else_label)
@@ -454,7 +533,7 @@ class Module:
         self.emit_opcode(">")
         self.emit_opcode("bfalse_imm")
         self.register_patch_of_resolved_label_here(end)
-        self.emit_short(f"branch_target: {end}")
+        self.emit_word(f"branch_target: {end}")
 
         # paste loop body
         self.compile_lexer_contents(loopbody_lexer)
@@ -467,7 +546,7 @@ class Module:
         # jump start
         self.emit_opcode("jump_imm")
         self.register_patch_of_resolved_label_here(loop_start)
-        self.emit_short(f"branch_target: {loop_start}")
+        self.emit_word(f"branch_target: {loop_start}")
 
         self.register_label_here(end)
         self.emit_opcode("rpop")
@@ -476,21 +555,21 @@ class Module:
         self.emit_opcode("drop")
 
     def register_patch_of_resolved_label_here(self, label_name):
-        self.patchups[len(self.program)] = label_name
+        self.patchups[(self.segment, len(self.program))] = label_name
 
     def register_label_here(self, label_name):
         self.trace(label_name + ":")
-        self.labels[label_name] = len(self.program)
+        self.labels[label_name] = (self.segment, len(self.program))
 
     def emit_opcode(self, opcode):
         self.trace(opcode)
         self.program.append(OPCODES[opcode])
 
-    # little endian
-    def emit_short(self, tracetext, value=0):
-        self.trace(tracetext, 2)
-        self.program.append(value & 0xFF)
-        self.program.append((value >> 8) & 0xFF)
+    # little endian, word_size bytes
+    def emit_word(self, tracetext, value=0):
+        self.trace(tracetext, self.word_size)
+        for i in range(self.word_size):
+            self.program.append((value >> (8 * i)) & 0xFF)
 
     def trace(self, message, proglen=1):
         self.tracetext += f"{len(self.program)}"
@@ -507,14 +586,31 @@ class Module:
         if self.module_name is None:
             print("no module_name!")
             exit(1)
+        wide = self.word_size == 4
+        segmented = self.data or self.bss_size
+        versioned = self.imports or wide or segmented
+        if versioned:
+            # 0 can't be a name length, marks a versioned header
+            header.append(0)
+            version = HEADER_SEGMENTS if segmented else HEADER_IMPORTS
+            header.append(version | (HEADER_WIDE if wide else 0))
+        if segmented:
+            for size in (len(self.code), len(self.data), self.bss_size):
+                for i in range(self.word_size):
+                    header.append((size >> (8 * i)) & 0xFF)
         header.append(len(self.module_name))
         header.extend(self.module_name.encode("ascii"))
         header.append(len(self.resolved_exports))
         for fn_name, fn_offset in self.resolved_exports.items():
             header.append(len(fn_name))
             header.extend(fn_name.encode("ascii"))
-            header.append(fn_offset & 0xFF)
-            header.append((fn_offset >> 8) & 0xFF)
+            for i in range(self.word_size):
+                header.append((fn_offset >> (8 * i)) & 0xFF)
+        if versioned:
+            header.append(len(self.imports))
+            for module_name in self.imports:
+                header.append(len(module_name))
+                header.extend(module_name.encode("ascii"))
 
         return header
 
@@ -523,12 +619,21 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("input")
     parser.add_argument("output")
+    parser.add_argument(
+        "--wide",
+        action="store_true",
+        help="32-bit words and immediates, for vm::Machine32",
+    )
 
     args = parser.parse_args()
 
     filetext = open(args.input).read()
 
-    m = Module(filetext)
+    m = Module(filetext, word_size=4 if args.wide else 2)
 
-    with open(args.output, "wb") as outfile:
+    # written beside the output and renamed over it, a running vm may have the
+    # old file mapped and truncating it would crash it
+    tmp_output = args.output + ".tmp"
+    with open(tmp_output, "wb") as outfile:
         outfile.write(m.bytecode())
+    os.replace(tmp_output, args.output)
@@ -0,0 +1,448 @@
+#include "BytecodeBuilder.hpp"
+#include "HeadlessModules.hpp"
+#include "Machine.hpp"
+#include "SharedModule.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Each workload is one export that leaves the stacks as it found them, so
+// it can be executed back to back. Instructions per iteration are counted
+// once with Machine::execute_counted and reported as time/instr and instr/s.
+
+namespace {
+
+/// @brief serves the library module for the extern_call workload
+class BenchPlatform final : public vm::IPlatform {
+public:
+   std::optional<vm::BytecodeModule> get_module(std::string_view name
+   ) override {
+      if(name != "lib") {
+         return std::nullopt;
+      }
+      BytecodeBuilder b("lib");
+      b.label("nop").op(vm::I_RETURN).export_fn("nop");
+      auto bytes = b.build();
+      auto mod = vm::BytecodeModule::load(bytes);
+      if(!mod.has_value()) {
+         return std::nullopt;
+      }
+      return std::move(*mod);
+   }
+};
+
+struct Workload {
+   std::string name;
+   std::function<std::vector<unsigned char>()> bytes;
+   /// @brief called once before measuring, if not empty
+   std::string_view setup = {};
+   std::string_view fn = "entry";
+   /// @brief calls of fn per iteration
+   int repeat = 1;
+};
+
+constexpr int FRAMEBUFFER_SIZE = 16 * 1024;
+
+std::vector<unsigned char> arithmetic() {
+   BytecodeBuilder b("program");
+   b.label("entry").push(10000);
+   b.label("loop")
+      .op(vm::I_DUP)
+      .push(3)
+      .op(vm::I_MUL)
+      .push(7)
+      .op(vm::I_ADD)
+      .push(5)
+      .op(vm::I_SHR)
+      .op(vm::I_DROP)
+      .op(vm::I_DEC)
+      .op(vm::I_DUP)
+      .btrue("loop")
+      .op(vm::I_DROP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> for_loop() {
+   BytecodeBuilder b("program");
+   b.label("entry")
+      .push(0)
+      .push(0)
+      .push(10000)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY).op(vm::I_ADD);
+      })
+      .op(vm::I_DROP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> calls() {
+   // three levels of call_imm per iteration, verifiable
+   BytecodeBuilder b("program");
+   b.label("leaf").op(vm::I_INC).op(vm::I_RETURN);
+   b.label("mid").call("leaf").call("leaf").op(vm::I_RETURN);
+   b.label("top").call("mid").call("mid").op(vm::I_RETURN);
+   b.label("entry")
+      .push(0)
+      .push(0)
+      .push(2000)
+      .for_loop([](BytecodeBuilder& body) { body.call("top"); })
+      .op(vm::I_DROP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> fib() {
+   // recursion can't be verified, so this measures the checked interpreter
+   BytecodeBuilder b("program");
+   b.label("fib")
+      .op(vm::I_DUP)
+      .push(2)
+      .op(vm::I_LT)
+      .bfalse("recurse")
+      .op(vm::I_RETURN)
+      .label("recurse")
+      .op(vm::I_DUP)
+      .op(vm::I_DEC)
+      .call("fib")
+      .op(vm::I_SWAP)
+      .push(2)
+      .op(vm::I_SUB)
+      .call("fib")
+      .op(vm::I_ADD)
+      .op(vm::I_RETURN);
+   b.label("entry")
+      .push(15)
+      .call("fib")
+      .op(vm::I_DROP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> framebuffer_bytes() {
+   BytecodeBuilder b("program");
+   b.label("fb").zeros(FRAMEBUFFER_SIZE);
+   b.label("entry")
+      .push(0)
+      .push(FRAMEBUFFER_SIZE)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY)
+            .op(vm::I_RCOPY)
+            .push_addr("fb")
+            .op(vm::I_ADD)
+            .op(vm::I_STORE_BYTE);
+      })
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> framebuffer_words() {
+   BytecodeBuilder b("program");
+   b.label("fb").zeros(FRAMEBUFFER_SIZE);
+   b.label("entry")
+      .push(0)
+      .push(FRAMEBUFFER_SIZE / 2)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY)
+            .op(vm::I_DUP)
+            .op(vm::I_ADD)
+            .push_addr("fb")
+            .op(vm::I_ADD)
+            .op(vm::I_DUP)
+            .op(vm::I_LOAD_WORD)
+            .op(vm::I_INC)
+            .op(vm::I_SWAP)
+            .op(vm::I_STORE_WORD);
+      })
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> extern_system() {
+   BytecodeBuilder b("program");
+   b.label("entry")
+      .push(0)
+      .push(1000)
+      .for_loop([](BytecodeBuilder& body) {
+         body.push_module("system").push(1).op(vm::I_EXTERN_CALL);
+      })
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+std::vector<unsigned char> extern_module() {
+   BytecodeBuilder b("program");
+   b.label("entry")
+      .push(0)
+      .push(1000)
+      .for_loop([](BytecodeBuilder& body) {
+         body.push_module("lib").push(0).op(vm::I_EXTERN_CALL);
+      })
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   return b.build();
+}
+
+#ifdef VM_BENCH_SMILETRAIL
+std::vector<unsigned char> smiletrail() {
+   std::ifstream file(VM_BENCH_SMILETRAIL, std::ios::binary);
+   return {std::istreambuf_iterator<char>(file), {}};
+}
+#endif
+
+std::vector<Workload> workloads() {
+   return {
+      {"arithmetic", arithmetic},
+      {"for_loop", for_loop},
+      {"calls", calls},
+      {"fib", fib},
+      {"framebuffer_bytes", framebuffer_bytes},
+      {"framebuffer_words", framebuffer_words},
+      {"extern_call_system", extern_system},
+      {"extern_call_module", extern_module},
+#ifdef VM_BENCH_SMILETRAIL
+      // fade runs every 10th frame
+      {"smiletrail_10_frames", smiletrail, "entry", "frame", 10},
+#endif
+   };
+}
+
+std::string engine_name(vm::Engine engine) {
+   switch(engine) {
+   case vm::Engine::Switch:
+      return "Switch";
+   case vm::Engine::Threaded:
+      return "Threaded";
+   case vm::Engine::Jit:
+      return "Jit";
+   }
+   return "Unknown";
+}
+
+void run_workload(
+   benchmark::State& state, Workload const& workload, vm::Engine engine
+) {
+   BenchPlatform platform;
+   vm::HeadlessSystem system;
+   vm::HeadlessGraphics graphics;
+   vm::Machine machine(platform);
+   machine.set_engine(engine);
+   machine.add_system_module(&system);
+   machine.add_system_module(&graphics);
+
+   auto bytes = workload.bytes();
+   auto mod = vm::BytecodeModule::load(bytes);
+   if(!mod.has_value()) {
+      state.SkipWithError(vm::error_to_str(mod.error()).data());
+      return;
+   }
+   auto index = machine.add_module(std::move(*mod));
+   if(!workload.setup.empty()) {
+      if(auto error = machine.execute("program", workload.setup)) {
+         state.SkipWithError(vm::error_to_str(*error).data());
+         return;
+      }
+   }
+
+   auto fn = machine.resolve("program", workload.fn);
+   if(!fn.has_value()) {
+      state.SkipWithError(vm::error_to_str(fn.error()).data());
+      return;
+   }
+   std::uint64_t instructions = 0;
+   for(int i = 0; i < workload.repeat; ++i) {
+      auto count = machine.execute_counted(*fn);
+      if(!count.has_value()) {
+         state.SkipWithError(vm::error_to_str(count.error()).data());
+         return;
+      }
+      instructions += *count;
+   }
+   if(machine.verify_module(index).has_value()) {
+      state.SetLabel("checked");
+   }
+
+   for(auto _ : state) {
+      for(int i = 0; i < workload.repeat; ++i) {
+         if(auto error = machine.execute(*fn)) {
+            state.SkipWithError(vm::error_to_str(*error).data());
+            return;
+         }
+      }
+   }
+
+   state.counters["instrs"] = instructions;
+   state.counters["instr/s"] = benchmark::Counter(
+      instructions, benchmark::Counter::kIsIterationInvariantRate
+   );
+   // inverted rate, seconds per instruction
+   state.counters["time/instr"] = benchmark::Counter(
+      instructions,
+      benchmark::Counter::kIsIterationInvariantRate |
+         benchmark::Counter::kInvert
+   );
+}
+
+void load_module(benchmark::State& state) {
+   auto bytes = framebuffer_words();
+#ifdef VM_BENCH_SMILETRAIL
+   bytes = smiletrail();
+#endif
+   for(auto _ : state) {
+      auto mod = vm::BytecodeModule::load(bytes);
+      benchmark::DoNotOptimize(mod);
+   }
+   state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+
+/// @brief a module that's almost all initialised data, like one holding
+/// sprites and maps, written to a file to load from
+std::filesystem::path asset_module_file() {
+   BytecodeBuilder b("assets");
+   b.label("entry").op(vm::I_RETURN).export_fn("entry");
+   b.data();
+   for(int i = 0; i < 60 * 1024; ++i) {
+      b.byte(i * 7);
+   }
+   auto bytes = b.build();
+   auto path = std::filesystem::temp_directory_path() / "vm_bench_assets.bin";
+   std::ofstream(path, std::ios::binary)
+      .write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+   return path;
+}
+
+/// @brief read the file, then BytecodeModule::load a copy of it
+void load_module_read(benchmark::State& state) {
+   auto path = asset_module_file();
+   for(auto _ : state) {
+      std::ifstream file(path, std::ios::binary);
+      std::vector<unsigned char> bytes{
+         std::istreambuf_iterator<char>(file), {}
+      };
+      auto mod = vm::BytecodeModule::load(bytes);
+      benchmark::DoNotOptimize(mod);
+   }
+}
+
+#if MODULE_HAS_MMAP
+void load_module_file(benchmark::State& state) {
+   auto path = asset_module_file();
+   for(auto _ : state) {
+      auto mod = vm::BytecodeModule::load_file(path.c_str());
+      benchmark::DoNotOptimize(mod);
+   }
+}
+#endif
+
+/// @brief Run one call of the smiletrail workload (framebuffer_words
+/// without it), then put the machine back with Machine::restore, or save an
+/// incremental snapshot of it
+void snapshot(benchmark::State& state, bool restore) {
+   Workload workload = {"framebuffer_words", framebuffer_words};
+#ifdef VM_BENCH_SMILETRAIL
+   workload = {"smiletrail", smiletrail, "entry", "frame"};
+#endif
+   BenchPlatform platform;
+   vm::HeadlessSystem system;
+   vm::HeadlessGraphics graphics;
+   vm::Machine machine(platform);
+   machine.add_system_module(&system);
+   machine.add_system_module(&graphics);
+   auto bytes = workload.bytes();
+   machine.add_module(vm::BytecodeModule::load(bytes).value());
+   if(!workload.setup.empty()) {
+      machine.execute("program", workload.setup);
+   }
+   auto fn = machine.resolve("program", workload.fn).value();
+
+   auto saved = machine.save();
+   for(auto _ : state) {
+      machine.execute(fn);
+      if(restore) {
+         machine.restore(saved);
+      } else {
+         saved = machine.save(&saved);
+      }
+   }
+   state.counters["memory"] = saved.memory_bytes();
+}
+
+/// @brief another instance of a loaded module, by copying it
+void copy_module(benchmark::State& state) {
+   auto path = asset_module_file();
+   std::ifstream file(path, std::ios::binary);
+   std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(file), {}};
+   auto loaded = vm::BytecodeModule::load(bytes).value();
+   for(auto _ : state) {
+      auto mod = loaded;
+      benchmark::DoNotOptimize(mod);
+   }
+}
+
+/// @brief another instance of a loaded module, from a SharedModule
+void instantiate_module(benchmark::State& state) {
+   auto path = asset_module_file();
+   std::ifstream file(path, std::ios::binary);
+   std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(file), {}};
+   auto shared = vm::SharedModule::load(bytes).value();
+   for(auto _ : state) {
+      auto mod = shared.instantiate();
+      benchmark::DoNotOptimize(mod);
+   }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+   std::vector<vm::Engine> engines = {vm::Engine::Switch};
+#if MACHINE_HAS_THREADED_ENGINE
+   engines.push_back(vm::Engine::Threaded);
+#endif
+#if MACHINE_HAS_JIT
+   engines.push_back(vm::Engine::Jit);
+#endif
+
+   for(auto const& workload : workloads()) {
+      for(auto engine : engines) {
+         auto name = workload.name + "/" + engine_name(engine);
+         benchmark::RegisterBenchmark(
+            name.c_str(), [workload, engine](benchmark::State& state) {
+               run_workload(state, workload, engine);
+            }
+         );
+      }
+   }
+   benchmark::RegisterBenchmark("module_load", load_module);
+   benchmark::RegisterBenchmark("module_load_read/assets", load_module_read);
+#if MODULE_HAS_MMAP
+   benchmark::RegisterBenchmark("module_load_file/assets", load_module_file);
+#endif
+   benchmark::RegisterBenchmark("snapshot_save", snapshot, false);
+   benchmark::RegisterBenchmark("snapshot_restore", snapshot, true);
+   benchmark::RegisterBenchmark("module_copy/assets", copy_module);
+   benchmark::RegisterBenchmark(
+      "module_instantiate/assets", instantiate_module
+   );
+
+   benchmark::Initialize(&argc, argv);
+   if(benchmark::ReportUnrecognizedArguments(argc, argv)) {
+      return 1;
+   }
+   benchmark::RunSpecifiedBenchmarks();
+   benchmark::Shutdown();
+   return 0;
+}
@@ -3,28 +3,169 @@
 #include <iostream>
 #include <optional>
 
+#if MODULE_HAS_MMAP
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace vm {
 
+BytecodeModule::BytecodeModule(ModuleMemory memory, Header const& header) :
+   m_image(make_image(std::span(memory.data(), memory.size()), header)),
+   m_memory(std::move(memory)),
+   m_code_start_index(header.code_start_index),
+   m_import_ids(header.imports.size(), -1) {
+   std::vector<int> roots;
+   roots.reserve(m_image->exports.size());
+   for(auto const& exp : m_image->exports) {
+      roots.push_back(exp.bytecode_offset);
+   }
+   m_decoded = DecodedCode(code(), roots, m_image->word_size);
+}
+
 BytecodeModule::BytecodeModule(
-   std::vector<unsigned char> bytecode, std::string_view module_name,
-   std::vector<ExportFunction> exports, int code_start_index
+   std::shared_ptr<Image const> image, ModuleMemory memory,
+   DecodedCode decoded
 ) :
-   m_bytecode(std::move(bytecode)),
-   m_code_start_index(code_start_index),
-   m_module_name(module_name),
-   m_exports(std::move(exports)) {
-   m_bytecode_after_header = std::span<unsigned char>(
-      m_bytecode.data() + m_code_start_index,
-      m_bytecode.size() - m_code_start_index
+   m_image(std::move(image)),
+   m_memory(std::move(memory)),
+   m_code_start_index(m_image->code_start_index),
+   m_import_ids(m_image->imports.size(), -1),
+   m_decoded(std::move(decoded)) {}
+
+std::shared_ptr<BytecodeModule::Image const> BytecodeModule::make_image(
+   std::span<unsigned char const> bytecode, Header const& header
+) {
+   auto image = std::make_shared<Image>();
+   image->header.assign(
+      bytecode.begin(), bytecode.begin() + header.code_start_index
    );
+   auto view = [&](Header::Name name) {
+      return std::string_view(
+         reinterpret_cast<char const*>(image->header.data() + name.offset),
+         name.length
+      );
+   };
+
+   image->module_name = view(header.module_name);
+   image->exports.reserve(header.exports.size());
+   image->export_indices.reserve(header.exports.size());
+   for(auto const& exp : header.exports) {
+      image->exports.push_back(
+         ExportFunction(view(exp.name), exp.bytecode_offset)
+      );
+      image->export_indices.emplace(
+         image->exports.back().name, image->exports.size() - 1
+      );
+   }
+   image->imports.reserve(header.imports.size());
+   for(auto name : header.imports) {
+      image->imports.push_back(view(name));
+   }
+   image->code_start_index = header.code_start_index;
+   image->word_size = header.word_size;
+   image->segments = header.segments;
+   return image;
 }
 
 std::expected<BytecodeModule, Error> BytecodeModule::load(
-   std::span<unsigned char> bytecode
+   std::span<unsigned char const> bytecode
+) {
+   auto header = read_header(bytecode);
+   if(!header.has_value()) {
+      return std::unexpected(header.error());
+   }
+   return BytecodeModule(
+      ModuleMemory(bytecode, header->segments.bss_size), *header
+   );
+}
+
+#if MODULE_HAS_MMAP
+std::expected<BytecodeModule, Error> BytecodeModule::load_fd(int fd) {
+   struct stat info;
+   if(fstat(fd, &info) != 0) {
+      return std::unexpected(Error::FileUnreadable);
+   }
+   auto size = static_cast<std::size_t>(info.st_size);
+   auto memory = ModuleMemory::map(fd, size, 0);
+   if(!memory.has_value()) {
+      return std::unexpected(Error::FileUnreadable);
+   }
+
+   auto header = read_header(std::span(memory->data(), size));
+   if(!header.has_value()) {
+      return std::unexpected(header.error());
+   }
+   if(header->segments.bss_size > 0) {
+      // map it again with room for the BSS, the header offsets still apply
+      memory = ModuleMemory::map(fd, size, header->segments.bss_size);
+      if(!memory.has_value()) {
+         return std::unexpected(Error::FileUnreadable);
+      }
+   }
+   return BytecodeModule(std::move(*memory), *header);
+}
+
+std::expected<BytecodeModule, Error> BytecodeModule::load_file(
+   char const* path
+) {
+   auto fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0) {
+      return std::unexpected(Error::FileUnreadable);
+   }
+   // the mapping outlives the descriptor
+   auto result = load_fd(fd);
+   close(fd);
+   return result;
+}
+#endif
+
+std::expected<BytecodeModule::Header, Error> BytecodeModule::read_header(
+   std::span<unsigned char const> bytecode
 ) {
    std::size_t cursor = 0;
 
-   std::vector<unsigned char> bytecode_copy(bytecode.begin(), bytecode.end());
+   if(cursor >= bytecode.size())
+      return std::unexpected(Error::InvalidHeader);
+
+   // a module name can't be empty, so a leading 0 marks a versioned header
+   int version = 1;
+   int word_size = 2;
+   if(bytecode[cursor] == 0) {
+      if(cursor + 1 >= bytecode.size())
+         return std::unexpected(Error::InvalidHeader);
+      version = bytecode[cursor + 1] & ~HEADER_WIDE;
+      if(bytecode[cursor + 1] & HEADER_WIDE)
+         word_size = 4;
+      cursor += 2;
+      if(version != HEADER_IMPORTS && version != HEADER_SEGMENTS)
+         return std::unexpected(Error::InvalidHeader);
+   }
+
+   // little endian, a wide value that doesn't fit an int comes out negative
+   auto read_word = [&]() {
+      int value = 0;
+      for(int byte = 0; byte < word_size; ++byte) {
+         value |= bytecode[cursor + byte] << (8 * byte);
+      }
+      cursor += word_size;
+      return value;
+   };
+
+   // code and data sizes are checked against the file once the rest of the
+   // header is read, BSS is left to the caller to allocate
+   Segments segments{0, 0, 0};
+   if(version >= HEADER_SEGMENTS) {
+      if(cursor + 3 * word_size > bytecode.size())
+         return std::unexpected(Error::InvalidHeader);
+      segments.code_size = read_word();
+      segments.data_size = read_word();
+      segments.bss_size = read_word();
+      if(segments.code_size < 0 || segments.data_size < 0 ||
+         segments.bss_size < 0)
+         return std::unexpected(Error::InvalidHeader);
+   }
 
    if(cursor >= bytecode.size())
       return std::unexpected(Error::InvalidHeader);
@@ -34,10 +175,7 @@ std::expected<BytecodeModule, Error> BytecodeModule::load(
    if(module_name_len + cursor > bytecode.size())
       return std::unexpected(Error::InvalidHeader);
 
-   auto module_name = std::string_view(
-      reinterpret_cast<char*>(&bytecode_copy.data()[cursor]),
-      module_name_len
-   );
+   auto module_name = Header::Name{cursor, module_name_len};
 
    cursor += module_name_len;
 
@@ -46,7 +184,7 @@ std::expected<BytecodeModule, Error> BytecodeModule::load(
    auto num_exports = std::size_t{bytecode[cursor]};
    cursor += 1;
 
-   std::vector<ExportFunction> exports;
+   std::vector<Header::Export> exports;
    exports.reserve(num_exports);
 
    for(int i = 0; i < num_exports; ++i) {
@@ -58,27 +196,58 @@ std::expected<BytecodeModule, Error> BytecodeModule::load(
       if(fn_name_len + cursor > bytecode.size())
          return std::unexpected(Error::InvalidHeader);
 
-      auto fn_name = std::string_view(
-         reinterpret_cast<char const*>(&bytecode_copy.data()[cursor]),
-         fn_name_len
-      );
+      auto fn_name = Header::Name{cursor, fn_name_len};
       cursor += fn_name_len;
 
-      if(cursor + 1 >= bytecode.size())
+      if(cursor + word_size > bytecode.size())
          return std::unexpected(Error::InvalidHeader);
 
-      auto fn_offset = int{bytecode[cursor]} | (int{bytecode[cursor + 1]} << 8);
-      cursor += 2;
+      // a negative offset is as invalid as any other outside the code
+      int fn_offset = read_word();
 
-      exports.push_back(ExportFunction(fn_name, fn_offset));
+      exports.push_back(Header::Export{fn_name, fn_offset});
    }
 
-   return BytecodeModule(
-      std::move(bytecode_copy),
+   std::vector<Header::Name> imports;
+   if(version >= HEADER_IMPORTS) {
+      if(cursor >= bytecode.size())
+         return std::unexpected(Error::InvalidHeader);
+      auto num_imports = std::size_t{bytecode[cursor]};
+      cursor += 1;
+      imports.reserve(num_imports);
+
+      for(int i = 0; i < num_imports; ++i) {
+         if(cursor >= bytecode.size())
+            return std::unexpected(Error::InvalidHeader);
+         auto import_name_len = std::size_t{bytecode[cursor]};
+         cursor += 1;
+
+         if(import_name_len + cursor > bytecode.size())
+            return std::unexpected(Error::InvalidHeader);
+
+         imports.push_back(Header::Name{cursor, import_name_len});
+         cursor += import_name_len;
+      }
+   }
+
+   auto file_size = bytecode.size() - cursor;
+   if(version >= HEADER_SEGMENTS) {
+      auto stored = static_cast<std::size_t>(segments.code_size) +
+         segments.data_size;
+      if(stored != file_size)
+         return std::unexpected(Error::InvalidHeader);
+   } else {
+      segments.code_size = file_size;
+   }
+
+   return Header{
       module_name,
       std::move(exports),
-      cursor
-   );
+      std::move(imports),
+      static_cast<int>(cursor),
+      word_size,
+      segments,
+   };
 }
 
 } // namespace vm
\ No newline at end of file
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <expected>
+#include <memory>
 #include <optional>
 #include <span>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #define DEBUG_DUMP
@@ -12,10 +14,17 @@
 #include <iostream>
 #endif
 
+#include "DecodedCode.hpp"
+#include "ModuleMemory.hpp"
+#include "Verifier.hpp"
 #include "engine_common.hpp"
 
 namespace vm {
 
+class SharedModule;
+
+/// @brief A loaded module: its memory, decoded code and verification, and an
+/// immutable image of its header that copies of the module share.
 class BytecodeModule {
 public:
    struct ExportFunction {
@@ -23,69 +32,236 @@ public:
       int bytecode_offset;
    };
 
+   /// @brief Result of running the verifier over the module, filled in by
+   /// Machine the first time one of its exports is called
+   struct Verification {
+      enum State { Pending, Running, Verified, Rejected };
+      State state = Pending;
+      /// @brief Machine's code generation when it was verified, a store to
+      /// verified code makes it stale
+      unsigned generation = 0;
+      /// @brief summary of each export, in header order
+      std::vector<FunctionSummary> exports;
+      std::optional<VerifyError> error;
+   };
+
+   /// @brief Sizes of the module's segments, laid out in that order in
+   /// code(). Modules without a segment table are all code.
+   struct Segments {
+      /// @brief functions and constants, the same for every instance
+      int code_size;
+      /// @brief initialised variables
+      int data_size;
+      /// @brief zeroed variables, allocated on load rather than stored
+      int bss_size;
+   };
+
+   /// @brief header version with an import table, see README.md
+   static constexpr int HEADER_IMPORTS = 2;
+
+   /// @brief header version with a segment table after the version byte
+   static constexpr int HEADER_SEGMENTS = 3;
+
+   /// @brief flag in the version byte of a module for BasicMachine<int32_t>:
+   /// 4 byte immediates, words and export offsets
+   static constexpr int HEADER_WIDE = 0x80;
+
+   /// @brief load a copy of bytecode
    static std::expected<BytecodeModule, Error> load(
-      std::span<unsigned char> bytecode
+      std::span<unsigned char const> bytecode
    );
 
+#if MODULE_HAS_MMAP
+   /// @brief Load a module file by mapping it rather than reading it, see
+   /// ModuleMemory. Error::FileUnreadable if it can't be opened or mapped.
+   ///
+   /// Pages the module hasn't written still read the file, so it must not be
+   /// rewritten in place while the module is loaded: truncating it raises
+   /// SIGBUS on the next access, and new content shows through unwritten
+   /// pages. Tools replace the file instead (write elsewhere and rename).
+   static std::expected<BytecodeModule, Error> load_file(char const* path);
+
+   /// @brief load_file() of an open file, which can be closed afterwards
+   static std::expected<BytecodeModule, Error> load_fd(int fd);
+#endif
+
    std::string_view name() const {
-      return m_module_name;
+      return m_image->module_name;
+   }
+
+   /// @brief bytes in a word and an immediate, 2 or 4 with HEADER_WIDE
+   int word_size() const {
+      return m_image->word_size;
+   }
+
+   Segments segments() const {
+      return m_image->segments;
    }
 
    std::optional<ExportFunction> nth_export(int n) const {
-      if(n < m_exports.size()) {
-         return m_exports[n];
+      if(n < m_image->exports.size()) {
+         return m_image->exports[n];
       } else {
          return std::nullopt;
       }
    }
 
    std::optional<ExportFunction> get_export(std::string_view name) const {
-      for(auto const& exp : m_exports) {
-         if(exp.name == name) {
-            return exp;
-         }
+      auto index = export_index(name);
+      if(index < 0) {
+         return std::nullopt;
+      }
+      return m_image->exports[index];
+   }
+
+   /// @return index of the export for nth_export(), or -1
+   int export_index(std::string_view name) const {
+      auto it = m_image->export_indices.find(name);
+      return it == m_image->export_indices.end() ? -1 : it->second;
+   }
+
+   /// @brief names of the modules push_module refers to, by index
+   std::span<std::string_view const> imports() const {
+      return m_image->imports;
+   }
+
+   /// @brief module id an import resolved to
+   /// @return id, or -1 if out of range or not resolved yet
+   int import_id(int index) const {
+      if(static_cast<unsigned>(index) >= m_import_ids.size()) {
+         return -1;
       }
-      return std::nullopt;
+      return m_import_ids[index];
+   }
+
+   void set_import_id(int index, int module_id) {
+      m_import_ids[index] = module_id;
    }
 
    std::span<unsigned char> code() {
-      return m_bytecode_after_header;
+      return {
+         m_memory.data() + m_code_start_index,
+         m_memory.size() - m_code_start_index
+      };
+   }
+
+   std::span<unsigned char const> code() const {
+      return {
+         m_memory.data() + m_code_start_index,
+         m_memory.size() - m_code_start_index
+      };
    }
 
    int code_start_index() const {
       return m_code_start_index;
    }
 
+   /// @brief pre-decoded form of code(), used by the threaded engine
+   DecodedCode& decoded() {
+      return m_decoded;
+   }
+
+   /// @brief Must be called after writing to code() from outside the
+   /// interpreter (eg. from a system module), in case the write hit code.
+   /// @return true if it did
+   bool invalidate_decoded(int address, int length) {
+      auto mask = m_decoded.code_mask();
+      for(int i = 0; i < length; ++i) {
+         if(mask[address + i]) {
+            m_decoded.invalidate(address, length);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   Verification& verification() {
+      return m_verification;
+   }
+
 #ifdef DEBUG_DUMP
    void dump_header() const {
-      std::cout << "name: " << m_module_name << "\n";
-      for(auto e : m_exports) {
+      auto const& image = *m_image;
+      std::cout << "name: " << image.module_name << "\n";
+      for(auto e : image.exports) {
          std::cout << "export: " << e.name << " " << e.bytecode_offset << "\n";
       }
+      for(auto name : image.imports) {
+         std::cout << "import: " << name << "\n";
+      }
+      std::cout << "segments: code " << image.segments.code_size << " data "
+                << image.segments.data_size << " bss "
+                << image.segments.bss_size << "\n";
    }
 #endif
 
 private:
-   /// @brief local copy of bytecode
-   ///
-   /// NOTE: Be careful not to re-allocate this, since the string_views are
-   /// references pointing in to this
-   std::vector<unsigned char> m_bytecode;
+   friend class SharedModule;
+
+   /// @brief Where the module's header was found, as offsets so it applies
+   /// to any copy of the bytes
+   struct Header {
+      struct Name {
+         std::size_t offset;
+         std::size_t length;
+      };
+      struct Export {
+         Name name;
+         int bytecode_offset;
+      };
+      Name module_name;
+      std::vector<Export> exports;
+      std::vector<Name> imports;
+      int code_start_index;
+      int word_size;
+      Segments segments;
+   };
+
+   /// @brief The parts of a module that never change once it's loaded
+   struct Image {
+      /// @brief copy of the header bytes, which the names view
+      std::vector<unsigned char> header;
+      std::string_view module_name;
+      std::vector<ExportFunction> exports;
+      /// @brief export name -> index in exports, first one wins
+      std::unordered_map<std::string_view, int> export_indices;
+      std::vector<std::string_view> imports;
+      int code_start_index;
+      int word_size;
+      Segments segments;
+   };
+
+   /// @brief shared by every copy of the module
+   std::shared_ptr<Image const> m_image;
 
-   /// @brief index of code (skipping header)
+   /// @brief local copy (or mapping) of bytecode
+   ModuleMemory m_memory;
+
+   /// @brief m_image->code_start_index, kept here for code()
    int m_code_start_index;
 
-   std::span<unsigned char> m_bytecode_after_header;
+   /// @brief resolved module id of each import, -1 until resolved
+   std::vector<int> m_import_ids;
+
+   DecodedCode m_decoded;
 
-   /// @brief module name, view into m_bytecode
-   std::string_view m_module_name;
+   Verification m_verification;
 
-   /// @brief exports names, view into m_bytecode
-   std::vector<ExportFunction> m_exports;
+   BytecodeModule(ModuleMemory memory, Header const& header);
 
    BytecodeModule(
-      std::vector<unsigned char> bytecode, std::string_view module_name,
-      std::vector<ExportFunction> exports, int code_start_index
+      std::shared_ptr<Image const> image, ModuleMemory memory,
+      DecodedCode decoded
+   );
+
+   static std::shared_ptr<Image const> make_image(
+      std::span<unsigned char const> bytecode, Header const& header
+   );
+
+   /// @brief check the header and work out where everything is, without
+   /// allocating the module
+   static std::expected<Header, Error> read_header(
+      std::span<unsigned char const> bytecode
    );
 };
 
@@ -0,0 +1,249 @@
+#include "DecodedCode.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace vm {
+
+static constexpr auto handler_of = [] {
+   std::array<Handler, 256> table{};
+   table.fill(H_UNKNOWN);
+#define HANDLER_MAP(_name) table[I_##_name] = H_##_name;
+   DECODED_HANDLERS(HANDLER_MAP)
+#undef HANDLER_MAP
+   return table;
+}();
+
+static bool has_immediate(Handler handler) {
+   switch(handler) {
+   case H_JUMP_IMM:
+   case H_CALL_IMM:
+   case H_BTRUE_IMM:
+   case H_BFALSE_IMM:
+   case H_PUSH_IMM:
+   case H_PUSH_MODULE:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static bool is_branch(Handler handler) {
+   switch(handler) {
+   case H_JUMP_IMM:
+   case H_CALL_IMM:
+   case H_BTRUE_IMM:
+   case H_BFALSE_IMM:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static bool falls_through(Handler handler) {
+   switch(handler) {
+   case H_JUMP_IMM:
+   case H_RETURN:
+   case H_UNKNOWN:
+   case H_EOF:
+   case H_FOR_NEXT:
+      return false;
+   default:
+      return true;
+   }
+}
+
+struct FusionPattern {
+   Handler handler;
+   int length;
+   std::array<Instruction, 5> ops;
+};
+
+// same order as FUSED_HANDLERS
+static constexpr FusionPattern fusion_patterns[] = {
+   {H_FOR_TEST, 3, {I_RCOPY2, I_GT, I_BFALSE_IMM}},
+   {H_FOR_NEXT, 4, {I_RPOP, I_INC, I_RPUSH, I_JUMP_IMM}},
+   {H_INC_AT, 5, {I_DUP, I_LOAD_WORD, I_INC, I_SWAP, I_STORE_WORD}},
+   {H_DEC_AT, 5, {I_DUP, I_LOAD_WORD, I_DEC, I_SWAP, I_STORE_WORD}},
+   {H_LOAD_BYTE_OFFSET, 3, {I_PUSH_IMM, I_ADD, I_LOAD_BYTE}},
+   {H_STORE_BYTE_OFFSET, 3, {I_PUSH_IMM, I_ADD, I_STORE_BYTE}},
+   {H_LOAD_WORD_ABS, 2, {I_PUSH_IMM, I_LOAD_WORD}},
+   {H_STORE_WORD_ABS, 2, {I_PUSH_IMM, I_STORE_WORD}},
+   {H_ADD_IMM, 2, {I_PUSH_IMM, I_ADD}},
+   {H_MUL_IMM, 2, {I_PUSH_IMM, I_MUL}},
+};
+
+static_assert(std::size(fusion_patterns) == FUSED_COUNT);
+
+static constexpr std::string_view fused_names[] = {
+#define FUSED_NAME(_name, _pattern) _pattern,
+   FUSED_HANDLERS(FUSED_NAME)
+#undef FUSED_NAME
+};
+
+std::string_view fused_name(int index) {
+   return fused_names[index];
+}
+
+DecodedInstr DecodedCode::decode_one(
+   std::span<unsigned char const> code, int pc, int word_size
+) {
+   int code_size = code.size();
+   if(pc < 0 || pc >= code_size) {
+      return DecodedInstr{H_EOF, 0, 0};
+   }
+
+   auto handler = handler_of[code[pc]];
+   if(!has_immediate(handler)) {
+      return DecodedInstr{handler, 1, 0};
+   }
+
+   if(pc + word_size >= code_size) {
+      // immediate runs off the end of the code
+      return DecodedInstr{H_EOF, 0, 0};
+   }
+
+   // little endian, sign extended the same way as pop_progmem_word()
+   int imm;
+   if(word_size == 4) {
+      imm = static_cast<std::int32_t>(
+         code[pc + 1] | (code[pc + 2] << 8) | (code[pc + 3] << 16) |
+         (std::uint32_t{code[pc + 4]} << 24)
+      );
+   } else {
+      imm = static_cast<short>(code[pc + 1] | (code[pc + 2] << 8));
+   }
+   if(is_branch(handler) && (imm < 0 || imm >= code_size)) {
+      imm = code_size;
+   }
+   return DecodedInstr{
+      handler, static_cast<unsigned char>(1 + word_size), imm
+   };
+}
+
+std::optional<DecodedInstr> DecodedCode::decode_fused(
+   std::span<unsigned char const> code, int pc, int word_size
+) {
+   for(auto const& pattern : fusion_patterns) {
+      auto cursor = pc;
+      auto operand = 0;
+      auto matched = true;
+      for(int i = 0; i < pattern.length; ++i) {
+         if(cursor >= code.size() || code[cursor] != pattern.ops[i]) {
+            matched = false;
+            break;
+         }
+         auto instr = decode_one(code, cursor, word_size);
+         if(instr.handler == H_EOF) {
+            matched = false;
+            break;
+         }
+         if(instr.length > 1) {
+            operand = instr.operand;
+         }
+         cursor += instr.length;
+      }
+      if(matched) {
+         return DecodedInstr{
+            pattern.handler, static_cast<unsigned char>(cursor - pc), operand
+         };
+      }
+   }
+   return std::nullopt;
+}
+
+static bool fused_branches(Handler handler) {
+   return handler == H_FOR_TEST || handler == H_FOR_NEXT;
+}
+
+DecodedCode::DecodedCode(
+   std::span<unsigned char const> code, std::span<int const> roots,
+   int word_size
+) :
+   m_word_size(word_size),
+   m_slots({}, (code.size() + 1) * sizeof(DecodedInstr)),
+   m_code_mask({}, code.size() + 1) {
+   std::fill_n(
+      reinterpret_cast<DecodedInstr*>(m_slots.data()), code.size(),
+      DecodedInstr{H_DECODE, 0, 0}
+   );
+   slot(code.size()) = DecodedInstr{H_EOF, 0, 0};
+
+   std::vector<int> worklist(roots.begin(), roots.end());
+   while(!worklist.empty()) {
+      auto pc = worklist.back();
+      worklist.pop_back();
+      if(pc < 0 || pc >= code.size() || slot(pc).handler != H_DECODE) {
+         continue;
+      }
+
+      decode_at(code, pc);
+      auto const& instr = slot(pc);
+
+      if(is_branch(instr.handler) || fused_branches(instr.handler)) {
+         worklist.push_back(instr.operand);
+      }
+      if(falls_through(instr.handler)) {
+         worklist.push_back(pc + instr.length);
+      }
+   }
+}
+
+DecodedCode DecodedCode::with_storage(
+   ModuleMemory slots, ModuleMemory mask
+) const {
+   DecodedCode copy;
+   copy.m_word_size = m_word_size;
+   copy.m_slots = std::move(slots);
+   copy.m_code_mask = std::move(mask);
+   copy.m_native_generation = m_native_generation;
+   copy.m_generation = m_generation;
+   copy.m_extern_call_caches = m_extern_call_caches;
+   copy.m_extern_call_sites = m_extern_call_sites;
+   return copy;
+}
+
+void DecodedCode::decode_at(std::span<unsigned char const> code, int pc) {
+   auto instr = decode_fused(code, pc, m_word_size)
+                   .value_or(decode_one(code, pc, m_word_size));
+   if(instr.handler == H_EXTERN_CALL) {
+      instr.operand = extern_call_site(pc);
+   }
+   slot(pc) = instr;
+   for(int i = 0; i < std::max<int>(instr.length, 1); ++i) {
+      m_code_mask.data()[pc + i] |= MASK_DECODED;
+   }
+}
+
+void DecodedCode::invalidate(int address, int length) {
+   ++m_generation;
+   auto first = std::max(0, address - (MAX_INSTR_LENGTH - 1));
+   auto last = std::min<int>(address + length, slot_count() - 1);
+   for(int pc = first; pc < last; ++pc) {
+      slot(pc) = DecodedInstr{H_DECODE, 0, 0};
+   }
+   for(int i = std::max(0, address); i < last; ++i) {
+      if(m_code_mask.data()[i] & MASK_NATIVE) {
+         ++m_native_generation;
+         break;
+      }
+   }
+}
+
+int DecodedCode::extern_call_site(int pc) {
+   auto [it, inserted] =
+      m_extern_call_sites.emplace(pc, m_extern_call_caches.size());
+   if(inserted) {
+      m_extern_call_caches.emplace_back();
+   }
+   return it->second;
+}
+
+void DecodedCode::mark_native(int address, int length) {
+   auto last = std::min<int>(address + length, m_code_mask.size());
+   for(int i = address; i < last; ++i) {
+      m_code_mask.data()[i] |= MASK_NATIVE;
+   }
+}
+
+} // namespace vm
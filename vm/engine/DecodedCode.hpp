@@ -0,0 +1,236 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Instruction.hpp"
+#include "ModuleMemory.hpp"
+
+namespace vm {
+
+// Dense handler numbering for the threaded engine. Every opcode byte is
+// widened to one of these when decoded, and any byte we don't know lands on
+// H_UNKNOWN.
+#define DECODED_HANDLERS(X)                                                    \
+   X(NOP)                                                                      \
+   X(ADD)                                                                      \
+   X(SUB)                                                                      \
+   X(MUL)                                                                      \
+   X(DIV)                                                                      \
+   X(MOD)                                                                      \
+   X(SHR)                                                                      \
+   X(SHL)                                                                      \
+   X(GT)                                                                       \
+   X(LT)                                                                       \
+   X(GE)                                                                       \
+   X(LE)                                                                       \
+   X(EQ)                                                                       \
+   X(NEQ)                                                                      \
+   X(JUMP_IMM)                                                                 \
+   X(CALL_IMM)                                                                 \
+   X(BTRUE_IMM)                                                                \
+   X(BFALSE_IMM)                                                               \
+   X(RETURN)                                                                   \
+   X(LOAD_MODULE)                                                              \
+   X(EXTERN_CALL)                                                              \
+   X(LOAD_WORD)                                                                \
+   X(STORE_WORD)                                                               \
+   X(PUSH_IMM)                                                                 \
+   X(DUP)                                                                      \
+   X(SWAP)                                                                     \
+   X(DROP)                                                                     \
+   X(OVER)                                                                     \
+   X(ROT)                                                                      \
+   X(RPUSH)                                                                    \
+   X(RPOP)                                                                     \
+   X(RCOPY)                                                                    \
+   X(INC)                                                                      \
+   X(DEC)                                                                      \
+   X(RCOPY2)                                                                   \
+   X(LOAD_BYTE)                                                                \
+   X(STORE_BYTE)                                                               \
+   X(PICK)                                                                     \
+   X(PUSH_MODULE)
+
+// Superinstructions, matched against the raw opcode sequence when a slot is
+// decoded. Each pattern may contain at most one instruction with an
+// immediate, which becomes the fused slot's operand. Patterns are tried in
+// order, so longer ones sharing a prefix must come first.
+//
+// To add a fusion, add a row here, a pattern to fusion_patterns in
+// DecodedCode.cpp and a handler to ThreadedEngine.cpp.
+#define FUSED_HANDLERS(X)                                                      \
+   X(FOR_TEST, "rcopy2 > bfalse_imm")                                          \
+   X(FOR_NEXT, "rpop inc rpush jump_imm")                                      \
+   X(INC_AT, "dup @ inc swap !")                                               \
+   X(DEC_AT, "dup @ dec swap !")                                               \
+   X(LOAD_BYTE_OFFSET, "push_imm + @b")                                        \
+   X(STORE_BYTE_OFFSET, "push_imm + !b")                                       \
+   X(LOAD_WORD_ABS, "push_imm @")                                              \
+   X(STORE_WORD_ABS, "push_imm !")                                             \
+   X(ADD_IMM, "push_imm +")                                                    \
+   X(MUL_IMM, "push_imm *")
+
+enum Handler : unsigned char {
+   H_UNKNOWN,
+   /// @brief slot not decoded yet (or invalidated by a store), decode lazily
+   H_DECODE,
+   /// @brief pc ran off the end of the code, or into a truncated immediate
+   H_EOF,
+#define HANDLER_ENUM(_name) H_##_name,
+   DECODED_HANDLERS(HANDLER_ENUM)
+#undef HANDLER_ENUM
+#define FUSED_ENUM(_name, _pattern) H_##_name,
+   FUSED_HANDLERS(FUSED_ENUM)
+#undef FUSED_ENUM
+   H_COUNT,
+};
+
+#define FUSED_ONE(_name, _pattern) +1
+static constexpr int FUSED_COUNT = 0 FUSED_HANDLERS(FUSED_ONE);
+#undef FUSED_ONE
+
+/// @brief first superinstruction handler, H_FUSED_BEGIN + i is fusion i
+static constexpr int H_FUSED_BEGIN = H_COUNT - FUSED_COUNT;
+
+/// @brief opcode sequence of fusion i, eg "push_imm @"
+std::string_view fused_name(int index);
+
+/// @brief single pre-decoded instruction
+struct DecodedInstr {
+   Handler handler;
+   /// @brief number of progmem bytes this covers, 0 for H_DECODE and H_EOF so
+   /// they re-dispatch on the same pc
+   unsigned char length;
+   /// @brief decoded immediate. For branches this is the target slot, which
+   /// is clamped to the EOF slot if the target is outside the code.
+   int operand;
+};
+
+/// @brief Inline cache of an extern_call site, the last (module id, fn id)
+/// called from there and the entry it resolved to
+struct ExternCallCache {
+   int module_id = -1;
+   int fn_id = -1;
+   int pc = 0;
+};
+
+/// @brief Pre-decoded form of a module's code section.
+///
+/// There is one slot per byte of code (plus an EOF sentinel), so a pc is
+/// also a slot index and branch targets need no translation. Slots reachable
+/// from the exports are decoded up front, anything else is decoded the first
+/// time it's executed. Common opcode sequences are fused in to a single
+/// superinstruction slot (see FUSED_HANDLERS). The slots inside a fused
+/// sequence are decoded separately, so jumping in to the middle still works.
+///
+/// Every byte that has been decoded as part of an instruction is flagged in
+/// code_mask(), as is every byte the JIT compiled. Stores must check the mask
+/// and call invalidate() when they hit code, stores into data only pay for
+/// the mask lookup.
+///
+/// The slots and the mask are kept in ModuleMemory, so SharedModule can
+/// give each instance a copy-on-write copy of them (see with_storage()).
+class DecodedCode {
+public:
+   /// @brief longest decoded slot in bytes, including superinstructions
+   static constexpr int MAX_INSTR_LENGTH = 8;
+
+   /// @brief code_mask() bits
+   static constexpr unsigned char MASK_DECODED = 1;
+   static constexpr unsigned char MASK_NATIVE = 2;
+
+   DecodedCode() = default;
+
+   /// @brief decode everything reachable from roots
+   /// @param word_size bytes in an immediate, BytecodeModule::word_size()
+   DecodedCode(
+      std::span<unsigned char const> code, std::span<int const> roots,
+      int word_size = 2
+   );
+
+   DecodedInstr const* slots() const {
+      return reinterpret_cast<DecodedInstr const*>(m_slots.data());
+   }
+
+   unsigned char const* code_mask() const {
+      return m_code_mask.data();
+   }
+
+   /// @brief the bytes behind slots() and code_mask(), to share them
+   std::span<unsigned char const> slot_bytes() const {
+      return {m_slots.data(), m_slots.size()};
+   }
+
+   std::span<unsigned char const> mask_bytes() const {
+      return {m_code_mask.data(), m_code_mask.size()};
+   }
+
+   /// @brief Copy of this using slots and mask as its storage, which must
+   /// hold copies of slot_bytes() and mask_bytes()
+   DecodedCode with_storage(ModuleMemory slots, ModuleMemory mask) const;
+
+   /// @brief (re-)decode a single slot from the current code bytes, fusing
+   /// it with the instructions that follow if they match a superinstruction
+   void decode_at(std::span<unsigned char const> code, int pc);
+
+   /// @brief a store wrote [address, address+length), throw away any slot
+   /// that was decoded from those bytes
+   void invalidate(int address, int length);
+
+   /// @brief flag bytes that the JIT translated, so stores to them are seen
+   void mark_native(int address, int length);
+
+   /// @brief cache index of the extern_call at pc, which is also the operand
+   /// of its decoded slot. The cache survives the slot being re-decoded.
+   int extern_call_site(int pc);
+
+   ExternCallCache& extern_call_cache(int index) {
+      return m_extern_call_caches[index];
+   }
+
+   /// @brief bumped whenever invalidate() hits bytes flagged by
+   /// mark_native(), native code older than this is stale
+   unsigned native_generation() const {
+      return m_native_generation;
+   }
+
+   /// @brief bumped by every invalidate(), verification of code older than
+   /// this is stale
+   unsigned generation() const {
+      return m_generation;
+   }
+
+   static DecodedInstr decode_one(
+      std::span<unsigned char const> code, int pc, int word_size = 2
+   );
+
+   static std::optional<DecodedInstr> decode_fused(
+      std::span<unsigned char const> code, int pc, int word_size = 2
+   );
+
+private:
+   DecodedInstr& slot(int pc) {
+      return reinterpret_cast<DecodedInstr*>(m_slots.data())[pc];
+   }
+
+   int slot_count() const {
+      return m_slots.size() / sizeof(DecodedInstr);
+   }
+
+   int m_word_size = 2;
+   /// @brief DecodedInstr per byte of code, plus the EOF slot
+   ModuleMemory m_slots;
+   ModuleMemory m_code_mask;
+   unsigned m_native_generation = 0;
+   unsigned m_generation = 0;
+   std::vector<ExternCallCache> m_extern_call_caches;
+   /// @brief extern_call pc -> index in m_extern_call_caches
+   std::unordered_map<int, int> m_extern_call_sites;
+};
+
+} // namespace vm
@@ -0,0 +1,138 @@
+#include "FilesystemPlatform.hpp"
+
+#include <fstream>
+#include <system_error>
+#include <utility>
+
+#if MODULE_HAS_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vm {
+
+namespace {
+
+/// @brief a module file's bytes, mapped where possible
+std::optional<ModuleMemory> read_file(
+   std::filesystem::path const& path, std::size_t size
+) {
+#if MODULE_HAS_MMAP
+   auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd < 0) {
+      return std::nullopt;
+   }
+   auto memory = ModuleMemory::map(fd, size, 0);
+   close(fd);
+   return memory;
+#else
+   std::ifstream file(path, std::ios::binary);
+   std::vector<unsigned char> bytes(size);
+   file.read(reinterpret_cast<char*>(bytes.data()), size);
+   if(!file) {
+      return std::nullopt;
+   }
+   return ModuleMemory(bytes, 0);
+#endif
+}
+
+} // namespace
+
+FilesystemPlatform::FilesystemPlatform(
+   std::vector<std::filesystem::path> search_paths, std::size_t cache_size
+) :
+   m_search_paths(std::move(search_paths)),
+   m_cache_size(cache_size) {}
+
+void FilesystemPlatform::add_search_path(std::filesystem::path path) {
+   m_search_paths.push_back(std::move(path));
+}
+
+std::optional<BytecodeModule> FilesystemPlatform::get_module(
+   std::string_view name
+) {
+   auto key = std::string(name);
+   auto file_name = key + ".bin";
+   for(auto const& directory : m_search_paths) {
+      auto path = directory / file_name;
+      std::error_code error;
+      auto size = std::filesystem::file_size(path, error);
+      if(error) {
+         continue;
+      }
+      auto modified = std::filesystem::last_write_time(path, error);
+      if(error) {
+         continue;
+      }
+
+      auto cached = m_by_name.find(key);
+      auto same_file = cached != m_by_name.end() &&
+         cached->second->path == path;
+      if(same_file && cached->second->size == size &&
+         cached->second->modified == modified) {
+         ++m_stats.hits;
+         return touch(cached->second).instantiate();
+      }
+
+      auto bytes = read_file(path, size);
+      if(!bytes.has_value()) {
+         continue;
+      }
+      auto hash = content_hash(std::span(bytes->data(), size));
+      if(same_file && cached->second->hash == hash) {
+         // rewritten with the same content
+         cached->second->size = size;
+         cached->second->modified = modified;
+         ++m_stats.hits;
+         return touch(cached->second).instantiate();
+      }
+
+      auto module = BytecodeModule::load(std::span(bytes->data(), size));
+      if(!module.has_value() || module->name() != name) {
+         continue;
+      }
+      ++m_stats.misses;
+      auto shared = SharedModule(*module);
+      auto instance = shared.instantiate();
+      insert(Entry{key, path, size, modified, hash, std::move(shared)});
+      return instance;
+   }
+   return std::nullopt;
+}
+
+std::uint64_t FilesystemPlatform::content_hash(
+   std::span<unsigned char const> bytes
+) {
+   std::uint64_t hash = 0xcbf29ce484222325;
+   for(auto byte : bytes) {
+      hash = (hash ^ byte) * 0x100000001b3;
+   }
+   return hash;
+}
+
+SharedModule const& FilesystemPlatform::touch(
+   std::list<Entry>::iterator entry
+) {
+   m_entries.splice(m_entries.begin(), m_entries, entry);
+   return entry->module;
+}
+
+void FilesystemPlatform::insert(Entry entry) {
+   auto existing = m_by_name.find(entry.name);
+   if(existing != m_by_name.end()) {
+      m_entries.erase(existing->second);
+      m_by_name.erase(existing);
+   }
+   if(m_cache_size == 0) {
+      return;
+   }
+   while(m_entries.size() >= m_cache_size) {
+      m_by_name.erase(m_entries.back().name);
+      m_entries.pop_back();
+      ++m_stats.evictions;
+   }
+   m_entries.push_front(std::move(entry));
+   m_by_name[m_entries.front().name] = m_entries.begin();
+}
+
+} // namespace vm
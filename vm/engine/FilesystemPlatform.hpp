@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "IPlatform.hpp"
+#include "SharedModule.hpp"
+
+namespace vm {
+
+/// @brief IPlatform serving `<name>.bin` from a list of directories.
+///
+/// Nothing is opened until a module is asked for, and a file whose header
+/// names a different module is skipped. Parsed and decoded modules are kept
+/// in an LRU cache as SharedModules, so loading one again (in another
+/// Machine, or after a restart) is a copy-on-write instance of it. A cached
+/// module is reused while its file's size and modification time are
+/// unchanged, or if the file changed but still hashes the same.
+class FilesystemPlatform final : public IPlatform {
+public:
+   static constexpr std::size_t DEFAULT_CACHE_SIZE = 16;
+
+   struct Stats {
+      /// @brief served from the cache
+      int hits = 0;
+      /// @brief parsed from a file
+      int misses = 0;
+      int evictions = 0;
+   };
+
+   explicit FilesystemPlatform(
+      std::vector<std::filesystem::path> search_paths = {},
+      std::size_t cache_size = DEFAULT_CACHE_SIZE
+   );
+
+   /// @brief searched after the paths already added
+   void add_search_path(std::filesystem::path path);
+
+   std::optional<BytecodeModule> get_module(std::string_view name) override;
+
+   Stats const& stats() const {
+      return m_stats;
+   }
+
+   std::size_t cached_count() const {
+      return m_entries.size();
+   }
+
+   /// @brief 64-bit FNV-1a, the cache's content hash of a module file
+   static std::uint64_t content_hash(std::span<unsigned char const> bytes);
+
+private:
+   struct Entry {
+      std::string name;
+      std::filesystem::path path;
+      std::uintmax_t size;
+      std::filesystem::file_time_type modified;
+      std::uint64_t hash;
+      SharedModule module;
+   };
+
+   std::vector<std::filesystem::path> m_search_paths;
+   std::size_t m_cache_size;
+   /// @brief most recently used first
+   std::list<Entry> m_entries;
+   std::unordered_map<std::string, std::list<Entry>::iterator> m_by_name;
+   Stats m_stats;
+
+   /// @brief move an entry to the front, it was just used
+   SharedModule const& touch(std::list<Entry>::iterator entry);
+   void insert(Entry entry);
+};
+
+} // namespace vm
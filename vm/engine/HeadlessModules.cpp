@@ -0,0 +1,83 @@
+#include "HeadlessModules.hpp"
+
+#include "Machine.hpp"
+
+namespace vm {
+
+namespace {
+
+enum GraphicsFn {
+   SET_DISPLAY_BUF = 0,
+   IS_KEY_DOWN = 1,
+   BLIT = 2,
+};
+
+/// @brief bytes per row of the display buffer, as in pc_port
+constexpr int SCREEN_WIDTH = 256;
+
+} // namespace
+
+void HeadlessSystem::invoke_index(BasicMachine<short>& machine, int fn_id) {
+   if(fn_id == 0) {
+      machine.stack().pop();
+   }
+}
+
+std::optional<StackEffect> HeadlessSystem::stack_effect(int fn_id) const {
+   switch(fn_id) {
+   case 0:
+      return StackEffect{1, 0};
+   case 1:
+      return StackEffect{0, 0};
+   default:
+      return std::nullopt;
+   }
+}
+
+void HeadlessGraphics::invoke_index(BasicMachine<short>& machine, int fn_id) {
+   auto& stack = machine.stack();
+   auto code = machine.current_module().code();
+   switch(fn_id) {
+   case SET_DISPLAY_BUF:
+      // ( buffptr -- )
+      m_display_buf = stack.pop();
+      break;
+   case IS_KEY_DOWN: {
+      // ( key -- down? )
+      auto key = stack.pop();
+      stack.push(
+         keys && keys(frame, key) ? Machine::TRUE_WORD : Machine::FALSE_WORD
+      );
+   } break;
+   case BLIT: {
+      // ( x y spriteptr -- )
+      auto sprite = stack.pop();
+      auto y = stack.pop();
+      auto x = stack.pop();
+      int width = code[sprite];
+      int height = code[sprite + 1];
+      for(int row = 0; row < height; ++row) {
+         auto dest = m_display_buf + (y + row) * SCREEN_WIDTH + x;
+         for(int col = 0; col < width; ++col) {
+            code[dest + col] = code[sprite + 2 + row * width + col];
+         }
+         machine.code_changed(dest, width);
+      }
+   } break;
+   }
+}
+
+std::optional<StackEffect> HeadlessGraphics::stack_effect(int fn_id) const {
+   switch(fn_id) {
+   case SET_DISPLAY_BUF:
+      return StackEffect{1, 0};
+   case IS_KEY_DOWN:
+      return StackEffect{1, 1};
+   case BLIT:
+      return StackEffect{3, 0};
+   default:
+      return std::nullopt;
+   }
+}
+
+} // namespace vm
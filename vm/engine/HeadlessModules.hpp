@@ -0,0 +1,46 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <utility>
+
+#include "ISystemModule.hpp"
+
+namespace vm {
+
+/// @brief pc_port's "system" module without the printing, for running
+/// programs in tests and tools. fn 0 ( n -- ) drops n, fn 1 ( -- ) does
+/// nothing.
+class HeadlessSystem final : public ISystemModule {
+public:
+   HeadlessSystem() : ISystemModule("system") {}
+
+   void invoke_index(BasicMachine<short>& machine, int fn_id) override;
+   std::optional<StackEffect> stack_effect(int fn_id) const override;
+};
+
+/// @brief pc_port's "graphics" module without a window. Sprites are blitted
+/// in to module memory as pc_port does, and keys come from a KeySource
+/// rather than the keyboard.
+class HeadlessGraphics final : public ISystemModule {
+public:
+   /// @brief whether key is held in frame
+   using KeySource = std::function<bool(int frame, int key)>;
+
+   /// @param keys if empty, every key is up
+   explicit HeadlessGraphics(KeySource keys = {}) :
+      ISystemModule("graphics"),
+      keys(std::move(keys)) {}
+
+   void invoke_index(BasicMachine<short>& machine, int fn_id) override;
+   std::optional<StackEffect> stack_effect(int fn_id) const override;
+
+   KeySource keys;
+   /// @brief frame passed to keys, set by the caller, entry being 0
+   int frame = 0;
+
+private:
+   int m_display_buf = 0;
+};
+
+} // namespace vm
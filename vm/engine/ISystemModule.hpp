@@ -1,22 +1,41 @@
 #pragma once
 
+#include <cstdint>
+#include <optional>
 #include <string_view>
 
 namespace vm {
 
-class Machine;
+template <typename Word> class BasicMachine;
 
-class ISystemModule {
+/// @brief data stack items a system function pops and then pushes
+struct StackEffect {
+   int pops;
+   int pushes;
+};
+
+/// @brief Native module for a BasicMachine of the same word type
+template <typename Word> class BasicSystemModule {
 public:
-   ISystemModule(std::string_view name) : m_module_name(name) {}
+   BasicSystemModule(std::string_view name) : m_module_name(name) {}
 
    std::string_view name() const {
       return m_module_name;
    }
 
-   virtual void invoke_index(Machine& machine, int fn_id) = 0;
+   virtual void invoke_index(BasicMachine<Word>& machine, int fn_id) = 0;
+
+   /// @brief Stack effect of fn_id, for the verifier. Modules calling a
+   /// function without one can't be verified and always run checked.
+   virtual std::optional<StackEffect> stack_effect(int /*fn_id*/) const {
+      return std::nullopt;
+   }
 
 private:
    std::string_view m_module_name;
 };
-} // namespace vm
\ No newline at end of file
+
+using ISystemModule = BasicSystemModule<short>;
+using ISystemModule32 = BasicSystemModule<std::int32_t>;
+
+} // namespace vm
@@ -0,0 +1,123 @@
+#include "InputLog.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+namespace vm {
+
+namespace {
+
+constexpr char INPUT_MAGIC[4] = {'V', 'M', 'I', 'N'};
+constexpr unsigned INPUT_VERSION = 1;
+
+void write_varint(std::ostream& out, std::uint32_t value) {
+   while(value >= 0x80) {
+      out.put(static_cast<char>(value | 0x80));
+      value >>= 7;
+   }
+   out.put(static_cast<char>(value));
+}
+
+bool read_varint(std::istream& in, std::uint32_t& value) {
+   value = 0;
+   for(int shift = 0; shift < 32; shift += 7) {
+      auto byte = in.get();
+      if(byte == std::istream::traits_type::eof()) {
+         return false;
+      }
+      value |= static_cast<std::uint32_t>(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+} // namespace
+
+void InputLog::press(int frame, int key) {
+   if(frame < 0 || key < 0 || key > 0xffff) {
+      return;
+   }
+   if(frame >= m_frames.size()) {
+      m_frames.resize(frame + 1);
+   }
+   auto& keys = m_frames[frame];
+   auto it = std::lower_bound(keys.begin(), keys.end(), key);
+   if(it == keys.end() || *it != key) {
+      keys.insert(it, key);
+   }
+}
+
+bool InputLog::is_down(int frame, int key) const {
+   if(frame < 0 || frame >= m_frames.size()) {
+      return false;
+   }
+   auto const& keys = m_frames[frame];
+   return std::binary_search(keys.begin(), keys.end(), key);
+}
+
+void InputLog::truncate(int frame) {
+   if(frame >= 0 && frame < m_frames.size()) {
+      m_frames.resize(frame);
+   }
+}
+
+void InputLog::write(std::ostream& out) const {
+   out.write(INPUT_MAGIC, sizeof(INPUT_MAGIC));
+   write_varint(out, INPUT_VERSION);
+   write_varint(out, m_frames.size());
+
+   std::vector<std::uint16_t> previous;
+   std::vector<std::uint16_t> changed;
+   for(auto const& keys : m_frames) {
+      changed.clear();
+      std::set_symmetric_difference(
+         previous.begin(), previous.end(), keys.begin(), keys.end(),
+         std::back_inserter(changed)
+      );
+      write_varint(out, changed.size());
+      for(auto key : changed) {
+         write_varint(out, key);
+      }
+      previous = keys;
+   }
+}
+
+std::expected<InputLog, Error> InputLog::read(std::istream& in) {
+   char magic[sizeof(INPUT_MAGIC)];
+   std::uint32_t version;
+   std::uint32_t frame_count;
+   if(!in.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), INPUT_MAGIC) ||
+      !read_varint(in, version) || version != INPUT_VERSION ||
+      !read_varint(in, frame_count)) {
+      return std::unexpected(Error::InvalidHeader);
+   }
+
+   InputLog log;
+   std::vector<std::uint16_t> keys;
+   for(std::uint32_t frame = 0; frame < frame_count; ++frame) {
+      std::uint32_t change_count;
+      if(!read_varint(in, change_count)) {
+         return std::unexpected(Error::InvalidHeader);
+      }
+      for(std::uint32_t i = 0; i < change_count; ++i) {
+         std::uint32_t key;
+         if(!read_varint(in, key) || key > 0xffff) {
+            return std::unexpected(Error::InvalidHeader);
+         }
+         // each change toggles the key
+         auto it = std::lower_bound(keys.begin(), keys.end(), key);
+         if(it != keys.end() && *it == key) {
+            keys.erase(it);
+         } else {
+            keys.insert(it, key);
+         }
+      }
+      log.m_frames.push_back(keys);
+   }
+   return log;
+}
+
+} // namespace vm
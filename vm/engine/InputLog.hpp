@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "engine_common.hpp"
+
+namespace vm {
+
+/// @brief The keys a program saw held in each frame of a run, so the run
+/// can be replayed exactly.
+///
+/// A graphics system module records in to it with press() when the program
+/// asks for a key that's held, and replays with is_down() in place of the
+/// keyboard. Keys nobody asked for aren't recorded, and replay reports them
+/// as up. Frames are numbered by the caller, typically entry as 0 and each
+/// call of frame after it.
+class InputLog {
+public:
+   /// @brief key was held when the program asked in frame
+   void press(int frame, int key);
+
+   bool is_down(int frame, int key) const;
+
+   /// @brief frames recorded, one past the last frame press() was called
+   /// with or truncated to
+   int frame_count() const {
+      return m_frames.size();
+   }
+
+   /// @brief forget frame and everything after it, eg. after rewinding
+   void truncate(int frame);
+
+   /// @brief Write in the format read() reads: per frame, the keys that went
+   /// down or up since the frame before, as varints. A frame where nothing
+   /// changed takes a byte.
+   void write(std::ostream& out) const;
+
+   /// @return the log, or Error::InvalidHeader if it isn't one
+   static std::expected<InputLog, Error> read(std::istream& in);
+
+private:
+   /// @brief keys held, sorted, per frame
+   std::vector<std::vector<std::uint16_t>> m_frames;
+};
+
+} // namespace vm
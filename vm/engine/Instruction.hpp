@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string_view>
+
+namespace vm {
+
+enum Instruction {
+   I_NOP = 0,
+   I_ADD = 1,
+   I_SUB = 2,
+   I_MUL = 3,
+   I_DIV = 4,
+   I_MOD = 5,
+   I_SHR = 6,
+   I_SHL = 7,
+   I_INVERT = 8,
+   I_GT = 9,
+   I_LT = 10,
+   I_GE = 11,
+   I_LE = 12,
+   I_EQ = 13,
+   I_NEQ = 14,
+   I_JUMP_IMM = 16,
+   I_CALL_IMM = 18,
+   I_BTRUE_IMM = 20,
+   I_BFALSE_IMM = 22,
+   I_RETURN = 23,
+   I_LOAD_MODULE = 24,
+   I_EXTERN_CALL = 25,
+   I_LOAD_WORD = 26,
+   I_STORE_WORD = 27,
+   I_PUSH_IMM = 28,
+   I_DUP = 29,
+   I_SWAP = 30,
+   I_DROP = 31,
+   I_OVER = 32,
+   I_ROT = 33,
+   I_RPUSH = 38,
+   I_RPOP = 39,
+   I_RCOPY = 40,
+   I_INC = 41,
+   I_DEC = 42,
+   I_RCOPY2 = 43,
+   I_LOAD_BYTE = 44,
+   I_STORE_BYTE = 45,
+   I_PICK = 46,
+   I_PUSH_MODULE = 47,
+};
+
+/// @brief as2.py mnemonic of an opcode, or "?" if there isn't one
+constexpr std::string_view instruction_name(int opcode) {
+   switch(opcode) {
+   case I_NOP:
+      return "nop";
+   case I_ADD:
+      return "+";
+   case I_SUB:
+      return "-";
+   case I_MUL:
+      return "*";
+   case I_DIV:
+      return "/";
+   case I_MOD:
+      return "%";
+   case I_SHR:
+      return ">>";
+   case I_SHL:
+      return "<<";
+   case I_INVERT:
+      return "~";
+   case I_GT:
+      return ">";
+   case I_LT:
+      return "<";
+   case I_GE:
+      return ">=";
+   case I_LE:
+      return "<=";
+   case I_EQ:
+      return "==";
+   case I_NEQ:
+      return "!=";
+   case I_JUMP_IMM:
+      return "jump_imm";
+   case I_CALL_IMM:
+      return "call_imm";
+   case I_BTRUE_IMM:
+      return "btrue_imm";
+   case I_BFALSE_IMM:
+      return "bfalse_imm";
+   case I_RETURN:
+      return "return";
+   case I_LOAD_MODULE:
+      return "load_module";
+   case I_EXTERN_CALL:
+      return "extern_call";
+   case I_LOAD_WORD:
+      return "@";
+   case I_STORE_WORD:
+      return "!";
+   case I_PUSH_IMM:
+      return "push_imm";
+   case I_DUP:
+      return "dup";
+   case I_SWAP:
+      return "swap";
+   case I_DROP:
+      return "drop";
+   case I_OVER:
+      return "over";
+   case I_ROT:
+      return "rot";
+   case I_RPUSH:
+      return "rpush";
+   case I_RPOP:
+      return "rpop";
+   case I_RCOPY:
+      return "rcopy";
+   case I_INC:
+      return "inc";
+   case I_DEC:
+      return "dec";
+   case I_RCOPY2:
+      return "rcopy2";
+   case I_LOAD_BYTE:
+      return "@b";
+   case I_STORE_BYTE:
+      return "!b";
+   case I_PICK:
+      return "pick";
+   case I_PUSH_MODULE:
+      return "push_module";
+   default:
+      return "?";
+   }
+}
+
+} // namespace vm
\ No newline at end of file
@@ -0,0 +1,1113 @@
+#include "Jit.hpp"
+#include "DecodedCode.hpp"
+#include "Instruction.hpp"
+#include "Machine.hpp"
+
+#if MACHINE_HAS_JIT
+
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <span>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace vm {
+
+namespace {
+
+enum Reg : int {
+   RAX,
+   RCX,
+   RDX,
+   RBX,
+   RSP,
+   RBP,
+   RSI,
+   RDI,
+   R8,
+   R9,
+   R10,
+   R11,
+   R12,
+   R13,
+   R14,
+   R15,
+   NO_REG = -1,
+};
+
+// Register assignment inside generated code. Everything except RAX, RCX,
+// RDX and RSI is callee saved by the prologue.
+constexpr Reg STATE = RBX;
+constexpr Reg SP = R12;
+constexpr Reg RSP_VM = R13;
+constexpr Reg MEMORY = R14;
+constexpr Reg ENTRIES = R15;
+constexpr Reg MASK = RBP;
+/// @brief cached top of stack, sign extended to 32 bits
+constexpr Reg TOS = RAX;
+
+enum Width { BYTE, WORD, DWORD, QWORD };
+
+enum Condition {
+   CC_AE = 0x3,
+   CC_E = 0x4,
+   CC_NE = 0x5,
+   CC_S = 0x8,
+   CC_L = 0xc,
+   CC_GE = 0xd,
+   CC_LE = 0xe,
+   CC_G = 0xf,
+};
+
+struct Mem {
+   Reg base;
+   int disp = 0;
+   Reg index = NO_REG;
+   int scale = 1;
+};
+
+/// @brief Just enough of an x86-64 encoder for the instruction templates
+class Assembler {
+public:
+   std::vector<unsigned char> bytes;
+
+   int size() const {
+      return bytes.size();
+   }
+
+   void u8(int value) {
+      bytes.push_back(value & 0xff);
+   }
+
+   void u16(int value) {
+      u8(value);
+      u8(value >> 8);
+   }
+
+   void u32(int value) {
+      u16(value);
+      u16(value >> 16);
+   }
+
+   /// @brief `opcode reg, [mem]`, reg may also be an opcode extension
+   void rm(std::initializer_list<int> opcode, int reg, Mem const& m, Width w) {
+      prefix(w, reg, m.index == NO_REG ? 0 : m.index, m.base);
+      for(auto op : opcode) {
+         u8(op);
+      }
+
+      auto base = m.base & 7;
+      auto mod = (m.disp == 0 && base != 5) ? 0
+         : (m.disp >= -128 && m.disp <= 127) ? 1
+                                             : 2;
+      if(m.index == NO_REG && base != 4) {
+         u8(mod << 6 | (reg & 7) << 3 | base);
+      } else {
+         auto index = m.index == NO_REG ? 4 : (m.index & 7);
+         auto ss = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0;
+         u8(mod << 6 | (reg & 7) << 3 | 4);
+         u8(ss << 6 | index << 3 | base);
+      }
+      if(mod == 1) {
+         u8(m.disp);
+      } else if(mod == 2) {
+         u32(m.disp);
+      }
+   }
+
+   /// @brief `opcode reg, rm` with both operands registers
+   void rr(std::initializer_list<int> opcode, int reg, int rm, Width w) {
+      prefix(w, reg, 0, rm);
+      for(auto op : opcode) {
+         u8(op);
+      }
+      u8(0xc0 | (reg & 7) << 3 | (rm & 7));
+   }
+
+   // data movement
+
+   void mov32_imm(Reg dst, int imm) {
+      if(dst & 8) {
+         u8(0x41);
+      }
+      u8(0xb8 + (dst & 7));
+      u32(imm);
+   }
+
+   void mov32(Reg dst, Reg src) {
+      rr({0x89}, src, dst, DWORD);
+   }
+
+   void mov64(Reg dst, Reg src) {
+      rr({0x89}, src, dst, QWORD);
+   }
+
+   void load64(Reg dst, Mem const& m) {
+      rm({0x8b}, dst, m, QWORD);
+   }
+
+   void store64(Mem const& m, Reg src) {
+      rm({0x89}, src, m, QWORD);
+   }
+
+   void store32(Mem const& m, Reg src) {
+      rm({0x89}, src, m, DWORD);
+   }
+
+   void store32_imm(Mem const& m, int imm) {
+      rm({0xc7}, 0, m, DWORD);
+      u32(imm);
+   }
+
+   void store16(Mem const& m, Reg src) {
+      rm({0x89}, src, m, WORD);
+   }
+
+   void store16_imm(Mem const& m, int imm) {
+      rm({0xc7}, 0, m, WORD);
+      u16(imm);
+   }
+
+   void store8(Mem const& m, Reg src) {
+      rm({0x88}, src, m, BYTE);
+   }
+
+   void load8(Reg dst, Mem const& m) {
+      rm({0x8a}, dst, m, BYTE);
+   }
+
+   void movsx16(Reg dst, Mem const& m) {
+      rm({0x0f, 0xbf}, dst, m, DWORD);
+   }
+
+   void movzx8(Reg dst, Mem const& m) {
+      rm({0x0f, 0xb6}, dst, m, DWORD);
+   }
+
+   /// @brief truncate to a StackWord, `movsx dst, dst16`
+   void sign_extend16(Reg reg) {
+      rr({0x0f, 0xbf}, reg, reg, DWORD);
+   }
+
+   void movsxd(Reg dst, Reg src) {
+      rr({0x63}, dst, src, QWORD);
+   }
+
+   // arithmetic
+
+   void alu32(int opcode, Reg dst, Reg src) {
+      rr({opcode}, src, dst, DWORD);
+   }
+
+   void add32(Reg dst, Reg src) {
+      alu32(0x01, dst, src);
+   }
+
+   void sub32(Reg dst, Reg src) {
+      alu32(0x29, dst, src);
+   }
+
+   void cmp32(Reg l, Reg r) {
+      alu32(0x39, l, r);
+   }
+
+   void test32(Reg l, Reg r) {
+      alu32(0x85, l, r);
+   }
+
+   void imul32(Reg dst, Reg src) {
+      rr({0x0f, 0xaf}, dst, src, DWORD);
+   }
+
+   void idiv32(Reg divisor) {
+      u8(0x99); // cdq
+      rr({0xf7}, 7, divisor, DWORD);
+   }
+
+   void shl32_cl(Reg reg) {
+      rr({0xd3}, 4, reg, DWORD);
+   }
+
+   void sar32_cl(Reg reg) {
+      rr({0xd3}, 7, reg, DWORD);
+   }
+
+   void add32_imm8(Reg reg, int imm) {
+      rr({0x83}, 0, reg, DWORD);
+      u8(imm);
+   }
+
+   void add64_imm8(Reg reg, int imm) {
+      rr({0x83}, 0, reg, QWORD);
+      u8(imm);
+   }
+
+   void sub64_imm8(Reg reg, int imm) {
+      rr({0x83}, 5, reg, QWORD);
+      u8(imm);
+   }
+
+   void cmp32_imm(Reg reg, int imm) {
+      rr({0x81}, 7, reg, DWORD);
+      u32(imm);
+   }
+
+   void cmp64(Reg reg, Mem const& m) {
+      rm({0x3b}, reg, m, QWORD);
+   }
+
+   void cmp8_imm(Mem const& m, int imm) {
+      rm({0x80}, 7, m, BYTE);
+      u8(imm);
+   }
+
+   void or8(Reg dst, Mem const& m) {
+      rm({0x0a}, dst, m, BYTE);
+   }
+
+   void neg32(Reg reg) {
+      rr({0xf7}, 3, reg, DWORD);
+   }
+
+   void neg64(Reg reg) {
+      rr({0xf7}, 3, reg, QWORD);
+   }
+
+   void test64(Reg l, Reg r) {
+      rr({0x85}, r, l, QWORD);
+   }
+
+   /// @brief reg = condition ? TRUE_WORD : FALSE_WORD
+   void set_flag(Condition cc, Reg reg) {
+      rr({0x0f, 0x90 + cc}, 0, reg, BYTE);
+      rr({0x0f, 0xb6}, reg, reg, DWORD);
+      neg32(reg);
+   }
+
+   // control flow, the rel32 forms return the offset to patch
+
+   int jmp() {
+      u8(0xe9);
+      u32(0);
+      return size() - 4;
+   }
+
+   int jcc(Condition cc) {
+      u8(0x0f);
+      u8(0x80 + cc);
+      u32(0);
+      return size() - 4;
+   }
+
+   void jmp(Reg target) {
+      rr({0xff}, 4, target, DWORD);
+   }
+
+   void push(Reg reg) {
+      if(reg & 8) {
+         u8(0x41);
+      }
+      u8(0x50 + (reg & 7));
+   }
+
+   void pop(Reg reg) {
+      if(reg & 8) {
+         u8(0x41);
+      }
+      u8(0x58 + (reg & 7));
+   }
+
+   void ret() {
+      u8(0xc3);
+   }
+
+   void patch(int at, int target) {
+      auto rel = static_cast<int>(target - (at + 4));
+      std::memcpy(&bytes[at], &rel, sizeof(rel));
+   }
+
+private:
+   void prefix(Width w, int reg, int index, int base) {
+      if(w == WORD) {
+         u8(0x66);
+      }
+      auto rex = (w == QWORD ? 8 : 0) | (reg & 8 ? 4 : 0) |
+         (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0);
+      if(rex) {
+         u8(0x40 | rex);
+      }
+   }
+};
+
+Mem state_field(std::size_t offset) {
+   return Mem{STATE, static_cast<int>(offset)};
+}
+
+/// @brief Translates the reachable code of one module. Output starts with
+/// the entry trampoline, see emit_prologue().
+class Compiler {
+public:
+   struct Output {
+      std::vector<unsigned char> bytes;
+      /// @brief (pc, offset in bytes) of every block leader
+      std::vector<std::pair<int, int>> entries;
+   };
+
+   explicit Compiler(BytecodeModule& module) :
+      m_module(module),
+      m_code(module.code()),
+      m_decoded(module.decoded()),
+      m_visited(m_code.size() + 1, false),
+      m_leader(m_code.size() + 1, false),
+      m_offsets(m_code.size() + 1, -1) {}
+
+   Output compile(std::span<int const> roots) {
+      find_reachable(roots);
+      emit_prologue();
+
+      int code_size = m_code.size();
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(!m_visited[pc]) {
+            continue;
+         }
+         if(m_leader[pc]) {
+            flush();
+            m_offsets[pc] = m_asm.size();
+         }
+         auto instr = DecodedCode::decode_one(m_code, pc);
+         emit(pc, instr);
+
+         auto next = pc + instr.length;
+         if(falls_through(instr.handler) && !emitted_next(pc, next)) {
+            flush();
+            jump_to_pc(m_asm.jmp(), next);
+         }
+      }
+      emit_stubs();
+
+      for(auto [at, pc] : m_pc_fixups) {
+         m_asm.patch(at, m_offsets[pc]);
+      }
+
+      Output out;
+      out.bytes = std::move(m_asm.bytes);
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(m_leader[pc] && m_offsets[pc] >= 0) {
+            out.entries.emplace_back(pc, m_offsets[pc]);
+         }
+      }
+      return out;
+   }
+
+private:
+   struct ExitStub {
+      int fixup;
+      int pc;
+      JitExit reason;
+      /// @brief length of the store for JitExit::CodeWrite, address in RCX
+      int write_length;
+      /// @brief push the address in RCX back on to the stack first
+      bool push_address = false;
+   };
+
+   Assembler m_asm;
+   BytecodeModule const& m_module;
+   std::span<unsigned char const> m_code;
+   DecodedCode& m_decoded;
+   std::vector<bool> m_visited;
+   std::vector<bool> m_leader;
+   std::vector<int> m_offsets;
+   std::vector<std::pair<int, int>> m_pc_fixups;
+   std::vector<ExitStub> m_stubs;
+   int m_exit = 0;
+   int m_exit_interpret = 0;
+   /// @brief TOS holds the top of stack, which is not in memory yet
+   bool m_cached = false;
+
+   static bool falls_through(Handler handler) {
+      switch(handler) {
+      case H_JUMP_IMM:
+      case H_RETURN:
+      case H_LOAD_MODULE:
+      case H_EXTERN_CALL:
+      case H_UNKNOWN:
+      case H_EOF:
+         return false;
+      default:
+         return true;
+      }
+   }
+
+   void find_reachable(std::span<int const> roots) {
+      int code_size = m_code.size();
+      std::vector<int> worklist;
+      for(auto root : roots) {
+         if(root >= 0 && root <= code_size) {
+            m_leader[root] = true;
+            worklist.push_back(root);
+         }
+      }
+
+      auto add = [&](int pc, bool leader) {
+         m_leader[pc] = m_leader[pc] || leader;
+         worklist.push_back(pc);
+      };
+
+      while(!worklist.empty()) {
+         auto pc = worklist.back();
+         worklist.pop_back();
+         if(m_visited[pc]) {
+            continue;
+         }
+         m_visited[pc] = true;
+
+         auto instr = DecodedCode::decode_one(m_code, pc);
+         auto next = pc + instr.length;
+         if(instr.length > 0) {
+            m_decoded.mark_native(pc, instr.length);
+         }
+         switch(instr.handler) {
+         case H_JUMP_IMM:
+            add(instr.operand, true);
+            break;
+         case H_BTRUE_IMM:
+         case H_BFALSE_IMM:
+            add(instr.operand, true);
+            add(next, false);
+            break;
+         case H_CALL_IMM:
+            add(instr.operand, true);
+            add(next, true);
+            break;
+         case H_LOAD_MODULE:
+         case H_EXTERN_CALL:
+         case H_STORE_WORD:
+         case H_STORE_BYTE:
+            // resumed from the interpreter
+            add(next, true);
+            break;
+         case H_PUSH_MODULE:
+            // unresolved imports are left to the interpreter
+            add(next, m_module.import_id(instr.operand) < 0);
+            break;
+         case H_RETURN:
+         case H_UNKNOWN:
+         case H_EOF:
+            break;
+         default:
+            add(next, false);
+            break;
+         }
+      }
+
+      // anything not reached by falling out of the previous emitted
+      // instruction needs a label
+      int previous = -1;
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(!m_visited[pc]) {
+            continue;
+         }
+         if(previous >= 0) {
+            auto instr = DecodedCode::decode_one(m_code, previous);
+            if(previous + instr.length != pc) {
+               m_leader[pc] = true;
+            }
+         }
+         previous = pc;
+      }
+      for(int pc = 0; pc <= code_size; ++pc) {
+         if(!m_visited[pc]) {
+            continue;
+         }
+         auto instr = DecodedCode::decode_one(m_code, pc);
+         auto next = pc + instr.length;
+         if(falls_through(instr.handler) && !emitted_next(pc, next)) {
+            m_leader[next] = true;
+         }
+      }
+   }
+
+   /// @brief is next the instruction emitted straight after pc
+   bool emitted_next(int pc, int next) const {
+      for(int i = pc + 1; i < m_visited.size(); ++i) {
+         if(m_visited[i]) {
+            return i == next;
+         }
+      }
+      return false;
+   }
+
+   void jump_to_pc(int fixup, int pc) {
+      m_pc_fixups.emplace_back(fixup, pc);
+   }
+
+   /// @brief `int entry(JitState*, void const* target)`, then the shared
+   /// exit paths. Exits take the resume pc in RSI and the JitExit in RDI.
+   void emit_prologue() {
+      for(auto reg : {RBX, RBP, R12, R13, R14, R15}) {
+         m_asm.push(reg);
+      }
+      m_asm.mov64(STATE, RDI);
+      m_asm.load64(SP, state_field(offsetof(JitState, sp)));
+      m_asm.load64(RSP_VM, state_field(offsetof(JitState, return_sp)));
+      m_asm.load64(MEMORY, state_field(offsetof(JitState, memory)));
+      m_asm.load64(MASK, state_field(offsetof(JitState, code_mask)));
+      m_asm.load64(ENTRIES, state_field(offsetof(JitState, entries)));
+      m_asm.jmp(RSI);
+
+      m_exit_interpret = m_asm.size();
+      m_asm.mov32_imm(RDI, static_cast<int>(JitExit::Interpret));
+
+      m_exit = m_asm.size();
+      m_asm.store32(state_field(offsetof(JitState, pc)), RSI);
+      m_asm.store64(state_field(offsetof(JitState, sp)), SP);
+      m_asm.store64(state_field(offsetof(JitState, return_sp)), RSP_VM);
+      m_asm.mov32(RAX, RDI);
+      for(auto reg : {R15, R14, R13, R12, RBP, RBX}) {
+         m_asm.pop(reg);
+      }
+      m_asm.ret();
+   }
+
+   void emit_stubs() {
+      for(auto const& stub : m_stubs) {
+         m_asm.patch(stub.fixup, m_asm.size());
+         if(stub.reason == JitExit::CodeWrite) {
+            m_asm.store32(state_field(offsetof(JitState, write_address)), RCX);
+            m_asm.store32_imm(
+               state_field(offsetof(JitState, write_length)), stub.write_length
+            );
+         }
+         if(stub.push_address) {
+            m_asm.store16(Mem{SP}, RCX);
+            m_asm.add64_imm8(SP, 2);
+         }
+         m_asm.mov32_imm(RSI, stub.pc);
+         m_asm.mov32_imm(RDI, static_cast<int>(stub.reason));
+         m_asm.patch(m_asm.jmp(), m_exit);
+      }
+   }
+
+   /// @brief Leave the instruction at pc to the interpreter unless length
+   /// bytes from the address just popped in to RCX are inside the module.
+   /// Verification doesn't bound addresses, the interpreter reports them.
+   void check_address(int pc, int length) {
+      // unsigned, so negative addresses are out of range too
+      m_asm.cmp32_imm(RCX, static_cast<int>(m_code.size()) - length + 1);
+      m_stubs.push_back({m_asm.jcc(CC_AE), pc, JitExit::Interpret, 0, true});
+   }
+
+   void exit_to(int pc, JitExit reason) {
+      flush();
+      m_asm.mov32_imm(RSI, pc);
+      m_asm.mov32_imm(RDI, static_cast<int>(reason));
+      m_asm.patch(m_asm.jmp(), m_exit);
+   }
+
+   // The data stack lives in memory at SP, apart from the top which may be
+   // cached in TOS. Block leaders always start with it flushed.
+
+   void flush() {
+      if(m_cached) {
+         m_asm.store16(Mem{SP}, TOS);
+         m_asm.add64_imm8(SP, 2);
+         m_cached = false;
+      }
+   }
+
+   void pop(Reg dst) {
+      if(m_cached) {
+         if(dst != TOS) {
+            m_asm.mov32(dst, TOS);
+         }
+         m_cached = false;
+      } else {
+         m_asm.movsx16(dst, Mem{SP, -2});
+         m_asm.sub64_imm8(SP, 2);
+      }
+   }
+
+   /// @brief src must not be TOS unless the cache was just popped
+   void push(Reg src) {
+      flush();
+      if(src != TOS) {
+         m_asm.mov32(TOS, src);
+      }
+      m_cached = true;
+   }
+
+   void binary_op(Handler handler) {
+      pop(RCX);
+      pop(RAX);
+      switch(handler) {
+      case H_ADD:
+         m_asm.add32(RAX, RCX);
+         break;
+      case H_SUB:
+         m_asm.sub32(RAX, RCX);
+         break;
+      case H_MUL:
+         m_asm.imul32(RAX, RCX);
+         break;
+      case H_DIV:
+         m_asm.idiv32(RCX);
+         break;
+      case H_MOD:
+         m_asm.idiv32(RCX);
+         m_asm.mov32(RAX, RDX);
+         break;
+      case H_SHR:
+         m_asm.sar32_cl(RAX);
+         break;
+      case H_SHL:
+         m_asm.shl32_cl(RAX);
+         break;
+      default:
+         break;
+      }
+      m_asm.sign_extend16(RAX);
+      push(RAX);
+   }
+
+   void comparison_op(Condition cc) {
+      pop(RCX);
+      pop(RAX);
+      m_asm.cmp32(RAX, RCX);
+      m_asm.set_flag(cc, RAX);
+      push(RAX);
+   }
+
+   void emit(int pc, DecodedInstr const& instr) {
+      auto next = pc + instr.length;
+      switch(instr.handler) {
+      case H_NOP:
+         break;
+
+      case H_ADD:
+      case H_SUB:
+      case H_MUL:
+      case H_DIV:
+      case H_MOD:
+      case H_SHR:
+      case H_SHL:
+         binary_op(instr.handler);
+         break;
+
+      case H_GT:
+         comparison_op(CC_G);
+         break;
+      case H_LT:
+         comparison_op(CC_L);
+         break;
+      case H_GE:
+         comparison_op(CC_GE);
+         break;
+      case H_LE:
+         comparison_op(CC_LE);
+         break;
+      case H_EQ:
+         comparison_op(CC_E);
+         break;
+      case H_NEQ:
+         comparison_op(CC_NE);
+         break;
+
+      case H_JUMP_IMM:
+         flush();
+         jump_to_pc(m_asm.jmp(), instr.operand);
+         break;
+
+      case H_CALL_IMM:
+         flush();
+         m_asm.store16_imm(Mem{RSP_VM}, next);
+         m_asm.add64_imm8(RSP_VM, 2);
+         jump_to_pc(m_asm.jmp(), instr.operand);
+         break;
+
+      case H_BTRUE_IMM:
+      case H_BFALSE_IMM:
+         pop(RAX);
+         m_asm.test32(RAX, RAX);
+         jump_to_pc(
+            m_asm.jcc(instr.handler == H_BTRUE_IMM ? CC_NE : CC_E),
+            instr.operand
+         );
+         break;
+
+      case H_RETURN: {
+         flush();
+         m_asm.cmp64(
+            RSP_VM, state_field(offsetof(JitState, return_stack_base))
+         );
+         m_stubs.push_back({m_asm.jcc(CC_E), next, JitExit::Return, 0});
+         m_asm.movsx16(RSI, Mem{RSP_VM, -2});
+         // returns tagged by an extern_call switch modules, which the
+         // interpreter does
+         m_asm.test32(RSI, RSI);
+         m_stubs.push_back({m_asm.jcc(CC_S), pc, JitExit::Interpret, 0});
+         m_asm.sub64_imm8(RSP_VM, 2);
+         // pc is in RSI for the exit path
+         m_asm.cmp32_imm(RSI, m_code.size());
+         m_asm.patch(m_asm.jcc(CC_AE), m_exit_interpret);
+         m_asm.load64(RAX, Mem{ENTRIES, 0, RSI, 8});
+         m_asm.test64(RAX, RAX);
+         m_asm.patch(m_asm.jcc(CC_E), m_exit_interpret);
+         m_asm.jmp(RAX);
+      } break;
+
+      case H_LOAD_WORD:
+         pop(RCX);
+         check_address(pc, 2);
+         m_asm.movsxd(RCX, RCX);
+         m_asm.movsx16(RAX, Mem{MEMORY, 0, RCX});
+         push(RAX);
+         break;
+
+      case H_LOAD_BYTE:
+         pop(RCX);
+         check_address(pc, 1);
+         m_asm.movsxd(RCX, RCX);
+         m_asm.movzx8(RAX, Mem{MEMORY, 0, RCX});
+         push(RAX);
+         break;
+
+      case H_STORE_WORD:
+         pop(RCX);
+         check_address(pc, 2);
+         pop(RDX);
+         m_asm.movsxd(RCX, RCX);
+         m_asm.store16(Mem{MEMORY, 0, RCX}, RDX);
+         m_asm.load8(RAX, Mem{MASK, 0, RCX});
+         m_asm.or8(RAX, Mem{MASK, 1, RCX});
+         m_stubs.push_back({m_asm.jcc(CC_NE), next, JitExit::CodeWrite, 2});
+         break;
+
+      case H_STORE_BYTE:
+         pop(RCX);
+         check_address(pc, 1);
+         pop(RDX);
+         m_asm.movsxd(RCX, RCX);
+         m_asm.store8(Mem{MEMORY, 0, RCX}, RDX);
+         m_asm.cmp8_imm(Mem{MASK, 0, RCX}, 0);
+         m_stubs.push_back({m_asm.jcc(CC_NE), next, JitExit::CodeWrite, 1});
+         break;
+
+      case H_PUSH_IMM:
+         flush();
+         m_asm.mov32_imm(TOS, instr.operand);
+         m_cached = true;
+         break;
+
+      case H_PUSH_MODULE: {
+         // imports never change once resolved
+         auto id = m_module.import_id(instr.operand);
+         if(id < 0) {
+            exit_to(pc, JitExit::Interpret);
+            break;
+         }
+         flush();
+         m_asm.mov32_imm(TOS, id);
+         m_cached = true;
+      } break;
+
+      case H_DUP:
+         if(m_cached) {
+            flush();
+         } else {
+            m_asm.movsx16(TOS, Mem{SP, -2});
+         }
+         m_cached = true;
+         break;
+
+      case H_SWAP:
+         pop(RCX);
+         pop(RDX);
+         push(RCX);
+         push(RDX);
+         break;
+
+      case H_DROP:
+         if(m_cached) {
+            m_cached = false;
+         } else {
+            m_asm.sub64_imm8(SP, 2);
+         }
+         break;
+
+      case H_OVER:
+         m_asm.movsx16(RCX, Mem{SP, m_cached ? -2 : -4});
+         push(RCX);
+         break;
+
+      case H_ROT:
+         pop(RCX);
+         pop(RDX);
+         pop(RSI);
+         push(RDX);
+         push(RCX);
+         push(RSI);
+         break;
+
+      case H_PICK:
+         pop(RCX);
+         m_asm.movsxd(RCX, RCX);
+         m_asm.neg64(RCX);
+         m_asm.movsx16(RDX, Mem{SP, -2, RCX, 2});
+         push(RDX);
+         break;
+
+      case H_RPUSH:
+         pop(RAX);
+         m_asm.store16(Mem{RSP_VM}, RAX);
+         m_asm.add64_imm8(RSP_VM, 2);
+         break;
+
+      case H_RPOP:
+         m_asm.movsx16(RCX, Mem{RSP_VM, -2});
+         m_asm.sub64_imm8(RSP_VM, 2);
+         push(RCX);
+         break;
+
+      case H_RCOPY:
+         m_asm.movsx16(RCX, Mem{RSP_VM, -2});
+         push(RCX);
+         break;
+
+      case H_RCOPY2:
+         m_asm.movsx16(RCX, Mem{RSP_VM, -4});
+         m_asm.movsx16(RDX, Mem{RSP_VM, -2});
+         push(RCX);
+         push(RDX);
+         break;
+
+      case H_INC:
+      case H_DEC:
+         pop(RAX);
+         m_asm.add32_imm8(RAX, instr.handler == H_INC ? 1 : -1);
+         m_asm.sign_extend16(RAX);
+         push(RAX);
+         break;
+
+      default:
+         // load_module, extern_call, unknown opcodes and running off the end
+         // of the code are all left to the interpreter
+         exit_to(pc, JitExit::Interpret);
+         break;
+      }
+   }
+};
+
+/// @brief W^X buffer holding one module's native code
+class ExecutableBuffer {
+public:
+   ExecutableBuffer() = default;
+
+   explicit ExecutableBuffer(std::span<unsigned char const> bytes) {
+      auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      m_size = (bytes.size() + page - 1) / page * page;
+      auto memory = mmap(
+         nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+         -1, 0
+      );
+      if(memory == MAP_FAILED) {
+         m_size = 0;
+         return;
+      }
+      std::memcpy(memory, bytes.data(), bytes.size());
+      if(mprotect(memory, m_size, PROT_READ | PROT_EXEC) != 0) {
+         munmap(memory, m_size);
+         m_size = 0;
+         return;
+      }
+      m_data = static_cast<unsigned char*>(memory);
+   }
+
+   ExecutableBuffer(ExecutableBuffer const&) = delete;
+   ExecutableBuffer& operator=(ExecutableBuffer const&) = delete;
+
+   ExecutableBuffer& operator=(ExecutableBuffer&& other) noexcept {
+      std::swap(m_data, other.m_data);
+      std::swap(m_size, other.m_size);
+      return *this;
+   }
+
+   ~ExecutableBuffer() {
+      if(m_data) {
+         munmap(m_data, m_size);
+      }
+   }
+
+   unsigned char const* data() const {
+      return m_data;
+   }
+
+private:
+   unsigned char* m_data = nullptr;
+   std::size_t m_size = 0;
+};
+
+} // namespace
+
+struct Jit::CompiledModule {
+   std::vector<int> roots;
+   std::vector<unsigned short> call_counts;
+   std::vector<void const*> entries;
+   ExecutableBuffer native;
+   /// @brief DecodedCode::native_generation() the code was compiled at
+   unsigned generation = 0;
+   bool stale = true;
+   int recompiles = 0;
+   bool disabled = false;
+};
+
+Jit::Jit() = default;
+Jit::~Jit() = default;
+
+Jit::CompiledModule& Jit::compiled(BytecodeModule& module, int module_index) {
+   if(module_index >= m_modules.size()) {
+      m_modules.resize(module_index + 1);
+   }
+   auto& compiled = m_modules[module_index];
+   if(!compiled) {
+      compiled = std::make_unique<CompiledModule>();
+      for(int i = 0; auto exp = module.nth_export(i); ++i) {
+         compiled->roots.push_back(exp->bytecode_offset);
+      }
+      compiled->call_counts.resize(module.code().size(), 0);
+   }
+   return *compiled;
+}
+
+void Jit::compile(BytecodeModule& module, CompiledModule& compiled) {
+   auto code = module.code();
+   auto out = Compiler(module).compile(compiled.roots);
+
+   compiled.native = ExecutableBuffer(out.bytes);
+   compiled.entries.assign(code.size() + 1, nullptr);
+   if(!compiled.native.data()) {
+      // no executable memory, interpret everything
+      compiled.disabled = true;
+      return;
+   }
+   for(auto [pc, offset] : out.entries) {
+      compiled.entries[pc] = compiled.native.data() + offset;
+   }
+   compiled.generation = module.decoded().native_generation();
+   compiled.stale = false;
+}
+
+void const* Jit::entry(BytecodeModule& module, int module_index, int pc) {
+   auto& compiled = this->compiled(module, module_index);
+   if(compiled.disabled) {
+      return nullptr;
+   }
+
+   if(!compiled.stale &&
+      compiled.generation != module.decoded().native_generation()) {
+      // a store hit compiled code
+      compiled.stale = true;
+      if(++compiled.recompiles > MAX_RECOMPILES) {
+         compiled.disabled = true;
+         return nullptr;
+      }
+   }
+   if(compiled.stale) {
+      compile(module, compiled);
+      if(compiled.disabled) {
+         return nullptr;
+      }
+   }
+
+   if(pc < 0 || pc >= compiled.entries.size()) {
+      return nullptr;
+   }
+   return compiled.entries[pc];
+}
+
+void Jit::count_call(BytecodeModule& module, int module_index, int target) {
+   auto& compiled = this->compiled(module, module_index);
+   if(target < 0 || target >= compiled.call_counts.size()) {
+      return;
+   }
+   if(++compiled.call_counts[target] == CALL_THRESHOLD) {
+      compiled.roots.push_back(target);
+      compiled.stale = true;
+   }
+}
+
+bool Jit::disabled(int module_index) const {
+   return module_index < m_modules.size() && m_modules[module_index] &&
+      m_modules[module_index]->disabled;
+}
+
+JitExit Jit::run(int module_index, void const* entry, JitState& state) {
+   auto& compiled = *m_modules[module_index];
+   state.entries = compiled.entries.data();
+   auto trampoline = reinterpret_cast<int (*)(JitState*, void const*)>(
+      compiled.native.data()
+   );
+   return static_cast<JitExit>(trampoline(&state, entry));
+}
+
+template <> void BasicMachine<StackWord>::run_jit() {
+   if(!m_jit) {
+      m_jit = std::make_unique<Jit>();
+   }
+
+   for(;;) {
+      auto& module = current_module();
+      auto native = m_jit->entry(module, m_current_module_idx, m_pc);
+      if(native) {
+         JitState state{};
+         state.sp = m_stack.data() + m_stack.item_count();
+         state.return_sp = m_return_stack.data() + m_return_stack.item_count();
+         state.return_stack_base = m_return_stack.data();
+         state.memory = module.code().data();
+         state.code_mask = module.decoded().code_mask();
+
+         auto exit = m_jit->run(m_current_module_idx, native, state);
+         m_stack.set_item_count(state.sp - m_stack.data());
+         m_return_stack.set_item_count(
+            state.return_sp - m_return_stack.data()
+         );
+         m_pc = state.pc;
+
+         if(exit == JitExit::Return) {
+            return;
+         }
+         if(exit == JitExit::CodeWrite) {
+            module.decoded().invalidate(
+               state.write_address, state.write_length
+            );
+            if(!code_written()) {
+               return;
+            }
+            continue;
+         }
+      } else if(m_jit->disabled(m_current_module_idx)) {
+         run_threaded();
+         return;
+      }
+
+      // Single step anything native code couldn't handle
+      auto code = current_code();
+      auto op = m_pc >= 0 && m_pc < code.size()
+         ? code[m_pc]
+         : static_cast<unsigned char>(I_NOP);
+      if(op == I_CALL_IMM && m_pc + 2 < code.size()) {
+         auto target =
+            static_cast<StackWord>(code[m_pc + 1] | (code[m_pc + 2] << 8));
+         m_jit->count_call(module, m_current_module_idx, target);
+      }
+      if(!instr()) {
+         return;
+      }
+   }
+}
+
+} // namespace vm
+
+#endif
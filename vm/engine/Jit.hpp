@@ -0,0 +1,93 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__) && VM_JIT
+#define MACHINE_HAS_JIT 1
+#else
+#define MACHINE_HAS_JIT 0
+#endif
+
+#if MACHINE_HAS_JIT
+
+namespace vm {
+
+class BytecodeModule;
+
+/// @brief VM registers passed in and out of native code. The generated code
+/// addresses these fields directly, see the prologue in Jit.cpp.
+struct JitState {
+   /// @brief one past the top of the data stack
+   short* sp;
+   /// @brief one past the top of the return stack
+   short* return_sp;
+   short const* return_stack_base;
+   unsigned char* memory;
+   unsigned char const* code_mask;
+   void const* const* entries;
+   /// @brief where to carry on after native code exits
+   int pc;
+   /// @brief bytes written by the store that caused JitExit::CodeWrite
+   int write_address;
+   int write_length;
+};
+
+enum class JitExit : int {
+   /// @brief top level return
+   Return,
+   /// @brief the instruction at pc needs the interpreter
+   Interpret,
+   /// @brief a store hit decoded or compiled code, pc is the next instruction
+   CodeWrite,
+};
+
+/// @brief Baseline x86-64 compiler for bytecode modules.
+///
+/// Each module is compiled as a whole, starting from its exports plus any
+/// call_imm target the interpreter has seen more than CALL_THRESHOLD times.
+/// Every instruction becomes a fixed template, with the top of the data stack
+/// kept in a register inside a basic block. Block leaders (branch targets,
+/// return sites, ...) get an entry in a per-pc table, which is used to
+/// re-enter native code from the interpreter and to resolve `return`.
+///
+/// Native code exits back to Machine for load_module, extern_call, unknown
+/// opcodes, returns to a pc without an entry and stores that hit code. The
+/// compiled bytes are flagged in DecodedCode::code_mask(), so a store to them
+/// (from native code or the interpreter) bumps native_generation() and the
+/// module is recompiled before it is entered again. A module that keeps
+/// rewriting its own code is left to the interpreter after MAX_RECOMPILES.
+class Jit {
+public:
+   static constexpr int CALL_THRESHOLD = 16;
+   static constexpr int MAX_RECOMPILES = 8;
+
+   Jit();
+   ~Jit();
+
+   /// @brief Native code for pc, compiling the module on first use
+   /// @return entry point, or nullptr if pc has to be interpreted
+   void const* entry(BytecodeModule& module, int module_index, int pc);
+
+   /// @brief Note that the interpreter is about to `call_imm target`. Hot
+   /// targets are added to the module's roots and compiled.
+   void count_call(BytecodeModule& module, int module_index, int target);
+
+   /// @brief true once the module has been handed back to the interpreter
+   bool disabled(int module_index) const;
+
+   /// @brief Run native code until it exits. Stack pointers in state must be
+   /// set up by the caller, the rest is filled in here.
+   JitExit run(int module_index, void const* entry, JitState& state);
+
+private:
+   struct CompiledModule;
+   std::vector<std::unique_ptr<CompiledModule>> m_modules;
+
+   CompiledModule& compiled(BytecodeModule& module, int module_index);
+   void compile(BytecodeModule& module, CompiledModule& compiled);
+};
+
+} // namespace vm
+
+#endif
@@ -1,101 +1,479 @@
-#include <cstdio>
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
+#include "Instruction.hpp"
 #include "Machine.hpp"
-namespace vm {
 
-#define MACHINE_TRACE (0)
+namespace vm {
 
 #if MACHINE_TRACE
-#define trace(fmt, ...) std::printf("machine_trace: " fmt "\n", ##__VA_ARGS__)
+#define trace()                                                                \
+   if(m_trace) {                                                               \
+      record_trace();                                                          \
+   }
 #else
-#define trace(...)
+#define trace()
 #endif
 
-enum Instruction {
-   I_NOP = 0,
-   I_ADD = 1,
-   I_SUB = 2,
-   I_MUL = 3,
-   I_DIV = 4,
-   I_MOD = 5,
-   I_SHR = 6,
-   I_SHL = 7,
-   I_INVERT = 8,
-   I_GT = 9,
-   I_LT = 10,
-   I_GE = 11,
-   I_LE = 12,
-   I_EQ = 13,
-   I_NEQ = 14,
-   I_JUMP_IMM = 16,
-   I_CALL_IMM = 18,
-   I_BTRUE_IMM = 20,
-   I_BFALSE_IMM = 22,
-   I_RETURN = 23,
-   I_LOAD_MODULE = 24,
-   I_EXTERN_CALL = 25,
-   I_LOAD_WORD = 26,
-   I_STORE_WORD = 27,
-   I_PUSH_IMM = 28,
-   I_DUP = 29,
-   I_SWAP = 30,
-   I_DROP = 31,
-   I_OVER = 32,
-   I_ROT = 33,
-   I_RPUSH = 38,
-   I_RPOP = 39,
-   I_RCOPY = 40,
-   I_INC = 41,
-   I_DEC = 42,
-   I_RCOPY2 = 43,
-   I_LOAD_BYTE = 44,
-   I_STORE_BYTE = 45,
-   I_PICK = 46,
-};
+#if MACHINE_PROFILE
+#define profile(_event, ...)                                                   \
+   if(m_profiler) {                                                            \
+      m_profiler->_event(__VA_ARGS__);                                         \
+   }
+#else
+#define profile(...)
+#endif
 
-std::optional<Error> Machine::execute_first_module() {
+template <typename Word>
+std::optional<Error> BasicMachine<Word>::execute_first_module() {
    if(m_modules.size() == 0) {
       return Error::ModuleNotFound;
    }
-   return execute_by_index(0, "entry");
+   auto fn = resolve_by_index(0, "entry");
+   if(!fn.has_value()) {
+      return fn.error();
+   }
+   return execute(*fn);
 }
 
-std::optional<Error> Machine::execute(
+template <typename Word>
+std::optional<Error> BasicMachine<Word>::execute(
    std::string_view module_name, std::string_view fn_name
 ) {
-   m_errorno = std::nullopt;
+   auto fn = resolve(module_name, fn_name);
+   if(!fn.has_value()) {
+      return fn.error();
+   }
+   return execute(*fn);
+}
 
+template <typename Word>
+std::expected<FunctionHandle, Error> BasicMachine<Word>::resolve(
+   std::string_view module_name, std::string_view fn_name
+) {
    auto index = get_or_load_module(module_name);
-   if(index < 0) {
-      return Error::ModuleNotFound;
+   if(index < 0 || (index & SYSTEM_MODULE_MASK)) {
+      return std::unexpected(Error::ModuleNotFound);
    }
-
-   return execute_by_index(index, fn_name);
+   return resolve_by_index(index, fn_name);
 }
 
-std::optional<Error> Machine::execute_by_index(
+template <typename Word>
+std::expected<FunctionHandle, Error> BasicMachine<Word>::resolve_by_index(
    int module_index, std::string_view fn_name
 ) {
-   m_current_module_idx = module_index;
-   auto entry = current_module().get_export(fn_name);
+   auto& module = m_modules[module_index];
+   auto export_index = module.export_index(fn_name);
+   if(export_index < 0) {
+      return std::unexpected(Error::EntryNotFound);
+   }
+   auto entry = module.nth_export(export_index);
+   return FunctionHandle(
+      &module, module_index, export_index, entry->bytecode_offset
+   );
+}
+
+template <typename Word>
+std::optional<Error> BasicMachine<Word>::execute_native(
+   std::string_view module_name, std::string_view fn_name, NativeFunction fn
+) {
+   m_errorno = std::nullopt;
+
+   auto handle = resolve(module_name, fn_name);
+   if(!handle.has_value()) {
+      return handle.error();
+   }
+   if(!fits_verified(*handle)) {
+      return execute(*handle);
+   }
+
+   m_current_module_idx = handle->m_module_index;
+   return fn(*this, current_module().code());
+}
+
+template <typename Word>
+std::optional<Error> BasicMachine<Word>::call_extern(int module_id, int fn_id) {
+   if(module_id & SYSTEM_MODULE_MASK) {
+      auto& system_module = *m_system_modules[module_id & ~SYSTEM_MODULE_MASK];
+      profile(enter_system, system_module.name(), module_id, fn_id);
+      system_module.invoke_index(*this, fn_id);
+      profile(leave_system);
+      return std::nullopt;
+   }
+   if(module_id < 0 || module_id >= m_modules.size()) {
+      return Error::ModuleNotFound;
+   }
+   auto& module = m_modules[module_id];
+   auto entry = module.nth_export(fn_id);
    if(!entry.has_value()) {
       return Error::EntryNotFound;
    }
 
-   m_pc = entry.value().bytecode_offset;
+   // translated code keeps its own return stack, so this runs as a top level
+   // call and returns here
+   auto caller = m_current_module_idx;
+   auto caller_pc = m_pc;
+   auto error = execute(
+      FunctionHandle(&module, module_id, fn_id, entry->bytecode_offset)
+   );
+   m_current_module_idx = caller;
+   m_pc = caller_pc;
+   return error;
+}
 
-   while(instr()) {
+template <typename Word>
+bool BasicMachine<Word>::call_module(
+   int module_id, int fn_id, ExternCallCache& cache
+) {
+   if(cache.module_id != module_id || cache.fn_id != fn_id) {
+      if(module_id < 0 || module_id >= m_modules.size()) {
+         m_errorno = Error::ModuleNotFound;
+         return false;
+      }
+      auto entry = m_modules[module_id].nth_export(fn_id);
+      if(!entry.has_value()) {
+         m_errorno = Error::EntryNotFound;
+         return false;
+      }
+      cache = ExternCallCache{module_id, fn_id, entry->bytecode_offset};
+   }
+
+   m_return_stack.push(m_current_module_idx);
+   m_return_stack.push(m_pc | RETURN_MODULE_TAG);
+   m_current_module_idx = module_id;
+   m_pc = cache.pc;
+   return true;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::return_to_module(Word tagged_pc) {
+   int module_id = -1;
+   if(m_return_stack.item_count() > 0) {
+      module_id = m_return_stack.pop();
    }
+   if(module_id < 0 || module_id >= m_modules.size()) {
+      m_errorno = Error::ModuleNotFound;
+      return false;
+   }
+   m_current_module_idx = module_id;
+   m_pc = tagged_pc & std::numeric_limits<Word>::max();
+   return true;
+}
+
+template <typename Word>
+std::optional<Error> BasicMachine<Word>::execute(FunctionHandle const& fn) {
+   if(!fn) {
+      return Error::EntryNotFound;
+   }
+
+   m_errorno = std::nullopt;
+   m_current_module_idx = fn.m_module_index;
+   m_pc = fn.m_pc;
+
+   profile(begin, fn.module(), fn.m_module_index, fn.m_pc);
 
+   m_checked = !fits_verified(fn);
+   if(!m_checked) {
+      run_unchecked();
+   }
+   if(m_checked && !m_errorno.has_value()) {
+      // never verified, or the engine stopped after a store hit its code
+      while(check_instr() && instr()) {
+      }
+   }
+
+   profile(end);
    return m_errorno;
 }
 
+template <typename Word>
+std::expected<std::uint64_t, Error> BasicMachine<Word>::execute_counted(
+   FunctionHandle const& fn
+) {
+   if(!fn) {
+      return std::unexpected(Error::EntryNotFound);
+   }
+
+   m_errorno = std::nullopt;
+   m_current_module_idx = fn.m_module_index;
+   m_pc = fn.m_pc;
+   m_checked = true;
+   profile(begin, fn.module(), fn.m_module_index, fn.m_pc);
+
+   std::uint64_t count = 0;
+   while(check_instr()) {
+      ++count;
+      if(!instr()) {
+         break;
+      }
+   }
+   profile(end);
+
+   if(m_errorno.has_value()) {
+      return std::unexpected(*m_errorno);
+   }
+   return count;
+}
+
+template <typename Word>
+void BasicMachine<Word>::run_unchecked() {
+   if(hooks_attached()) {
+      // the other engines don't report what they run
+      while(instr()) {
+      }
+      return;
+   }
+
+#if MACHINE_HAS_JIT
+   if constexpr(HAS_JIT) {
+      if(m_engine == Engine::Jit) {
+         run_jit();
+         return;
+      }
+   }
+#endif
+
+#if MACHINE_HAS_THREADED_ENGINE
+   if(m_engine == Engine::Threaded) {
+      run_threaded();
+      return;
+   }
+#endif
+
+   while(instr()) {
+   }
+}
+
+template <typename Word>
+unsigned BasicMachine<Word>::code_generation() {
+   unsigned generation = 0;
+   for(auto& module : m_modules) {
+      generation += module.decoded().generation();
+   }
+   return generation;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::invoke_system(int module_id, int fn_id) {
+   auto generation = code_generation();
+   m_system_modules[module_id & ~SYSTEM_MODULE_MASK]->invoke_index(
+      *this, fn_id
+   );
+   if(code_generation() != generation) {
+      return code_written();
+   }
+   return true;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::fits_verified(FunctionHandle const& fn) {
+   if(!ensure_verified(fn.m_module_index)) {
+      return false;
+   }
+   // a return with anything already on the return stack wouldn't end the
+   // call, so only top level calls run unchecked
+   auto const& summary =
+      fn.module().verification().exports[fn.m_export_index];
+   auto items = m_stack.item_count();
+   return m_return_stack.item_count() == 0 && items >= summary.inputs &&
+      items + summary.max_depth <= STACK_SIZE &&
+      summary.max_return_depth <= RETURN_STACK_SIZE;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::ensure_verified(int module_index) {
+   auto& verification = m_modules[module_index].verification();
+   using State = BytecodeModule::Verification::State;
+   if(verification.state == State::Running) {
+      // modules calling each other, one of them has to run checked
+      return false;
+   }
+   if(verification.state == State::Pending ||
+      verification.generation != code_generation()) {
+      verify_module(module_index);
+   }
+   return verification.state == State::Verified;
+}
+
+template <typename Word>
+std::optional<VerifyError> BasicMachine<Word>::verify_module(int module_index) {
+   auto& module = m_modules[module_index];
+   auto& verification = module.verification();
+   using State = BytecodeModule::Verification::State;
+   verification.state = State::Running;
+
+   std::vector<int> entries;
+   for(int i = 0; auto entry = module.nth_export(i); ++i) {
+      entries.push_back(entry->bytecode_offset);
+   }
+
+   auto extern_summary = [&](int import_index, int fn_id)
+      -> std::optional<FunctionSummary> {
+      auto id = module.import_id(import_index);
+      if(id < 0) {
+         id = resolve_import(module_index, import_index);
+      }
+      if(id < 0) {
+         return std::nullopt;
+      }
+
+      if(id & SYSTEM_MODULE_MASK) {
+         auto effect = m_system_modules[id & ~SYSTEM_MODULE_MASK]->stack_effect(
+            fn_id
+         );
+         if(!effect.has_value()) {
+            return std::nullopt;
+         }
+         auto net = effect->pushes - effect->pops;
+         return FunctionSummary{effect->pops, net, std::max(net, 0), 0};
+      }
+
+      if(!ensure_verified(id)) {
+         return std::nullopt;
+      }
+      auto const& exports = m_modules[id].verification().exports;
+      if(static_cast<unsigned>(fn_id) >= exports.size()) {
+         return std::nullopt;
+      }
+      auto summary = exports[fn_id];
+      // the caller's module id and tagged return pc
+      summary.max_return_depth += 2;
+      return summary;
+   };
+
+   auto result =
+      verify(module.code(), entries, extern_summary, module.word_size());
+   verification.generation = code_generation();
+   if(result.has_value()) {
+      verification.state = State::Verified;
+      verification.exports = std::move(*result);
+      verification.error = std::nullopt;
+   } else {
+      verification.state = State::Rejected;
+      verification.exports.clear();
+      verification.error = result.error();
+   }
+   return verification.error;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::check_instr() {
+   auto code = current_code();
+   int code_size = code.size();
+   if(m_pc < 0 || m_pc >= code_size) {
+      m_errorno = Error::EofWithoutReturn;
+      return false;
+   }
+
+   auto op = code[m_pc];
+   auto effect = instr_effect(op, WORD_SIZE);
+   if(!effect.has_value()) {
+      // instr() stops on it
+      return true;
+   }
+
+   auto fail = [&](Error error) {
+      // instr() won't run it, but it's the one a trace is for
+      trace();
+      m_errorno = error;
+      return false;
+   };
+   auto in_memory = [&](int address, int length) {
+      return address >= 0 && address + length <= code_size;
+   };
+
+   if(m_pc + effect->length > code_size) {
+      return fail(Error::EofWithoutReturn);
+   }
+   int items = m_stack.item_count();
+   int return_items = m_return_stack.item_count();
+   if(items < effect->pops || return_items < effect->return_pops) {
+      return fail(Error::StackUnderflow);
+   }
+   if(items - effect->pops + effect->pushes > STACK_SIZE ||
+      return_items - effect->return_pops + effect->return_pushes >
+         RETURN_STACK_SIZE) {
+      return fail(Error::StackOverflow);
+   }
+
+   switch(op) {
+   case I_LOAD_WORD:
+   case I_STORE_WORD:
+      if(!in_memory(m_stack.peek(), WORD_SIZE)) {
+         return fail(Error::AddressOutOfRange);
+      }
+      break;
+   case I_LOAD_BYTE:
+   case I_STORE_BYTE:
+      if(!in_memory(m_stack.peek(), 1)) {
+         return fail(Error::AddressOutOfRange);
+      }
+      break;
+   case I_LOAD_MODULE: {
+      auto name_ptr = m_stack.peek();
+      if(!in_memory(name_ptr, 1) ||
+         std::find(code.begin() + name_ptr, code.end(), 0) == code.end()) {
+         return fail(Error::AddressOutOfRange);
+      }
+   } break;
+   case I_PICK: {
+      auto index = m_stack.peek();
+      if(index < 0 || index >= items - 1) {
+         return fail(Error::StackUnderflow);
+      }
+   } break;
+   case I_EXTERN_CALL: {
+      auto fn_id = m_stack.peek();
+      auto module_id = m_stack.peek_n(1);
+      if(module_id < 0) {
+         return fail(Error::ModuleNotFound);
+      }
+      if(!(module_id & SYSTEM_MODULE_MASK)) {
+         // call_module() checks the ids
+         if(return_items + 2 > RETURN_STACK_SIZE) {
+            return fail(Error::StackOverflow);
+         }
+         break;
+      }
+      auto index = module_id & ~SYSTEM_MODULE_MASK;
+      if(index >= m_system_modules.size()) {
+         return fail(Error::ModuleNotFound);
+      }
+      // functions without a declared effect are trusted
+      auto call = m_system_modules[index]->stack_effect(fn_id);
+      if(call.has_value()) {
+         auto args = items - 2;
+         if(args < call->pops) {
+            return fail(Error::StackUnderflow);
+         }
+         if(args - call->pops + call->pushes > STACK_SIZE) {
+            return fail(Error::StackOverflow);
+         }
+      }
+   } break;
+   }
+   return true;
+}
+
+#if MACHINE_TRACE
+template <typename Word>
+[[gnu::noinline, gnu::cold]] void BasicMachine<Word>::record_trace() {
+   int depth = m_stack.item_count();
+   m_trace->record(TraceRecord{
+      static_cast<std::uint16_t>(m_pc),
+      current_code()[m_pc],
+      static_cast<std::uint8_t>(m_current_module_idx),
+      static_cast<std::int16_t>(depth > 0 ? m_stack.peek() : 0),
+      static_cast<std::uint16_t>(depth),
+   });
+}
+#endif
+
 #define BINARY_OP(_opcode, _op)                                                \
    case _opcode: {                                                             \
       auto r = m_stack.pop();                                                  \
       auto l = m_stack.pop();                                                  \
-      trace(#_opcode " %hu %hu", l, r);                                        \
       m_stack.push(l _op r);                                                   \
    } break
 
@@ -103,21 +481,21 @@ std::optional<Error> Machine::execute_by_index(
    case _opcode: {                                                             \
       auto r = m_stack.pop();                                                  \
       auto l = m_stack.pop();                                                  \
-      trace(#_opcode " %d %d", l, r);                                          \
       m_stack.push((l _op r) ? TRUE_WORD : FALSE_WORD);                        \
    } break
 
-bool Machine::instr() {
+template <typename Word>
+bool BasicMachine<Word>::instr() {
    if(m_pc >= current_code().size()) {
       m_errorno = Error::EofWithoutReturn;
       return false;
    }
 
-   // trace("exe %d", m_pc);
+   trace();
+   profile(instruction, m_current_module_idx, m_pc, current_code()[m_pc]);
    auto instr = pop_progmem();
    switch(instr) {
    case I_NOP:
-      trace("I_NOP");
       break;
 
       BINARY_OP(I_ADD, +);
@@ -137,19 +515,17 @@ bool Machine::instr() {
 
    case I_JUMP_IMM: {
       auto dest = pop_progmem_word();
-      trace("I_JUMP_IMM %hu", dest);
       m_pc = dest;
    } break;
    case I_CALL_IMM: {
       auto dest = pop_progmem_word();
       m_return_stack.push(m_pc);
-      trace("I_CALL_IMM %hu", dest);
       m_pc = dest;
+      profile(call, current_module(), m_current_module_idx, dest);
    } break;
    case I_BTRUE_IMM: {
       auto dest = pop_progmem_word();
       auto test = m_stack.pop();
-      trace("I_BTRUE_IMM %hu (test %hu)", dest, test);
       if(test) {
          m_pc = dest;
       }
@@ -157,7 +533,6 @@ bool Machine::instr() {
    case I_BFALSE_IMM: {
       auto dest = pop_progmem_word();
       auto test = m_stack.pop();
-      trace("I_BFALSE_IMM %hu (test %hu)", dest, test);
       if(!test) {
          m_pc = dest;
       }
@@ -165,85 +540,112 @@ bool Machine::instr() {
    case I_RETURN: {
       if(m_return_stack.item_count() == 0) {
          // top level return
-         trace("I_RETURN toplevel");
+         profile(ret);
          return false;
       }
       auto caller = m_return_stack.pop();
-      trace("I_RETURN %hu", caller);
-      // TODO inter-module return
+      profile(ret);
+      if(caller < 0) {
+         // tagged by an extern_call, caller is in another module
+         return return_to_module(caller);
+      }
       m_pc = caller;
    } break;
    case I_LOAD_MODULE: {
-      // TODO unsafe as fuck
-      auto name_ptr = m_stack.pop();
-      auto name_cstr =
-         reinterpret_cast<char const*>(&current_code().data()[name_ptr]);
-      auto name = std::string_view(name_cstr);
-      trace("I_LOAD_MODULE `%s`", name_cstr);
+      auto code = current_code();
+      auto name_ptr = m_stack.peek();
+      if(!in_code(code.size(), name_ptr, 1) ||
+         std::find(code.begin() + name_ptr, code.end(), 0) == code.end()) {
+         m_errorno = Error::AddressOutOfRange;
+         return false;
+      }
+      m_stack.pop();
+      auto name = std::string_view(
+         reinterpret_cast<char const*>(&code[name_ptr])
+      );
       auto index = get_or_load_module(name);
-      trace("   -> %d", index);
       if(index < 0) {
          m_errorno = Error::ModuleNotFound;
          return false;
       }
       m_stack.push(index);
    } break;
+   case I_PUSH_MODULE: {
+      auto import_index = pop_progmem_word();
+      auto id = import_module_id(import_index);
+      if(id < 0) {
+         m_errorno = Error::ModuleNotFound;
+         return false;
+      }
+      m_stack.push(id);
+   } break;
    case I_EXTERN_CALL: {
       auto fn_id = m_stack.pop();
       auto module_id = m_stack.pop();
       if(module_id & SYSTEM_MODULE_MASK) {
          // system module
-         auto module_index = module_id & (~SYSTEM_MODULE_MASK);
-         trace("I_EXTERN_CALL SYSTEM %d %d", module_index, fn_id);
-         m_system_modules[module_index]->invoke_index(*this, fn_id);
+         profile(
+            enter_system,
+            m_system_modules[module_id & ~SYSTEM_MODULE_MASK]->name(),
+            module_id, fn_id
+         );
+         auto unchanged = invoke_system(module_id, fn_id);
+         profile(leave_system);
+         if(!unchanged) {
+            return false;
+         }
       } else {
          // bytecode module
-         trace("unimpl");
-         return false;
+         auto& decoded = current_module().decoded();
+         auto site = decoded.extern_call_site(m_pc - 1);
+         if(!call_module(
+               module_id, fn_id, decoded.extern_call_cache(site)
+            )) {
+            return false;
+         }
+         profile(call, current_module(), m_current_module_idx, m_pc);
       }
    } break;
    case I_LOAD_WORD: {
+      if(!in_code(current_code().size(), m_stack.peek(), WORD_SIZE)) {
+         m_errorno = Error::AddressOutOfRange;
+         return false;
+      }
       auto address = m_stack.pop();
-      auto code = current_code();
-      trace("I_LOAD_WORD %hu", address);
-      auto val = code[address] | (code[address + 1] << 8);
-      trace("   -> %hu", val);
-      m_stack.push(val);
+      m_stack.push(read_word(&current_code()[address]));
    } break;
    case I_STORE_WORD: {
+      if(!in_code(current_code().size(), m_stack.peek(), WORD_SIZE)) {
+         m_errorno = Error::AddressOutOfRange;
+         return false;
+      }
       auto address = m_stack.pop();
       auto value = m_stack.pop();
-      auto code = current_code();
-      trace("I_STORE_WORD %d <- %d", address, value);
-      code[address] = value & 0xff;
-      code[address + 1] = value >> 8;
+      write_word(&current_code()[address], value);
+      if(current_module().invalidate_decoded(address, WORD_SIZE)) {
+         return code_written();
+      }
    } break;
    case I_PUSH_IMM: {
       auto imm = pop_progmem_word();
-      trace("I_PUSH_IMM %hu", imm);
       m_stack.push(imm);
    } break;
    case I_DUP: {
-      trace("I_DUP");
       m_stack.push(m_stack.peek());
    } break;
    case I_SWAP: {
-      trace("I_SWAP");
       auto a = m_stack.pop();
       auto b = m_stack.pop();
       m_stack.push(a);
       m_stack.push(b);
    } break;
    case I_DROP: {
-      trace("I_DROP");
       m_stack.pop();
    } break;
    case I_OVER: {
-      trace("I_OVER");
       m_stack.push(m_stack.peek_n(1));
    } break;
    case I_ROT: {
-      trace("I_ROT");
       auto c = m_stack.pop();
       auto b = m_stack.pop();
       auto a = m_stack.pop();
@@ -252,80 +654,135 @@ bool Machine::instr() {
       m_stack.push(a);
    } break;
    case I_PICK: {
-      trace("I_PICK");
       auto index = m_stack.pop();
       m_stack.push(m_stack.peek_n(index));
    } break;
    case I_RPUSH: {
-      trace("I_RPUSH");
       auto n = m_stack.pop();
       m_return_stack.push(n);
    } break;
    case I_RPOP: {
-      trace("I_RPOP");
       auto n = m_return_stack.pop();
       m_stack.push(n);
    } break;
    case I_RCOPY: {
-      trace("I_RCOPY");
       auto n = m_return_stack.peek();
       m_stack.push(n);
    } break;
    case I_INC: {
-      trace("I_INC");
       m_stack.push(m_stack.pop() + 1);
    } break;
    case I_DEC: {
-      trace("I_DEC");
       m_stack.push(m_stack.pop() - 1);
    } break;
    case I_RCOPY2: {
-      trace("I_RCOPY2");
       auto top = m_return_stack.peek_n(0);
       auto second = m_return_stack.peek_n(1);
       m_stack.push(second);
       m_stack.push(top);
    } break;
    case I_LOAD_BYTE: {
+      if(!in_code(current_code().size(), m_stack.peek(), 1)) {
+         m_errorno = Error::AddressOutOfRange;
+         return false;
+      }
       auto address = m_stack.pop();
       auto code = current_code();
-      trace("I_LOAD_BYTE %hu", address);
       auto val = code[address];
-      trace("   -> %hu", val);
       m_stack.push(val);
    } break;
    case I_STORE_BYTE: {
+      if(!in_code(current_code().size(), m_stack.peek(), 1)) {
+         m_errorno = Error::AddressOutOfRange;
+         return false;
+      }
       auto address = m_stack.pop();
       auto value = m_stack.pop() & 0xff;
       auto code = current_code();
-      trace("I_STORE_BYTE %d <- %d", address, value);
       code[address] = value;
+      if(current_module().invalidate_decoded(address, 1)) {
+         return code_written();
+      }
    } break;
    default: {
-      trace("unknown opcode: %d", instr);
       return false;
    }
    }
    return true;
 };
 
-int Machine::module_index_by_name(std::string_view name) {
-   // search system modules first
-   for(int i = 0; i < m_system_modules.size(); ++i) {
-      if(m_system_modules[i]->name() == name) {
-         return SYSTEM_MODULE_MASK | i;
+template <typename Word>
+void BasicMachine<Word>::add_system_module(SystemModule* system_module) {
+   int index = SYSTEM_MODULE_MASK | m_system_modules.size();
+   m_system_modules.push_back(system_module);
+   auto [it, inserted] = m_module_indices.emplace(system_module->name(), index);
+   if(!inserted && !(it->second & SYSTEM_MODULE_MASK)) {
+      it->second = index;
+   }
+
+   // link imports of modules added before this, resolved ones are left
+   // alone since compiled code may depend on them
+   for(auto& module : m_modules) {
+      auto imports = module.imports();
+      for(int i = 0; i < imports.size(); ++i) {
+         if(module.import_id(i) < 0 && imports[i] == system_module->name()) {
+            module.set_import_id(i, it->second);
+         }
       }
    }
+   retry_rejected();
+}
 
-   for(int i = 0; i < m_modules.size(); ++i) {
-      if(m_modules[i].name() == name) {
-         return i;
+template <typename Word>
+void BasicMachine<Word>::retry_rejected() {
+   for(auto& module : m_modules) {
+      auto& verification = module.verification();
+      if(verification.state == BytecodeModule::Verification::Rejected) {
+         verification.state = BytecodeModule::Verification::Pending;
       }
    }
-   return -1;
 }
 
-int Machine::get_or_load_module(std::string_view name) {
+template <typename Word>
+int BasicMachine<Word>::add_module(BytecodeModule module) {
+   if(module.word_size() != WORD_SIZE) {
+      return -1;
+   }
+   int index = m_modules.size();
+   m_modules.push_back(std::move(module));
+   m_module_indices.emplace(m_modules.back().name(), index);
+
+   // Registered before resolving its imports, so modules importing each
+   // other find it instead of loading it again. Anything the platform
+   // can't load yet is retried by import_module_id().
+   for(int i = 0; i < m_modules[index].imports().size(); ++i) {
+      resolve_import(index, i);
+   }
+   retry_rejected();
+   return index;
+}
+
+template <typename Word>
+int BasicMachine<Word>::resolve_import(int module_index, int import_index) {
+   auto& module = m_modules[module_index];
+   if(static_cast<unsigned>(import_index) >= module.imports().size()) {
+      return -1;
+   }
+   auto id = get_or_load_module(module.imports()[import_index]);
+   if(id >= 0) {
+      module.set_import_id(import_index, id);
+   }
+   return id;
+}
+
+template <typename Word>
+int BasicMachine<Word>::module_index_by_name(std::string_view name) {
+   auto it = m_module_indices.find(name);
+   return it == m_module_indices.end() ? -1 : it->second;
+}
+
+template <typename Word>
+int BasicMachine<Word>::get_or_load_module(std::string_view name) {
    auto idx = module_index_by_name(name);
    if(idx >= 0) {
       return idx;
@@ -333,8 +790,7 @@ int Machine::get_or_load_module(std::string_view name) {
       // not found, we need to load it
       auto mod = m_platform.get_module(name);
       if(mod.has_value()) {
-         m_modules.push_back(mod.value());
-         return m_modules.size() - 1;
+         return add_module(std::move(*mod));
       } else {
          // platform couldn't load it
          return -1;
@@ -342,4 +798,91 @@ int Machine::get_or_load_module(std::string_view name) {
    }
 }
 
+template <typename Word>
+auto BasicMachine<Word>::save(Snapshot const* base) const -> Snapshot {
+   Snapshot snapshot;
+   snapshot.m_stack = m_stack;
+   snapshot.m_return_stack = m_return_stack;
+   snapshot.m_pc = m_pc;
+   snapshot.m_current_module_idx = m_current_module_idx;
+   snapshot.m_modules.resize(m_modules.size());
+
+   for(std::size_t m = 0; m < m_modules.size(); ++m) {
+      auto code = m_modules[m].code();
+      auto page_count =
+         (code.size() + Snapshot::PAGE_SIZE - 1) / Snapshot::PAGE_SIZE;
+      // a base taken before the module was added has nothing to share
+      auto const* base_pages = base && m < base->m_modules.size() &&
+            base->m_modules[m].size() == page_count
+         ? &base->m_modules[m]
+         : nullptr;
+
+      auto& pages = snapshot.m_modules[m];
+      pages.reserve(page_count);
+      for(std::size_t n = 0; n < page_count; ++n) {
+         auto bytes = code.subspan(
+            n * Snapshot::PAGE_SIZE,
+            std::min<std::size_t>(
+               Snapshot::PAGE_SIZE, code.size() - n * Snapshot::PAGE_SIZE
+            )
+         );
+         if(base_pages &&
+            std::equal(bytes.begin(), bytes.end(), (*base_pages)[n]->begin())) {
+            pages.push_back((*base_pages)[n]);
+            continue;
+         }
+         auto page = std::make_shared<typename Snapshot::Page>();
+         std::copy(bytes.begin(), bytes.end(), page->begin());
+         pages.push_back(std::move(page));
+         snapshot.m_new_bytes += Snapshot::PAGE_SIZE;
+      }
+      snapshot.m_memory_bytes += code.size();
+   }
+   return snapshot;
+}
+
+template <typename Word>
+bool BasicMachine<Word>::restore(Snapshot const& snapshot) {
+   if(snapshot.m_modules.size() > m_modules.size()) {
+      return false;
+   }
+   for(std::size_t m = 0; m < snapshot.m_modules.size(); ++m) {
+      auto size = m_modules[m].code().size();
+      auto page_count =
+         (size + Snapshot::PAGE_SIZE - 1) / Snapshot::PAGE_SIZE;
+      if(snapshot.m_modules[m].size() != page_count) {
+         return false;
+      }
+   }
+
+   for(std::size_t m = 0; m < snapshot.m_modules.size(); ++m) {
+      auto& module = m_modules[m];
+      auto code = module.code();
+      auto const& pages = snapshot.m_modules[m];
+      for(std::size_t n = 0; n < pages.size(); ++n) {
+         auto offset = n * Snapshot::PAGE_SIZE;
+         auto bytes = code.subspan(
+            offset,
+            std::min<std::size_t>(Snapshot::PAGE_SIZE, code.size() - offset)
+         );
+         if(std::equal(bytes.begin(), bytes.end(), pages[n]->begin())) {
+            continue;
+         }
+         std::copy_n(pages[n]->begin(), bytes.size(), bytes.begin());
+         module.invalidate_decoded(offset, bytes.size());
+      }
+   }
+
+   m_stack = snapshot.m_stack;
+   m_return_stack = snapshot.m_return_stack;
+   m_pc = snapshot.m_pc;
+   m_current_module_idx = snapshot.m_current_module_idx;
+   return true;
+}
+
+template class BasicMachine<StackWord>;
+#if MACHINE_WIDE
+template class BasicMachine<StackWord32>;
+#endif
+
 } // namespace vm
\ No newline at end of file
@@ -1,39 +1,258 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <expected>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "BytecodeModule.hpp"
 #include "IPlatform.hpp"
 #include "ISystemModule.hpp"
+#include "Jit.hpp"
 #include "Stack.hpp"
 
+#if MACHINE_PROFILE
+#include "Profiler.hpp"
+#endif
+#if MACHINE_TRACE
+#include "TraceRing.hpp"
+#endif
+
 namespace vm {
 
+/// @brief word of Machine, the 16-bit VM
 using StackWord = short;
+/// @brief word of Machine32
+using StackWord32 = std::int32_t;
+
+/// @brief Interpreter loop used by Machine::execute
+enum class Engine {
+   /// @brief reference `switch` interpreter, one call to instr() per opcode
+   Switch,
+   /// @brief computed-goto dispatch, needs GCC/clang labels-as-values
+   Threaded,
+   /// @brief x86-64 native code, interpreting whatever it can't compile
+   Jit,
+};
+
+#if defined(__GNUC__)
+#define MACHINE_HAS_THREADED_ENGINE 1
+#else
+#define MACHINE_HAS_THREADED_ENGINE 0
+#endif
 
-class Machine {
+/// @brief An export resolved by Machine::resolve(), so it can be called
+/// repeatedly without looking up names. Modules are never unloaded, so a handle
+/// stays valid for the lifetime of the Machine that made it.
+class FunctionHandle {
 public:
-   Machine(IPlatform& platform) :
-      m_stack(STACK_SIZE),
-      m_return_stack(RETURN_STACK_SIZE),
-      m_pc(0),
-      m_platform(platform) {}
+   FunctionHandle() = default;
+
+   explicit operator bool() const {
+      return m_module != nullptr;
+   }
+
+   BytecodeModule& module() const {
+      return *m_module;
+   }
+
+   /// @brief index of module() for Machine::module_by_index()
+   int module_index() const {
+      return m_module_index;
+   }
+
+   /// @brief entry pc of the export
+   int pc() const {
+      return m_pc;
+   }
+
+private:
+   template <typename> friend class BasicMachine;
+
+   FunctionHandle(
+      BytecodeModule* module, int module_index, int export_index, int pc
+   ) :
+      m_module(module),
+      m_module_index(module_index),
+      m_export_index(export_index),
+      m_pc(pc) {}
+
+   BytecodeModule* m_module = nullptr;
+   int m_module_index = -1;
+   int m_export_index = -1;
+   int m_pc = 0;
+};
+
+/// @brief The VM, with a data and return stack of Word.
+///
+/// Word is also the size of an immediate and of a `@`/`!` memory access, and
+/// only modules with that word size can be added: BytecodeModule::HEADER_WIDE
+/// modules for 32 bits. Both are built in to the engine library, see
+/// Machine and Machine32 below. The JIT is 16-bit only.
+template <typename Word> class BasicMachine {
+public:
+   /// @brief bytes in a Word, BytecodeModule::word_size() of its modules
+   static constexpr int WORD_SIZE = sizeof(Word);
+
+   static constexpr bool HAS_JIT = MACHINE_HAS_JIT && WORD_SIZE == 2;
+
+   /// @brief the JIT if this word size has one, otherwise the threaded engine
+   /// if it's built and enabled
+#if MACHINE_HAS_THREADED_ENGINE && VM_THREADED_DISPATCH
+   static constexpr Engine DEFAULT_ENGINE =
+      HAS_JIT ? Engine::Jit : Engine::Threaded;
+#else
+   static constexpr Engine DEFAULT_ENGINE =
+      HAS_JIT ? Engine::Jit : Engine::Switch;
+#endif
+
+   static constexpr int STACK_SIZE = 0x100;
+   static constexpr int RETURN_STACK_SIZE = 0x100;
+
+   using DataStack = Stack<Word, STACK_SIZE>;
+   using ReturnStack = Stack<Word, RETURN_STACK_SIZE>;
+   using SystemModule = BasicSystemModule<Word>;
+
+   /// @brief The stacks, pc, current module and every bytecode module's
+   /// memory, as saved by save().
+   ///
+   /// Memory is held in fixed size pages shared by reference, so copying a
+   /// snapshot is cheap, and a snapshot saved against a base shares every
+   /// page that hasn't changed since with it.
+   class Snapshot {
+   public:
+      static constexpr int PAGE_SIZE = 256;
+
+      /// @brief bytes of pages save() copied rather than shared with its
+      /// base, what this snapshot costs on top of the base
+      std::size_t new_bytes() const {
+         return m_new_bytes;
+      }
+
+      /// @brief bytes of module memory the snapshot covers
+      std::size_t memory_bytes() const {
+         return m_memory_bytes;
+      }
+
+      /// @brief bytes of pages no other snapshot shares, what destroying
+      /// this one would free
+      std::size_t unique_bytes() const {
+         std::size_t bytes = 0;
+         for(auto const& pages : m_modules) {
+            for(auto const& page : pages) {
+               if(page.use_count() == 1) {
+                  bytes += PAGE_SIZE;
+               }
+            }
+         }
+         return bytes;
+      }
+
+      /// @brief bytes of the snapshot itself and its page table, on top of
+      /// the pages
+      std::size_t overhead_bytes() const {
+         auto bytes = sizeof(Snapshot);
+         for(auto const& pages : m_modules) {
+            bytes += pages.capacity() * sizeof(pages[0]);
+         }
+         return bytes;
+      }
+
+   private:
+      friend class BasicMachine;
+
+      using Page = std::array<unsigned char, PAGE_SIZE>;
+
+      DataStack m_stack;
+      ReturnStack m_return_stack;
+      int m_pc = 0;
+      int m_current_module_idx = -1;
+      /// @brief pages of each bytecode module's code(), by module index
+      std::vector<std::vector<std::shared_ptr<Page const>>> m_modules;
+      std::size_t m_new_bytes = 0;
+      std::size_t m_memory_bytes = 0;
+   };
+
+   BasicMachine(IPlatform& platform) : m_pc(0), m_platform(platform) {}
 
    std::optional<Error> execute(
       std::string_view module_name, std::string_view fn_name
    );
    std::optional<Error> execute_first_module();
 
+   /// @brief Look up an export once, loading its module if needed
+   /// @return handle for execute(FunctionHandle const&), or ModuleNotFound /
+   /// EntryNotFound
+   std::expected<FunctionHandle, Error> resolve(
+      std::string_view module_name, std::string_view fn_name
+   );
+
+   /// @brief execute() without the name lookups
+   ///
+   /// The module is verified on its first call (see Verifier.hpp). If it
+   /// passes and the stacks have room for the export's summary, it runs on
+   /// the selected engine without bounds checks, otherwise every instruction
+   /// is checked first by the reference interpreter.
+   std::optional<Error> execute(FunctionHandle const& fn);
+
+   /// @brief execute() on the checked interpreter, counting the instructions
+   /// it runs, including any in other bytecode modules. Much slower than
+   /// execute(), for benchmarks and tools that need to know how much bytecode
+   /// a call is.
+   std::expected<std::uint64_t, Error> execute_counted(FunctionHandle const& fn);
+
+   /// @brief Verify a module now instead of on its first call
+   /// @return why it was rejected, if it was
+   std::optional<VerifyError> verify_module(int module_index);
+
+   /// @brief An export translated to C++ by the aot tool. memory is the
+   /// module's code().
+   using NativeFunction = std::optional<Error> (*)(
+      BasicMachine& machine, std::span<unsigned char> memory
+   );
+
+   /// @brief Run fn, the translation of module_name's export fn_name,
+   /// loading the module first if needed. The module is current for the
+   /// duration of the call, same as execute(). Translated code doesn't check
+   /// the stacks, so if the export couldn't run unchecked on an engine it
+   /// runs on the checked interpreter instead.
+   std::optional<Error> execute_native(
+      std::string_view module_name, std::string_view fn_name, NativeFunction fn
+   );
+
+   /// @brief extern_call from translated code. System modules are invoked
+   /// directly, bytecode modules run to completion on the selected engine.
+   /// @param module_id id returned by load_module
+   std::optional<Error> call_extern(int module_id, int fn_id);
+
+   /// @brief Save the machine's state, see Snapshot. Pages of memory that
+   /// are the same in base are shared with it, so saving against the
+   /// previous snapshot only copies the pages written since.
+   /// @param base an earlier snapshot of this machine, or nullptr
+   Snapshot save(Snapshot const* base = nullptr) const;
+
+   /// @brief Put the stacks, pc and module memory back as they were in
+   /// snapshot. Only pages that differ are copied, and code decoded from
+   /// them is invalidated. Modules added since are left as they are. Not
+   /// for use during execute().
+   /// @return false, having changed nothing, if snapshot's modules don't
+   /// match this machine's
+   bool restore(Snapshot const& snapshot);
+
    /// @brief Add system module
    /// @param system_module Module to add. Reference must outlive this Machine
-   void add_system_module(ISystemModule* system_module) {
-      m_system_modules.push_back(system_module);
-   }
+   void add_system_module(SystemModule* system_module);
 
-   void add_module(BytecodeModule module) {
-      m_modules.push_back(std::move(module));
-   }
+   /// @brief Add bytecode module
+   /// @return index of the module, or -1 if its word_size() isn't WORD_SIZE
+   int add_module(BytecodeModule module);
 
    /// @brief Get index of module from name. Does not load it if it doesn't
    /// exist
@@ -46,7 +265,16 @@ public:
    /// @return index if found, otherwise -1
    int get_or_load_module(std::string_view name);
 
-   Stack<StackWord>& stack() {
+   /// @brief Module id for push_module in the current module. Imports are
+   /// resolved when a module is added, anything that couldn't be loaded
+   /// then is tried again here.
+   /// @return id, or -1 if the module can't be loaded
+   int import_module_id(int import_index) {
+      auto id = current_module().import_id(import_index);
+      return id >= 0 ? id : resolve_import(m_current_module_idx, import_index);
+   }
+
+   DataStack& stack() {
       return m_stack;
    }
 
@@ -54,38 +282,209 @@ public:
       return m_modules[m_current_module_idx];
    }
 
+   /// @brief System modules must call this after writing length bytes at
+   /// address in current_module().code(). If the write hit code, the rest
+   /// of the call runs on the checked interpreter.
+   void code_changed(int address, int length) {
+      current_module().invalidate_decoded(address, length);
+   }
+
    BytecodeModule& module_by_index(int index) {
       return m_modules[index];
    }
 
-   static constexpr StackWord TRUE_WORD = 0xffff;
-   static constexpr StackWord FALSE_WORD = 0;
+   /// @brief bytecode modules added so far, indices are 0 to module_count()
+   int module_count() const {
+      return m_modules.size();
+   }
 
-private:
-   static constexpr int STACK_SIZE = 0x100;
-   static constexpr int RETURN_STACK_SIZE = 0x100;
+   Engine engine() const {
+      return m_engine;
+   }
+
+   /// @brief How many times each superinstruction has run on the threaded
+   /// engine, index i is fused_name(i)
+   std::span<std::uint64_t const> fusion_counts() const {
+      return m_fusion_counts;
+   }
+
+   void reset_fusion_counts() {
+      m_fusion_counts.fill(0);
+   }
 
+   /// @brief Select the interpreter loop. Engine::Jit falls back to
+   /// Engine::Threaded, and that to Engine::Switch, if not compiled in.
+   void set_engine(Engine engine) {
+      if(engine == Engine::Jit && !HAS_JIT) {
+         engine = Engine::Threaded;
+      }
+      if(engine == Engine::Threaded && !MACHINE_HAS_THREADED_ENGINE) {
+         engine = Engine::Switch;
+      }
+      m_engine = engine;
+   }
+
+#if MACHINE_PROFILE
+   /// @brief Record calls to execute() in profiler, or stop with nullptr.
+   /// While one is attached everything runs on the Engine::Switch
+   /// interpreter, the others don't report what they run.
+   /// @param profiler must outlive this Machine, or be detached first
+   void set_profiler(Profiler* profiler) {
+      m_profiler = profiler;
+   }
+#endif
+
+#if MACHINE_TRACE
+   /// @brief Record every instruction in to trace, or stop with nullptr.
+   /// Like a profiler, this moves calls to the Engine::Switch interpreter.
+   /// @param trace must outlive this Machine, or be detached first
+   void set_trace(TraceRing* trace) {
+      m_trace = trace;
+   }
+#endif
+
+   static constexpr Word TRUE_WORD = static_cast<Word>(~0);
+   static constexpr Word FALSE_WORD = 0;
+
+   /// @brief little endian Word at bytes
+   static Word read_word(unsigned char const* bytes) {
+      std::make_unsigned_t<Word> out = 0;
+      for(int i = 0; i < WORD_SIZE; ++i) {
+         out |= static_cast<std::make_unsigned_t<Word>>(bytes[i]) << (8 * i);
+      }
+      return static_cast<Word>(out);
+   }
+
+   static void write_word(unsigned char* bytes, Word value) {
+      for(int i = 0; i < WORD_SIZE; ++i) {
+         bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+      }
+   }
+
+private:
    // Don't want to touch the sign bit for 16-bit ints since we use negative
    // numbers as module not found.
    static constexpr int SYSTEM_MODULE_MASK = 0x4000;
 
-   Stack<StackWord> m_stack;
-   Stack<StackWord> m_return_stack;
+   // An extern_call to a bytecode module pushes the caller's module id and
+   // then its return pc with the sign bit set, so `return` only has to look
+   // at the sign of what it pops to know it's leaving the module.
+   static constexpr int RETURN_MODULE_TAG = std::numeric_limits<Word>::min();
+
+   DataStack m_stack;
+   ReturnStack m_return_stack;
    int m_pc;
    int m_current_module_idx = -1;
 
-   std::vector<BytecodeModule> m_modules;
-   std::vector<ISystemModule*> m_system_modules;
+   // deque so that modules, and the FunctionHandles and string_views pointing
+   // in to them, don't move when more are loaded
+   std::deque<BytecodeModule> m_modules;
+   std::vector<SystemModule*> m_system_modules;
+
+   /// @brief name -> index as returned by module_index_by_name(). System
+   /// modules take precedence over bytecode modules, otherwise the first
+   /// module added with a name wins.
+   std::unordered_map<std::string_view, int> m_module_indices;
 
    IPlatform& m_platform;
    std::optional<Error> m_errorno;
+   /// @brief the current call is running on the checked interpreter
+   bool m_checked = false;
+   Engine m_engine = DEFAULT_ENGINE;
+   std::array<std::uint64_t, FUSED_COUNT> m_fusion_counts{};
+#if MACHINE_HAS_JIT
+   std::unique_ptr<Jit> m_jit;
+#endif
+#if MACHINE_PROFILE
+   Profiler* m_profiler = nullptr;
+#endif
+#if MACHINE_TRACE
+   TraceRing* m_trace = nullptr;
+#endif
 
    bool instr();
 
+   /// @brief Check the instruction at m_pc against the stacks and memory
+   /// before instr() runs it
+   /// @return false with m_errorno set if it would fail
+   bool check_instr();
+
+   /// @brief run the current call on the selected engine, unchecked
+   void run_unchecked();
+
+   /// @brief a profiler or trace wants to see every instruction, which only
+   /// instr() reports
+   bool hooks_attached() const {
+#if MACHINE_PROFILE
+      if(m_profiler) {
+         return true;
+      }
+#endif
+#if MACHINE_TRACE
+      if(m_trace) {
+         return true;
+      }
+#endif
+      return false;
+   }
+
+#if MACHINE_TRACE
+   /// @brief record the instruction at m_pc, which is in the code. Kept
+   /// out of instr() so it costs the interpreter nothing until attached.
+   void record_trace();
+#endif
+
+   /// @brief A store from the running engine hit code, so verification of it
+   /// no longer holds
+   /// @return false if the engine has to stop at m_pc and leave the rest of
+   /// the call to the checked interpreter
+   bool code_written() {
+      if(m_checked) {
+         return true;
+      }
+      m_checked = true;
+      return false;
+   }
+
+   /// @brief sum of every module's DecodedCode::generation()
+   unsigned code_generation();
+
+   /// @brief invoke fn_id of a system module
+   /// @return false if it wrote over code and the engine has to stop at m_pc
+   /// and leave the rest of the call to the checked interpreter
+   bool invoke_system(int module_id, int fn_id);
+
+   /// @brief verify module_index if it hasn't been since code last changed
+   /// @return true if it passed
+   bool ensure_verified(int module_index);
+
+   /// @brief whether fn can run unchecked with the stacks as they are now
+   bool fits_verified(FunctionHandle const& fn);
+
+   /// @brief modules rejected because of a missing import may pass now
+   void retry_rejected();
+
+#if MACHINE_HAS_THREADED_ENGINE
+   void run_threaded();
+#endif
+
+#if MACHINE_HAS_JIT
+   void run_jit();
+#endif
+
    std::span<unsigned char> current_code() {
       return current_module().code();
    }
 
+   /// @brief whether length bytes from address fit in code_size bytes.
+   /// Verification doesn't bound addresses, so the engines check every load
+   /// and store with this, checked or not.
+   static bool in_code(std::size_t code_size, Word address, int length) {
+      // negative addresses convert to ones far past the end of any module
+      auto first = static_cast<std::size_t>(address);
+      return first < code_size && first + length <= code_size;
+   }
+
    unsigned char pop_progmem() {
       // todo that's a lot of lookup for one bit of program memory
       auto out = current_code()[m_pc];
@@ -93,18 +492,44 @@ private:
       return out;
    }
 
-   StackWord pop_progmem_word() {
-      auto code = current_code();
-      // little endian
-      StackWord out =
-         static_cast<StackWord>(code[m_pc] | (code[m_pc + 1] << 8));
-      m_pc += 2;
+   Word pop_progmem_word() {
+      auto out = read_word(&current_code()[m_pc]);
+      m_pc += WORD_SIZE;
       return out;
    }
 
-   std::optional<Error> execute_by_index(
+   /// @brief extern_call in to a bytecode module: push the return to the
+   /// current module at m_pc and continue at the export's entry
+   /// @param cache the call site's cache, refilled on a miss
+   /// @return false with m_errorno set if there's no such module or export
+   bool call_module(int module_id, int fn_id, ExternCallCache& cache);
+
+   /// @brief second half of `return` when the popped pc was tagged with
+   /// RETURN_MODULE_TAG, switch back to the module below it
+   /// @return false with m_errorno set if that isn't a bytecode module
+   bool return_to_module(Word tagged_pc);
+
+   /// @brief resolve (or retry) one import of a module, -1 if it can't be
+   int resolve_import(int module_index, int import_index);
+
+   std::expected<FunctionHandle, Error> resolve_by_index(
       int module_index, std::string_view fn_name
    );
 };
 
+using Machine = BasicMachine<StackWord>;
+#if MACHINE_WIDE
+using Machine32 = BasicMachine<StackWord32>;
+#endif
+
+#if MACHINE_HAS_JIT
+template <> void BasicMachine<StackWord>::run_jit();
+#endif
+
+// instantiated in Machine.cpp
+extern template class BasicMachine<StackWord>;
+#if MACHINE_WIDE
+extern template class BasicMachine<StackWord32>;
+#endif
+
 } // namespace vm
\ No newline at end of file
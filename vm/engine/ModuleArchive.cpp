@@ -0,0 +1,180 @@
+#include "ModuleArchive.hpp"
+
+#include <algorithm>
+#include <string>
+
+#if MODULE_HAS_MMAP
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vm {
+
+namespace {
+
+constexpr unsigned char MAGIC[] = {'S', 'B', 'C', 'A'};
+
+void push_u32(std::vector<unsigned char>& out, std::uint32_t value) {
+   for(int i = 0; i < 4; ++i) {
+      out.push_back((value >> (8 * i)) & 0xff);
+   }
+}
+
+} // namespace
+
+std::expected<ModuleArchive, Error> ModuleArchive::open(
+   std::span<unsigned char const> image
+) {
+   if(image.size() < HEADER_SIZE ||
+      !std::equal(std::begin(MAGIC), std::end(MAGIC), image.begin()) ||
+      image[4] != VERSION) {
+      return std::unexpected(Error::InvalidHeader);
+   }
+   std::size_t count = image[6] | image[7] << 8;
+   if(HEADER_SIZE + count * INDEX_ENTRY_SIZE > image.size()) {
+      return std::unexpected(Error::InvalidHeader);
+   }
+
+   // check every entry now, so lookups don't have to
+   auto archive = ModuleArchive(image, count);
+   for(std::size_t n = 0; n < count; ++n) {
+      auto entry = HEADER_SIZE + n * INDEX_ENTRY_SIZE;
+      std::size_t name_offset = archive.read_u32(entry);
+      std::size_t module_offset = archive.read_u32(entry + 4);
+      std::size_t module_size = archive.read_u32(entry + 8);
+      if(name_offset >= image.size() ||
+         name_offset + 1 + image[name_offset] > image.size() ||
+         module_offset > image.size() ||
+         module_size > image.size() - module_offset) {
+         return std::unexpected(Error::InvalidHeader);
+      }
+      if(n > 0 && archive.name(n - 1) >= archive.name(n)) {
+         return std::unexpected(Error::InvalidHeader);
+      }
+   }
+   return archive;
+}
+
+#if MODULE_HAS_MMAP
+std::expected<ModuleArchive, Error> ModuleArchive::open_file(
+   char const* path
+) {
+   auto fd = ::open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0) {
+      return std::unexpected(Error::FileUnreadable);
+   }
+   struct stat info;
+   std::optional<ModuleMemory> mapping;
+   if(fstat(fd, &info) == 0) {
+      mapping = ModuleMemory::map(fd, info.st_size, 0);
+   }
+   close(fd);
+   if(!mapping.has_value()) {
+      return std::unexpected(Error::FileUnreadable);
+   }
+
+   auto archive = open(std::span(mapping->data(), mapping->size()));
+   if(archive.has_value()) {
+      archive->m_mapping = std::move(*mapping);
+   }
+   return archive;
+}
+#endif
+
+std::expected<std::vector<unsigned char>, Error> ModuleArchive::build(
+   std::span<std::vector<unsigned char> const> modules
+) {
+   struct Member {
+      std::string name;
+      std::vector<unsigned char> const* bytes;
+   };
+   std::vector<Member> members;
+   for(auto const& bytes : modules) {
+      auto module = BytecodeModule::load(bytes);
+      if(!module.has_value()) {
+         return std::unexpected(module.error());
+      }
+      members.push_back(Member{std::string(module->name()), &bytes});
+   }
+   std::sort(members.begin(), members.end(), [](auto& a, auto& b) {
+      return a.name < b.name;
+   });
+   for(std::size_t n = 1; n < members.size(); ++n) {
+      if(members[n - 1].name == members[n].name) {
+         return std::unexpected(Error::InvalidHeader);
+      }
+   }
+   if(members.size() > 0xffff) {
+      return std::unexpected(Error::InvalidHeader);
+   }
+
+   // header, index, length prefixed names, then the modules
+   std::vector<unsigned char> out(std::begin(MAGIC), std::end(MAGIC));
+   out.push_back(VERSION);
+   out.push_back(0);
+   out.push_back(members.size() & 0xff);
+   out.push_back(members.size() >> 8);
+
+   std::size_t name_offset = HEADER_SIZE + members.size() * INDEX_ENTRY_SIZE;
+   std::size_t module_offset = name_offset;
+   for(auto const& member : members) {
+      module_offset += 1 + member.name.size();
+   }
+   for(auto const& member : members) {
+      push_u32(out, name_offset);
+      push_u32(out, module_offset);
+      push_u32(out, member.bytes->size());
+      name_offset += 1 + member.name.size();
+      module_offset += member.bytes->size();
+   }
+   for(auto const& member : members) {
+      out.push_back(member.name.size());
+      out.insert(out.end(), member.name.begin(), member.name.end());
+   }
+   for(auto const& member : members) {
+      out.insert(out.end(), member.bytes->begin(), member.bytes->end());
+   }
+   return out;
+}
+
+std::string_view ModuleArchive::name(std::size_t n) const {
+   auto offset = read_u32(HEADER_SIZE + n * INDEX_ENTRY_SIZE);
+   return std::string_view(
+      reinterpret_cast<char const*>(m_image.data() + offset + 1),
+      m_image[offset]
+   );
+}
+
+std::optional<std::span<unsigned char const>> ModuleArchive::find(
+   std::string_view name
+) const {
+   std::size_t low = 0;
+   std::size_t high = m_count;
+   while(low < high) {
+      auto mid = low + (high - low) / 2;
+      auto mid_name = this->name(mid);
+      if(mid_name == name) {
+         return module(mid);
+      } else if(mid_name < name) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+   return std::nullopt;
+}
+
+std::uint32_t ModuleArchive::read_u32(std::size_t offset) const {
+   return std::uint32_t{m_image[offset]} |
+      std::uint32_t{m_image[offset + 1]} << 8 |
+      std::uint32_t{m_image[offset + 2]} << 16 |
+      std::uint32_t{m_image[offset + 3]} << 24;
+}
+
+std::span<unsigned char const> ModuleArchive::module(std::size_t n) const {
+   auto entry = HEADER_SIZE + n * INDEX_ENTRY_SIZE;
+   return m_image.subspan(read_u32(entry + 4), read_u32(entry + 8));
+}
+
+} // namespace vm
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "IPlatform.hpp"
+#include "ModuleMemory.hpp"
+#include "engine_common.hpp"
+
+namespace vm {
+
+/// @brief Many modules in one image: a header, an index sorted by module
+/// name, then the module files as they are. See README.md for the layout.
+///
+/// The index is read in place, so an archive in flash or a mapped file is
+/// looked up in O(log n) without allocating.
+class ModuleArchive {
+public:
+   static constexpr std::uint8_t VERSION = 1;
+   static constexpr std::size_t HEADER_SIZE = 8;
+   static constexpr std::size_t INDEX_ENTRY_SIZE = 12;
+
+   // the index points in to m_mapping, which moves with the archive
+   ModuleArchive(ModuleArchive&&) = default;
+   ModuleArchive& operator=(ModuleArchive&&) = default;
+   ModuleArchive(ModuleArchive const&) = delete;
+   ModuleArchive& operator=(ModuleArchive const&) = delete;
+
+   /// @brief Check image's header and index. image must outlive the
+   /// archive. Error::InvalidHeader if it's not an archive, an entry is out
+   /// of bounds or the names aren't sorted.
+   static std::expected<ModuleArchive, Error> open(
+      std::span<unsigned char const> image
+   );
+
+#if MODULE_HAS_MMAP
+   /// @brief open() a mapping of the archive file, which the archive owns.
+   /// Like BytecodeModule::load_file(), the file must be replaced rather
+   /// than rewritten in place while the archive is open.
+   static std::expected<ModuleArchive, Error> open_file(char const* path);
+#endif
+
+   /// @brief Pack modules in to an archive, in any order. Error::InvalidHeader
+   /// if one isn't a valid module or two have the same name.
+   static std::expected<std::vector<unsigned char>, Error> build(
+      std::span<std::vector<unsigned char> const> modules
+   );
+
+   std::size_t size() const {
+      return m_count;
+   }
+
+   /// @brief name of the nth module, in sorted order
+   std::string_view name(std::size_t n) const;
+
+   /// @brief the module file called name, pointing in to the image
+   std::optional<std::span<unsigned char const>> find(
+      std::string_view name
+   ) const;
+
+private:
+   /// @brief set by open_file() only
+   ModuleMemory m_mapping;
+   std::span<unsigned char const> m_image;
+   std::size_t m_count = 0;
+
+   ModuleArchive(std::span<unsigned char const> image, std::size_t count) :
+      m_image(image),
+      m_count(count) {}
+
+   std::uint32_t read_u32(std::size_t offset) const;
+   /// @brief module file bytes of the nth index entry
+   std::span<unsigned char const> module(std::size_t n) const;
+};
+
+/// @brief IPlatform serving modules out of a ModuleArchive
+class ArchivePlatform final : public IPlatform {
+public:
+   explicit ArchivePlatform(ModuleArchive archive) :
+      m_archive(std::move(archive)) {}
+
+   std::optional<BytecodeModule> get_module(std::string_view name) override {
+      auto bytes = m_archive.find(name);
+      if(!bytes.has_value()) {
+         return std::nullopt;
+      }
+      auto module = BytecodeModule::load(*bytes);
+      if(!module.has_value()) {
+         return std::nullopt;
+      }
+      return std::move(*module);
+   }
+
+   ModuleArchive const& archive() const {
+      return m_archive;
+   }
+
+private:
+   ModuleArchive m_archive;
+};
+
+} // namespace vm
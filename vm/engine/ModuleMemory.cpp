@@ -0,0 +1,160 @@
+#include "ModuleMemory.hpp"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#if MODULE_HAS_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace vm {
+
+ModuleMemory::ModuleMemory(
+   std::span<unsigned char const> bytes, std::size_t bss
+) {
+   m_owned.reserve(bytes.size() + bss);
+   m_owned.assign(bytes.begin(), bytes.end());
+   m_owned.resize(bytes.size() + bss);
+   m_data = m_owned.data();
+   m_size = m_owned.size();
+}
+
+#if MODULE_HAS_MMAP
+std::optional<ModuleMemory> ModuleMemory::map(
+   int fd, std::size_t size, std::size_t bss
+) {
+   auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+   auto round_up = [&](std::size_t n) {
+      return (n + page - 1) / page * page;
+   };
+   auto mapped_size = round_up(std::max<std::size_t>(size + bss, 1));
+
+   // anonymous zero pages for the whole module, then the file over the start.
+   // The end of the file's last page reads as zeroes, so BSS can start there.
+   auto memory = mmap(
+      nullptr, mapped_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+   );
+   if(memory == MAP_FAILED) {
+      return std::nullopt;
+   }
+   if(size > 0 &&
+      mmap(
+         memory, round_up(size), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_FIXED, fd, 0
+      ) == MAP_FAILED) {
+      munmap(memory, mapped_size);
+      return std::nullopt;
+   }
+
+   ModuleMemory result;
+   result.m_data = static_cast<unsigned char*>(memory);
+   result.m_size = size + bss;
+   result.m_mapped_size = mapped_size;
+   return result;
+}
+#endif
+
+ModuleMemory::ModuleMemory(ModuleMemory const& other) :
+   ModuleMemory(std::span(other.m_data, other.m_size), 0) {}
+
+ModuleMemory::ModuleMemory(ModuleMemory&& other) noexcept {
+   *this = std::move(other);
+}
+
+ModuleMemory& ModuleMemory::operator=(ModuleMemory&& other) noexcept {
+   if(this == &other) {
+      return *this;
+   }
+   release();
+   // moving a vector keeps its buffer, so m_data stays valid either way
+   m_owned = std::move(other.m_owned);
+   m_data = std::exchange(other.m_data, nullptr);
+   m_size = std::exchange(other.m_size, 0);
+   m_mapped_size = std::exchange(other.m_mapped_size, 0);
+   return *this;
+}
+
+ModuleMemory::~ModuleMemory() {
+   release();
+}
+
+void ModuleMemory::release() {
+#if MODULE_HAS_MMAP
+   if(m_mapped_size != 0) {
+      munmap(m_data, m_mapped_size);
+   }
+#endif
+   m_owned.clear();
+   m_data = nullptr;
+   m_size = 0;
+   m_mapped_size = 0;
+}
+
+SharedPages::SharedPages(std::span<unsigned char const> bytes) :
+   m_size(bytes.size()) {
+#if MODULE_HAS_SHARED_PAGES
+   auto fd = memfd_create("vm-module", MFD_CLOEXEC);
+   if(fd >= 0) {
+      auto remaining = bytes;
+      while(!remaining.empty()) {
+         auto written = write(fd, remaining.data(), remaining.size());
+         if(written <= 0) {
+            break;
+         }
+         remaining = remaining.subspan(written);
+      }
+      if(remaining.empty()) {
+         m_fd = fd;
+         return;
+      }
+      close(fd);
+   }
+#endif
+   m_bytes.assign(bytes.begin(), bytes.end());
+}
+
+SharedPages::SharedPages(SharedPages&& other) noexcept {
+   *this = std::move(other);
+}
+
+SharedPages& SharedPages::operator=(SharedPages&& other) noexcept {
+   if(this == &other) {
+      return *this;
+   }
+#if MODULE_HAS_SHARED_PAGES
+   if(m_fd >= 0) {
+      close(m_fd);
+   }
+#endif
+   m_fd = std::exchange(other.m_fd, -1);
+   m_size = std::exchange(other.m_size, 0);
+   m_bytes = std::move(other.m_bytes);
+   return *this;
+}
+
+SharedPages::~SharedPages() {
+#if MODULE_HAS_SHARED_PAGES
+   if(m_fd >= 0) {
+      close(m_fd);
+   }
+#endif
+}
+
+ModuleMemory SharedPages::instance(std::size_t extra) const {
+#if MODULE_HAS_SHARED_PAGES
+   if(m_fd >= 0) {
+      auto memory = ModuleMemory::map(m_fd, m_size, extra);
+      if(!memory.has_value()) {
+         // out of address space, as a vector would be out of memory
+         throw std::bad_alloc();
+      }
+      return std::move(*memory);
+   }
+#endif
+   return ModuleMemory(m_bytes, extra);
+}
+
+} // namespace vm
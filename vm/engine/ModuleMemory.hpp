@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MODULE_HAS_MMAP 1
+#else
+#define MODULE_HAS_MMAP 0
+#endif
+
+#if defined(__linux__)
+#define MODULE_HAS_SHARED_PAGES 1
+#else
+#define MODULE_HAS_SHARED_PAGES 0
+#endif
+
+namespace vm {
+
+/// @brief Bytes of a loaded module, header included, followed by its zeroed
+/// BSS.
+///
+/// Either a vector, or a private mapping of the module file. A mapping reads
+/// the file in place: pages are shared with the page cache until the module
+/// writes to them, and only then copied. Copying a ModuleMemory always makes
+/// a vector.
+class ModuleMemory {
+public:
+   ModuleMemory() = default;
+
+   /// @param bss zero bytes to add after bytes
+   ModuleMemory(std::span<unsigned char const> bytes, std::size_t bss);
+
+#if MODULE_HAS_MMAP
+   /// @brief Map the first size bytes of fd copy-on-write, followed by bss
+   /// zero bytes. fd can be closed afterwards.
+   /// @return the mapping, or nullopt if mmap failed
+   static std::optional<ModuleMemory> map(
+      int fd, std::size_t size, std::size_t bss
+   );
+#endif
+
+   ModuleMemory(ModuleMemory const& other);
+   ModuleMemory& operator=(ModuleMemory const& other) {
+      return *this = ModuleMemory(other);
+   }
+   ModuleMemory(ModuleMemory&& other) noexcept;
+   ModuleMemory& operator=(ModuleMemory&& other) noexcept;
+   ~ModuleMemory();
+
+   unsigned char* data() {
+      return m_data;
+   }
+
+   unsigned char const* data() const {
+      return m_data;
+   }
+
+   std::size_t size() const {
+      return m_size;
+   }
+
+   bool is_mapped() const {
+      return m_mapped_size != 0;
+   }
+
+private:
+   std::vector<unsigned char> m_owned;
+   unsigned char* m_data = nullptr;
+   std::size_t m_size = 0;
+   /// @brief page rounded length of the mapping, 0 if m_owned holds the data
+   std::size_t m_mapped_size = 0;
+
+   void release();
+};
+
+/// @brief Read-only bytes that many ModuleMemory instances start as a copy
+/// of.
+///
+/// With MODULE_HAS_SHARED_PAGES the bytes are in a memory file, which each
+/// instance maps copy-on-write: pages no instance writes to exist once, no
+/// matter how many instances there are. Otherwise every instance is a copy.
+class SharedPages {
+public:
+   SharedPages() = default;
+   explicit SharedPages(std::span<unsigned char const> bytes);
+
+   SharedPages(SharedPages const&) = delete;
+   SharedPages& operator=(SharedPages const&) = delete;
+   SharedPages(SharedPages&& other) noexcept;
+   SharedPages& operator=(SharedPages&& other) noexcept;
+   ~SharedPages();
+
+   /// @brief a private copy of the bytes, followed by extra zero bytes
+   ModuleMemory instance(std::size_t extra = 0) const;
+
+   std::size_t size() const {
+      return m_size;
+   }
+
+   /// @brief true if instances share pages rather than copying
+   bool is_shared() const {
+      return m_fd >= 0;
+   }
+
+private:
+   int m_fd = -1;
+   std::size_t m_size = 0;
+   /// @brief the bytes, if they couldn't be put in a memory file
+   std::vector<unsigned char> m_bytes;
+};
+
+} // namespace vm
@@ -0,0 +1,278 @@
+#include "OpcodeMiner.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+#include "DecodedCode.hpp"
+#include "Instruction.hpp"
+#include "Verifier.hpp"
+
+namespace vm {
+
+namespace {
+
+std::uint32_t function_key(int module, int pc) {
+   return static_cast<std::uint32_t>(module) << 16 | pc;
+}
+
+bool ends_sequence(unsigned char opcode) {
+   switch(opcode) {
+   case I_JUMP_IMM:
+   case I_CALL_IMM:
+   case I_BTRUE_IMM:
+   case I_BFALSE_IMM:
+   case I_RETURN:
+   case I_EXTERN_CALL:
+      return true;
+   default:
+      return false;
+   }
+}
+
+int length_of(unsigned char opcode) {
+   auto effect = instr_effect(opcode);
+   return effect.has_value() ? effect->length : 1;
+}
+
+/// @brief whether a superinstruction already covers all of name
+bool already_fused(std::string const& name) {
+   for(int i = 0; i < FUSED_COUNT; ++i) {
+      auto fused = " " + std::string(fused_name(i)) + " ";
+      if(fused.find(" " + name + " ") != std::string::npos) {
+         return true;
+      }
+   }
+   return false;
+}
+
+std::string json_string(std::string_view text) {
+   std::string out = "\"";
+   for(auto c : text) {
+      if(c == '"' || c == '\\') {
+         out += '\\';
+      }
+      out += c;
+   }
+   return out + "\"";
+}
+
+void write_gram(
+   std::ostream& out, OpcodeMiner::RankedGram const& ranked, bool last
+) {
+   auto name = OpcodeMiner::gram_name(ranked.gram);
+   out << "{\"ops\": " << json_string(name) << ", \"n\": "
+       << OpcodeMiner::gram_length(ranked.gram)
+       << ", \"count\": " << ranked.count
+       << ", \"saved_dispatches\": " << ranked.saved_dispatches
+       << ", \"already_fused\": " << (already_fused(name) ? "true" : "false")
+       << "}" << (last ? "" : ",");
+}
+
+void write_grams(
+   std::ostream& out, std::vector<OpcodeMiner::RankedGram> const& grams,
+   int top, std::string_view indent
+) {
+   auto count = std::min<std::size_t>(grams.size(), top);
+   out << "[";
+   for(int i = 0; i < count; ++i) {
+      out << "\n" << indent << "  ";
+      write_gram(out, grams[i], i + 1 == count);
+   }
+   out << (count ? "\n" + std::string(indent) : "") << "]";
+}
+
+} // namespace
+
+std::string OpcodeMiner::gram_name(Gram gram) {
+   std::string out;
+   for(int i = 0; i < gram_length(gram); ++i) {
+      if(i != 0) {
+         out += ' ';
+      }
+      out += instruction_name(gram_opcode(gram, i));
+   }
+   return out;
+}
+
+OpcodeMiner::FunctionStats& OpcodeMiner::function(std::uint32_t key) {
+   auto [it, inserted] = m_functions.try_emplace(key);
+   if(inserted) {
+      it->second.module = key >> 16;
+      it->second.pc = key & 0xffff;
+   }
+   return it->second;
+}
+
+void OpcodeMiner::enter(TraceRecord const& record) {
+   m_stack.push_back(function_key(record.module, record.pc));
+}
+
+void OpcodeMiner::end_call() {
+   m_stack.clear();
+   m_window_size = 0;
+}
+
+void OpcodeMiner::add(std::span<TraceRecord const> records) {
+   for(auto const& record : records) {
+      auto sequential = false;
+      if(m_stack.empty()) {
+         m_window_size = 0;
+         enter(record);
+      } else {
+         auto const& previous = m_window[0];
+         auto next_pc = previous.pc + length_of(previous.opcode);
+         auto falls_through =
+            record.module == previous.module && record.pc == next_pc;
+         auto& caller = function(m_stack.back());
+
+         switch(previous.opcode) {
+         case I_BTRUE_IMM:
+         case I_BFALSE_IMM: {
+            auto& branch = caller.branches[previous.pc];
+            ++(falls_through ? branch.not_taken : branch.taken);
+         } break;
+         case I_CALL_IMM:
+            enter(record);
+            break;
+         case I_EXTERN_CALL:
+            // system modules return straight away
+            if(!falls_through) {
+               enter(record);
+            }
+            break;
+         case I_RETURN:
+            if(m_stack.size() > 1) {
+               m_stack.pop_back();
+            }
+            break;
+         }
+         sequential = falls_through && !ends_sequence(previous.opcode);
+      }
+
+      if(!sequential) {
+         m_window_size = 0;
+      }
+      for(int i = MAX_GRAM - 1; i > 0; --i) {
+         m_window[i] = m_window[i - 1];
+      }
+      m_window[0] = record;
+      m_window_size = std::min(m_window_size + 1, MAX_GRAM);
+
+      auto& current = function(m_stack.back());
+      ++current.instructions;
+      ++m_instructions;
+      for(int n = 2; n <= m_window_size; ++n) {
+         // oldest opcode in the low byte
+         auto gram = static_cast<Gram>(n) << 24;
+         for(int i = 0; i < n; ++i) {
+            gram |= Gram{m_window[n - 1 - i].opcode} << (8 * i);
+         }
+         ++current.grams[gram];
+      }
+   }
+}
+
+std::vector<OpcodeMiner::RankedGram> OpcodeMiner::ranked(
+   std::function<bool(FunctionStats const&)> const& filter
+) const {
+   std::unordered_map<Gram, std::uint64_t> totals;
+   for(auto const& [key, fn] : m_functions) {
+      if(filter && !filter(fn)) {
+         continue;
+      }
+      for(auto [gram, count] : fn.grams) {
+         totals[gram] += count;
+      }
+   }
+
+   std::vector<RankedGram> out;
+   for(auto [gram, count] : totals) {
+      out.push_back(RankedGram{
+         gram, count, count * (gram_length(gram) - 1)
+      });
+   }
+   std::ranges::sort(out, [](auto const& a, auto const& b) {
+      return a.saved_dispatches != b.saved_dispatches
+         ? a.saved_dispatches > b.saved_dispatches
+         : a.gram < b.gram;
+   });
+   return out;
+}
+
+void OpcodeMiner::write_json(
+   std::ostream& out, std::span<std::string const> module_names,
+   FunctionNamer const& name_function, int top
+) const {
+   out << "{\n  \"instructions\": " << m_instructions << ",\n";
+   out << "  \"ranked\": ";
+   write_grams(out, ranked(), top, "  ");
+   out << ",\n";
+
+   std::set<int> modules;
+   for(auto const& [key, fn] : m_functions) {
+      modules.insert(fn.module);
+   }
+   std::vector<FunctionStats const*> functions;
+   for(auto const& [key, fn] : m_functions) {
+      functions.push_back(&fn);
+   }
+   std::ranges::sort(functions, [](auto a, auto b) {
+      return a->instructions != b->instructions
+         ? a->instructions > b->instructions
+         : a->pc < b->pc;
+   });
+
+   out << "  \"modules\": [";
+   auto first_module = true;
+   for(auto module : modules) {
+      auto name = module < module_names.size() ? module_names[module] : "";
+      out << (first_module ? "" : ",") << "\n    {\"module\": " << module
+          << ", \"name\": " << json_string(name) << ", \"ranked\": ";
+      write_grams(
+         out,
+         ranked([&](FunctionStats const& fn) { return fn.module == module; }),
+         top, "    "
+      );
+      out << "}";
+      first_module = false;
+   }
+   out << "\n  ],\n";
+
+   out << "  \"functions\": [";
+   auto first_function = true;
+   for(auto const* fn : functions) {
+      out << (first_function ? "" : ",") << "\n    {\"name\": "
+          << json_string(name_function(fn->module, fn->pc))
+          << ", \"module\": " << fn->module << ", \"pc\": " << fn->pc
+          << ", \"instructions\": " << fn->instructions << ",\n";
+      out << "     \"ranked\": ";
+      auto own = [&](FunctionStats const& other) { return &other == fn; };
+      write_grams(out, ranked(own), top, "     ");
+      out << ",\n     \"branches\": [";
+      std::vector<std::pair<int, BranchStats>> branches(
+         fn->branches.begin(), fn->branches.end()
+      );
+      std::ranges::sort(branches, [](auto const& a, auto const& b) {
+         return a.first < b.first;
+      });
+      for(int i = 0; i < branches.size(); ++i) {
+         auto const& [pc, branch] = branches[i];
+         auto total = branch.taken + branch.not_taken;
+         char ratio[32];
+         std::snprintf(
+            ratio, sizeof(ratio), "%.4f",
+            total ? static_cast<double>(branch.taken) / total : 0.0
+         );
+         out << (i ? "," : "") << "\n       {\"pc\": " << pc
+             << ", \"taken\": " << branch.taken
+             << ", \"not_taken\": " << branch.not_taken
+             << ", \"taken_ratio\": " << ratio << "}";
+      }
+      out << (branches.empty() ? "" : "\n     ") << "]}";
+      first_function = false;
+   }
+   out << "\n  ]\n}\n";
+}
+
+} // namespace vm
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TraceRing.hpp"
+
+namespace vm {
+
+/// @brief Dynamic opcode statistics mined from a stream of TraceRecords: how
+/// often each opcode bigram and trigram runs, and how often each conditional
+/// branch is taken, per function.
+///
+/// Calls, returns and branches aren't recorded as such, they're worked out
+/// from consecutive records, so the stream has to be gapless within a call to
+/// Machine::execute(). Only sequences that fall through in the code are
+/// counted, with a branch allowed last, since those are the ones that could
+/// become a superinstruction. Fusing an n-gram saves n - 1 dispatches each
+/// time it runs.
+class OpcodeMiner {
+public:
+   static constexpr int MAX_GRAM = 3;
+
+   /// @brief Opcodes of an n-gram, first in the low byte, with n in the top
+   /// byte so that a bigram and a trigram never collide
+   using Gram = std::uint32_t;
+
+   struct BranchStats {
+      std::uint64_t taken = 0;
+      std::uint64_t not_taken = 0;
+   };
+
+   struct FunctionStats {
+      int module;
+      int pc;
+      std::uint64_t instructions = 0;
+      std::unordered_map<Gram, std::uint64_t> grams;
+      /// @brief by pc of the btrue_imm or bfalse_imm
+      std::unordered_map<int, BranchStats> branches;
+   };
+
+   struct RankedGram {
+      Gram gram;
+      std::uint64_t count;
+      /// @brief count * (n - 1)
+      std::uint64_t saved_dispatches;
+   };
+
+   /// @brief Name of the function entered at pc of a module
+   using FunctionNamer = std::function<std::string(int module, int pc)>;
+
+   static int gram_length(Gram gram) {
+      return gram >> 24;
+   }
+
+   static unsigned char gram_opcode(Gram gram, int i) {
+      return gram >> (8 * i);
+   }
+
+   /// @brief mnemonics separated by spaces, the same as fused_name()
+   static std::string gram_name(Gram gram);
+
+   /// @brief Add records that follow on from the previous ones
+   void add(std::span<TraceRecord const> records);
+
+   /// @brief The next record starts a new call to Machine::execute(), or
+   /// records were lost since the last one
+   void end_call();
+
+   std::uint64_t instructions() const {
+      return m_instructions;
+   }
+
+   /// @brief by (module << 16 | entry pc)
+   std::unordered_map<std::uint32_t, FunctionStats> const& functions() const {
+      return m_functions;
+   }
+
+   /// @brief grams of the functions accepted by filter, or all of them,
+   /// most dispatches saved first
+   std::vector<RankedGram> ranked(
+      std::function<bool(FunctionStats const&)> const& filter = {}
+   ) const;
+
+   /// @brief Everything as JSON: totals, the top ranked grams overall and per
+   /// module, and per function its top grams and every branch
+   /// @param module_names by module index, as in the records
+   /// @param top grams listed in each ranking
+   void write_json(
+      std::ostream& out, std::span<std::string const> module_names,
+      FunctionNamer const& name_function, int top
+   ) const;
+
+private:
+   std::unordered_map<std::uint32_t, FunctionStats> m_functions;
+   std::uint64_t m_instructions = 0;
+
+   /// @brief function keys of the calls in progress
+   std::vector<std::uint32_t> m_stack;
+   /// @brief the last records, newest first, while they fall through
+   std::array<TraceRecord, MAX_GRAM> m_window{};
+   int m_window_size = 0;
+
+   FunctionStats& function(std::uint32_t key);
+   void enter(TraceRecord const& record);
+};
+
+} // namespace vm
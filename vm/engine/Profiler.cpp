@@ -0,0 +1,296 @@
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <numeric>
+
+#include "BytecodeModule.hpp"
+#include "Instruction.hpp"
+
+namespace vm {
+
+namespace {
+
+constexpr int HOT_PC_COUNT = 20;
+
+std::uint64_t frame_key(int module_id, int pc) {
+   return (static_cast<std::uint64_t>(static_cast<unsigned>(module_id)) << 32) |
+      static_cast<unsigned>(pc);
+}
+
+std::string hex(int value) {
+   char out[16];
+   std::snprintf(out, sizeof(out), "0x%04x", value);
+   return out;
+}
+
+double milliseconds(Profiler::Clock::duration time) {
+   return std::chrono::duration<double, std::milli>(time).count();
+}
+
+double percent(std::uint64_t part, std::uint64_t total) {
+   return total == 0 ? 0.0 : 100.0 * part / total;
+}
+
+} // namespace
+
+Profiler::Profiler() {
+   reset();
+}
+
+void Profiler::reset() {
+   m_opcode_counts.fill(0);
+   m_modules.clear();
+   m_frame_names.clear();
+   m_frames.clear();
+   m_nodes.assign(1, Node{-1, -1});
+   m_children.clear();
+   m_stack.assign(1, 0);
+   m_begin_depths.clear();
+   m_last = Clock::now();
+}
+
+int Profiler::frame(std::uint64_t key, auto const& make_name) {
+   auto [it, inserted] = m_frames.emplace(key, m_frame_names.size());
+   if(inserted) {
+      m_frame_names.push_back(make_name());
+   }
+   return it->second;
+}
+
+void Profiler::push(int frame) {
+   auto parent = m_stack.back();
+   auto key = frame_key(parent, frame);
+   auto [it, inserted] = m_children.emplace(key, m_nodes.size());
+   if(inserted) {
+      m_nodes.push_back(Node{frame, parent});
+   }
+   ++m_nodes[it->second].calls;
+   m_stack.push_back(it->second);
+}
+
+void Profiler::charge() {
+   auto now = Clock::now();
+   m_nodes[m_stack.back()].time += now - m_last;
+   m_last = now;
+}
+
+void Profiler::begin(BytecodeModule const& module, int module_index, int pc) {
+   if(m_begin_depths.empty()) {
+      // time between calls to execute() isn't anyone's
+      m_last = Clock::now();
+   } else {
+      charge();
+   }
+   m_begin_depths.push_back(m_stack.size());
+   call(module, module_index, pc);
+}
+
+void Profiler::end() {
+   charge();
+   if(m_begin_depths.empty()) {
+      return;
+   }
+   m_stack.resize(m_begin_depths.back());
+   m_begin_depths.pop_back();
+}
+
+void Profiler::call(BytecodeModule const& module, int module_index, int pc) {
+   if(!m_begin_depths.empty()) {
+      charge();
+   }
+   if(module_index >= m_modules.size()) {
+      m_modules.resize(module_index + 1);
+   }
+   auto& counts = m_modules[module_index];
+   if(counts.pc_counts.size() < module.code().size()) {
+      counts.name = module.name();
+      counts.pc_counts.resize(module.code().size());
+      counts.opcodes.resize(module.code().size());
+   }
+
+   push(frame(frame_key(module_index, pc), [&] {
+      for(int i = 0; auto entry = module.nth_export(i); ++i) {
+         if(entry->bytecode_offset == pc) {
+            return std::string(module.name()) + ":" +
+               std::string(entry->name);
+         }
+      }
+      return std::string(module.name()) + ":" + hex(pc);
+   }));
+}
+
+void Profiler::ret() {
+   charge();
+   if(m_stack.size() > 1) {
+      m_stack.pop_back();
+   }
+}
+
+void Profiler::enter_system(
+   std::string_view module_name, int module_id, int fn_id
+) {
+   charge();
+   push(frame(frame_key(module_id, fn_id), [&] {
+      return std::string(module_name) + ":" + std::to_string(fn_id);
+   }));
+}
+
+void Profiler::leave_system() {
+   ret();
+}
+
+std::uint64_t Profiler::total_instructions() const {
+   return std::accumulate(
+      m_opcode_counts.begin(), m_opcode_counts.end(), std::uint64_t{0}
+   );
+}
+
+std::span<std::uint64_t const> Profiler::pc_counts(int module_index) const {
+   if(module_index < 0 || module_index >= m_modules.size()) {
+      return {};
+   }
+   return m_modules[module_index].pc_counts;
+}
+
+std::vector<Profiler::FunctionStats> Profiler::functions() const {
+   // children always come after their parent, so totals can be summed
+   // bottom up in one reverse pass
+   std::vector<std::uint64_t> total_instructions(m_nodes.size());
+   std::vector<Clock::duration> total_time(m_nodes.size());
+   for(int i = m_nodes.size() - 1; i > 0; --i) {
+      total_instructions[i] += m_nodes[i].instructions;
+      total_time[i] += m_nodes[i].time;
+      total_instructions[m_nodes[i].parent] += total_instructions[i];
+      total_time[m_nodes[i].parent] += total_time[i];
+   }
+
+   std::vector<FunctionStats> out(m_frame_names.size());
+   for(int i = 0; i < out.size(); ++i) {
+      out[i].name = m_frame_names[i];
+   }
+   for(int i = 1; i < m_nodes.size(); ++i) {
+      auto const& node = m_nodes[i];
+      auto& stats = out[node.frame];
+      stats.calls += node.calls;
+      stats.self_instructions += node.instructions;
+      stats.self_time += node.time;
+
+      // recursive calls are already in the outermost one's total
+      auto recursive = false;
+      for(auto p = node.parent; p > 0; p = m_nodes[p].parent) {
+         if(m_nodes[p].frame == node.frame) {
+            recursive = true;
+            break;
+         }
+      }
+      if(!recursive) {
+         stats.total_instructions += total_instructions[i];
+         stats.total_time += total_time[i];
+      }
+   }
+
+   std::ranges::sort(out, [](auto const& a, auto const& b) {
+      return a.total_instructions != b.total_instructions
+         ? a.total_instructions > b.total_instructions
+         : a.total_time > b.total_time;
+   });
+   return out;
+}
+
+void Profiler::write_report(std::ostream& out) const {
+   auto flags = out.flags();
+   auto total = total_instructions();
+   out << std::fixed << total << " instructions\n\n";
+
+   out << "opcodes:\n";
+   std::vector<int> opcodes;
+   for(int op = 0; op < m_opcode_counts.size(); ++op) {
+      if(m_opcode_counts[op] != 0) {
+         opcodes.push_back(op);
+      }
+   }
+   std::ranges::stable_sort(opcodes, [&](int a, int b) {
+      return m_opcode_counts[a] > m_opcode_counts[b];
+   });
+   for(auto op : opcodes) {
+      out << std::setw(14) << m_opcode_counts[op] << std::setw(7)
+          << std::setprecision(2) << percent(m_opcode_counts[op], total)
+          << "%  " << instruction_name(op) << "\n";
+   }
+
+   out << "\nfunctions:\n";
+   out << std::setw(12) << "calls" << std::setw(13) << "self"
+       << std::setw(13) << "total" << std::setw(11) << "self ms"
+       << std::setw(11) << "total ms"
+       << "  name\n";
+   for(auto const& fn : functions()) {
+      out << std::setw(12) << fn.calls << std::setw(13)
+          << fn.self_instructions << std::setw(13) << fn.total_instructions
+          << std::setprecision(3) << std::setw(11)
+          << milliseconds(fn.self_time) << std::setw(11)
+          << milliseconds(fn.total_time) << "  " << fn.name << "\n";
+   }
+
+   struct HotPc {
+      int module_index;
+      int pc;
+      std::uint64_t count;
+   };
+   std::vector<HotPc> pcs;
+   for(int module_index = 0; module_index < m_modules.size();
+       ++module_index) {
+      auto const& counts = m_modules[module_index].pc_counts;
+      for(int pc = 0; pc < counts.size(); ++pc) {
+         if(counts[pc] != 0) {
+            pcs.push_back(HotPc{module_index, pc, counts[pc]});
+         }
+      }
+   }
+   auto shown = std::min<std::size_t>(pcs.size(), HOT_PC_COUNT);
+   std::ranges::partial_sort(
+      pcs, pcs.begin() + shown,
+      [](auto const& a, auto const& b) { return a.count > b.count; }
+   );
+   out << "\nhottest pcs:\n";
+   for(auto const& hot : std::span(pcs).first(shown)) {
+      auto const& module = m_modules[hot.module_index];
+      out << std::setw(14) << hot.count << std::setw(7)
+          << std::setprecision(2) << percent(hot.count, total) << "%  "
+          << module.name << ":" << hex(hot.pc) << " "
+          << instruction_name(module.opcodes[hot.pc]) << "\n";
+   }
+   out.flags(flags);
+}
+
+std::string Profiler::node_path(int node) const {
+   std::vector<int> frames;
+   for(; node > 0; node = m_nodes[node].parent) {
+      frames.push_back(m_nodes[node].frame);
+   }
+   std::string out;
+   for(auto it = frames.rbegin(); it != frames.rend(); ++it) {
+      if(!out.empty()) {
+         out += ';';
+      }
+      out += m_frame_names[*it];
+   }
+   return out;
+}
+
+void Profiler::write_folded(std::ostream& out, Weight weight) const {
+   for(int i = 1; i < m_nodes.size(); ++i) {
+      auto const& node = m_nodes[i];
+      std::uint64_t value =
+         weight == Weight::Instructions
+         ? node.instructions
+         : std::chrono::duration_cast<std::chrono::nanoseconds>(node.time)
+              .count();
+      if(value != 0) {
+         out << node_path(i) << ' ' << value << '\n';
+      }
+   }
+}
+
+} // namespace vm
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace vm {
+
+class BytecodeModule;
+
+/// @brief Counts collected by Machine while one is attached with
+/// Machine::set_profiler(), which only exists when built with VM_PROFILE.
+///
+/// Every instruction is counted by opcode and by pc, and charged to the
+/// function running it. Functions are exports, call_imm targets and system
+/// module functions, kept as a tree of call stacks so the folded output can
+/// be fed to flamegraph.pl, inferno or speedscope. Time is read from the
+/// clock at calls and returns only, so it includes the profiler's own
+/// overhead per instruction but is accurate for system functions.
+class Profiler {
+public:
+   using Clock = std::chrono::steady_clock;
+
+   /// @brief What the folded output weighs each stack by
+   enum class Weight { Instructions, Nanoseconds };
+
+   /// @brief Totals for one function over every stack it appeared in
+   struct FunctionStats {
+      std::string name;
+      std::uint64_t calls = 0;
+      /// @brief instructions run by the function itself
+      std::uint64_t self_instructions = 0;
+      /// @brief including the functions it called
+      std::uint64_t total_instructions = 0;
+      Clock::duration self_time{};
+      Clock::duration total_time{};
+   };
+
+   Profiler();
+
+   /// @brief Forget everything collected so far
+   void reset();
+
+   /// @brief Machine::execute() entered fn
+   void begin(BytecodeModule const& module, int module_index, int pc);
+   /// @brief Machine::execute() is returning, unwinding whatever an error
+   /// left behind
+   void end();
+   /// @brief call_imm, or extern_call in to a bytecode module
+   void call(BytecodeModule const& module, int module_index, int pc);
+   /// @brief return from the innermost call
+   void ret();
+   /// @brief about to invoke_index() fn_id of a system module
+   void enter_system(std::string_view module_name, int module_id, int fn_id);
+   /// @brief invoke_index() returned
+   void leave_system();
+
+   void instruction(int module_index, int pc, unsigned char opcode) {
+      ++m_opcode_counts[opcode];
+      auto& module = m_modules[module_index];
+      if(static_cast<unsigned>(pc) < module.pc_counts.size()) {
+         ++module.pc_counts[pc];
+         module.opcodes[pc] = opcode;
+      }
+      ++m_nodes[m_stack.back()].instructions;
+   }
+
+   std::uint64_t total_instructions() const;
+
+   /// @brief executions of each opcode, indexed by opcode
+   std::span<std::uint64_t const, 256> opcode_counts() const {
+      return m_opcode_counts;
+   }
+
+   /// @brief executions of each pc of a module, empty if it never ran
+   std::span<std::uint64_t const> pc_counts(int module_index) const;
+
+   /// @brief one entry per function, most instructions first
+   std::vector<FunctionStats> functions() const;
+
+   /// @brief Human readable summary of opcodes, functions and the hottest pcs
+   void write_report(std::ostream& out) const;
+
+   /// @brief One line per call stack, `outer;inner weight`, the format
+   /// flamegraph.pl reads. Stacks with no weight are left out.
+   void write_folded(std::ostream& out, Weight weight) const;
+
+private:
+   /// @brief Call tree node, one per distinct stack of frames
+   struct Node {
+      int frame;
+      int parent;
+      std::uint64_t calls = 0;
+      std::uint64_t instructions = 0;
+      Clock::duration time{};
+   };
+
+   /// @brief Per pc counts of a bytecode module, sized to its code when
+   /// it's first entered
+   struct ModuleCounts {
+      std::string name;
+      std::vector<std::uint64_t> pc_counts;
+      /// @brief last opcode run at each pc, code can change under us
+      std::vector<unsigned char> opcodes;
+   };
+
+   std::array<std::uint64_t, 256> m_opcode_counts{};
+   /// @brief by module index
+   std::vector<ModuleCounts> m_modules;
+
+   /// @brief "module:function" by frame index
+   std::vector<std::string> m_frame_names;
+   /// @brief (module id << 32 | pc or fn id) -> frame index
+   std::unordered_map<std::uint64_t, int> m_frames;
+
+   /// @brief node 0 is the root, outside every call
+   std::vector<Node> m_nodes;
+   /// @brief (parent << 32 | frame) -> node index
+   std::unordered_map<std::uint64_t, int> m_children;
+   /// @brief nodes of the calls in progress, root first
+   std::vector<int> m_stack;
+   /// @brief m_stack size at each begin(), for end() to unwind to
+   std::vector<std::size_t> m_begin_depths;
+   Clock::time_point m_last;
+
+   int frame(std::uint64_t key, auto const& make_name);
+   void push(int frame);
+   /// @brief add the time since the last event to the current node
+   void charge();
+   std::string node_path(int node) const;
+};
+
+} // namespace vm
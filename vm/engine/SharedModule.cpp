@@ -0,0 +1,36 @@
+#include "SharedModule.hpp"
+
+namespace vm {
+
+SharedModule::SharedModule(BytecodeModule const& module) {
+   auto shared = std::make_shared<Shared>();
+   shared->image = module.m_image;
+   shared->memory = SharedPages(
+      std::span(module.m_memory.data(), module.m_memory.size())
+   );
+   shared->slots = SharedPages(module.m_decoded.slot_bytes());
+   shared->mask = SharedPages(module.m_decoded.mask_bytes());
+   shared->decoded = module.m_decoded.with_storage({}, {});
+   m_shared = std::move(shared);
+}
+
+std::expected<SharedModule, Error> SharedModule::load(
+   std::span<unsigned char const> bytecode
+) {
+   auto module = BytecodeModule::load(bytecode);
+   if(!module.has_value()) {
+      return std::unexpected(module.error());
+   }
+   return SharedModule(*module);
+}
+
+BytecodeModule SharedModule::instantiate() const {
+   return BytecodeModule(
+      m_shared->image, m_shared->memory.instance(),
+      m_shared->decoded.with_storage(
+         m_shared->slots.instance(), m_shared->mask.instance()
+      )
+   );
+}
+
+} // namespace vm
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <expected>
+#include <memory>
+#include <span>
+#include <string_view>
+
+#include "BytecodeModule.hpp"
+#include "DecodedCode.hpp"
+#include "ModuleMemory.hpp"
+#include "engine_common.hpp"
+
+namespace vm {
+
+/// @brief A module loaded and decoded once, to run in many Machines.
+///
+/// instantiate() makes a BytecodeModule that shares the module's header
+/// image, and whose memory and decoded slots start as copy-on-write
+/// mappings of this module's (see SharedPages). An extra instance costs the
+/// pages it writes to, which for most programs is just its data and BSS,
+/// plus the slots it re-decodes. Without MODULE_HAS_SHARED_PAGES instances
+/// are copies, as they would be copying a BytecodeModule.
+///
+/// Instances start unverified and with no imports resolved, each Machine
+/// does that for its own copy. Copying a SharedModule is cheap, and
+/// instantiate() can be called from any thread.
+class SharedModule {
+public:
+   /// @brief share module as it is now, including anything it has written
+   /// to its memory
+   explicit SharedModule(BytecodeModule const& module);
+
+   static std::expected<SharedModule, Error> load(
+      std::span<unsigned char const> bytecode
+   );
+
+   BytecodeModule instantiate() const;
+
+   std::string_view name() const {
+      return m_shared->image->module_name;
+   }
+
+   /// @brief true if instances share pages rather than copying
+   bool is_shared() const {
+      return m_shared->memory.is_shared();
+   }
+
+private:
+   struct Shared {
+      std::shared_ptr<BytecodeModule::Image const> image;
+      SharedPages memory;
+      SharedPages slots;
+      SharedPages mask;
+      /// @brief everything from the module's DecodedCode but its storage
+      DecodedCode decoded;
+   };
+
+   std::shared_ptr<Shared const> m_shared;
+};
+
+} // namespace vm
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+
+#include "Machine.hpp"
+
+namespace vm {
+
+/// @brief The latest states of a Machine, for rewinding it.
+///
+/// Each push() saves a Machine::Snapshot against the one before, so a frame
+/// costs only the pages it wrote. The oldest snapshots are dropped to stay
+/// within capacity() and max_bytes(). Snapshots are numbered oldest first,
+/// restore() to any of them and truncate() the newer ones to carry on from
+/// there.
+template <typename Word> class BasicSnapshotRing {
+public:
+   using Machine = BasicMachine<Word>;
+   using Snapshot = typename Machine::Snapshot;
+
+   /// @brief ten seconds at 60 frames per second
+   static constexpr std::size_t DEFAULT_CAPACITY = 600;
+   static constexpr std::size_t DEFAULT_MAX_BYTES = 64 << 20;
+
+   explicit BasicSnapshotRing(
+      std::size_t capacity = DEFAULT_CAPACITY,
+      std::size_t max_bytes = DEFAULT_MAX_BYTES
+   ) :
+      m_capacity(capacity), m_max_bytes(max_bytes) {}
+
+   std::size_t capacity() const {
+      return m_capacity;
+   }
+
+   std::size_t max_bytes() const {
+      return m_max_bytes;
+   }
+
+   std::size_t size() const {
+      return m_snapshots.size();
+   }
+
+   /// @brief pages and bookkeeping held by the snapshots
+   std::size_t memory_bytes() const {
+      return m_bytes;
+   }
+
+   /// @brief save machine's state as the newest snapshot
+   void push(Machine const& machine) {
+      auto snapshot = machine.save(
+         m_snapshots.empty() ? nullptr : &m_snapshots.back()
+      );
+      m_bytes += snapshot.new_bytes() + snapshot.overhead_bytes();
+      m_snapshots.push_back(std::move(snapshot));
+      // always keep the newest, however big it is
+      while(m_snapshots.size() > 1 &&
+            (m_snapshots.size() > m_capacity || m_bytes > m_max_bytes)) {
+         drop(m_snapshots.front());
+         m_snapshots.pop_front();
+      }
+   }
+
+   /// @brief put machine back to snapshot n, 0 being the oldest
+   /// @return false if there's no such snapshot, or it's of another machine
+   bool restore(Machine& machine, std::size_t n) const {
+      return n < m_snapshots.size() && machine.restore(m_snapshots[n]);
+   }
+
+   /// @brief drop all but the oldest count snapshots
+   void truncate(std::size_t count) {
+      while(m_snapshots.size() > count) {
+         drop(m_snapshots.back());
+         m_snapshots.pop_back();
+      }
+   }
+
+   void clear() {
+      m_snapshots.clear();
+      m_bytes = 0;
+   }
+
+private:
+   std::size_t m_capacity;
+   std::size_t m_max_bytes;
+   std::deque<Snapshot> m_snapshots;
+   std::size_t m_bytes = 0;
+
+   /// @brief account for a snapshot that's about to be destroyed
+   void drop(Snapshot const& snapshot) {
+      m_bytes -= snapshot.unique_bytes() + snapshot.overhead_bytes();
+   }
+};
+
+using SnapshotRing = BasicSnapshotRing<StackWord>;
+
+} // namespace vm
@@ -1,38 +1,55 @@
 #pragma once
 
-#include <vector>
+#include <array>
 
 namespace vm {
 
-template <typename T> class Stack {
+/// @brief Fixed capacity stack, stored inline.
+///
+/// There's one spare slot below the bottom, so an interpreter that keeps the
+/// top item in a register can spill it to data()[item_count() - 1] and read
+/// it back without checking for an empty stack.
+template <typename T, int N> class Stack {
 public:
-   Stack(int size) : m_stack(size, 0), m_sp(0) {}
+   static constexpr int capacity() {
+      return N;
+   }
 
    T peek() const {
-      return m_stack[m_sp - 1];
+      return m_stack[m_sp];
    }
 
    T peek_n(int n) const {
-      return m_stack[m_sp - 1 - n];
+      return m_stack[m_sp - n];
    }
 
    T pop() {
-      --m_sp;
-      return m_stack[m_sp];
+      return m_stack[m_sp--];
    }
 
    void push(T n) {
-      m_stack[m_sp] = n;
-      ++m_sp;
+      m_stack[++m_sp] = n;
    }
 
-   int item_count() {
+   int item_count() const {
       return m_sp;
    }
 
+   /// @brief raw storage, for code that manipulates the stack directly.
+   /// data()[-1] can be written and read, but isn't an item.
+   T* data() {
+      return m_stack.data() + 1;
+   }
+
+   /// @brief resync after writing through data()
+   void set_item_count(int count) {
+      m_sp = count;
+   }
+
 private:
-   std::vector<T> m_stack;
+   // m_stack[0] is the spare slot, items are m_stack[1] to m_stack[m_sp]
+   std::array<T, N + 1> m_stack{};
    int m_sp = 0;
 };
 
-} // namespace vm
\ No newline at end of file
+} // namespace vm
@@ -0,0 +1,474 @@
+#include "DecodedCode.hpp"
+#include "Machine.hpp"
+
+#include <algorithm>
+
+#if MACHINE_HAS_THREADED_ENGINE
+
+namespace vm {
+
+/// @brief any of the N code_mask() bytes at mask are code
+template <int N> static bool hits_code(unsigned char const* mask) {
+   unsigned char any = 0;
+   for(int i = 0; i < N; ++i) {
+      any |= mask[i];
+   }
+   return any;
+}
+
+// No bounds check on pc: branch targets are clamped to the EOF slot when
+// decoded, and H_EOF/H_DECODE have length 0 so pc never walks past it.
+#define DISPATCH()                                                             \
+   do {                                                                        \
+      ip = &slots[pc];                                                         \
+      pc += ip->length;                                                        \
+      goto* handlers[ip->handler];                                             \
+   } while(0)
+
+#define LOAD_CODE_STATE()                                                      \
+   do {                                                                        \
+      auto& module = current_module();                                         \
+      code_span = module.code();                                               \
+      code = code_span.data();                                                 \
+      code_size = code_span.size();                                            \
+      decoded = &module.decoded();                                             \
+      slots = decoded->slots();                                                \
+      code_mask = decoded->code_mask();                                        \
+   } while(0)
+
+// The top of the data stack is kept in tos, and sp points at the slot it
+// spills to, data()[item_count() - 1]. Everything below it is in memory. An
+// empty stack spills to the spare slot under the bottom.
+#define LOAD_STACK()                                                           \
+   do {                                                                        \
+      sp = stack_base + m_stack.item_count() - 1;                              \
+      tos = *sp;                                                               \
+   } while(0)
+
+#define SAVE_STACK()                                                           \
+   do {                                                                        \
+      *sp = tos;                                                               \
+      m_stack.set_item_count(sp - stack_base + 1);                             \
+   } while(0)
+
+#define PUSH(_value)                                                           \
+   do {                                                                        \
+      Word value = (_value);                                                   \
+      *sp++ = tos;                                                             \
+      tos = value;                                                             \
+   } while(0)
+
+#define DROP() tos = *--sp
+
+// A store hit decoded code. What was verified no longer holds, so hand the
+// rest of the call to the checked interpreter.
+#define INVALIDATE_CODE(_address, _length)                                     \
+   do {                                                                        \
+      decoded->invalidate(_address, _length);                                  \
+      if(!code_written()) {                                                    \
+         SAVE_STACK();                                                         \
+         m_pc = pc;                                                            \
+         return;                                                               \
+      }                                                                        \
+   } while(0)
+
+// Verification doesn't bound addresses. One outside the module leaves the
+// instruction, fused or not, to the checked interpreter, which reports it with
+// the stacks as they were before it.
+#define CHECK_ADDRESS(_address, _length)                                       \
+   do {                                                                        \
+      if(!in_code(code_size, _address, _length)) {                             \
+         m_checked = true;                                                     \
+         SAVE_STACK();                                                         \
+         m_pc = pc - ip->length;                                               \
+         return;                                                               \
+      }                                                                        \
+   } while(0)
+
+#define THREADED_BINARY_OP(_name, _op)                                         \
+   op_##_name : tos = sp[-1] _op tos;                                          \
+   --sp;                                                                       \
+   DISPATCH()
+
+#define THREADED_COMPARISON_OP(_name, _op)                                     \
+   op_##_name : tos = (sp[-1] _op tos) ? TRUE_WORD : FALSE_WORD;               \
+   --sp;                                                                       \
+   DISPATCH()
+
+template <typename Word> void BasicMachine<Word>::run_threaded() {
+   static void* const handlers[H_COUNT] = {
+      &&op_UNKNOWN,
+      &&op_DECODE,
+      &&op_EOF,
+#define HANDLER_LABEL(_name) &&op_##_name,
+      DECODED_HANDLERS(HANDLER_LABEL)
+#undef HANDLER_LABEL
+#define FUSED_LABEL(_name, _pattern) &&op_##_name,
+      FUSED_HANDLERS(FUSED_LABEL)
+#undef FUSED_LABEL
+   };
+
+   // Keep the hot state in locals rather than going through
+   // m_modules[m_current_module_idx] for every instruction.
+   std::span<unsigned char> code_span;
+   unsigned char* code;
+   unsigned code_size;
+   DecodedCode* decoded;
+   DecodedInstr const* slots;
+   unsigned char const* code_mask;
+   LOAD_CODE_STATE();
+
+   Word* const stack_base = m_stack.data();
+   Word* sp;
+   Word tos;
+   LOAD_STACK();
+
+   DecodedInstr const* ip;
+   int pc = m_pc;
+   if(static_cast<unsigned>(pc) > code_size) {
+      pc = code_size;
+   }
+
+   DISPATCH();
+
+op_DECODE:
+   decoded->decode_at(code_span, pc);
+   DISPATCH();
+
+op_NOP:
+   DISPATCH();
+
+   THREADED_BINARY_OP(ADD, +);
+   THREADED_BINARY_OP(SUB, -);
+   THREADED_BINARY_OP(MUL, *);
+   THREADED_BINARY_OP(DIV, /);
+   THREADED_BINARY_OP(MOD, %);
+   THREADED_BINARY_OP(SHR, >>);
+   THREADED_BINARY_OP(SHL, <<);
+
+   THREADED_COMPARISON_OP(GT, >);
+   THREADED_COMPARISON_OP(LT, <);
+   THREADED_COMPARISON_OP(GE, >=);
+   THREADED_COMPARISON_OP(LE, <=);
+   THREADED_COMPARISON_OP(EQ, ==);
+   THREADED_COMPARISON_OP(NEQ, !=);
+
+op_JUMP_IMM:
+   pc = ip->operand;
+   DISPATCH();
+
+op_CALL_IMM:
+   m_return_stack.push(pc);
+   pc = ip->operand;
+   DISPATCH();
+
+op_BTRUE_IMM: {
+   auto test = tos;
+   DROP();
+   if(test) {
+      pc = ip->operand;
+   }
+}
+   DISPATCH();
+
+op_BFALSE_IMM: {
+   auto test = tos;
+   DROP();
+   if(!test) {
+      pc = ip->operand;
+   }
+}
+   DISPATCH();
+
+op_RETURN:
+   if(m_return_stack.item_count() == 0) {
+      // top level return
+      goto exit;
+   }
+   pc = m_return_stack.pop();
+   if(static_cast<unsigned>(pc) > code_size) {
+      if(pc >= 0) {
+         pc = code_size;
+      } else {
+         // tagged by an extern_call, caller is in another module
+         if(!return_to_module(pc)) {
+            goto exit;
+         }
+         LOAD_CODE_STATE();
+         pc = m_pc;
+         if(static_cast<unsigned>(pc) > code_size) {
+            pc = code_size;
+         }
+      }
+   }
+   DISPATCH();
+
+op_LOAD_MODULE: {
+   CHECK_ADDRESS(tos, 1);
+   auto name_ptr = tos;
+   auto name_start = code + name_ptr;
+   auto name_length = std::find(name_start, code + code_size, 0) - name_start;
+   // the name and its terminator
+   CHECK_ADDRESS(name_ptr, name_length + 1);
+   auto name = std::string_view(
+      reinterpret_cast<char const*>(name_start), name_length
+   );
+   auto index = get_or_load_module(name);
+   if(index < 0) {
+      DROP();
+      m_errorno = Error::ModuleNotFound;
+      goto exit;
+   }
+   tos = index;
+}
+   DISPATCH();
+
+op_PUSH_MODULE: {
+   auto id = import_module_id(ip->operand);
+   if(id < 0) {
+      m_errorno = Error::ModuleNotFound;
+      goto exit;
+   }
+   PUSH(id);
+}
+   DISPATCH();
+
+op_EXTERN_CALL: {
+   auto fn_id = tos;
+   auto module_id = sp[-1];
+   sp -= 2;
+   tos = *sp;
+   m_pc = pc;
+   if(!(module_id & SYSTEM_MODULE_MASK)) {
+      // bytecode module
+      auto& cache = decoded->extern_call_cache(ip->operand);
+      if(!call_module(module_id, fn_id, cache)) {
+         goto exit;
+      }
+      LOAD_CODE_STATE();
+      pc = m_pc;
+      if(static_cast<unsigned>(pc) > code_size) {
+         pc = code_size;
+      }
+      DISPATCH();
+   }
+   // system modules work on m_stack
+   SAVE_STACK();
+   if(!invoke_system(module_id, fn_id)) {
+      // it wrote over code, m_pc is already past the call
+      return;
+   }
+   LOAD_STACK();
+}
+   DISPATCH();
+
+op_LOAD_WORD:
+   CHECK_ADDRESS(tos, WORD_SIZE);
+   tos = read_word(&code[tos]);
+   DISPATCH();
+
+op_STORE_WORD: {
+   CHECK_ADDRESS(tos, WORD_SIZE);
+   auto address = tos;
+   auto value = sp[-1];
+   sp -= 2;
+   tos = *sp;
+   write_word(&code[address], value);
+   if(hits_code<WORD_SIZE>(&code_mask[address])) {
+      INVALIDATE_CODE(address, WORD_SIZE);
+   }
+}
+   DISPATCH();
+
+op_PUSH_IMM:
+   PUSH(ip->operand);
+   DISPATCH();
+
+op_DUP:
+   *sp++ = tos;
+   DISPATCH();
+
+op_SWAP: {
+   auto b = sp[-1];
+   sp[-1] = tos;
+   tos = b;
+}
+   DISPATCH();
+
+op_DROP:
+   DROP();
+   DISPATCH();
+
+op_OVER:
+   PUSH(sp[-1]);
+   DISPATCH();
+
+op_ROT: {
+   auto a = sp[-2];
+   sp[-2] = sp[-1];
+   sp[-1] = tos;
+   tos = a;
+}
+   DISPATCH();
+
+op_PICK:
+   // popping the index and pushing the item leaves sp where it was, and
+   // everything under the index is already in memory
+   tos = sp[-1 - tos];
+   DISPATCH();
+
+op_RPUSH:
+   m_return_stack.push(tos);
+   DROP();
+   DISPATCH();
+
+op_RPOP:
+   PUSH(m_return_stack.pop());
+   DISPATCH();
+
+op_RCOPY:
+   PUSH(m_return_stack.peek());
+   DISPATCH();
+
+op_INC:
+   tos = tos + 1;
+   DISPATCH();
+
+op_DEC:
+   tos = tos - 1;
+   DISPATCH();
+
+op_RCOPY2:
+   sp[0] = tos;
+   sp[1] = m_return_stack.peek_n(1);
+   sp += 2;
+   tos = m_return_stack.peek_n(0);
+   DISPATCH();
+
+op_LOAD_BYTE:
+   CHECK_ADDRESS(tos, 1);
+   tos = code[tos];
+   DISPATCH();
+
+op_STORE_BYTE: {
+   CHECK_ADDRESS(tos, 1);
+   auto address = tos;
+   auto value = sp[-1] & 0xff;
+   sp -= 2;
+   tos = *sp;
+   code[address] = value;
+   if(code_mask[address]) {
+      INVALIDATE_CODE(address, 1);
+   }
+}
+   DISPATCH();
+
+   // superinstructions, see FUSED_HANDLERS
+
+op_FOR_TEST:
+   ++m_fusion_counts[H_FOR_TEST - H_FUSED_BEGIN];
+   if(!(m_return_stack.peek_n(1) > m_return_stack.peek_n(0))) {
+      pc = ip->operand;
+   }
+   DISPATCH();
+
+op_FOR_NEXT:
+   ++m_fusion_counts[H_FOR_NEXT - H_FUSED_BEGIN];
+   m_return_stack.push(m_return_stack.pop() + 1);
+   pc = ip->operand;
+   DISPATCH();
+
+op_INC_AT: {
+   CHECK_ADDRESS(tos, WORD_SIZE);
+   ++m_fusion_counts[H_INC_AT - H_FUSED_BEGIN];
+   auto address = tos;
+   DROP();
+   write_word(&code[address], read_word(&code[address]) + 1);
+   if(hits_code<WORD_SIZE>(&code_mask[address])) {
+      INVALIDATE_CODE(address, WORD_SIZE);
+   }
+}
+   DISPATCH();
+
+op_DEC_AT: {
+   CHECK_ADDRESS(tos, WORD_SIZE);
+   ++m_fusion_counts[H_DEC_AT - H_FUSED_BEGIN];
+   auto address = tos;
+   DROP();
+   write_word(&code[address], read_word(&code[address]) - 1);
+   if(hits_code<WORD_SIZE>(&code_mask[address])) {
+      INVALIDATE_CODE(address, WORD_SIZE);
+   }
+}
+   DISPATCH();
+
+op_LOAD_BYTE_OFFSET: {
+   Word address = tos + ip->operand;
+   CHECK_ADDRESS(address, 1);
+   ++m_fusion_counts[H_LOAD_BYTE_OFFSET - H_FUSED_BEGIN];
+   tos = code[address];
+}
+   DISPATCH();
+
+op_STORE_BYTE_OFFSET: {
+   Word address = tos + ip->operand;
+   CHECK_ADDRESS(address, 1);
+   ++m_fusion_counts[H_STORE_BYTE_OFFSET - H_FUSED_BEGIN];
+   code[address] = sp[-1] & 0xff;
+   sp -= 2;
+   tos = *sp;
+   if(code_mask[address]) {
+      INVALIDATE_CODE(address, 1);
+   }
+}
+   DISPATCH();
+
+op_LOAD_WORD_ABS: {
+   CHECK_ADDRESS(ip->operand, WORD_SIZE);
+   ++m_fusion_counts[H_LOAD_WORD_ABS - H_FUSED_BEGIN];
+   PUSH(read_word(&code[ip->operand]));
+}
+   DISPATCH();
+
+op_STORE_WORD_ABS: {
+   CHECK_ADDRESS(ip->operand, WORD_SIZE);
+   ++m_fusion_counts[H_STORE_WORD_ABS - H_FUSED_BEGIN];
+   auto address = ip->operand;
+   auto value = tos;
+   DROP();
+   write_word(&code[address], value);
+   if(hits_code<WORD_SIZE>(&code_mask[address])) {
+      INVALIDATE_CODE(address, WORD_SIZE);
+   }
+}
+   DISPATCH();
+
+op_ADD_IMM:
+   ++m_fusion_counts[H_ADD_IMM - H_FUSED_BEGIN];
+   tos = tos + ip->operand;
+   DISPATCH();
+
+op_MUL_IMM:
+   ++m_fusion_counts[H_MUL_IMM - H_FUSED_BEGIN];
+   tos = tos * ip->operand;
+   DISPATCH();
+
+op_UNKNOWN:
+   goto exit;
+
+op_EOF:
+   m_errorno = Error::EofWithoutReturn;
+
+exit:
+   SAVE_STACK();
+   m_pc = pc;
+}
+
+template void BasicMachine<StackWord>::run_threaded();
+#if MACHINE_WIDE
+template void BasicMachine<StackWord32>::run_threaded();
+#endif
+
+} // namespace vm
+
+#endif
@@ -0,0 +1,186 @@
+#include "TraceRing.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+#include "Instruction.hpp"
+#include "Verifier.hpp"
+
+namespace vm {
+
+namespace {
+
+constexpr char TRACE_MAGIC[4] = {'V', 'M', 'T', 'R'};
+constexpr std::uint16_t TRACE_VERSION = 1;
+
+template <typename T> void write_le(std::ostream& out, T value) {
+   for(int i = 0; i < sizeof(T); ++i) {
+      out.put(static_cast<char>(static_cast<std::uint64_t>(value) >> 8 * i));
+   }
+}
+
+template <typename T> bool read_le(std::istream& in, T& value) {
+   std::uint64_t out = 0;
+   for(int i = 0; i < sizeof(T); ++i) {
+      auto byte = in.get();
+      if(byte == std::istream::traits_type::eof()) {
+         return false;
+      }
+      out |= static_cast<std::uint64_t>(byte) << (8 * i);
+   }
+   value = static_cast<T>(out);
+   return true;
+}
+
+} // namespace
+
+TraceRing::TraceRing(std::size_t capacity) :
+   m_records(
+      std::make_unique<std::atomic<std::uint64_t>[]>(
+         std::bit_ceil(capacity + 1)
+      )
+   ),
+   m_mask(std::bit_ceil(capacity + 1) - 1) {}
+
+std::vector<TraceRecord> TraceRing::snapshot(std::size_t max_records) const {
+   std::uint64_t head;
+   return snapshot(max_records, head);
+}
+
+std::vector<TraceRecord> TraceRing::snapshot(
+   std::size_t max_records, std::uint64_t& head
+) const {
+   head = recorded();
+   auto count = std::min<std::uint64_t>({head, capacity(), max_records});
+   std::vector<TraceRecord> out;
+   out.reserve(count);
+   for(auto i = head - count; i < head; ++i) {
+      out.push_back(TraceRecord::unpack(
+         m_records[i & m_mask].load(std::memory_order_relaxed)
+      ));
+   }
+
+   // Slots the writer has lapped since head was read hold newer records.
+   // It may also be part way through writing the next one, which the spare
+   // slot keeps clear of the snapshot until it's lapped.
+   std::atomic_thread_fence(std::memory_order_acquire);
+   auto first = head - count;
+   auto written = m_head.load(std::memory_order_relaxed) + 1;
+   if(written - first > m_mask + 1) {
+      auto overwritten =
+         std::min<std::uint64_t>(written - first - (m_mask + 1), count);
+      out.erase(out.begin(), out.begin() + overwritten);
+   }
+   return out;
+}
+
+void TraceRing::write(
+   std::ostream& out, std::span<std::string_view const> module_names,
+   std::size_t max_records
+) const {
+   std::uint64_t head;
+   auto records = snapshot(max_records, head);
+   out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+   write_le<std::uint16_t>(out, TRACE_VERSION);
+   write_le<std::uint16_t>(out, module_names.size());
+   write_le<std::uint64_t>(out, head);
+   write_le<std::uint32_t>(out, records.size());
+   for(auto name : module_names) {
+      write_le<std::uint16_t>(out, name.size());
+      out.write(name.data(), name.size());
+   }
+   for(auto const& record : records) {
+      write_le<std::uint64_t>(out, record.pack());
+   }
+}
+
+std::expected<TraceDump, Error> read_trace(std::istream& in) {
+   auto invalid = std::unexpected(Error::InvalidHeader);
+
+   char magic[sizeof(TRACE_MAGIC)];
+   if(!in.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC)) {
+      return invalid;
+   }
+   std::uint16_t version;
+   std::uint16_t module_count;
+   std::uint32_t record_count;
+   TraceDump dump;
+   if(!read_le(in, version) || version != TRACE_VERSION ||
+      !read_le(in, module_count) || !read_le(in, dump.recorded) ||
+      !read_le(in, record_count)) {
+      return invalid;
+   }
+
+   for(int i = 0; i < module_count; ++i) {
+      std::uint16_t length;
+      if(!read_le(in, length)) {
+         return invalid;
+      }
+      std::string name(length, '\0');
+      if(!in.read(name.data(), length)) {
+         return invalid;
+      }
+      dump.module_names.push_back(std::move(name));
+   }
+
+   dump.records.reserve(record_count);
+   for(std::uint32_t i = 0; i < record_count; ++i) {
+      std::uint64_t bits;
+      if(!read_le(in, bits)) {
+         return invalid;
+      }
+      dump.records.push_back(TraceRecord::unpack(bits));
+   }
+   return dump;
+}
+
+std::string format_trace_record(
+   TraceRecord const& record, std::span<std::string const> module_names,
+   std::span<unsigned char const> code
+) {
+   std::string out;
+   if(record.module < module_names.size()) {
+      out = module_names[record.module];
+   } else {
+      out = "module" + std::to_string(record.module);
+   }
+
+   char buf[64];
+   std::snprintf(buf, sizeof(buf), ":0x%04x ", record.pc);
+   out += buf;
+   out += instruction_name(record.opcode);
+
+   auto effect = instr_effect(record.opcode);
+   if(effect.has_value() && effect->length == 3 &&
+      record.pc + 2 < code.size()) {
+      auto imm = static_cast<std::int16_t>(
+         code[record.pc + 1] | (code[record.pc + 2] << 8)
+      );
+      switch(record.opcode) {
+      case I_JUMP_IMM:
+      case I_CALL_IMM:
+      case I_BTRUE_IMM:
+      case I_BFALSE_IMM:
+         std::snprintf(buf, sizeof(buf), " 0x%04x", imm & 0xffff);
+         out += buf;
+         break;
+      default:
+         out += " " + std::to_string(imm);
+         break;
+      }
+   }
+
+   if(record.depth == 0) {
+      std::snprintf(buf, sizeof(buf), "   ( )");
+   } else {
+      std::snprintf(
+         buf, sizeof(buf), "   ( %d items, tos %d )", record.depth, record.tos
+      );
+   }
+   out += buf;
+   return out;
+}
+
+} // namespace vm
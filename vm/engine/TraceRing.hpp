@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "engine_common.hpp"
+
+namespace vm {
+
+/// @brief One instruction, as Machine was about to run it
+struct TraceRecord {
+   std::uint16_t pc = 0;
+   std::uint8_t opcode = 0;
+   /// @brief low 8 bits of the module index
+   std::uint8_t module = 0;
+   /// @brief top of the data stack, 0 if it's empty
+   std::int16_t tos = 0;
+   /// @brief data stack items
+   std::uint16_t depth = 0;
+
+   std::uint64_t pack() const {
+      return std::uint64_t{pc} | std::uint64_t{opcode} << 16 |
+         std::uint64_t{module} << 24 |
+         std::uint64_t{static_cast<std::uint16_t>(tos)} << 32 |
+         std::uint64_t{depth} << 48;
+   }
+
+   static TraceRecord unpack(std::uint64_t bits) {
+      return TraceRecord{
+         static_cast<std::uint16_t>(bits),
+         static_cast<std::uint8_t>(bits >> 16),
+         static_cast<std::uint8_t>(bits >> 24),
+         static_cast<std::int16_t>(bits >> 32),
+         static_cast<std::uint16_t>(bits >> 48),
+      };
+   }
+
+   bool operator==(TraceRecord const&) const = default;
+};
+
+/// @brief The last capacity() instructions run by a Machine, attached with
+/// Machine::set_trace() (built with VM_TRACE).
+///
+/// Written by the thread running the machine without locks, one relaxed
+/// atomic store per record, so snapshot() can be taken from another thread
+/// while it runs. Records overwritten during a snapshot are dropped from it.
+class TraceRing {
+public:
+   static constexpr std::size_t DEFAULT_CAPACITY = (1 << 16) - 1;
+
+   /// @param capacity least records kept, rounded up to one less than a
+   /// power of two. The extra slot is the one record() may be writing while
+   /// another thread takes a snapshot().
+   explicit TraceRing(std::size_t capacity = DEFAULT_CAPACITY);
+
+   /// @brief most records snapshot() returns
+   std::size_t capacity() const {
+      return m_mask;
+   }
+
+   void record(TraceRecord const& record) {
+      auto head = m_head.load(std::memory_order_relaxed);
+      m_records[head & m_mask].store(
+         record.pack(), std::memory_order_relaxed
+      );
+      m_head.store(head + 1, std::memory_order_release);
+   }
+
+   /// @brief records written since construction or clear(), including the
+   /// ones since overwritten
+   std::uint64_t recorded() const {
+      return m_head.load(std::memory_order_acquire);
+   }
+
+   /// @brief Forget every record. Not safe while the machine is running.
+   void clear() {
+      m_head.store(0, std::memory_order_release);
+   }
+
+   /// @brief up to max_records of the latest records, oldest first
+   std::vector<TraceRecord> snapshot(
+      std::size_t max_records = static_cast<std::size_t>(-1)
+   ) const;
+
+   /// @brief Write snapshot(max_records) in the format read_trace() reads
+   /// @param module_names by module index, for the decoder to print
+   void write(
+      std::ostream& out, std::span<std::string_view const> module_names,
+      std::size_t max_records = static_cast<std::size_t>(-1)
+   ) const;
+
+private:
+   std::unique_ptr<std::atomic<std::uint64_t>[]> m_records;
+   std::size_t m_mask;
+   std::atomic<std::uint64_t> m_head{0};
+
+   /// @param head set to recorded() as of the last record returned
+   std::vector<TraceRecord> snapshot(
+      std::size_t max_records, std::uint64_t& head
+   ) const;
+};
+
+/// @brief A trace written by TraceRing::write()
+struct TraceDump {
+   std::vector<std::string> module_names;
+   /// @brief TraceRing::recorded() when it was written, the first record is
+   /// number recorded - records.size()
+   std::uint64_t recorded = 0;
+   std::vector<TraceRecord> records;
+};
+
+/// @return the dump, or Error::InvalidHeader if it isn't one
+std::expected<TraceDump, Error> read_trace(std::istream& in);
+
+/// @brief Readable form of a record, `module:pc mnemonic [immediate]` and the
+/// data stack
+/// @param code the module's code, to read immediates from. It may have changed
+/// since the record was taken.
+std::string format_trace_record(
+   TraceRecord const& record, std::span<std::string const> module_names,
+   std::span<unsigned char const> code = {}
+);
+
+} // namespace vm
@@ -0,0 +1,369 @@
+#include "Verifier.hpp"
+
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "DecodedCode.hpp"
+#include "Instruction.hpp"
+
+namespace vm {
+
+std::optional<InstrEffect> instr_effect(unsigned char opcode, int word_size) {
+   // opcode and immediate
+   auto imm = 1 + word_size;
+   switch(opcode) {
+   case I_NOP:
+      return InstrEffect{1, 0, 0, 0, 0};
+   case I_ADD:
+   case I_SUB:
+   case I_MUL:
+   case I_DIV:
+   case I_MOD:
+   case I_SHR:
+   case I_SHL:
+   case I_GT:
+   case I_LT:
+   case I_GE:
+   case I_LE:
+   case I_EQ:
+   case I_NEQ:
+      return InstrEffect{1, 2, 1, 0, 0};
+   case I_JUMP_IMM:
+      return InstrEffect{imm, 0, 0, 0, 0};
+   case I_CALL_IMM:
+      return InstrEffect{imm, 0, 0, 0, 1};
+   case I_BTRUE_IMM:
+   case I_BFALSE_IMM:
+      return InstrEffect{imm, 1, 0, 0, 0};
+   case I_RETURN:
+      return InstrEffect{1, 0, 0, 0, 0};
+   case I_LOAD_MODULE:
+      return InstrEffect{1, 1, 1, 0, 0};
+   case I_EXTERN_CALL:
+      return InstrEffect{1, 2, 0, 0, 0};
+   case I_LOAD_WORD:
+      return InstrEffect{1, 1, 1, 0, 0};
+   case I_STORE_WORD:
+      return InstrEffect{1, 2, 0, 0, 0};
+   case I_PUSH_IMM:
+      return InstrEffect{imm, 0, 1, 0, 0};
+   case I_DUP:
+      return InstrEffect{1, 1, 2, 0, 0};
+   case I_SWAP:
+      return InstrEffect{1, 2, 2, 0, 0};
+   case I_DROP:
+      return InstrEffect{1, 1, 0, 0, 0};
+   case I_OVER:
+      return InstrEffect{1, 2, 3, 0, 0};
+   case I_ROT:
+      return InstrEffect{1, 3, 3, 0, 0};
+   case I_RPUSH:
+      return InstrEffect{1, 1, 0, 0, 1};
+   case I_RPOP:
+      return InstrEffect{1, 0, 1, 1, 0};
+   case I_RCOPY:
+      return InstrEffect{1, 0, 1, 1, 1};
+   case I_INC:
+   case I_DEC:
+      return InstrEffect{1, 1, 1, 0, 0};
+   case I_RCOPY2:
+      return InstrEffect{1, 0, 2, 2, 2};
+   case I_LOAD_BYTE:
+      return InstrEffect{1, 1, 1, 0, 0};
+   case I_STORE_BYTE:
+      return InstrEffect{1, 2, 0, 0, 0};
+   case I_PICK:
+      return InstrEffect{1, 1, 1, 0, 0};
+   case I_PUSH_MODULE:
+      return InstrEffect{imm, 0, 1, 0, 0};
+   default:
+      return std::nullopt;
+   }
+}
+
+namespace {
+
+/// @brief What's known about a stack item, enough to follow
+/// `push_module i push_imm f extern_call` and `push_imm k pick`
+struct Value {
+   enum Kind { Unknown, Int, Import } kind = Unknown;
+   int value = 0;
+
+   bool operator==(Value const&) const = default;
+};
+
+/// @brief depths at an instruction, relative to the function's entry
+struct State {
+   int depth = 0;
+   int return_depth = 0;
+   std::array<Value, 2> top{};
+};
+
+class Verifier {
+public:
+   Verifier(
+      std::span<unsigned char const> code, ExternSummary const& extern_summary,
+      int word_size
+   ) :
+      m_code(code),
+      m_extern_summary(extern_summary),
+      m_word_size(word_size) {}
+
+   std::expected<FunctionSummary, VerifyError> summary(int entry);
+
+private:
+   std::span<unsigned char const> m_code;
+   ExternSummary const& m_extern_summary;
+   int m_word_size;
+   std::unordered_map<int, FunctionSummary> m_summaries;
+   /// @brief functions being analysed, a call to one of these is recursion
+   std::unordered_set<int> m_active;
+
+   std::expected<FunctionSummary, VerifyError> analyse(int entry);
+};
+
+std::expected<FunctionSummary, VerifyError> Verifier::summary(int entry) {
+   if(auto it = m_summaries.find(entry); it != m_summaries.end()) {
+      return it->second;
+   }
+   m_active.insert(entry);
+   auto result = analyse(entry);
+   m_active.erase(entry);
+   if(result.has_value()) {
+      m_summaries.emplace(entry, *result);
+   }
+   return result;
+}
+
+std::expected<FunctionSummary, VerifyError> Verifier::analyse(int entry) {
+   FunctionSummary out;
+   out.returns = false;
+   std::unordered_map<int, State> states;
+   std::vector<int> worklist;
+
+   auto fail = [](int pc, std::string_view reason) {
+      return std::unexpected(VerifyError{pc, reason});
+   };
+
+   // Record the state flowing in to pc. Depths have to agree with every
+   // other path there, known values that don't are forgotten.
+   auto flow = [&](int from, int pc, State const& state)
+      -> std::optional<VerifyError> {
+      if(pc < 0 || pc >= m_code.size()) {
+         return VerifyError{from, "branch outside the code"};
+      }
+      auto [it, inserted] = states.emplace(pc, state);
+      if(inserted) {
+         worklist.push_back(pc);
+         return std::nullopt;
+      }
+      auto& existing = it->second;
+      if(existing.depth != state.depth ||
+         existing.return_depth != state.return_depth) {
+         return VerifyError{pc, "stack depth differs between paths"};
+      }
+      auto changed = false;
+      for(int i = 0; i < existing.top.size(); ++i) {
+         if(existing.top[i] != state.top[i] &&
+            existing.top[i].kind != Value::Unknown) {
+            existing.top[i] = Value{};
+            changed = true;
+         }
+      }
+      if(changed) {
+         worklist.push_back(pc);
+      }
+      return std::nullopt;
+   };
+
+   auto pop = [&](State& state, int count) {
+      state.depth -= count;
+      out.inputs = std::max(out.inputs, -state.depth);
+      for(int i = 0; i < state.top.size(); ++i) {
+         auto from = i + count;
+         state.top[i] = from < state.top.size() ? state.top[from] : Value{};
+      }
+   };
+
+   auto push = [&](State& state, Value value) {
+      state.depth += 1;
+      out.max_depth = std::max(out.max_depth, state.depth);
+      for(int i = state.top.size() - 1; i > 0; --i) {
+         state.top[i] = state.top[i - 1];
+      }
+      state.top[0] = value;
+   };
+
+   // callee's effect on top of whatever this function has pushed already
+   auto apply_call = [&](State& state, FunctionSummary const& callee,
+                         int return_entries) {
+      out.inputs = std::max(out.inputs, callee.inputs - state.depth);
+      out.max_depth = std::max(out.max_depth, state.depth + callee.max_depth);
+      out.max_return_depth = std::max(
+         out.max_return_depth,
+         state.return_depth + return_entries + callee.max_return_depth
+      );
+      state.depth += callee.net;
+      out.max_depth = std::max(out.max_depth, state.depth);
+      state.top = {};
+   };
+
+   if(entry < 0 || entry >= m_code.size()) {
+      return fail(entry, "entry outside the code");
+   }
+   states.emplace(entry, State{});
+   worklist.push_back(entry);
+
+   while(!worklist.empty()) {
+      auto pc = worklist.back();
+      worklist.pop_back();
+      auto state = states[pc];
+      auto instr = DecodedCode::decode_one(m_code, pc, m_word_size);
+      auto next = pc + instr.length;
+
+      if(instr.handler == H_EOF) {
+         return fail(pc, "immediate runs off the end of the code");
+      }
+      if(instr.handler == H_UNKNOWN) {
+         // the interpreter stops here
+         continue;
+      }
+
+      auto effect = *instr_effect(m_code[pc], m_word_size);
+      if(state.return_depth < effect.return_pops) {
+         return fail(pc, "return stack pop past the return address");
+      }
+
+      switch(instr.handler) {
+      case H_JUMP_IMM:
+         if(auto error = flow(pc, instr.operand, state)) {
+            return std::unexpected(*error);
+         }
+         continue;
+      case H_BTRUE_IMM:
+      case H_BFALSE_IMM:
+         pop(state, 1);
+         if(auto error = flow(pc, instr.operand, state)) {
+            return std::unexpected(*error);
+         }
+         break;
+      case H_CALL_IMM: {
+         if(instr.operand >= m_code.size()) {
+            return fail(pc, "branch outside the code");
+         }
+         if(m_active.contains(instr.operand)) {
+            return fail(pc, "recursive call");
+         }
+         auto callee = summary(instr.operand);
+         if(!callee.has_value()) {
+            return callee;
+         }
+         apply_call(state, *callee, 1);
+         if(!callee->returns) {
+            continue;
+         }
+         // the callee's return pops the return address again
+         effect.return_pushes = 0;
+      } break;
+      case H_RETURN:
+         if(state.return_depth != 0) {
+            return fail(pc, "return with items on the return stack");
+         }
+         if(out.returns && out.net != state.depth) {
+            return fail(pc, "returns with different stack depths");
+         }
+         out.returns = true;
+         out.net = state.depth;
+         continue;
+      case H_EXTERN_CALL: {
+         auto fn = state.top[0];
+         auto module = state.top[1];
+         pop(state, 2);
+         if(fn.kind != Value::Int || module.kind != Value::Import) {
+            return fail(pc, "extern_call target only known at runtime");
+         }
+         auto callee = m_extern_summary(module.value, fn.value);
+         if(!callee.has_value()) {
+            return fail(pc, "extern_call with unknown stack effect");
+         }
+         apply_call(state, *callee, 0);
+         if(!callee->returns) {
+            continue;
+         }
+      } break;
+      case H_PICK: {
+         auto index = state.top[0];
+         if(index.kind != Value::Int || index.value < 0) {
+            return fail(pc, "pick index only known at runtime");
+         }
+         pop(state, 1);
+         out.inputs = std::max(out.inputs, index.value + 1 - state.depth);
+         push(state, Value{});
+      } break;
+      case H_PUSH_IMM:
+         push(state, Value{Value::Int, instr.operand});
+         break;
+      case H_PUSH_MODULE:
+         push(state, Value{Value::Import, instr.operand});
+         break;
+      case H_DUP: {
+         auto top = state.top[0];
+         pop(state, 1);
+         push(state, top);
+         push(state, top);
+      } break;
+      case H_SWAP: {
+         auto a = state.top[0];
+         auto b = state.top[1];
+         pop(state, 2);
+         push(state, a);
+         push(state, b);
+      } break;
+      default:
+         pop(state, effect.pops);
+         for(int i = 0; i < effect.pushes; ++i) {
+            push(state, Value{});
+         }
+         break;
+      }
+
+      state.return_depth += effect.return_pushes - effect.return_pops;
+      out.max_return_depth =
+         std::max(out.max_return_depth, state.return_depth);
+
+      if(next >= m_code.size()) {
+         return fail(pc, "runs off the end of the code");
+      }
+      if(auto error = flow(pc, next, state)) {
+         return std::unexpected(*error);
+      }
+   }
+
+   if(!out.returns) {
+      out.net = 0;
+   }
+   return out;
+}
+
+} // namespace
+
+std::expected<std::vector<FunctionSummary>, VerifyError> verify(
+   std::span<unsigned char const> code, std::span<int const> entries,
+   ExternSummary const& extern_summary, int word_size
+) {
+   Verifier verifier(code, extern_summary, word_size);
+   std::vector<FunctionSummary> summaries;
+   summaries.reserve(entries.size());
+   for(auto entry : entries) {
+      auto summary = verifier.summary(entry);
+      if(!summary.has_value()) {
+         return std::unexpected(summary.error());
+      }
+      summaries.push_back(*summary);
+   }
+   return summaries;
+}
+
+} // namespace vm
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <expected>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace vm {
+
+/// @brief Stack usage of a function, relative to the depths when it's called
+struct FunctionSummary {
+   /// @brief data stack items it reads from below its entry depth
+   int inputs = 0;
+   /// @brief change in data stack depth once it returns
+   int net = 0;
+   /// @brief highest data stack depth above its entry depth
+   int max_depth = 0;
+   /// @brief most return stack items it pushes, including for nested calls
+   int max_return_depth = 0;
+   /// @brief false if no path reaches a `return`
+   bool returns = true;
+};
+
+/// @brief Why a module was rejected
+struct VerifyError {
+   /// @brief offset in to code() of the offending instruction
+   int pc;
+   std::string_view reason;
+};
+
+/// @brief The part of an opcode's stack effect that doesn't depend on runtime
+/// values. pick, extern_call and return have more on top, see check_instr().
+struct InstrEffect {
+   int length;
+   int pops;
+   int pushes;
+   int return_pops;
+   int return_pushes;
+};
+
+/// @brief nullopt for opcodes the interpreter stops on
+/// @param word_size bytes in an immediate, BytecodeModule::word_size()
+std::optional<InstrEffect> instr_effect(
+   unsigned char opcode, int word_size = 2
+);
+
+/// @brief Effect of `extern_call` on export fn_id of import import_index,
+/// including the return stack entries the call itself pushes. nullopt if it
+/// isn't known.
+using ExternSummary = std::function<
+   std::optional<FunctionSummary>(int import_index, int fn_id)>;
+
+/// @brief Walk every instruction reachable from entries and work out the
+/// stack depths at each one. Rejects code where the depth at an instruction
+/// depends on the path taken, branches or immediates that leave the code,
+/// recursion, return stack pops past the return address, and calls whose
+/// target or stack effect is only known at runtime.
+/// @return summary of each entry, in order
+std::expected<std::vector<FunctionSummary>, VerifyError> verify(
+   std::span<unsigned char const> code, std::span<int const> entries,
+   ExternSummary const& extern_summary, int word_size = 2
+);
+
+} // namespace vm
@@ -12,6 +12,16 @@ std::string_view error_to_str(Error error) {
       return "`entry` export not found";
    case Error::EofWithoutReturn:
       return "reached end of module without return opcode";
+   case Error::NotTranslated:
+      return "reached code that was not translated ahead of time";
+   case Error::StackUnderflow:
+      return "stack underflow";
+   case Error::StackOverflow:
+      return "stack overflow";
+   case Error::AddressOutOfRange:
+      return "address outside of module memory";
+   case Error::FileUnreadable:
+      return "couldn't read module file";
    default:
       return "<Unknown error>";
    }
@@ -9,6 +9,16 @@ enum class Error {
    ModuleNotFound,
    EntryNotFound,
    EofWithoutReturn,
+   /// @brief ahead-of-time translated code reached code it doesn't have
+   NotTranslated,
+   /// @brief checked mode caught a pop from an empty stack
+   StackUnderflow,
+   /// @brief checked mode caught a push to a full stack
+   StackOverflow,
+   /// @brief checked mode caught a load or store outside the module
+   AddressOutOfRange,
+   /// @brief a module file couldn't be opened or mapped
+   FileUnreadable,
 };
 
 std::string_view error_to_str(Error error);
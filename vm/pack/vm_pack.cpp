@@ -0,0 +1,90 @@
+// Packs module files in to one archive, for ArchivePlatform.
+//
+// usage: vm_pack out.sbca module.bin [module.bin ...]
+//        vm_pack --list archive.sbca
+//
+// Each module is stored as it is, under the name in its header. --list
+// prints the index of an existing archive.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ModuleArchive.hpp"
+
+namespace {
+
+void usage() {
+   std::printf(
+      "usage: vm_pack out.sbca module.bin [module.bin ...]\n"
+      "       vm_pack --list archive.sbca\n"
+   );
+   std::exit(1);
+}
+
+std::vector<unsigned char> read_file(char const* filename) {
+   std::ifstream file(filename, std::ios::binary);
+   return {std::istreambuf_iterator<char>(file), {}};
+}
+
+int list(char const* filename) {
+   auto bytes = read_file(filename);
+   auto archive = vm::ModuleArchive::open(bytes);
+   if(!archive.has_value()) {
+      std::printf(
+         "%s: %s\n", filename, vm::error_to_str(archive.error()).data()
+      );
+      return 1;
+   }
+   for(std::size_t n = 0; n < archive->size(); ++n) {
+      auto name = archive->name(n);
+      std::printf(
+         "%.*s %zu\n", static_cast<int>(name.size()), name.data(),
+         archive->find(name)->size()
+      );
+   }
+   return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+   if(argc == 3 && std::string_view(argv[1]) == "--list") {
+      return list(argv[2]);
+   }
+   if(argc < 3) {
+      usage();
+   }
+
+   std::vector<std::vector<unsigned char>> modules;
+   for(int i = 2; i < argc; ++i) {
+      modules.push_back(read_file(argv[i]));
+      if(!vm::BytecodeModule::load(modules.back()).has_value()) {
+         std::printf("%s: not a valid module\n", argv[i]);
+         return 1;
+      }
+   }
+
+   auto archive = vm::ModuleArchive::build(modules);
+   if(!archive.has_value()) {
+      std::printf("two modules have the same name\n");
+      return 1;
+   }
+
+   // renamed over the output, a running pc_port may have the old one mapped
+   auto tmp_path = std::string(argv[1]) + ".tmp";
+   {
+      std::ofstream out(tmp_path, std::ios::binary);
+      out.write(
+         reinterpret_cast<char const*>(archive->data()), archive->size()
+      );
+      if(!out) {
+         return 1;
+      }
+   }
+   return std::rename(tmp_path.c_str(), argv[1]) == 0 ? 0 : 1;
+}
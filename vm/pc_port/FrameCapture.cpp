@@ -0,0 +1,147 @@
+#include "FrameCapture.hpp"
+#include "GraphicsModule.hpp"
+#include "raylib.h"
+
+#include <algorithm>
+#include <array>
+
+static constexpr int WIDTH = GraphicsModule::SCREEN_WIDTH;
+static constexpr int HEIGHT = GraphicsModule::SCREEN_HEIGHT;
+
+/// @brief Y, Cb and Cr (BT.601, studio range) of each palette entry
+static std::array<std::array<unsigned char, 3>, 16> palette_ycbcr() {
+   std::array<unsigned char, 16> indices;
+   std::array<unsigned char, 16 * 4> rgba;
+   for(int i = 0; i < 16; ++i) {
+      indices[i] = i;
+   }
+   GraphicsModule::to_rgba(indices, rgba);
+
+   std::array<std::array<unsigned char, 3>, 16> out;
+   for(int i = 0; i < 16; ++i) {
+      double r = rgba[4 * i], g = rgba[4 * i + 1], b = rgba[4 * i + 2];
+      auto y = 16 + (65.481 * r + 128.553 * g + 24.966 * b) / 255;
+      auto cb = 128 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255;
+      auto cr = 128 + (112.0 * r - 93.786 * g - 18.214 * b) / 255;
+      out[i] = {
+         static_cast<unsigned char>(y + 0.5),
+         static_cast<unsigned char>(cb + 0.5),
+         static_cast<unsigned char>(cr + 0.5),
+      };
+   }
+   return out;
+}
+
+/// @brief whether path holds exactly one conversion for the frame number,
+/// `%d` with an optional width like `%05d`, and no other `%` but `%%`
+static bool is_frame_pattern(std::string_view path) {
+   auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+   int conversions = 0;
+   for(std::size_t i = 0; i < path.size(); ++i) {
+      if(path[i] != '%') {
+         continue;
+      }
+      ++i;
+      if(i < path.size() && path[i] == '%') {
+         continue;
+      }
+      while(i < path.size() && is_digit(path[i])) {
+         ++i;
+      }
+      if(i == path.size() || path[i] != 'd') {
+         return false;
+      }
+      ++conversions;
+   }
+   return conversions == 1;
+}
+
+std::optional<FrameCapture> FrameCapture::open(std::string path) {
+   auto ends_with = [&](std::string_view suffix) {
+      return path.size() >= suffix.size() &&
+         path.compare(path.size() - suffix.size(), suffix.size(), suffix) ==
+         0;
+   };
+
+   Format format;
+   if(ends_with(".y4m")) {
+      format = Format::Y4m;
+   } else if(ends_with(".rgba")) {
+      format = Format::Rgba;
+   } else if(ends_with(".png") && is_frame_pattern(path)) {
+      // checked, so it's safe to hand to snprintf as the format
+      format = Format::Png;
+   } else {
+      return std::nullopt;
+   }
+
+   FrameCapture capture(format, path);
+   if(format != Format::Png) {
+      capture.m_file.reset(std::fopen(path.c_str(), "wb"));
+      if(!capture.m_file) {
+         return std::nullopt;
+      }
+   }
+   if(format == Format::Y4m) {
+      std::fprintf(
+         capture.m_file.get(), "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", WIDTH,
+         HEIGHT
+      );
+   }
+   return capture;
+}
+
+bool FrameCapture::write(std::span<unsigned char const> indexed) {
+   if(indexed.size() != WIDTH * HEIGHT) {
+      return false;
+   }
+   auto frame = m_frames++;
+   auto repeated = std::equal(
+      indexed.begin(), indexed.end(), m_last.begin(), m_last.end()
+   );
+   if(!repeated) {
+      m_last.assign(indexed.begin(), indexed.end());
+      encode(indexed);
+      ++m_unique_frames;
+   }
+
+   switch(m_format) {
+   case Format::Y4m:
+      std::fputs("FRAME\n", m_file.get());
+      [[fallthrough]];
+   case Format::Rgba:
+      return std::fwrite(
+                m_encoded.data(), 1, m_encoded.size(), m_file.get()
+             ) == m_encoded.size();
+   case Format::Png: {
+      if(repeated) {
+         return true;
+      }
+      auto name = std::vector<char>(m_path.size() + 32);
+      std::snprintf(name.data(), name.size(), m_path.c_str(), frame);
+      Image image = {
+         m_encoded.data(), WIDTH, HEIGHT, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+      };
+      return ExportImage(image, name.data());
+   }
+   }
+   return false;
+}
+
+void FrameCapture::encode(std::span<unsigned char const> indexed) {
+   if(m_format != Format::Y4m) {
+      m_encoded.resize(indexed.size() * 4);
+      GraphicsModule::to_rgba(indexed, m_encoded);
+      return;
+   }
+
+   // planar, all of Y then Cb then Cr
+   static auto const ycbcr = palette_ycbcr();
+   m_encoded.resize(indexed.size() * 3);
+   for(std::size_t i = 0; i < indexed.size(); ++i) {
+      auto const& pixel = ycbcr[indexed[i] & 0xf];
+      m_encoded[i] = pixel[0];
+      m_encoded[indexed.size() + i] = pixel[1];
+      m_encoded[2 * indexed.size() + i] = pixel[2];
+   }
+}
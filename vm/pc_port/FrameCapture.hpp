@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+/// @brief Writes GraphicsModule frames to a file, for pc_port --headless.
+///
+/// The format comes from the path's extension:
+///  - `.y4m`: YUV4MPEG2 4:4:4 video at 60 fps, for ffmpeg or mpv
+///  - `.rgba`: raw 256x64 RGBA frames one after another
+///  - `.png`: a PNG per frame, path is a printf pattern with one `%d` for
+///    the frame number, eg. `frames/%05d.png`
+///
+/// A frame identical to the one before isn't converted again. Video repeats
+/// it to keep time, a PNG sequence skips the file, so its numbers have gaps.
+class FrameCapture {
+public:
+   enum class Format { Y4m, Rgba, Png };
+
+   /// @return nullopt if the extension is unknown, a PNG path isn't a
+   /// pattern with one `%d`, or the file can't be created
+   static std::optional<FrameCapture> open(std::string path);
+
+   /// @brief add the next frame, as GraphicsModule::framebuffer()
+   /// @return false if it couldn't be written
+   bool write(std::span<unsigned char const> indexed);
+
+   int frames() const {
+      return m_frames;
+   }
+
+   /// @brief frames that differed from the one before
+   int unique_frames() const {
+      return m_unique_frames;
+   }
+
+private:
+   struct FileCloser {
+      void operator()(std::FILE* file) const {
+         std::fclose(file);
+      }
+   };
+
+   Format m_format;
+   std::string m_path;
+   std::unique_ptr<std::FILE, FileCloser> m_file;
+   /// @brief previous frame's pixels, and what was written for it
+   std::vector<unsigned char> m_last;
+   std::vector<unsigned char> m_encoded;
+   int m_frames = 0;
+   int m_unique_frames = 0;
+
+   FrameCapture(Format format, std::string path) :
+      m_format(format), m_path(std::move(path)) {}
+
+   void encode(std::span<unsigned char const> indexed);
+};
@@ -2,6 +2,8 @@
 #include "raylib.h"
 
 #include <array>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 
 enum Fn {
@@ -10,9 +12,6 @@ enum Fn {
    BLIT = 2,
 };
 
-static constexpr int SCREEN_WIDTH = 256;
-static constexpr int SCREEN_HEIGHT = 64;
-
 void GraphicsModule::invoke_index(vm::Machine& machine, int fn_id) {
    switch(fn_id) {
    case SET_DISPLAY_BUF:
@@ -22,8 +21,17 @@ void GraphicsModule::invoke_index(vm::Machine& machine, int fn_id) {
    case IS_KEY_DOWN: {
       // ( key -- down? )
       auto key = machine.stack().pop();
+      bool down;
+      if(m_input == Input::Replay) {
+         down = m_log->is_down(m_frame, key);
+      } else {
+         down = IsKeyDown(key);
+         if(down && m_input == Input::Record) {
+            m_log->press(m_frame, key);
+         }
+      }
       machine.stack().push(
-         IsKeyDown(key) ? vm::Machine::TRUE_WORD : vm::Machine::FALSE_WORD
+         down ? vm::Machine::TRUE_WORD : vm::Machine::FALSE_WORD
       );
    } break;
    case BLIT: {
@@ -48,6 +56,10 @@ void GraphicsModule::invoke_index(vm::Machine& machine, int fn_id) {
             sprite_width
          );
          std::copy(src_row.begin(), src_row.end(), dest_row.begin());
+         machine.code_changed(
+            m_display_buff_bytecode_address + dest_y * SCREEN_WIDTH + x,
+            sprite_width
+         );
       }
    } break;
    default:
@@ -55,6 +67,19 @@ void GraphicsModule::invoke_index(vm::Machine& machine, int fn_id) {
    }
 }
 
+std::optional<vm::StackEffect> GraphicsModule::stack_effect(int fn_id) const {
+   switch(fn_id) {
+   case SET_DISPLAY_BUF:
+      return vm::StackEffect{1, 0};
+   case IS_KEY_DOWN:
+      return vm::StackEffect{1, 1};
+   case BLIT:
+      return vm::StackEffect{3, 0};
+   default:
+      return std::nullopt;
+   }
+}
+
 static constexpr std::array<Color, 16> colormap = {
    Color{0, 0, 0, 0xff},
    Color{17, 14, 0, 0xff},
@@ -74,13 +99,87 @@ static constexpr std::array<Color, 16> colormap = {
    Color{255, 215, 0, 0xff},
 };
 
+std::span<unsigned char const> GraphicsModule::framebuffer(
+   vm::Machine& machine
+) const {
+   auto code = machine.current_module().code();
+   auto size = SCREEN_WIDTH * SCREEN_HEIGHT;
+   if(m_display_buff_bytecode_address < 0 ||
+      m_display_buff_bytecode_address + size > code.size()) {
+      return {};
+   }
+   return code.subspan(m_display_buff_bytecode_address, size);
+}
+
+void GraphicsModule::to_rgba(
+   std::span<unsigned char const> indexed, std::span<unsigned char> rgba
+) {
+   // each colour packed as its four bytes lie in memory, so a pixel is one
+   // table load and one store with no per-channel work
+   static auto const packed = [] {
+      std::array<std::uint32_t, colormap.size()> words;
+      for(std::size_t i = 0; i < colormap.size(); ++i) {
+         std::memcpy(&words[i], &colormap[i], sizeof(words[i]));
+      }
+      return words;
+   }();
+   auto out = rgba.data();
+   for(auto index : indexed) {
+      std::memcpy(out, &packed[index & 0xf], sizeof(std::uint32_t));
+      out += sizeof(std::uint32_t);
+   }
+}
+
 void GraphicsModule::draw(vm::Machine& machine) {
-   auto progmem = machine.current_module().code();
-   for(int y = 0; y < SCREEN_HEIGHT; ++y) {
-      for(int x = 0; x < SCREEN_WIDTH; ++x) {
-         auto pix =
-            progmem[m_display_buff_bytecode_address + (y * SCREEN_WIDTH + x)];
-         DrawRectangle(x * 4, y * 4, 3, 3, colormap[pix]);
+   auto pixels = framebuffer(machine);
+   if(pixels.empty()) {
+      return;
+   }
+   to_rgba(pixels, m_rgba);
+
+   if(m_screen.id == 0) {
+      m_screen = LoadTextureFromImage(Image{
+         m_rgba.data(), SCREEN_WIDTH, SCREEN_HEIGHT, 1,
+         PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+      });
+      SetTextureFilter(m_screen, TEXTURE_FILTER_POINT);
+
+      // one screen pixel's cell, lit but for its last row and column
+      std::array<Color, SCALE * SCALE> cell;
+      for(int y = 0; y < SCALE; ++y) {
+         for(int x = 0; x < SCALE; ++x) {
+            auto lit = x < SCALE - 1 && y < SCALE - 1;
+            cell[y * SCALE + x] = lit ? WHITE : BLACK;
+         }
       }
+      m_grid = LoadTextureFromImage(Image{
+         cell.data(), SCALE, SCALE, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+      });
+      SetTextureFilter(m_grid, TEXTURE_FILTER_POINT);
+      SetTextureWrap(m_grid, TEXTURE_WRAP_REPEAT);
+   } else {
+      UpdateTexture(m_screen, m_rgba.data());
+   }
+
+   auto window = Rectangle{
+      0, 0, float(SCREEN_WIDTH * SCALE), float(SCREEN_HEIGHT * SCALE)
+   };
+   DrawTexturePro(
+      m_screen, Rectangle{0, 0, SCREEN_WIDTH, SCREEN_HEIGHT}, window,
+      Vector2{0, 0}, 0, WHITE
+   );
+   // the cell repeated once per screen pixel, multiplied in to darken the
+   // gaps between them
+   BeginBlendMode(BLEND_MULTIPLIED);
+   DrawTexturePro(m_grid, window, window, Vector2{0, 0}, 0, WHITE);
+   EndBlendMode();
+}
+
+void GraphicsModule::unload() {
+   if(m_screen.id != 0) {
+      UnloadTexture(m_screen);
+      UnloadTexture(m_grid);
+      m_screen = {};
+      m_grid = {};
    }
-}
\ No newline at end of file
+}
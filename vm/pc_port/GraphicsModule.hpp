@@ -1,7 +1,12 @@
 #pragma once
 
+#include <array>
+#include <span>
+
 #include "ISystemModule.hpp"
+#include "InputLog.hpp"
 #include "Machine.hpp"
+#include "raylib.h"
 
 class GraphicsModule final : public vm::ISystemModule {
 public:
@@ -12,11 +17,55 @@ public:
       return inst;
    }
 
+   static constexpr int SCREEN_WIDTH = 256;
+   static constexpr int SCREEN_HEIGHT = 64;
+   /// @brief window pixels per screen pixel, the last row and column of
+   /// each left dark as a grid gap
+   static constexpr int SCALE = 4;
+
+   /// @brief Where IS_KEY_DOWN gets keys: the keyboard, the keyboard with
+   /// held keys logged, or a log replayed in place of the keyboard
+   enum class Input { Live, Record, Replay };
+
    void invoke_index(vm::Machine& machine, int fn_id) override;
+   std::optional<vm::StackEffect> stack_effect(int fn_id) const override;
+
+   /// @brief draw the display buffer as one texture scaled to the window,
+   /// creating the textures on first use
    void draw(vm::Machine& machine);
 
+   /// @brief free the textures draw created, before the window closes
+   void unload();
+
+   /// @param log for Record and Replay, must outlive its use
+   void set_input(Input input, vm::InputLog* log = nullptr) {
+      m_input = input;
+      m_log = log;
+   }
+
+   /// @brief frame keys are logged under and replayed from
+   void set_frame(int frame) {
+      m_frame = frame;
+   }
+
+   /// @brief the program's display buffer, a palette index per pixel, or
+   /// empty if the buffer isn't inside the module
+   std::span<unsigned char const> framebuffer(vm::Machine& machine) const;
+
+   /// @brief indexed pixels to 4 bytes of RGBA each, through the palette
+   static void to_rgba(
+      std::span<unsigned char const> indexed, std::span<unsigned char> rgba
+   );
+
 private:
    int m_display_buff_bytecode_address = 0;
+   Input m_input = Input::Live;
+   vm::InputLog* m_log = nullptr;
+   int m_frame = 0;
+
+   std::array<unsigned char, SCREEN_WIDTH * SCREEN_HEIGHT * 4> m_rgba{};
+   Texture2D m_screen{};
+   Texture2D m_grid{};
 
    GraphicsModule() : vm::ISystemModule("graphics") {}
 };
\ No newline at end of file
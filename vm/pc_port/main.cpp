@@ -1,20 +1,40 @@
 // #include "engine.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iterator>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "BytecodeModule.hpp"
+#include "FilesystemPlatform.hpp"
+#include "FrameCapture.hpp"
 #include "GraphicsModule.hpp"
 #include "IPlatform.hpp"
+#include "ModuleArchive.hpp"
 #include "ISystemModule.hpp"
 #include "Machine.hpp"
+#include "SnapshotRing.hpp"
 
 #include "raylib.h"
 
+#if PC_PORT_AOT
+// program translated at build time, see PC_PORT_AOT_PROGRAM
+#include "aot_program.hpp"
+#endif
+
 static std::vector<unsigned char> load_from_filename(char const* filename);
+static int compare_engines(std::vector<unsigned char> file, int frames);
+static int run_headless(
+   vm::Machine& machine, std::function<std::optional<vm::Error>()> run_frame,
+   int frames, char const* capture_path
+);
 
 class Platform final : public vm::IPlatform {
 public:
@@ -27,11 +47,29 @@ public:
 
    std::optional<vm::BytecodeModule> get_module(std::string_view name
    ) override {
-      return std::nullopt;
+      if(m_archive.has_value()) {
+         if(auto module = m_archive->get_module(name)) {
+            return module;
+         }
+      }
+      return m_files.get_module(name);
+   }
+
+   /// @brief serve modules from archive before looking for files
+   void set_archive(vm::ModuleArchive archive) {
+      m_archive.emplace(std::move(archive));
+   }
+
+   /// @brief look for `<name>.bin` in path when a module is imported
+   void add_search_path(std::filesystem::path path) {
+      m_files.add_search_path(std::move(path));
    }
 
 private:
    Platform(){};
+
+   std::optional<vm::ArchivePlatform> m_archive;
+   vm::FilesystemPlatform m_files;
 };
 
 class System final : public vm::ISystemModule {
@@ -54,88 +92,585 @@ public:
       }
    }
 
+   std::optional<vm::StackEffect> stack_effect(int fn_id) const override {
+      if(fn_id == 0) {
+         return vm::StackEffect{1, 0};
+      }
+      return std::nullopt;
+   }
+
 private:
    System() : vm::ISystemModule("system") {}
 };
 
+static void usage() {
+   std::printf("usage: vm [--interpreter | --compare frames] program.bin\n");
+   std::printf("   --interpreter     don't use the JIT\n");
+   std::printf("   --compare frames  run the JIT and the interpreter side\n");
+   std::printf("                     by side without a window, and check\n");
+   std::printf("                     they agree after every call\n");
+   std::printf("   --headless frames run frame that many times without a\n");
+   std::printf("                     window, and report the time taken\n");
+   std::printf("   --capture file    with --headless, write every frame to\n");
+   std::printf("                     file.y4m, file.rgba (raw 256x64 RGBA)\n");
+   std::printf("                     or a PNG each, eg. out/%%05d.png\n");
+   std::printf("   --modules dir     also look for imported modules in dir,\n");
+   std::printf("                     after the program's own directory\n");
+   std::printf("   --rewind frames   frames of history to keep, default\n");
+   std::printf("                     600. 0 turns rewinding off\n");
+   std::printf("   --rewind-mb mb    most memory the history can use,\n");
+   std::printf("                     default 64\n");
+   std::printf("   --record file     log the keys the program sees held\n");
+   std::printf("                     each frame, written to file on exit\n");
+   std::printf("   --replay file     play keys back from a --record log\n");
+   std::printf("                     instead of the keyboard\n");
+   std::printf("   --turbo n         frames run per frame drawn while tab\n");
+   std::printf("                     is held, default 8\n");
+#if MODULE_HAS_MMAP
+   std::printf("   --archive file    load imported modules from a vm_pack\n");
+   std::printf("                     archive first\n");
+#endif
+#if MACHINE_TRACE
+   std::printf("   --trace file      keep the last instructions run, and\n");
+   std::printf("                     write them to file on the first error\n");
+   std::printf("                     and on exit, see vm_trace\n");
+#endif
+#if MACHINE_PROFILE
+   std::printf("   --profile prefix  on exit write prefix.txt, and call\n");
+   std::printf("                     stacks for flamegraph.pl weighted by\n");
+   std::printf("                     instructions and by time to\n");
+   std::printf("                     prefix.folded and prefix.time.folded\n");
+#endif
+   std::printf("keys: hold backspace to rewind. p pauses, then left and\n");
+   std::printf("right step through the history and p carries on from there\n");
+#if PC_PORT_AOT
+   std::printf("without program.bin, runs the built in translated program\n");
+#endif
+   std::exit(1);
+}
+
 int main(int argc, char** argv) {
-   if(argc != 2) {
-      std::printf("usage: vm program.bin\n");
-      std::exit(1);
+   auto engine = vm::Machine::DEFAULT_ENGINE;
+   int compare_frames = -1;
+   int headless_frames = -1;
+   char const* capture_path = nullptr;
+   char const* record_path = nullptr;
+   char const* replay_path = nullptr;
+   char const* filename = nullptr;
+#if MACHINE_PROFILE
+   char const* profile_prefix = nullptr;
+#endif
+   char const* trace_file = nullptr;
+   std::vector<char const*> module_dirs;
+   std::size_t rewind_frames = vm::SnapshotRing::DEFAULT_CAPACITY;
+   std::size_t rewind_mb = vm::SnapshotRing::DEFAULT_MAX_BYTES >> 20;
+   int turbo = 8;
+   for(int i = 1; i < argc; ++i) {
+      auto arg = std::string_view(argv[i]);
+      if(arg == "--interpreter") {
+         engine = vm::Engine::Threaded;
+      } else if(arg == "--compare" && i + 1 < argc) {
+         compare_frames = std::atoi(argv[++i]);
+      } else if(arg == "--headless" && i + 1 < argc) {
+         headless_frames = std::max(0, std::atoi(argv[++i]));
+      } else if(arg == "--capture" && i + 1 < argc) {
+         capture_path = argv[++i];
+      } else if(arg == "--record" && i + 1 < argc) {
+         record_path = argv[++i];
+      } else if(arg == "--replay" && i + 1 < argc) {
+         replay_path = argv[++i];
+      } else if(arg == "--modules" && i + 1 < argc) {
+         module_dirs.push_back(argv[++i]);
+      } else if(arg == "--rewind" && i + 1 < argc) {
+         rewind_frames = std::strtoul(argv[++i], nullptr, 10);
+      } else if(arg == "--rewind-mb" && i + 1 < argc) {
+         rewind_mb = std::strtoul(argv[++i], nullptr, 10);
+      } else if(arg == "--turbo" && i + 1 < argc) {
+         turbo = std::max(1, std::atoi(argv[++i]));
+#if MODULE_HAS_MMAP
+      } else if(arg == "--archive" && i + 1 < argc) {
+         auto archive = vm::ModuleArchive::open_file(argv[++i]);
+         if(!archive.has_value()) {
+            std::printf(
+               "%s: %s\n", argv[i], vm::error_to_str(archive.error()).data()
+            );
+            return 1;
+         }
+         Platform::instance().set_archive(std::move(*archive));
+#endif
+#if MACHINE_TRACE
+      } else if(arg == "--trace" && i + 1 < argc) {
+         trace_file = argv[++i];
+#endif
+#if MACHINE_PROFILE
+      } else if(arg == "--profile" && i + 1 < argc) {
+         profile_prefix = argv[++i];
+#endif
+      } else if(!filename && !arg.starts_with("--")) {
+         filename = argv[i];
+      } else {
+         usage();
+      }
+   }
+
+   if((capture_path && headless_frames < 0) || (record_path && replay_path)) {
+      usage();
+   }
+
+   // modules the program imports are loaded from next to it
+   if(filename) {
+      auto program_dir = std::filesystem::path(filename).parent_path();
+      Platform::instance().add_search_path(program_dir);
+   }
+   for(auto dir : module_dirs) {
+      Platform::instance().add_search_path(dir);
    }
 
    auto m = vm::Machine(Platform::instance());
+   m.set_engine(engine);
    m.add_system_module(&System::instance());
 
-   auto file = load_from_filename(argv[1]);
-   auto mod = vm::BytecodeModule::load(file);
+#if MACHINE_TRACE
+   vm::TraceRing trace;
+   if(trace_file) {
+      m.set_trace(&trace);
+   }
+#endif
+   auto write_trace = [&] {
+#if MACHINE_TRACE
+      if(!trace_file) {
+         return;
+      }
+      std::vector<std::string_view> names;
+      for(int i = 0; i < m.module_count(); ++i) {
+         names.push_back(m.module_by_index(i).name());
+      }
+      std::ofstream out(trace_file, std::ios::binary);
+      trace.write(out, names);
+      std::cout << "trace written to " << trace_file << "\n";
+#endif
+   };
 
-   if(!mod.has_value()) {
-      std::printf("%s\n", vm::error_to_str(mod.error()));
-      return 1;
+#if MACHINE_PROFILE
+   vm::Profiler profiler;
+   if(profile_prefix) {
+      m.set_profiler(&profiler);
    }
+#endif
+
+   // the built in translated program runs without bytecode
+   bool translated = false;
+   auto call = [&](std::string_view fn) -> std::optional<vm::Error> {
+#if PC_PORT_AOT
+      if(translated) {
+         return fn == "entry" ? aot_program::entry(m) : aot_program::frame(m);
+      }
+#endif
+      return m.execute("program", fn);
+   };
+
+#if PC_PORT_AOT
+   if(!filename && compare_frames < 0) {
+      m.add_module(aot_program::load_module());
+      translated = true;
+   } else
+#endif
+   {
+      if(!filename) {
+         usage();
+      }
+      if(compare_frames >= 0) {
+         return compare_engines(load_from_filename(filename), compare_frames);
+      }
 
-   auto mod_v = mod.value();
+#if MODULE_HAS_MMAP
+      // mapped rather than read, only pages the program writes get copied.
+      // as2.py replaces its output rather than rewriting it, so reassembling
+      // while this runs leaves the mapping alone.
+      auto mod = vm::BytecodeModule::load_file(filename);
+#else
+      auto mod = vm::BytecodeModule::load(load_from_filename(filename));
+#endif
 
-   m.add_module(mod_v);
+      if(!mod.has_value()) {
+         std::printf("%s\n", vm::error_to_str(mod.error()).data());
+         return 1;
+      }
+
+      // moved, the module's string_views point in to its own buffer
+      m.add_module(std::move(*mod));
+   }
 
 #ifdef CONSOLE
    auto res = m.execute_first_module();
    if(res.has_value()) {
-      std::printf("%s\n", vm::error_to_str(mod.error()));
+      std::printf("%s\n", vm::error_to_str(res.value()).data());
    } else {
       std::printf("ok\n");
    }
 
 #else
-   static constexpr int screenWidth = 256 * 4;
-   static constexpr int screenHeight = 64 * 4;
+   static constexpr int screenWidth =
+      GraphicsModule::SCREEN_WIDTH * GraphicsModule::SCALE;
+   static constexpr int screenHeight =
+      GraphicsModule::SCREEN_HEIGHT * GraphicsModule::SCALE;
+
+   auto& graphics = GraphicsModule::instance();
+   m.add_system_module(&graphics);
 
-   m.add_system_module(&GraphicsModule::instance());
+   // keys held in each frame, entry being frame 0
+   vm::InputLog input_log;
+   int frame_number = 0;
+   if(replay_path) {
+      std::ifstream in(replay_path, std::ios::binary);
+      auto log = vm::InputLog::read(in);
+      if(!log.has_value()) {
+         std::printf(
+            "%s: %s\n", replay_path, vm::error_to_str(log.error()).data()
+         );
+         return 1;
+      }
+      input_log = std::move(*log);
+      graphics.set_input(GraphicsModule::Input::Replay, &input_log);
+   } else if(record_path) {
+      graphics.set_input(GraphicsModule::Input::Record, &input_log);
+   }
+   auto write_recording = [&] {
+      if(!record_path) {
+         return;
+      }
+      std::ofstream out(record_path, std::ios::binary);
+      input_log.write(out);
+      std::printf(
+         "recorded %d frames of input to %s\n", input_log.frame_count(),
+         record_path
+      );
+   };
+   // the next call of frame, forgetting keys recorded for it before a rewind
+   auto next_frame = [&] {
+      ++frame_number;
+      if(record_path) {
+         input_log.truncate(frame_number);
+      }
+      graphics.set_frame(frame_number);
+   };
 
-   auto err = m.execute("program", "entry");
+   auto err = call("entry");
 
    if(err.has_value()) {
       std::cout << vm::error_to_str(err.value()) << "\n";
+      write_trace();
       exit(1);
    }
 
+   // look frame up once rather than by name every frame
+   vm::FunctionHandle frame;
+   if(!translated) {
+      auto resolved = m.resolve("program", "frame");
+      if(!resolved.has_value()) {
+         std::cout << vm::error_to_str(resolved.error()) << "\n";
+         exit(1);
+      }
+      frame = *resolved;
+
+      auto rejected = m.verify_module(frame.module_index());
+      if(rejected.has_value()) {
+         std::cout << "not verified, running checked: " << rejected->reason
+                   << " at " << rejected->pc << "\n";
+      }
+   }
+
+   if(headless_frames >= 0) {
+      auto run_frame = [&] {
+         next_frame();
+         return frame ? m.execute(frame) : call("frame");
+      };
+      auto result = run_headless(m, run_frame, headless_frames, capture_path);
+      if(result != 0) {
+         write_trace();
+      }
+      write_recording();
+      return result;
+   }
+
    InitWindow(screenWidth, screenHeight, "vm graphics");
 
+   // the machine after each frame run, so it can be rewound. The graphics
+   // module only holds the display buffer address, which entry sets once.
+   vm::SnapshotRing history(rewind_frames, rewind_mb << 20);
+   // snapshot on screen while paused
+   std::size_t cursor = 0;
+   bool paused = false;
+
+   bool failed = false;
    SetTargetFPS(60);           // Set our game to run at 60 frames-per-second
    while(!WindowShouldClose()) // Detect window close button or ESC key
    {
-      m.execute("program", "frame");
+      if(IsKeyPressed(KEY_P) && history.size() > 0) {
+         paused = !paused;
+         if(paused) {
+            cursor = history.size() - 1;
+         } else {
+            // carry on from the frame on screen
+            frame_number -= history.size() - 1 - cursor;
+            history.truncate(cursor + 1);
+         }
+      }
+
+      const char* status = nullptr;
+      if(paused) {
+         if(IsKeyDown(KEY_LEFT) && cursor > 0) {
+            history.restore(m, --cursor);
+         } else if(IsKeyDown(KEY_RIGHT) && cursor + 1 < history.size()) {
+            history.restore(m, ++cursor);
+         }
+         status = TextFormat(
+            "paused %d/%d", static_cast<int>(cursor + 1),
+            static_cast<int>(history.size())
+         );
+      } else if(IsKeyDown(KEY_BACKSPACE) && history.size() > 1) {
+         // drop the frame on screen and show the one before
+         history.truncate(history.size() - 1);
+         history.restore(m, history.size() - 1);
+         --frame_number;
+         status = TextFormat("rewind %d", static_cast<int>(history.size()));
+      } else {
+         auto runs = IsKeyDown(KEY_TAB) ? turbo : 1;
+         for(int run = 0; run < runs; ++run) {
+            next_frame();
+            auto frame_err = frame ? m.execute(frame) : call("frame");
+            if(frame_err.has_value() && !failed) {
+               // keep running, but capture what led up to the first one
+               std::cout << "frame: " << vm::error_to_str(*frame_err) << "\n";
+               write_trace();
+               failed = true;
+            }
+            if(rewind_frames > 0) {
+               history.push(m);
+            }
+         }
+         if(runs > 1) {
+            status = TextFormat("turbo x%d", runs);
+         }
+      }
+
       BeginDrawing();
       {
          ClearBackground(BLACK);
          GraphicsModule::instance().draw(m);
          DrawFPS(0, 0);
+         if(status) {
+            DrawText(
+               TextFormat(
+                  "%s  history %d frames %.1f MB", status,
+                  static_cast<int>(history.size()),
+                  history.memory_bytes() / double(1 << 20)
+               ),
+               0, screenHeight - 20, 20, WHITE
+            );
+         }
       }
       EndDrawing();
    }
 
+   graphics.unload();
    CloseWindow(); // Close window and OpenGL context
+   if(!failed) {
+      write_trace();
+   }
+   write_recording();
+   if(rewind_frames > 0) {
+      std::printf(
+         "rewind history: %zu frames, %.1f MB of %zu MB\n", history.size(),
+         history.memory_bytes() / double(1 << 20), rewind_mb
+      );
+   }
+
+#if MACHINE_PROFILE
+   if(profile_prefix) {
+      auto prefix = std::string(profile_prefix);
+      std::ofstream report(prefix + ".txt");
+      profiler.write_report(report);
+      std::ofstream folded(prefix + ".folded");
+      profiler.write_folded(folded, vm::Profiler::Weight::Instructions);
+      std::ofstream time_folded(prefix + ".time.folded");
+      profiler.write_folded(time_folded, vm::Profiler::Weight::Nanoseconds);
+      std::cout << "profile written to " << prefix << ".*\n";
+   }
+#endif
+
+   std::cout << "superinstruction counts:\n";
+   auto fusion_counts = m.fusion_counts();
+   for(int i = 0; i < fusion_counts.size(); ++i) {
+      std::cout << "   " << vm::fused_name(i) << ": " << fusion_counts[i]
+                << "\n";
+   }
 #endif
 }
 
+/// @brief program under --compare, all state lives in the module's memory
+struct ComparedRun {
+   vm::Machine machine;
+
+   ComparedRun(std::vector<unsigned char> file, vm::Engine engine) :
+      machine(Platform::instance()) {
+      machine.set_engine(engine);
+      machine.add_system_module(&System::instance());
+      machine.add_system_module(&GraphicsModule::instance());
+      machine.add_module(vm::BytecodeModule::load(file).value());
+   }
+
+   std::vector<vm::StackWord> stack() {
+      std::vector<vm::StackWord> out;
+      auto& stack = machine.stack();
+      for(int i = stack.item_count() - 1; i >= 0; --i) {
+         out.push_back(stack.peek_n(i));
+      }
+      return out;
+   }
+
+   std::vector<unsigned char> memory() {
+      auto code = machine.module_by_index(0).code();
+      return {code.begin(), code.end()};
+   }
+};
+
+static int compare_engines(std::vector<unsigned char> file, int frames) {
+   if(!vm::BytecodeModule::load(file).has_value()) {
+      std::printf("invalid program\n");
+      return 1;
+   }
+   auto native = ComparedRun(file, vm::Engine::Jit);
+   auto interpreted = ComparedRun(file, vm::Engine::Threaded);
+
+   for(int call = 0; call <= frames; ++call) {
+      auto fn = call == 0 ? "entry" : "frame";
+      auto native_err = native.machine.execute("program", fn);
+      auto interpreted_err = interpreted.machine.execute("program", fn);
+
+      // a module that fails verification runs on the checked interpreter
+      // under both engines, which would only be compared with itself
+      auto const& verification =
+         native.machine.module_by_index(0).verification();
+      if(verification.state == vm::BytecodeModule::Verification::Rejected) {
+         std::printf(
+            "program failed verification at %d (%.*s), the JIT never ran\n",
+            verification.error->pc,
+            static_cast<int>(verification.error->reason.size()),
+            verification.error->reason.data()
+         );
+         return 1;
+      }
+
+      if(native_err != interpreted_err) {
+         std::printf("call %d (%s): errors differ\n", call, fn);
+         return 1;
+      }
+      if(native.stack() != interpreted.stack()) {
+         std::printf("call %d (%s): stacks differ\n", call, fn);
+         return 1;
+      }
+      auto native_memory = native.memory();
+      auto interpreted_memory = interpreted.memory();
+      auto diff = std::mismatch(
+         native_memory.begin(), native_memory.end(), interpreted_memory.begin()
+      );
+      if(diff.first != native_memory.end()) {
+         std::printf(
+            "call %d (%s): memory differs at %d\n",
+            call,
+            fn,
+            static_cast<int>(diff.first - native_memory.begin())
+         );
+         return 1;
+      }
+      if(native_err.has_value()) {
+         std::printf("stopped on %s\n", vm::error_to_str(*native_err).data());
+         break;
+      }
+   }
+   std::printf("ok\n");
+   return 0;
+}
+
+/// @brief --headless: frames calls of frame with no window, capturing each
+/// one if capture_path is set
+static int run_headless(
+   vm::Machine& machine, std::function<std::optional<vm::Error>()> run_frame,
+   int frames, char const* capture_path
+) {
+   std::optional<FrameCapture> capture;
+   if(capture_path) {
+      capture = FrameCapture::open(capture_path);
+      if(!capture.has_value()) {
+         std::printf(
+            "%s: can't write, use .y4m, .rgba or a .png pattern with one "
+            "%%d\n",
+            capture_path
+         );
+         return 1;
+      }
+   }
+
+   using clock = std::chrono::steady_clock;
+   clock::duration vm_time{};
+   clock::duration slowest{};
+   auto start = clock::now();
+   int ran = 0;
+   std::optional<vm::Error> error;
+   while(ran < frames && !error.has_value()) {
+      auto before = clock::now();
+      error = run_frame();
+      auto took = clock::now() - before;
+      vm_time += took;
+      slowest = std::max(slowest, took);
+      ++ran;
+
+      if(capture.has_value() &&
+         !capture->write(GraphicsModule::instance().framebuffer(machine))) {
+         std::printf("%s: couldn't write frame %d\n", capture_path, ran - 1);
+         return 1;
+      }
+   }
+   auto total = std::chrono::duration<double>(clock::now() - start).count();
+
+   if(error.has_value()) {
+      std::printf(
+         "frame %d: %s\n", ran - 1, vm::error_to_str(*error).data()
+      );
+   }
+   auto micros = [](clock::duration time) {
+      return std::chrono::duration<double, std::micro>(time).count();
+   };
+   std::printf(
+      "%d frames in %.3f s, %.0f frames/s\n", ran, total,
+      total > 0 ? ran / total : 0.0
+   );
+   std::printf(
+      "vm time per frame: mean %.1f us, max %.1f us\n",
+      ran > 0 ? micros(vm_time) / ran : 0.0, micros(slowest)
+   );
+   if(capture.has_value()) {
+      std::printf(
+         "captured %d frames, %d unique, to %s\n", capture->frames(),
+         capture->unique_frames(), capture_path
+      );
+   }
+   return error.has_value() ? 1 : 0;
+}
+
 static std::vector<unsigned char> load_from_filename(char const* filename) {
    std::ifstream file(filename, std::ifstream::binary | std::ifstream::in);
-   file.unsetf(std::ios::skipws);
-   std::streampos filesize;
    file.seekg(0, std::ios::end);
-   filesize = file.tellg();
+   auto filesize = file.tellg();
    file.seekg(0, std::ios::beg);
+   if(filesize <= 0) {
+      return {};
+   }
 
-   std::vector<unsigned char> vec;
-   vec.reserve(filesize);
-
-   // read the data:
-   vec.insert(
-      vec.begin(),
-      std::istream_iterator<unsigned char>(file),
-      std::istream_iterator<unsigned char>()
-   );
-
+   // one read, rather than a byte at a time through an istream_iterator
+   std::vector<unsigned char> vec(filesize);
+   file.read(reinterpret_cast<char*>(vec.data()), filesize);
+   vec.resize(file.gcount());
    return vec;
 }
\ No newline at end of file
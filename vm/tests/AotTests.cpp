@@ -0,0 +1,98 @@
+#include "HeadlessModules.hpp"
+#include "Machine.hpp"
+#include "TestPlatform.hpp"
+#include "errors_aot.hpp"
+#include "smiletrail_aot.hpp"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/// @brief scripted key presses, the same every run
+bool scripted_keys(int frame, int key) {
+   return (key == 'D' && (frame / 7) % 4 == 0) ||
+      (key == 'S' && (frame / 5) % 3 == 0) || (key == ' ' && frame % 97 == 0);
+}
+
+struct Program {
+   NullPlatform platform;
+   vm::HeadlessSystem system;
+   vm::HeadlessGraphics graphics{scripted_keys};
+   vm::Machine machine{platform};
+
+   Program() {
+      machine.set_engine(vm::Engine::Switch);
+      machine.add_system_module(&system);
+      machine.add_system_module(&graphics);
+      machine.add_module(smiletrail_aot::load_module());
+   }
+
+   std::vector<vm::StackWord> stack() {
+      std::vector<vm::StackWord> out;
+      for(int i = machine.stack().item_count() - 1; i >= 0; --i) {
+         out.push_back(machine.stack().peek_n(i));
+      }
+      return out;
+   }
+
+   std::vector<unsigned char> memory() {
+      auto code = machine.module_by_index(0).code();
+      return {code.begin(), code.end()};
+   }
+};
+
+} // namespace
+
+TEST(Aot, Smiletrail_MatchesInterpreter) {
+   Program interpreted;
+   Program translated;
+
+   ASSERT_EQ(interpreted.machine.execute("program", "entry"), std::nullopt);
+   ASSERT_EQ(smiletrail_aot::entry(translated.machine), std::nullopt);
+   EXPECT_EQ(translated.memory(), interpreted.memory());
+
+   for(int frame = 0; frame < 200; ++frame) {
+      interpreted.graphics.frame = frame;
+      translated.graphics.frame = frame;
+      ASSERT_EQ(interpreted.machine.execute("program", "frame"), std::nullopt);
+      ASSERT_EQ(smiletrail_aot::frame(translated.machine), std::nullopt);
+      ASSERT_EQ(translated.stack(), interpreted.stack()) << "frame " << frame;
+      ASSERT_EQ(translated.memory(), interpreted.memory()) << "frame " << frame;
+   }
+}
+
+TEST(Aot, ErroringPrograms_MatchInterpreter) {
+   using Export = std::optional<vm::Error> (*)(vm::Machine&);
+   std::pair<char const*, Export> exports[] = {
+      {"grow", errors_aot::grow},
+      {"deep", errors_aot::deep},
+      {"poke", errors_aot::poke},
+      {"peek", errors_aot::peek},
+   };
+
+   for(auto [name, translation] : exports) {
+      NullPlatform platform;
+      vm::Machine interpreted(platform);
+      vm::Machine translated(platform);
+      interpreted.add_module(errors_aot::load_module());
+      translated.add_module(errors_aot::load_module());
+
+      auto expected = interpreted.execute("errors", name);
+      ASSERT_NE(expected, std::nullopt) << name;
+      EXPECT_EQ(translation(translated), expected) << name;
+
+      auto& want = interpreted.stack();
+      auto& got = translated.stack();
+      ASSERT_EQ(got.item_count(), want.item_count()) << name;
+      for(int i = 0; i < want.item_count(); ++i) {
+         EXPECT_EQ(got.peek_n(i), want.peek_n(i)) << name << " item " << i;
+      }
+
+      auto want_code = interpreted.module_by_index(0).code();
+      auto got_code = translated.module_by_index(0).code();
+      EXPECT_TRUE(std::ranges::equal(got_code, want_code)) << name;
+   }
+}
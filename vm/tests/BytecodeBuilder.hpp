@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "Instruction.hpp"
+
+/// @brief Minimal in-test assembler. Emits a module in the same layout as
+/// as2.py, with label patchups resolved in build().
+class BytecodeBuilder {
+public:
+   /// @param word_size 4 for a HEADER_WIDE module, like `as2.py --wide`
+   explicit BytecodeBuilder(std::string module_name, int word_size = 2) :
+      m_module_name(std::move(module_name)),
+      m_word_size(word_size) {}
+
+   BytecodeBuilder& op(vm::Instruction opcode) {
+      m_code.push_back(opcode);
+      return *this;
+   }
+
+   BytecodeBuilder& push(int imm) {
+      op(vm::I_PUSH_IMM);
+      return word(imm);
+   }
+
+   /// @brief push_imm the address of a label (`&label` in as2)
+   BytecodeBuilder& push_addr(std::string const& label) {
+      op(vm::I_PUSH_IMM);
+      return label_ref(label);
+   }
+
+   BytecodeBuilder& jump(std::string const& label) {
+      op(vm::I_JUMP_IMM);
+      return label_ref(label);
+   }
+
+   BytecodeBuilder& call(std::string const& label) {
+      op(vm::I_CALL_IMM);
+      return label_ref(label);
+   }
+
+   BytecodeBuilder& btrue(std::string const& label) {
+      op(vm::I_BTRUE_IMM);
+      return label_ref(label);
+   }
+
+   BytecodeBuilder& bfalse(std::string const& label) {
+      op(vm::I_BFALSE_IMM);
+      return label_ref(label);
+   }
+
+   BytecodeBuilder& label(std::string const& name) {
+      m_labels[name] = m_code.size();
+      return *this;
+   }
+
+   BytecodeBuilder& byte(int value) {
+      m_code.push_back(value & 0xff);
+      return *this;
+   }
+
+   /// @brief little endian, word_size bytes
+   BytecodeBuilder& word(int value) {
+      for(int i = 0; i < m_word_size; ++i) {
+         m_code.push_back((value >> (8 * i)) & 0xff);
+      }
+      return *this;
+   }
+
+   BytecodeBuilder& zeros(int count) {
+      m_code.insert(m_code.end(), count, 0);
+      return *this;
+   }
+
+   /// @brief everything emitted from here on is the initialised data
+   /// segment, like wrapping the rest of the module in `$data [ ]`
+   BytecodeBuilder& data() {
+      m_data_start = m_code.size();
+      return *this;
+   }
+
+   /// @brief `$bss name #count`
+   BytecodeBuilder& bss(std::string const& name, int count) {
+      m_bss_labels[name] = m_bss_size;
+      m_bss_size += count;
+      return *this;
+   }
+
+   /// @brief `<start> <bound> $for [ body ]`, same expansion as as2.py
+   template <typename F> BytecodeBuilder& for_loop(F body) {
+      auto start = generate_label("loop_start");
+      auto end = generate_label("end");
+      op(vm::I_RPUSH).op(vm::I_RPUSH);
+      label(start);
+      op(vm::I_RCOPY2).op(vm::I_GT).bfalse(end);
+      body(*this);
+      op(vm::I_RPOP).op(vm::I_INC).op(vm::I_RPUSH);
+      jump(start);
+      label(end);
+      op(vm::I_RPOP).op(vm::I_RPOP).op(vm::I_DROP).op(vm::I_DROP);
+      return *this;
+   }
+
+   /// @brief export a label, must be defined before build()
+   BytecodeBuilder& export_fn(std::string const& name) {
+      m_exports.push_back(name);
+      return *this;
+   }
+
+   /// @brief `$modid name`, adding name to the import table
+   BytecodeBuilder& push_module(std::string const& name) {
+      auto it = std::find(m_imports.begin(), m_imports.end(), name);
+      auto index = it - m_imports.begin();
+      if(it == m_imports.end()) {
+         m_imports.push_back(name);
+      }
+      op(vm::I_PUSH_MODULE);
+      return word(index);
+   }
+
+   std::vector<unsigned char> build() const {
+      auto code = m_code;
+      for(auto const& [location, label_name] : m_patchups) {
+         auto target = address_of(label_name);
+         for(int i = 0; i < m_word_size; ++i) {
+            code[location + i] = (target >> (8 * i)) & 0xff;
+         }
+      }
+
+      auto wide = m_word_size == 4;
+      auto segmented = m_data_start.has_value() || m_bss_size > 0;
+      auto versioned = !m_imports.empty() || wide || segmented;
+      std::vector<unsigned char> out;
+      auto push_word = [&](int value) {
+         for(int i = 0; i < m_word_size; ++i) {
+            out.push_back((value >> (8 * i)) & 0xff);
+         }
+      };
+      if(versioned) {
+         out.push_back(0);
+         out.push_back(
+            (segmented ? vm::BytecodeModule::HEADER_SEGMENTS
+                       : vm::BytecodeModule::HEADER_IMPORTS) |
+            (wide ? vm::BytecodeModule::HEADER_WIDE : 0)
+         );
+      }
+      if(segmented) {
+         int code_size = m_data_start.value_or(m_code.size());
+         push_word(code_size);
+         push_word(m_code.size() - code_size);
+         push_word(m_bss_size);
+      }
+      out.push_back(m_module_name.size());
+      out.insert(out.end(), m_module_name.begin(), m_module_name.end());
+      out.push_back(m_exports.size());
+      for(auto const& name : m_exports) {
+         out.push_back(name.size());
+         out.insert(out.end(), name.begin(), name.end());
+         push_word(address_of(name));
+      }
+      if(versioned) {
+         out.push_back(m_imports.size());
+         for(auto const& name : m_imports) {
+            out.push_back(name.size());
+            out.insert(out.end(), name.begin(), name.end());
+         }
+      }
+      out.insert(out.end(), code.begin(), code.end());
+      return out;
+   }
+
+   /// @brief address of a label within the module, BSS labels come after
+   /// everything emitted
+   int address_of(std::string const& name) const {
+      auto bss = m_bss_labels.find(name);
+      if(bss != m_bss_labels.end()) {
+         return m_code.size() + bss->second;
+      }
+      return m_labels.at(name);
+   }
+
+private:
+   std::string m_module_name;
+   int m_word_size;
+   std::vector<unsigned char> m_code;
+   std::map<std::string, int> m_labels;
+   std::map<int, std::string> m_patchups;
+   std::optional<std::size_t> m_data_start;
+   std::map<std::string, int> m_bss_labels;
+   int m_bss_size = 0;
+   std::vector<std::string> m_exports;
+   std::vector<std::string> m_imports;
+   int m_genlabel_counter = 0;
+
+   BytecodeBuilder& label_ref(std::string const& label) {
+      m_patchups[m_code.size()] = label;
+      return word(0);
+   }
+
+   std::string generate_label(std::string const& name) {
+      return "__generated_" + name + "_" + std::to_string(++m_genlabel_counter);
+   }
+};
@@ -0,0 +1,63 @@
+#include "BytecodeBuilder.hpp"
+#include "BytecodeModule.hpp"
+#include <gtest/gtest.h>
+
+TEST(DecodedCode, Load_DecodesReachableCode) {
+   BytecodeBuilder b("m");
+   b.label("var").word(0x1234);
+   b.label("entry").push(-2).jump("end").label("end").op(vm::I_RETURN);
+   b.export_fn("entry");
+
+   auto bytes = b.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   ASSERT_TRUE(mod.has_value());
+
+   auto slots = mod->decoded().slots();
+   auto entry = b.address_of("entry");
+   EXPECT_EQ(slots[entry].handler, vm::H_PUSH_IMM);
+   EXPECT_EQ(slots[entry].length, 3);
+   EXPECT_EQ(slots[entry].operand, -2);
+   EXPECT_EQ(slots[entry + 3].handler, vm::H_JUMP_IMM);
+   EXPECT_EQ(slots[entry + 3].operand, b.address_of("end"));
+   EXPECT_EQ(slots[b.address_of("end")].handler, vm::H_RETURN);
+
+   // data is never decoded, so stores to it don't need to invalidate
+   auto mask = mod->decoded().code_mask();
+   EXPECT_EQ(mask[b.address_of("var")], 0);
+   EXPECT_EQ(mask[b.address_of("var") + 1], 0);
+   EXPECT_EQ(slots[b.address_of("var")].handler, vm::H_DECODE);
+}
+
+TEST(DecodedCode, BranchOutsideCode_TargetsEofSlot) {
+   BytecodeBuilder b("m");
+   b.label("entry").op(vm::I_JUMP_IMM).word(0x7000);
+   b.export_fn("entry");
+
+   auto bytes = b.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   ASSERT_TRUE(mod.has_value());
+
+   auto code_size = static_cast<int>(mod->code().size());
+   auto slots = mod->decoded().slots();
+   EXPECT_EQ(slots[0].operand, code_size);
+   EXPECT_EQ(slots[code_size].handler, vm::H_EOF);
+}
+
+TEST(DecodedCode, Invalidate_ResetsOverlappingInstructions) {
+   BytecodeBuilder b("m");
+   b.label("entry").push(1).op(vm::I_DUP).op(vm::I_RETURN);
+   b.export_fn("entry");
+
+   auto bytes = b.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   ASSERT_TRUE(mod.has_value());
+
+   // hitting the immediate's MSB must throw away the push that owns it
+   mod->invalidate_decoded(2, 1);
+   auto slots = mod->decoded().slots();
+   EXPECT_EQ(slots[0].handler, vm::H_DECODE);
+   EXPECT_EQ(slots[3].handler, vm::H_DUP);
+
+   mod->decoded().decode_at(mod->code(), 0);
+   EXPECT_EQ(slots[0].handler, vm::H_PUSH_IMM);
+}
@@ -0,0 +1,150 @@
+#include "BytecodeBuilder.hpp"
+#include "FilesystemPlatform.hpp"
+#include "Machine.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+class FilesystemPlatformTest : public testing::Test {
+protected:
+   std::filesystem::path m_dir;
+
+   void SetUp() override {
+      auto test = testing::UnitTest::GetInstance()->current_test_info();
+      m_dir = std::filesystem::temp_directory_path() /
+         (std::string("vm_tests_fs_") + test->name());
+      std::filesystem::remove_all(m_dir);
+      std::filesystem::create_directories(m_dir / "a");
+      std::filesystem::create_directories(m_dir / "b");
+   }
+
+   void TearDown() override {
+      std::filesystem::remove_all(m_dir);
+   }
+
+   /// @brief module `name` with an export `f` returning value
+   void write_module(
+      std::filesystem::path const& path, std::string const& name, int value
+   ) {
+      BytecodeBuilder b(name);
+      b.label("f").push(value).op(vm::I_RETURN).export_fn("f");
+      auto bytes = b.build();
+      std::ofstream(path, std::ios::binary)
+         .write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+   }
+
+   /// @brief the value lib's `f` pushes
+   static int value_of(vm::BytecodeModule const& module) {
+      // push_imm, then the little endian immediate
+      return module.code()[1] | module.code()[2] << 8;
+   }
+};
+
+} // namespace
+
+TEST_F(FilesystemPlatformTest, SearchPaths_FirstMatchWins) {
+   write_module(m_dir / "b" / "lib.bin", "lib", 2);
+   vm::FilesystemPlatform platform({m_dir / "a", m_dir / "b"});
+
+   auto module = platform.get_module("lib");
+   ASSERT_TRUE(module.has_value());
+   EXPECT_EQ(value_of(*module), 2);
+
+   write_module(m_dir / "a" / "lib.bin", "lib", 1);
+   module = platform.get_module("lib");
+   ASSERT_TRUE(module.has_value());
+   EXPECT_EQ(value_of(*module), 1);
+   EXPECT_FALSE(platform.get_module("missing").has_value());
+}
+
+TEST_F(FilesystemPlatformTest, WrongModuleName_IsSkipped) {
+   write_module(m_dir / "a" / "lib.bin", "other", 1);
+   write_module(m_dir / "b" / "lib.bin", "lib", 2);
+   vm::FilesystemPlatform platform({m_dir / "a", m_dir / "b"});
+
+   auto module = platform.get_module("lib");
+   ASSERT_TRUE(module.has_value());
+   EXPECT_EQ(value_of(*module), 2);
+}
+
+TEST_F(FilesystemPlatformTest, SecondLoad_HitsCache) {
+   write_module(m_dir / "a" / "lib.bin", "lib", 1);
+   vm::FilesystemPlatform platform({m_dir / "a"});
+
+   auto first = platform.get_module("lib");
+   auto second = platform.get_module("lib");
+   ASSERT_TRUE(first.has_value() && second.has_value());
+   EXPECT_EQ(platform.stats().misses, 1);
+   EXPECT_EQ(platform.stats().hits, 1);
+
+   // each load is its own copy
+   first->code()[1] = 9;
+   EXPECT_EQ(value_of(*second), 1);
+   EXPECT_EQ(value_of(*platform.get_module("lib")), 1);
+}
+
+TEST_F(FilesystemPlatformTest, ChangedFile_IsReloaded) {
+   auto path = m_dir / "a" / "lib.bin";
+   write_module(path, "lib", 1);
+   vm::FilesystemPlatform platform({m_dir / "a"});
+   ASSERT_TRUE(platform.get_module("lib").has_value());
+
+   // same content, new modification time: still a hit
+   auto later =
+      std::filesystem::last_write_time(path) + std::chrono::seconds(1);
+   write_module(path, "lib", 1);
+   std::filesystem::last_write_time(path, later);
+   ASSERT_TRUE(platform.get_module("lib").has_value());
+   EXPECT_EQ(platform.stats().hits, 1);
+
+   write_module(path, "lib", 3);
+   std::filesystem::last_write_time(path, later + std::chrono::seconds(1));
+   auto module = platform.get_module("lib");
+   ASSERT_TRUE(module.has_value());
+   EXPECT_EQ(value_of(*module), 3);
+   EXPECT_EQ(platform.stats().misses, 2);
+}
+
+TEST_F(FilesystemPlatformTest, FullCache_EvictsLeastRecentlyUsed) {
+   write_module(m_dir / "a" / "x.bin", "x", 1);
+   write_module(m_dir / "a" / "y.bin", "y", 2);
+   write_module(m_dir / "a" / "z.bin", "z", 3);
+   vm::FilesystemPlatform platform({m_dir / "a"}, 2);
+
+   platform.get_module("x");
+   platform.get_module("y");
+   platform.get_module("x");
+   platform.get_module("z");
+   EXPECT_EQ(platform.cached_count(), 2);
+   EXPECT_EQ(platform.stats().evictions, 1);
+
+   platform.get_module("x");
+   EXPECT_EQ(platform.stats().hits, 2);
+   platform.get_module("y");
+   EXPECT_EQ(platform.stats().misses, 4);
+}
+
+TEST_F(FilesystemPlatformTest, Machine_LoadsImportsFromSearchPath) {
+   write_module(m_dir / "a" / "lib.bin", "lib", 42);
+   vm::FilesystemPlatform platform({m_dir / "a"});
+   vm::Machine machine(platform);
+
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push_module("lib")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   EXPECT_EQ(machine.execute("test", "entry"), std::nullopt);
+   ASSERT_EQ(machine.stack().item_count(), 1);
+   EXPECT_EQ(machine.stack().peek(), 42);
+}
@@ -0,0 +1,81 @@
+#include "InputLog.hpp"
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+
+TEST(InputLog, Press_IsDownInThatFrameOnly) {
+   vm::InputLog log;
+   log.press(2, 65);
+   log.press(2, 68);
+   log.press(2, 65);
+   log.press(4, 68);
+
+   EXPECT_EQ(log.frame_count(), 5);
+   EXPECT_TRUE(log.is_down(2, 65));
+   EXPECT_TRUE(log.is_down(2, 68));
+   EXPECT_FALSE(log.is_down(3, 65));
+   EXPECT_TRUE(log.is_down(4, 68));
+   EXPECT_FALSE(log.is_down(4, 65));
+   // past the end nothing is held
+   EXPECT_FALSE(log.is_down(5, 68));
+   EXPECT_FALSE(log.is_down(-1, 68));
+}
+
+TEST(InputLog, WriteRead_RoundTrips) {
+   vm::InputLog log;
+   for(int frame = 0; frame < 100; ++frame) {
+      if(frame >= 10 && frame < 40) {
+         log.press(frame, 87);
+      }
+      if(frame % 7 == 0) {
+         log.press(frame, 300 + frame);
+      }
+   }
+   log.press(120, 32);
+
+   std::stringstream stream;
+   log.write(stream);
+   auto read = vm::InputLog::read(stream);
+   ASSERT_TRUE(read.has_value());
+   ASSERT_EQ(read->frame_count(), log.frame_count());
+   for(int frame = 0; frame < log.frame_count(); ++frame) {
+      for(int key : {32, 87, 300 + frame}) {
+         EXPECT_EQ(read->is_down(frame, key), log.is_down(frame, key))
+            << frame << " " << key;
+      }
+   }
+}
+
+TEST(InputLog, Write_IdleFramesTakeAByte) {
+   vm::InputLog log;
+   log.press(1000, 87);
+   std::stringstream stream;
+   log.write(stream);
+   // header, a byte for each frame, and the one key going down
+   EXPECT_LT(stream.str().size(), 4 + 3 + 1001 + 3);
+}
+
+TEST(InputLog, Truncate_ForgetsLaterFrames) {
+   vm::InputLog log;
+   log.press(3, 65);
+   log.press(5, 65);
+   log.truncate(4);
+   EXPECT_EQ(log.frame_count(), 4);
+   EXPECT_TRUE(log.is_down(3, 65));
+   EXPECT_FALSE(log.is_down(5, 65));
+}
+
+TEST(InputLog, Corrupt_FailsToRead) {
+   vm::InputLog log;
+   log.press(3, 65);
+   std::stringstream stream;
+   log.write(stream);
+   auto bytes = stream.str();
+
+   std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+   EXPECT_EQ(vm::InputLog::read(truncated).error(), vm::Error::InvalidHeader);
+
+   bytes[0] = 'X';
+   std::stringstream bad_magic(bytes);
+   EXPECT_EQ(vm::InputLog::read(bad_magic).error(), vm::Error::InvalidHeader);
+}
@@ -0,0 +1,1217 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "TestPlatform.hpp"
+#include <gtest/gtest.h>
+#include <optional>
+#include <vector>
+
+namespace {
+
+/// @brief serves the library module of a test
+class LibraryPlatform final : public vm::IPlatform {
+public:
+   std::optional<vm::BytecodeModule> get_module(std::string_view name
+   ) override {
+      if(!library || name != library_name) {
+         return std::nullopt;
+      }
+      auto bytes = library->build();
+      auto mod = vm::BytecodeModule::load(bytes);
+      if(!mod.has_value()) {
+         return std::nullopt;
+      }
+      return std::move(*mod);
+   }
+
+   std::string_view library_name = "lib";
+   BytecodeBuilder const* library = nullptr;
+};
+
+/// @brief records every value passed to fn 0
+template <typename Word>
+class BasicRecordingSystem final : public vm::BasicSystemModule<Word> {
+public:
+   BasicRecordingSystem() : vm::BasicSystemModule<Word>("system") {}
+
+   void invoke_index(vm::BasicMachine<Word>& machine, int fn_id) override {
+      if(fn_id == 0) {
+         printed.push_back(machine.stack().pop());
+      }
+   }
+
+   std::optional<vm::StackEffect> stack_effect(int fn_id) const override {
+      if(fn_id == 0) {
+         return vm::StackEffect{1, 0};
+      }
+      return std::nullopt;
+   }
+
+   std::vector<Word> printed;
+};
+
+using RecordingSystem = BasicRecordingSystem<vm::StackWord>;
+
+struct RunResult {
+   std::optional<vm::Error> error;
+   std::vector<vm::StackWord> stack;
+   std::vector<unsigned char> memory;
+   std::vector<vm::StackWord> printed;
+};
+
+RunResult run(
+   vm::Engine engine, BytecodeBuilder const& builder, std::string_view fn_name,
+   BytecodeBuilder const* library = nullptr
+) {
+   LibraryPlatform platform;
+   platform.library = library;
+   RecordingSystem system;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(engine);
+   machine.add_system_module(&system);
+
+   auto bytes = builder.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   EXPECT_TRUE(mod.has_value());
+   machine.add_module(std::move(*mod));
+
+   RunResult result;
+   result.error = machine.execute("test", fn_name);
+   auto& stack = machine.stack();
+   for(int i = stack.item_count() - 1; i >= 0; --i) {
+      result.stack.push_back(stack.peek_n(i));
+   }
+   auto code = machine.module_by_index(0).code();
+   result.memory.assign(code.begin(), code.end());
+   result.printed = system.printed;
+   return result;
+}
+
+class MachineTest : public testing::TestWithParam<vm::Engine> {
+protected:
+   /// @brief run on the parameterized engine and check it agrees with the
+   /// reference switch interpreter
+   RunResult run_checked(
+      BytecodeBuilder const& builder, std::string_view fn_name = "entry",
+      BytecodeBuilder const* library = nullptr
+   ) {
+      auto result = run(GetParam(), builder, fn_name, library);
+      auto reference = run(vm::Engine::Switch, builder, fn_name, library);
+      EXPECT_EQ(result.error, reference.error);
+      EXPECT_EQ(result.stack, reference.stack);
+      EXPECT_EQ(result.memory, reference.memory);
+      EXPECT_EQ(result.printed, reference.printed);
+      return result;
+   }
+};
+
+} // namespace
+
+TEST_P(MachineTest, Arithmetic_LeavesResultOnStack) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(7)
+      .push(5)
+      .op(vm::I_SUB)
+      .push(3)
+      .op(vm::I_MUL)
+      .push(-4)
+      .op(vm::I_LT)
+      .push(100)
+      .push(7)
+      .op(vm::I_MOD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{0, 2}));
+}
+
+TEST_P(MachineTest, ForLoop_AccumulatesInMemory) {
+   BytecodeBuilder b("test");
+   b.label("sum").word(0);
+   b.label("entry")
+      .push(0)
+      .push(100)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY)
+            .push_addr("sum")
+            .op(vm::I_LOAD_WORD)
+            .op(vm::I_ADD)
+            .push_addr("sum")
+            .op(vm::I_STORE_WORD);
+      })
+      .push_addr("sum")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{4950}));
+}
+
+TEST_P(MachineTest, RecursiveCalls_ComputeFib) {
+   BytecodeBuilder b("test");
+   b.label("fib")
+      .op(vm::I_DUP)
+      .push(2)
+      .op(vm::I_LT)
+      .bfalse("recurse")
+      .op(vm::I_RETURN)
+      .label("recurse")
+      .op(vm::I_DUP)
+      .op(vm::I_DEC)
+      .call("fib")
+      .op(vm::I_SWAP)
+      .push(2)
+      .op(vm::I_SUB)
+      .call("fib")
+      .op(vm::I_ADD)
+      .op(vm::I_RETURN);
+   b.label("entry").push(15).call("fib").op(vm::I_RETURN).export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{610}));
+}
+
+TEST_P(MachineTest, SelfModifyingStore_ChangesExecutedImmediate) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(1234)
+      .push_addr("patched")
+      .op(vm::I_INC)
+      .op(vm::I_STORE_WORD)
+      .label("patched")
+      .push(1)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{1234}));
+}
+
+TEST_P(MachineTest, PatchingAlreadyExecutedCode_TakesEffect) {
+   // each iteration rewrites the immediate of the push it just executed
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(3)
+      .for_loop([](BytecodeBuilder& body) {
+         body.label("patched")
+            .push(10)
+            .op(vm::I_INC)
+            .push_addr("patched")
+            .op(vm::I_INC)
+            .op(vm::I_STORE_WORD);
+      })
+      .push_addr("patched")
+      .op(vm::I_INC)
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{13}));
+}
+
+TEST_P(MachineTest, ByteStores_WriteBuffer) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(64)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY)
+            .op(vm::I_RCOPY)
+            .push_addr("buf")
+            .op(vm::I_ADD)
+            .op(vm::I_STORE_BYTE);
+      })
+      .push_addr("buf")
+      .push(63)
+      .op(vm::I_ADD)
+      .op(vm::I_LOAD_BYTE)
+      .op(vm::I_RETURN)
+      .label("buf")
+      .zeros(64)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{63}));
+}
+
+TEST_P(MachineTest, Segments_DataAndBssVariables) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push_addr("counter")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .push_addr("buf")
+      .push(7)
+      .op(vm::I_ADD)
+      .op(vm::I_STORE_BYTE)
+      .push_addr("buf")
+      .push(7)
+      .op(vm::I_ADD)
+      .op(vm::I_LOAD_BYTE)
+      .push_addr("buf")
+      .op(vm::I_LOAD_BYTE)
+      .op(vm::I_RETURN)
+      .export_fn("entry")
+      .data()
+      .label("counter")
+      .word(41)
+      .bss("buf", 16);
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{42, 0}));
+   EXPECT_EQ(result.memory.size(), b.address_of("buf") + 16);
+}
+
+TEST_P(MachineTest, IncrementInPlace_UpdatesVariable) {
+   // `++!: dup @ inc swap !` and `--!` from smiletrail
+   BytecodeBuilder b("test");
+   b.label("var").word(0x00ff);
+   b.label("entry")
+      .push_addr("var")
+      .op(vm::I_DUP)
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .op(vm::I_SWAP)
+      .op(vm::I_STORE_WORD)
+      .push_addr("var")
+      .push_addr("var")
+      .op(vm::I_DUP)
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_DEC)
+      .op(vm::I_SWAP)
+      .op(vm::I_STORE_WORD)
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{0x00ff}));
+}
+
+TEST_P(MachineTest, JumpIntoFusedSequence_RunsTail) {
+   // `push_imm !` is fused, jumping to the `!` must only run the store
+   BytecodeBuilder b("test");
+   b.label("var").word(0);
+   b.label("entry")
+      .push(77)
+      .push_addr("var")
+      .jump("store")
+      .push_addr("var")
+      .label("store")
+      .op(vm::I_STORE_WORD)
+      .push_addr("var")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{77}));
+}
+
+TEST_P(MachineTest, ExternCall_InvokesSystemModule) {
+   BytecodeBuilder b("test");
+   b.label("system_name").byte('s').byte('y').byte('s');
+   b.byte('t').byte('e').byte('m').byte(0);
+   b.label("entry")
+      .push(42)
+      .push_addr("system_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.printed, (std::vector<vm::StackWord>{42}));
+}
+
+TEST_P(MachineTest, ExternCall_SystemModuleSeesWholeStack) {
+   BytecodeBuilder b("test");
+   b.label("system_name").byte('s').byte('y').byte('s');
+   b.byte('t').byte('e').byte('m').byte(0);
+   b.label("entry")
+      .push(7)
+      .push(42)
+      .push_addr("system_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_INC)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.printed, (std::vector<vm::StackWord>{42}));
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{8}));
+}
+
+TEST_P(MachineTest, RunningOffEnd_ReportsEof) {
+   BytecodeBuilder b("test");
+   b.label("entry").push(1).op(vm::I_DUP).export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, vm::Error::EofWithoutReturn);
+}
+
+TEST_P(MachineTest, StackOps_MatchReference) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(1)
+      .push(2)
+      .push(3)
+      .op(vm::I_ROT)
+      .op(vm::I_OVER)
+      .op(vm::I_SWAP)
+      .op(vm::I_DROP)
+      .push(2)
+      .op(vm::I_PICK)
+      .push(-7)
+      .push(2)
+      .op(vm::I_DIV)
+      .push(-7)
+      .push(2)
+      .op(vm::I_MOD)
+      .push(-32768)
+      .push(1)
+      .op(vm::I_SHR)
+      .push(0x4000)
+      .push(2)
+      .op(vm::I_SHL)
+      .push(32767)
+      .op(vm::I_INC)
+      .push(3)
+      .push(3)
+      .op(vm::I_GE)
+      .push(3)
+      .push(4)
+      .op(vm::I_LE)
+      .op(vm::I_EQ)
+      .push(5)
+      .push(5)
+      .op(vm::I_NEQ)
+      .op(vm::I_NOP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(
+      result.stack,
+      (std::vector<vm::StackWord>{2, 3, 3, 2, -3, -1, -16384, 0, -32768, -1, 0})
+   );
+}
+
+TEST_P(MachineTest, ReturnStackOps_RoundTrip) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(10)
+      .op(vm::I_RPUSH)
+      .push(20)
+      .op(vm::I_RPUSH)
+      .op(vm::I_RCOPY2)
+      .op(vm::I_RCOPY)
+      .op(vm::I_RPOP)
+      .op(vm::I_RPOP)
+      .op(vm::I_ADD)
+      .push(1)
+      .btrue("taken")
+      .push(99)
+      .label("taken")
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{10, 20, 20, 30}));
+}
+
+TEST_P(MachineTest, SelfModifyingLoop_KeepsPatching) {
+   // enough rewrites of already-run code to exhaust the JIT's recompiles
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(40)
+      .for_loop([](BytecodeBuilder& body) {
+         body.label("patched")
+            .push(0)
+            .op(vm::I_INC)
+            .push_addr("patched")
+            .op(vm::I_INC)
+            .op(vm::I_STORE_WORD);
+      })
+      .push_addr("patched")
+      .op(vm::I_INC)
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{40}));
+}
+
+TEST_P(MachineTest, RepeatedExecute_ReusesCompiledCode) {
+   BytecodeBuilder b("test");
+   b.label("count").word(0);
+   b.label("square").op(vm::I_DUP).op(vm::I_MUL).op(vm::I_RETURN);
+   b.label("entry")
+      .push_addr("count")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .op(vm::I_DUP)
+      .push_addr("count")
+      .op(vm::I_STORE_WORD)
+      .call("square")
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto reference = run(vm::Engine::Switch, b, "entry");
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(GetParam());
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   for(int i = 0; i < 5; ++i) {
+      ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   }
+   EXPECT_EQ(machine.stack().item_count(), 5);
+   EXPECT_EQ(machine.stack().peek(), 25);
+   EXPECT_EQ(reference.stack, (std::vector<vm::StackWord>{1}));
+}
+
+TEST_P(MachineTest, ExternCall_CallsAndReturnsAcrossModules) {
+   BytecodeBuilder lib("lib");
+   lib.label("square").op(vm::I_DUP).op(vm::I_MUL).op(vm::I_RETURN);
+   // calls back in to the caller's module twice
+   lib.label("bump_twice")
+      .push_addr("test_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(1)
+      .op(vm::I_EXTERN_CALL)
+      .push_addr("test_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(1)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN);
+   lib.label("test_name").byte('t').byte('e').byte('s').byte('t').byte(0);
+   lib.export_fn("square").export_fn("bump_twice");
+
+   BytecodeBuilder b("test");
+   b.label("count").word(0);
+   b.label("lib_name").byte('l').byte('i').byte('b').byte(0);
+   b.label("entry")
+      .push(0)
+      .push(10)
+      .for_loop([](BytecodeBuilder& body) {
+         // same call site every iteration
+         body.op(vm::I_RCOPY)
+            .push_addr("lib_name")
+            .op(vm::I_LOAD_MODULE)
+            .push(0)
+            .op(vm::I_EXTERN_CALL);
+      })
+      .push_addr("lib_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(1)
+      .op(vm::I_EXTERN_CALL)
+      .push_addr("count")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_RETURN);
+   b.label("bump")
+      .push_addr("count")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .push_addr("count")
+      .op(vm::I_STORE_WORD)
+      .op(vm::I_RETURN);
+   b.export_fn("entry").export_fn("bump");
+
+   auto result = run_checked(b, "entry", &lib);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(
+      result.stack,
+      (std::vector<vm::StackWord>{0, 1, 4, 9, 16, 25, 36, 49, 64, 81, 2})
+   );
+}
+
+TEST_P(MachineTest, ExternCall_MissingExportFails) {
+   BytecodeBuilder lib("lib");
+   lib.label("fn").op(vm::I_RETURN).export_fn("fn");
+
+   BytecodeBuilder b("test");
+   b.label("lib_name").byte('l').byte('i').byte('b').byte(0);
+   b.label("entry")
+      .push_addr("lib_name")
+      .op(vm::I_LOAD_MODULE)
+      .push(3)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b, "entry", &lib);
+   EXPECT_EQ(result.error, vm::Error::EntryNotFound);
+}
+
+TEST_P(MachineTest, PushModule_CallsImportedModules) {
+   BytecodeBuilder lib("lib");
+   lib.label("square").op(vm::I_DUP).op(vm::I_MUL).op(vm::I_RETURN);
+   lib.export_fn("square");
+
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(4)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY)
+            .push_module("lib")
+            .push(0)
+            .op(vm::I_EXTERN_CALL)
+            .push_module("system")
+            .push(0)
+            .op(vm::I_EXTERN_CALL);
+      })
+      .push_module("lib")
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b, "entry", &lib);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.printed, (std::vector<vm::StackWord>{0, 1, 4, 9}));
+   // lib was loaded while adding test
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{1}));
+}
+
+TEST_P(MachineTest, PushModule_MissingImportFails) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(1)
+      .push_module("missing")
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, vm::Error::ModuleNotFound);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord>{1}));
+}
+
+TEST_P(MachineTest, PushModule_LinksSystemModulesAddedLater) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(7)
+      .push_module("system")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   RecordingSystem system;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(GetParam());
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   EXPECT_EQ(machine.module_by_index(0).import_id(0), -1);
+
+   machine.add_system_module(&system);
+   EXPECT_EQ(machine.module_by_index(0).import_id(0), 0x4000);
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   EXPECT_EQ(system.printed, (std::vector<vm::StackWord>{7}));
+}
+
+TEST_P(MachineTest, FunctionHandle_ExecutesRepeatedly) {
+   BytecodeBuilder b("test");
+   b.label("entry").push(1).op(vm::I_RETURN).export_fn("entry");
+   b.label("twice").push(2).op(vm::I_RETURN).export_fn("twice");
+
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(GetParam());
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   auto twice = machine.resolve("test", "twice");
+   ASSERT_TRUE(twice.has_value());
+   EXPECT_EQ(&twice->module(), &machine.module_by_index(0));
+   for(int i = 0; i < 3; ++i) {
+      ASSERT_EQ(machine.execute(*twice), std::nullopt);
+   }
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   EXPECT_EQ(machine.stack().item_count(), 4);
+   EXPECT_EQ(machine.stack().peek(), 1);
+   EXPECT_EQ(machine.stack().peek_n(1), 2);
+}
+
+TEST_P(MachineTest, CheckedMode_CatchesStackUnderflow) {
+   // verifies, but the stack doesn't hold the two inputs it needs
+   BytecodeBuilder b("test");
+   b.label("entry").op(vm::I_ADD).op(vm::I_RETURN).export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, vm::Error::StackUnderflow);
+}
+
+TEST_P(MachineTest, CheckedMode_CatchesRunawayLoop) {
+   BytecodeBuilder b("test");
+   b.label("entry").push(1).jump("entry").export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, vm::Error::StackOverflow);
+   EXPECT_EQ(result.stack.size(), 0x100);
+}
+
+TEST_P(MachineTest, CheckedMode_CatchesAddressOutOfRange) {
+   // any export failing verification puts the whole module in checked mode
+   BytecodeBuilder b("test");
+   b.label("entry").push(-4).op(vm::I_LOAD_WORD).op(vm::I_RETURN);
+   b.label("unbalanced").push(1).jump("unbalanced");
+   b.export_fn("entry").export_fn("unbalanced");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, vm::Error::AddressOutOfRange);
+}
+
+TEST_P(MachineTest, VerifiedMode_CatchesAddressOutOfRange) {
+   // verification doesn't bound addresses, so each engine checks them
+   for(auto op :
+       {vm::I_LOAD_WORD, vm::I_STORE_WORD, vm::I_LOAD_BYTE, vm::I_STORE_BYTE}) {
+      for(auto address : {-2, 30000}) {
+         // as an immediate, which fuses, and computed at runtime
+         for(bool computed : {false, true}) {
+            BytecodeBuilder b("test");
+            b.label("entry").push(0x4141).push(address);
+            if(computed) {
+               b.op(vm::I_INC).op(vm::I_DEC);
+            }
+            b.op(op).op(vm::I_RETURN).export_fn("entry");
+
+            auto result = run_checked(b);
+            EXPECT_EQ(result.error, vm::Error::AddressOutOfRange)
+               << vm::instruction_name(op) << " " << address;
+         }
+      }
+   }
+}
+
+/// @brief `next` bumps a counter in the data segment and leaves it on the
+/// stack, `value` returns the immediate at `imm` and `patch` overwrites it
+static BytecodeBuilder snapshot_module() {
+   BytecodeBuilder b("test");
+   b.label("next")
+      .push_addr("counter")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .op(vm::I_DUP)
+      .push_addr("counter")
+      .op(vm::I_STORE_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("next");
+   b.label("value").label("imm").push(5).op(vm::I_RETURN).export_fn("value");
+   b.label("patch")
+      .push(9)
+      .push_addr("imm")
+      .push(1)
+      .op(vm::I_ADD)
+      .op(vm::I_STORE_BYTE)
+      .op(vm::I_RETURN)
+      .export_fn("patch");
+   b.data().label("counter").word(0).bss("scratch", 4096);
+   return b;
+}
+
+TEST_P(MachineTest, Snapshot_RestoresStacksAndMemory) {
+   auto bytes = snapshot_module().build();
+   NullPlatform platform;
+   vm::Machine machine(platform);
+   machine.set_engine(GetParam());
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   auto snapshot = machine.save();
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   ASSERT_EQ(machine.stack().item_count(), 3);
+
+   EXPECT_TRUE(machine.restore(snapshot));
+   ASSERT_EQ(machine.stack().item_count(), 1);
+   EXPECT_EQ(machine.stack().peek(), 1);
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   EXPECT_EQ(machine.stack().peek(), 2);
+
+   // restoring again starts over from the same state
+   EXPECT_TRUE(machine.restore(snapshot));
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   EXPECT_EQ(machine.stack().peek(), 2);
+}
+
+TEST_P(MachineTest, Snapshot_SharesUnchangedPagesWithBase) {
+   auto bytes = snapshot_module().build();
+   NullPlatform platform;
+   vm::Machine machine(platform);
+   machine.set_engine(GetParam());
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   auto first = machine.save();
+   EXPECT_EQ(first.memory_bytes(), machine.module_by_index(0).code().size());
+   EXPECT_GE(first.new_bytes(), first.memory_bytes());
+
+   auto unchanged = machine.save(&first);
+   EXPECT_EQ(unchanged.new_bytes(), 0);
+
+   EXPECT_EQ(machine.execute("test", "next"), std::nullopt);
+   auto second = machine.save(&first);
+   EXPECT_EQ(second.new_bytes(), vm::Machine::Snapshot::PAGE_SIZE);
+
+   EXPECT_TRUE(machine.restore(first));
+   EXPECT_EQ(machine.stack().item_count(), 0);
+   EXPECT_TRUE(machine.restore(second));
+   EXPECT_EQ(machine.stack().peek(), 1);
+}
+
+TEST_P(MachineTest, Snapshot_RestoreInvalidatesRewrittenCode) {
+   auto bytes = snapshot_module().build();
+   NullPlatform platform;
+   vm::Machine machine(platform);
+   machine.set_engine(GetParam());
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   EXPECT_EQ(machine.execute("test", "value"), std::nullopt);
+   EXPECT_EQ(machine.stack().pop(), 5);
+   auto snapshot = machine.save();
+
+   EXPECT_EQ(machine.execute("test", "patch"), std::nullopt);
+   EXPECT_EQ(machine.execute("test", "value"), std::nullopt);
+   EXPECT_EQ(machine.stack().pop(), 9);
+
+   EXPECT_TRUE(machine.restore(snapshot));
+   EXPECT_EQ(machine.execute("test", "value"), std::nullopt);
+   EXPECT_EQ(machine.stack().pop(), 5);
+}
+
+TEST(Snapshot, DifferentModules_RestoresNothing) {
+   auto bytes = snapshot_module().build();
+   NullPlatform platform;
+   vm::Machine empty(platform);
+   vm::Machine machine(platform);
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   auto snapshot = machine.save();
+   EXPECT_FALSE(empty.restore(snapshot));
+
+   BytecodeBuilder other("other");
+   other.label("entry").op(vm::I_RETURN).export_fn("entry");
+   auto other_bytes = other.build();
+   vm::Machine different(platform);
+   different.add_module(*vm::BytecodeModule::load(other_bytes));
+   EXPECT_FALSE(different.restore(snapshot));
+}
+
+static std::string engine_name(vm::Engine engine) {
+   switch(engine) {
+   case vm::Engine::Switch:
+      return "Switch";
+   case vm::Engine::Threaded:
+      return "Threaded";
+   case vm::Engine::Jit:
+      return "Jit";
+   }
+   return "Unknown";
+}
+
+INSTANTIATE_TEST_SUITE_P(
+   Engines, MachineTest,
+   testing::Values(
+      vm::Engine::Switch, vm::Engine::Threaded
+#if MACHINE_HAS_JIT
+      ,
+      vm::Engine::Jit
+#endif
+   ),
+   [](auto const& info) { return engine_name(info.param); }
+);
+
+#if MACHINE_HAS_THREADED_ENGINE
+TEST(MachineFusion, ForLoop_CountsSuperinstructions) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(10)
+      .for_loop([](BytecodeBuilder&) {})
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(vm::Engine::Threaded);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+
+   auto counts = machine.fusion_counts();
+   EXPECT_EQ(counts[vm::H_FOR_TEST - vm::H_FUSED_BEGIN], 11);
+   EXPECT_EQ(counts[vm::H_FOR_NEXT - vm::H_FUSED_BEGIN], 10);
+   EXPECT_EQ(
+      vm::fused_name(vm::H_FOR_TEST - vm::H_FUSED_BEGIN),
+      "rcopy2 > bfalse_imm"
+   );
+}
+#endif
+
+#if MACHINE_HAS_THREADED_ENGINE
+TEST(MachineVerify, SelfModifyingStore_FinishesCallChecked) {
+   // the store rewrites verified code, so the rest of the call runs on the
+   // checked interpreter instead of the threaded engine's fused loop
+   BytecodeBuilder b("test");
+   b.label("patched_once").word(0);
+   b.label("entry")
+      .push_addr("patched_once")
+      .op(vm::I_LOAD_WORD)
+      .btrue("patched")
+      .push(1)
+      .push_addr("patched_once")
+      .op(vm::I_STORE_WORD)
+      .push(1234)
+      .push_addr("patched")
+      .op(vm::I_INC)
+      .op(vm::I_STORE_WORD)
+      .label("patched")
+      .push(1)
+      .push(0)
+      .push(10)
+      .for_loop([](BytecodeBuilder&) {})
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(vm::Engine::Threaded);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   EXPECT_EQ(machine.verify_module(0), std::nullopt);
+
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   EXPECT_EQ(machine.stack().peek(), 1234);
+   EXPECT_EQ(machine.fusion_counts()[vm::H_FOR_TEST - vm::H_FUSED_BEGIN], 0);
+
+   // verified again on the next call, which doesn't patch and runs threaded
+   machine.stack().pop();
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   EXPECT_EQ(machine.fusion_counts()[vm::H_FOR_TEST - vm::H_FUSED_BEGIN], 11);
+}
+
+TEST(MachineVerify, SystemModuleCodeWrite_FinishesCallChecked) {
+   // writes 1234 over the word at the address it's given
+   class PatchingSystem final : public vm::ISystemModule {
+   public:
+      PatchingSystem() : vm::ISystemModule("system") {}
+
+      void invoke_index(vm::Machine& machine, int) override {
+         auto address = machine.stack().pop();
+         auto code = machine.current_module().code();
+         code[address] = 1234 & 0xff;
+         code[address + 1] = 1234 >> 8;
+         machine.code_changed(address, 2);
+      }
+
+      std::optional<vm::StackEffect> stack_effect(int) const override {
+         return vm::StackEffect{1, 0};
+      }
+   };
+
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push_addr("patched")
+      .op(vm::I_INC)
+      .push_module("system")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .label("patched")
+      .push(1)
+      .push(0)
+      .push(10)
+      .for_loop([](BytecodeBuilder&) {})
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   PatchingSystem system;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(vm::Engine::Threaded);
+   machine.add_system_module(&system);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   EXPECT_EQ(machine.verify_module(0), std::nullopt);
+
+   ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+   EXPECT_EQ(machine.stack().peek(), 1234);
+   EXPECT_EQ(machine.fusion_counts()[vm::H_FOR_TEST - vm::H_FUSED_BEGIN], 0);
+}
+#endif
+
+TEST(MachineVerify, UndeclaredSystemCall_RejectsModule) {
+   class OpaqueSystem final : public vm::ISystemModule {
+   public:
+      OpaqueSystem() : vm::ISystemModule("system") {}
+
+      void invoke_index(vm::Machine&, int) override {}
+   };
+
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push_module("system")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   OpaqueSystem system;
+   auto machine = vm::Machine(platform);
+   machine.add_system_module(&system);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   auto error = machine.verify_module(0);
+   ASSERT_TRUE(error.has_value());
+   EXPECT_EQ(error->reason, "extern_call with unknown stack effect");
+   EXPECT_EQ(machine.execute("test", "entry"), std::nullopt);
+}
+
+TEST(MachineCount, ExecuteCounted_CountsEveryInstruction) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(3)
+      .for_loop([](BytecodeBuilder& body) { body.op(vm::I_NOP); })
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   auto fn = machine.resolve("test", "entry");
+   ASSERT_TRUE(fn.has_value());
+
+   // 2 pushes, 2 rpush, 4 bound checks of 3, 3 bodies of 5, 4 to clean up
+   // and the return
+   auto count = machine.execute_counted(*fn);
+   ASSERT_TRUE(count.has_value());
+   EXPECT_EQ(*count, 2 + 2 + 4 * 3 + 3 * 5 + 4 + 1);
+   EXPECT_EQ(machine.stack().item_count(), 0);
+}
+
+TEST(MachineResolve, MissingNames_ReturnErrors) {
+   BytecodeBuilder b("test");
+   b.label("entry").op(vm::I_RETURN).export_fn("entry");
+
+   NullPlatform platform;
+   RecordingSystem system;
+   auto machine = vm::Machine(platform);
+   machine.add_system_module(&system);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   EXPECT_EQ(
+      machine.resolve("nope", "entry").error(), vm::Error::ModuleNotFound
+   );
+   EXPECT_EQ(
+      machine.resolve("test", "nope").error(), vm::Error::EntryNotFound
+   );
+   // system modules have no exports to resolve
+   EXPECT_EQ(
+      machine.resolve("system", "entry").error(), vm::Error::ModuleNotFound
+   );
+   EXPECT_EQ(machine.execute(vm::FunctionHandle()), vm::Error::EntryNotFound);
+}
+
+TEST(MachineResolve, ModuleNames_SystemModulesTakePrecedence) {
+   BytecodeBuilder b("system");
+   b.label("entry").op(vm::I_RETURN).export_fn("entry");
+
+   NullPlatform platform;
+   RecordingSystem system;
+   auto machine = vm::Machine(platform);
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   EXPECT_EQ(machine.module_index_by_name("system"), 0);
+
+   machine.add_system_module(&system);
+   EXPECT_NE(machine.module_index_by_name("system"), 0);
+   EXPECT_EQ(machine.module_index_by_name("other"), -1);
+}
+
+#if MACHINE_WIDE
+namespace {
+
+struct WideRunResult {
+   std::optional<vm::Error> error;
+   std::vector<vm::StackWord32> stack;
+   std::vector<unsigned char> memory;
+   std::vector<vm::StackWord32> printed;
+};
+
+WideRunResult run_wide(
+   vm::Engine engine, BytecodeBuilder const& builder,
+   BytecodeBuilder const* library = nullptr
+) {
+   LibraryPlatform platform;
+   platform.library = library;
+   BasicRecordingSystem<vm::StackWord32> system;
+   auto machine = vm::Machine32(platform);
+   machine.set_engine(engine);
+   machine.add_system_module(&system);
+
+   auto bytes = builder.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   EXPECT_TRUE(mod.has_value());
+   EXPECT_EQ(machine.add_module(std::move(*mod)), 0);
+
+   WideRunResult result;
+   result.error = machine.execute("test", "entry");
+   auto& stack = machine.stack();
+   for(int i = stack.item_count() - 1; i >= 0; --i) {
+      result.stack.push_back(stack.peek_n(i));
+   }
+   auto code = machine.module_by_index(0).code();
+   result.memory.assign(code.begin(), code.end());
+   result.printed = system.printed;
+   return result;
+}
+
+class WideMachineTest : public testing::TestWithParam<vm::Engine> {
+protected:
+   WideRunResult run_checked(
+      BytecodeBuilder const& builder, BytecodeBuilder const* library = nullptr
+   ) {
+      auto result = run_wide(GetParam(), builder, library);
+      auto reference = run_wide(vm::Engine::Switch, builder, library);
+      EXPECT_EQ(result.error, reference.error);
+      EXPECT_EQ(result.stack, reference.stack);
+      EXPECT_EQ(result.memory, reference.memory);
+      EXPECT_EQ(result.printed, reference.printed);
+      return result;
+   }
+};
+
+} // namespace
+
+TEST_P(WideMachineTest, Arithmetic_UsesWholeWords) {
+   BytecodeBuilder b("test", 4);
+   b.label("var").word(0);
+   b.label("entry")
+      .push(100000)
+      .push(70000)
+      .op(vm::I_ADD)
+      .push_addr("var")
+      .op(vm::I_STORE_WORD)
+      .push_addr("var")
+      .op(vm::I_LOAD_WORD)
+      .push(-2)
+      .op(vm::I_MUL)
+      .push_addr("var")
+      .op(vm::I_LOAD_BYTE)
+      .push(40000)
+      .push(40000)
+      .op(vm::I_GT)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(
+      result.stack, (std::vector<vm::StackWord32>{-340000, 170000 & 0xff, 0})
+   );
+   EXPECT_EQ(result.memory[3], 170000 >> 24);
+   EXPECT_EQ(result.memory[2], (170000 >> 16) & 0xff);
+}
+
+TEST_P(WideMachineTest, LargeModule_CallsPast64K) {
+   BytecodeBuilder b("test", 4);
+   b.label("entry")
+      .call("far")
+      .push_module("system")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   b.zeros(0x10000);
+   b.label("far").push(0x12345).op(vm::I_RETURN);
+   ASSERT_GT(b.address_of("far"), 0xffff);
+
+   auto result = run_checked(b);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.printed, (std::vector<vm::StackWord32>{0x12345}));
+}
+
+TEST_P(WideMachineTest, ExternCall_ReturnsToPcPast64K) {
+   BytecodeBuilder lib("lib", 4);
+   lib.zeros(0x10000);
+   lib.label("f").push(1).op(vm::I_RETURN).export_fn("f");
+
+   BytecodeBuilder b("test", 4);
+   b.label("entry").jump("far").export_fn("entry");
+   b.zeros(0x10000);
+   b.label("far")
+      .push_module("lib")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_INC)
+      .op(vm::I_RETURN);
+
+   auto result = run_checked(b, &lib);
+   EXPECT_EQ(result.error, std::nullopt);
+   EXPECT_EQ(result.stack, (std::vector<vm::StackWord32>{2}));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+   Engines, WideMachineTest,
+   testing::Values(vm::Engine::Switch, vm::Engine::Threaded),
+   [](auto const& info) { return engine_name(info.param); }
+);
+
+TEST(WideMachine, WordSizeMismatch_RejectsModule) {
+   BytecodeBuilder narrow("narrow");
+   narrow.label("entry").op(vm::I_RETURN).export_fn("entry");
+   BytecodeBuilder wide("wide", 4);
+   wide.label("entry").op(vm::I_RETURN).export_fn("entry");
+   auto narrow_bytes = narrow.build();
+   auto wide_bytes = wide.build();
+
+   NullPlatform platform;
+   vm::Machine machine(platform);
+   vm::Machine32 machine32(platform);
+   EXPECT_EQ(machine.add_module(*vm::BytecodeModule::load(wide_bytes)), -1);
+   EXPECT_EQ(
+      machine32.add_module(*vm::BytecodeModule::load(narrow_bytes)), -1
+   );
+   EXPECT_EQ(machine32.add_module(*vm::BytecodeModule::load(wide_bytes)), 0);
+   EXPECT_EQ(machine32.execute("narrow", "entry"), vm::Error::ModuleNotFound);
+   EXPECT_EQ(machine32.execute("wide", "entry"), std::nullopt);
+}
+
+TEST(WideMachine, DefaultEngine_FollowsThreadedDispatch) {
+   // Machine32 has no JIT, whether or not it's built
+#if MACHINE_HAS_THREADED_ENGINE && VM_THREADED_DISPATCH
+   EXPECT_EQ(vm::Machine32::DEFAULT_ENGINE, vm::Engine::Threaded);
+#else
+   EXPECT_EQ(vm::Machine32::DEFAULT_ENGINE, vm::Engine::Switch);
+#endif
+   NullPlatform platform;
+   EXPECT_EQ(vm::Machine32(platform).engine(), vm::Machine32::DEFAULT_ENGINE);
+}
+#endif
@@ -0,0 +1,114 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "ModuleArchive.hpp"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+using namespace std::string_view_literals;
+
+namespace {
+
+/// @brief module `name` with an export `f` returning value
+std::vector<unsigned char> module_bytes(std::string const& name, int value) {
+   BytecodeBuilder b(name);
+   b.label("f").push(value).op(vm::I_RETURN).export_fn("f");
+   return b.build();
+}
+
+std::vector<unsigned char> archive_of(std::vector<std::string> const& names) {
+   std::vector<std::vector<unsigned char>> modules;
+   for(int i = 0; i < names.size(); ++i) {
+      modules.push_back(module_bytes(names[i], i));
+   }
+   return vm::ModuleArchive::build(modules).value();
+}
+
+} // namespace
+
+TEST(ModuleArchive, Build_SortsIndexByName) {
+   auto image = archive_of({"zeta", "alpha", "mid"});
+   auto archive = vm::ModuleArchive::open(image);
+   ASSERT_TRUE(archive.has_value());
+   ASSERT_EQ(archive->size(), 3);
+   EXPECT_EQ(archive->name(0), "alpha"sv);
+   EXPECT_EQ(archive->name(1), "mid"sv);
+   EXPECT_EQ(archive->name(2), "zeta"sv);
+}
+
+TEST(ModuleArchive, Find_ReturnsModuleInPlace) {
+   auto image = archive_of({"c", "a", "b", "d"});
+   auto archive = vm::ModuleArchive::open(image);
+   ASSERT_TRUE(archive.has_value());
+
+   for(auto name : {"a"sv, "b"sv, "c"sv, "d"sv}) {
+      auto bytes = archive->find(name);
+      ASSERT_TRUE(bytes.has_value()) << name;
+      EXPECT_GE(bytes->data(), image.data());
+      EXPECT_LT(bytes->data(), image.data() + image.size());
+      auto module = vm::BytecodeModule::load(*bytes);
+      ASSERT_TRUE(module.has_value());
+      EXPECT_EQ(module->name(), name);
+   }
+   EXPECT_FALSE(archive->find("").has_value());
+   EXPECT_FALSE(archive->find("bb").has_value());
+   EXPECT_FALSE(archive->find("e").has_value());
+}
+
+TEST(ModuleArchive, DuplicateNames_FailToBuild) {
+   std::vector<std::vector<unsigned char>> modules = {
+      module_bytes("a", 1), module_bytes("a", 2)
+   };
+   auto archive = vm::ModuleArchive::build(modules);
+   EXPECT_FALSE(archive.has_value());
+}
+
+TEST(ModuleArchive, CorruptIndex_FailsToOpen) {
+   auto image = archive_of({"a", "b"});
+   // second module's size runs off the end
+   image[vm::ModuleArchive::HEADER_SIZE + 12 + 8] = 0xff;
+   EXPECT_EQ(vm::ModuleArchive::open(image).error(), vm::Error::InvalidHeader);
+
+   image = archive_of({"a", "b"});
+   image[0] = 'X';
+   EXPECT_EQ(vm::ModuleArchive::open(image).error(), vm::Error::InvalidHeader);
+
+   image.resize(4);
+   EXPECT_EQ(vm::ModuleArchive::open(image).error(), vm::Error::InvalidHeader);
+}
+
+TEST(ModuleArchive, UnsortedIndex_FailsToOpen) {
+   auto image = archive_of({"a", "b"});
+   // swap the two index entries
+   auto first = image.begin() + vm::ModuleArchive::HEADER_SIZE;
+   std::swap_ranges(first, first + 12, first + 12);
+   EXPECT_EQ(vm::ModuleArchive::open(image).error(), vm::Error::InvalidHeader);
+}
+
+TEST(ModuleArchive, ArchivePlatform_ServesImports) {
+   std::vector<std::vector<unsigned char>> modules = {
+      module_bytes("lib", 42), module_bytes("other", 7)
+   };
+   auto image = vm::ModuleArchive::build(modules).value();
+   vm::ArchivePlatform platform(vm::ModuleArchive::open(image).value());
+   vm::Machine machine(platform);
+
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push_module("lib")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .push_module("other")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_ADD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   auto bytes = b.build();
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+
+   EXPECT_EQ(machine.execute("test", "entry"), std::nullopt);
+   ASSERT_EQ(machine.stack().item_count(), 1);
+   EXPECT_EQ(machine.stack().peek(), 49);
+   EXPECT_FALSE(platform.get_module("missing").has_value());
+}
@@ -0,0 +1,119 @@
+#include "Instruction.hpp"
+#include "OpcodeMiner.hpp"
+#include "TraceRing.hpp"
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+vm::TraceRecord at(int pc, unsigned char opcode, int module = 0) {
+   return vm::TraceRecord{
+      static_cast<std::uint16_t>(pc), opcode,
+      static_cast<std::uint8_t>(module)
+   };
+}
+
+/// @brief f at 0x10 calls g at 0x40, then returns from 0x20 if its bfalse
+/// is taken or from 0x1b if not
+std::vector<vm::TraceRecord> call_f(bool taken) {
+   std::vector<vm::TraceRecord> records = {
+      at(0x10, vm::I_PUSH_IMM), at(0x13, vm::I_DUP), at(0x14, vm::I_ADD),
+      at(0x15, vm::I_CALL_IMM), at(0x40, vm::I_INC), at(0x41, vm::I_RETURN),
+      at(0x18, vm::I_BFALSE_IMM),
+   };
+   records.push_back(at(taken ? 0x20 : 0x1b, vm::I_RETURN));
+   return records;
+}
+
+std::uint64_t count_of(
+   vm::OpcodeMiner::FunctionStats const& fn, std::string const& name
+) {
+   for(auto [gram, count] : fn.grams) {
+      if(vm::OpcodeMiner::gram_name(gram) == name) {
+         return count;
+      }
+   }
+   return 0;
+}
+
+} // namespace
+
+TEST(OpcodeMiner, Grams_OnlyCountFallThroughRuns) {
+   vm::OpcodeMiner miner;
+   miner.add(call_f(true));
+   miner.end_call();
+
+   auto const& f = miner.functions().at(0x10);
+   EXPECT_EQ(f.grams.size(), 5);
+   EXPECT_EQ(count_of(f, "push_imm dup"), 1);
+   EXPECT_EQ(count_of(f, "dup +"), 1);
+   EXPECT_EQ(count_of(f, "+ call_imm"), 1);
+   EXPECT_EQ(count_of(f, "push_imm dup +"), 1);
+   EXPECT_EQ(count_of(f, "dup + call_imm"), 1);
+   // the return lands mid-function and the branch is taken
+   EXPECT_EQ(count_of(f, "bfalse_imm return"), 0);
+
+   auto const& g = miner.functions().at(0x40);
+   EXPECT_EQ(g.grams.size(), 1);
+   EXPECT_EQ(count_of(g, "inc return"), 1);
+}
+
+TEST(OpcodeMiner, Calls_AttributeInstructionsToCallee) {
+   vm::OpcodeMiner miner;
+   // split mid-call, as when draining a ring
+   auto records = call_f(true);
+   miner.add(std::span(records).first(5));
+   miner.add(std::span(records).subspan(5));
+   miner.end_call();
+   miner.add(call_f(false));
+   miner.end_call();
+
+   EXPECT_EQ(miner.instructions(), 16);
+   ASSERT_EQ(miner.functions().size(), 2);
+   EXPECT_EQ(miner.functions().at(0x10).instructions, 12);
+   EXPECT_EQ(miner.functions().at(0x40).instructions, 4);
+}
+
+TEST(OpcodeMiner, Branches_CountTakenAndNotTaken) {
+   vm::OpcodeMiner miner;
+   for(auto taken : {true, false, true, true}) {
+      miner.add(call_f(taken));
+      miner.end_call();
+   }
+
+   auto const& branches = miner.functions().at(0x10).branches;
+   ASSERT_EQ(branches.size(), 1);
+   EXPECT_EQ(branches.at(0x18).taken, 3);
+   EXPECT_EQ(branches.at(0x18).not_taken, 1);
+}
+
+TEST(OpcodeMiner, Ranked_ByDispatchesSaved) {
+   vm::OpcodeMiner miner;
+   for(int i = 0; i < 2; ++i) {
+      miner.add(call_f(true));
+      miner.end_call();
+   }
+
+   auto ranked = miner.ranked();
+   ASSERT_EQ(ranked.size(), 6);
+   for(int i = 0; i < 2; ++i) {
+      EXPECT_EQ(vm::OpcodeMiner::gram_length(ranked[i].gram), 3);
+      EXPECT_EQ(ranked[i].count, 2);
+      EXPECT_EQ(ranked[i].saved_dispatches, 4);
+   }
+   EXPECT_EQ(ranked.back().saved_dispatches, 2);
+
+   auto in_g = miner.ranked([](auto const& fn) { return fn.pc == 0x40; });
+   ASSERT_EQ(in_g.size(), 1);
+   EXPECT_EQ(vm::OpcodeMiner::gram_name(in_g[0].gram), "inc return");
+
+   std::stringstream json;
+   std::vector<std::string> names = {"test"};
+   miner.write_json(
+      json, names, [](int, int pc) { return std::to_string(pc); }, 1
+   );
+   EXPECT_NE(json.str().find("\"instructions\": 16"), std::string::npos);
+   EXPECT_NE(json.str().find("\"taken_ratio\": 1.0000"), std::string::npos);
+}
@@ -1,6 +1,10 @@
 #include "BytecodeModule.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <optional>
 #include <vector>
 
 using namespace std::string_view_literals;
@@ -95,4 +99,207 @@ TEST(ParseModuleHeader, ExportByName_RetrievesExports) {
    ASSERT_TRUE(exp.has_value());
    EXPECT_EQ(exp->name, "wow"sv);
    EXPECT_EQ(exp->bytecode_offset, 0xC0DE);
-}
\ No newline at end of file
+}
+
+TEST(ParseModuleHeader, CopiedModule_OutlivesOriginal) {
+   std::vector<unsigned char> module_buf = {
+      3, // module name len
+      'a', 'b', 'c',
+      1, // num exports
+      5, // export name len
+      'e', 'n', 't', 'r', 'y',
+      0x00, // export offset LSB
+      0x00, // export offset MSB
+      0x00, // first byte of data/code
+   };
+
+   auto original = vm::BytecodeModule::load(module_buf);
+   ASSERT_TRUE(original.has_value());
+   auto copy = std::optional<vm::BytecodeModule>(*original);
+   original = std::unexpected(vm::Error::InvalidHeader);
+
+   EXPECT_EQ(copy->name(), "abc"sv);
+   auto entry = copy->get_export("entry");
+   ASSERT_TRUE(entry.has_value());
+   EXPECT_EQ(entry->name, "entry"sv);
+   EXPECT_FALSE(copy->get_export("missing").has_value());
+}
+
+TEST(ParseModuleHeader, ImportTable_ParsesNames) {
+   std::vector<unsigned char> module_buf = {
+      0, // versioned header
+      2, // version with imports
+      1, // module name len
+      'm',
+      1, // num exports
+      1, // export name len
+      'f',
+      0x00, // export offset LSB
+      0x00, // export offset MSB
+      2,    // num imports
+      3,    // import name len
+      'l',  'i', 'b',
+      6, // import name len
+      's',  'y', 's', 't', 'e', 'm',
+      0xEE, // first byte of data/code
+   };
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(result->name(), "m"sv);
+   ASSERT_EQ(result->imports().size(), 2);
+   EXPECT_EQ(result->imports()[0], "lib"sv);
+   EXPECT_EQ(result->imports()[1], "system"sv);
+   EXPECT_EQ(result->import_id(0), -1);
+   EXPECT_EQ(result->import_id(2), -1);
+   EXPECT_EQ(result->code()[0], 0xEE);
+}
+
+TEST(ParseModuleHeader, UnknownHeaderVersion_Fails) {
+   std::vector<unsigned char> module_buf = {0, 9, 1, 'm', 0, 0};
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   EXPECT_FALSE(result.has_value());
+   EXPECT_EQ(result.error(), vm::Error::InvalidHeader);
+}
+
+TEST(ParseModuleHeader, WideHeader_HasFourByteOffsets) {
+   std::vector<unsigned char> module_buf = {
+      0,    // versioned header
+      0x82, // version with imports, wide
+      1,    // module name len
+      'm',
+      1, // num exports
+      1, // export name len
+      'f',
+      0x01, // export offset LSB
+      0x00, 0x01,
+      0x00, // export offset MSB
+      0,    // num imports
+      0xEE, // first byte of data/code
+   };
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(result->word_size(), 4);
+   EXPECT_EQ(result->nth_export(0)->bytecode_offset, 0x10001);
+   EXPECT_EQ(result->code()[0], 0xEE);
+}
+
+TEST(ParseModuleHeader, SegmentTable_AllocatesZeroedBss) {
+   std::vector<unsigned char> module_buf = {
+      0, // versioned header
+      3, // version with segments
+      2,
+      0, // code size
+      1,
+      0, // data size
+      4,
+      0, // bss size
+      1, // module name len
+      'm',
+      0,    // num exports
+      0,    // num imports
+      0x10, // code
+      0x11,
+      0xDA, // data
+   };
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   ASSERT_TRUE(result.has_value());
+   auto segments = result->segments();
+   EXPECT_EQ(segments.code_size, 2);
+   EXPECT_EQ(segments.data_size, 1);
+   EXPECT_EQ(segments.bss_size, 4);
+   EXPECT_EQ(
+      std::vector(result->code().begin(), result->code().end()),
+      (std::vector<unsigned char>{0x10, 0x11, 0xDA, 0, 0, 0, 0})
+   );
+}
+
+TEST(ParseModuleHeader, SegmentSizesNotMatchingFile_Fails) {
+   std::vector<unsigned char> module_buf = {
+      0, 3, 2, 0, 2, 0, 4, 0, 1, 'm', 0, 0, 0x10, 0x11, 0xDA,
+   };
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   EXPECT_FALSE(result.has_value());
+   EXPECT_EQ(result.error(), vm::Error::InvalidHeader);
+}
+
+TEST(ParseModuleHeader, UnsegmentedModule_IsAllCode) {
+   std::vector<unsigned char> module_buf = {1, 'm', 0, 0xEE, 0xEF};
+
+   auto result = vm::BytecodeModule::load(module_buf);
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(result->segments().code_size, 2);
+   EXPECT_EQ(result->segments().data_size, 0);
+   EXPECT_EQ(result->segments().bss_size, 0);
+}
+
+#if MODULE_HAS_MMAP
+namespace {
+
+std::filesystem::path write_temp_module(
+   std::string const& name, std::vector<unsigned char> const& bytes
+) {
+   auto path = std::filesystem::temp_directory_path() / name;
+   std::ofstream(path, std::ios::binary)
+      .write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+   return path;
+}
+
+} // namespace
+
+TEST(ParseModuleHeader, LoadFile_MapsCodeDataAndBss) {
+   std::vector<unsigned char> module_buf = {
+      0, 3, 2, 0, 1, 0, 0x00, 0x20, 1, 'm', 1, 1, 'f', 0x00, 0x00, 0,
+      0x10, 0x11, // code
+      0xDA,       // data
+   };
+   auto path = write_temp_module("vm_tests_load_file.bin", module_buf);
+
+   auto result = vm::BytecodeModule::load_file(path.c_str());
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(result->name(), "m"sv);
+   EXPECT_EQ(result->get_export("f")->bytecode_offset, 0);
+   auto code = result->code();
+   ASSERT_EQ(code.size(), 3 + 0x2000);
+   EXPECT_EQ(code[0], 0x10);
+   EXPECT_EQ(code[2], 0xDA);
+   EXPECT_TRUE(std::all_of(code.begin() + 3, code.end(), [](auto byte) {
+      return byte == 0;
+   }));
+
+   // writes go to the module's private copy, never the file
+   code[2] = 0x55;
+   code[0x1000] = 0x66;
+   auto copy = *result;
+   result = vm::BytecodeModule::load_file(path.c_str());
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(result->code()[2], 0xDA);
+   EXPECT_EQ(result->code()[0x1000], 0);
+   EXPECT_EQ(copy.name(), "m"sv);
+   EXPECT_EQ(copy.code()[2], 0x55);
+   EXPECT_EQ(copy.code()[0x1000], 0x66);
+   std::filesystem::remove(path);
+}
+
+TEST(ParseModuleHeader, LoadFile_InvalidHeader_Fails) {
+   auto path = write_temp_module("vm_tests_bad_header.bin", {0, 9, 1, 'm'});
+
+   auto result = vm::BytecodeModule::load_file(path.c_str());
+   EXPECT_FALSE(result.has_value());
+   EXPECT_EQ(result.error(), vm::Error::InvalidHeader);
+   std::filesystem::remove(path);
+}
+
+TEST(ParseModuleHeader, LoadFile_MissingFile_Fails) {
+   auto path = std::filesystem::temp_directory_path() / "vm_tests_missing.bin";
+   std::filesystem::remove(path);
+
+   auto result = vm::BytecodeModule::load_file(path.c_str());
+   EXPECT_FALSE(result.has_value());
+   EXPECT_EQ(result.error(), vm::Error::FileUnreadable);
+}
+#endif
@@ -0,0 +1,147 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "Profiler.hpp"
+#include "TestPlatform.hpp"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <optional>
+#include <sstream>
+#include <string>
+
+namespace {
+
+/// @brief fn 0 ( n -- )
+class DropSystem final : public vm::ISystemModule {
+public:
+   DropSystem() : vm::ISystemModule("system") {}
+
+   void invoke_index(vm::Machine& machine, int) override {
+      machine.stack().pop();
+   }
+
+   std::optional<vm::StackEffect> stack_effect(int) const override {
+      return vm::StackEffect{1, 0};
+   }
+};
+
+vm::Profiler::FunctionStats const* find_function(
+   std::vector<vm::Profiler::FunctionStats> const& functions,
+   std::string_view name
+) {
+   for(auto const& fn : functions) {
+      if(fn.name == name) {
+         return &fn;
+      }
+   }
+   return nullptr;
+}
+
+} // namespace
+
+TEST(Profiler, Events_BuildCallTree) {
+   BytecodeBuilder b("test");
+   b.label("helper").op(vm::I_NOP).op(vm::I_RETURN);
+   b.label("entry").op(vm::I_RETURN).export_fn("entry");
+   auto bytes = b.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   ASSERT_TRUE(mod.has_value());
+   DropSystem system;
+
+   vm::Profiler profiler;
+   auto helper = b.address_of("helper");
+   auto entry = b.address_of("entry");
+   profiler.begin(*mod, 0, entry);
+   profiler.instruction(0, entry, vm::I_CALL_IMM);
+   for(int i = 0; i < 2; ++i) {
+      profiler.call(*mod, 0, helper);
+      profiler.instruction(0, helper, vm::I_NOP);
+      profiler.instruction(0, helper + 1, vm::I_RETURN);
+      profiler.ret();
+   }
+   profiler.enter_system(system.name(), 0x4000, 0);
+   profiler.leave_system();
+   // an error part way through a call, end() unwinds it
+   profiler.call(*mod, 0, helper);
+   profiler.end();
+
+   EXPECT_EQ(profiler.total_instructions(), 5);
+   EXPECT_EQ(profiler.opcode_counts()[vm::I_NOP], 2);
+   EXPECT_EQ(profiler.pc_counts(0)[helper], 2);
+   EXPECT_TRUE(profiler.pc_counts(1).empty());
+
+   auto functions = profiler.functions();
+   ASSERT_EQ(functions.size(), 3);
+   EXPECT_EQ(functions[0].name, "test:entry");
+   EXPECT_EQ(functions[0].calls, 1);
+   EXPECT_EQ(functions[0].self_instructions, 1);
+   EXPECT_EQ(functions[0].total_instructions, 5);
+   char helper_name[16];
+   std::snprintf(helper_name, sizeof(helper_name), "test:0x%04x", helper);
+   auto helper_stats = find_function(functions, helper_name);
+   ASSERT_NE(helper_stats, nullptr);
+   EXPECT_EQ(helper_stats->calls, 3);
+   EXPECT_EQ(helper_stats->self_instructions, 4);
+   auto system_stats = find_function(functions, "system:0");
+   ASSERT_NE(system_stats, nullptr);
+   EXPECT_EQ(system_stats->calls, 1);
+
+   std::ostringstream folded;
+   profiler.write_folded(folded, vm::Profiler::Weight::Instructions);
+   EXPECT_EQ(
+      folded.str(),
+      "test:entry 1\ntest:entry;" + std::string(helper_name) + " 4\n"
+   );
+}
+
+#if MACHINE_PROFILE
+TEST(Profiler, Machine_CountsEveryInstructionOnEveryEngine) {
+   BytecodeBuilder b("test");
+   b.label("square").op(vm::I_DUP).op(vm::I_MUL).op(vm::I_RETURN);
+   b.label("entry")
+      .push(0)
+      .push(0)
+      .push(3)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY).call("square").op(vm::I_ADD);
+      })
+      .push_module("system")
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry")
+      .export_fn("square");
+   auto bytes = b.build();
+
+   std::optional<std::uint64_t> expected;
+   for(auto engine :
+       {vm::Engine::Switch, vm::Engine::Threaded, vm::Engine::Jit}) {
+      NullPlatform platform;
+      DropSystem system;
+      auto machine = vm::Machine(platform);
+      machine.set_engine(engine);
+      machine.add_system_module(&system);
+      machine.add_module(*vm::BytecodeModule::load(bytes));
+      vm::Profiler profiler;
+      machine.set_profiler(&profiler);
+      ASSERT_EQ(machine.execute("test", "entry"), std::nullopt);
+
+      auto functions = profiler.functions();
+      auto square = find_function(functions, "test:square");
+      auto entry = find_function(functions, "test:entry");
+      ASSERT_NE(square, nullptr);
+      ASSERT_NE(entry, nullptr);
+      EXPECT_EQ(square->calls, 3);
+      EXPECT_EQ(square->self_instructions, 9);
+      EXPECT_EQ(entry->total_instructions, profiler.total_instructions());
+      EXPECT_EQ(profiler.opcode_counts()[vm::I_CALL_IMM], 3);
+      EXPECT_NE(find_function(functions, "system:0"), nullptr);
+
+      if(!expected) {
+         auto fn = machine.resolve("test", "entry");
+         machine.set_profiler(nullptr);
+         expected = machine.execute_counted(*fn).value();
+      }
+      EXPECT_EQ(profiler.total_instructions(), *expected);
+   }
+}
+#endif
@@ -0,0 +1,109 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "SharedModule.hpp"
+#include "TestPlatform.hpp"
+#include <gtest/gtest.h>
+#include <optional>
+#include <vector>
+
+namespace {
+
+/// @brief `next` increments and returns a counter in the data segment,
+/// `value` returns the immediate at `imm` and `patch` overwrites it
+BytecodeBuilder counter_module() {
+   BytecodeBuilder b("test");
+   b.label("next")
+      .push_addr("counter")
+      .op(vm::I_LOAD_WORD)
+      .op(vm::I_INC)
+      .op(vm::I_DUP)
+      .push_addr("counter")
+      .op(vm::I_STORE_WORD)
+      .op(vm::I_RETURN)
+      .export_fn("next");
+   b.label("value").label("imm").push(5).op(vm::I_RETURN).export_fn("value");
+   b.label("patch")
+      .push(9)
+      .push_addr("imm")
+      .push(1)
+      .op(vm::I_ADD)
+      .op(vm::I_STORE_BYTE)
+      .op(vm::I_RETURN)
+      .export_fn("patch");
+   b.data().label("counter").word(100).bss("scratch", 64);
+   return b;
+}
+
+int call(vm::Machine& machine, char const* fn) {
+   EXPECT_EQ(machine.execute("test", fn), std::nullopt);
+   return machine.stack().pop();
+}
+
+} // namespace
+
+TEST(SharedModule, Instances_KeepTheirOwnData) {
+   auto bytes = counter_module().build();
+   auto shared = vm::SharedModule::load(bytes);
+   ASSERT_TRUE(shared.has_value());
+
+   NullPlatform platform;
+   vm::Machine a(platform);
+   vm::Machine b(platform);
+   a.add_module(shared->instantiate());
+   b.add_module(shared->instantiate());
+
+   EXPECT_EQ(call(a, "next"), 101);
+   EXPECT_EQ(call(a, "next"), 102);
+   EXPECT_EQ(call(b, "next"), 101);
+
+   // a new instance starts from the module as it was shared
+   vm::Machine c(platform);
+   c.add_module(shared->instantiate());
+   EXPECT_EQ(call(c, "next"), 101);
+}
+
+TEST(SharedModule, SelfModifyingInstance_LeavesOthersAlone) {
+   auto bytes = counter_module().build();
+   auto shared = vm::SharedModule::load(bytes).value();
+
+   NullPlatform platform;
+   vm::Machine a(platform);
+   vm::Machine b(platform);
+   a.add_module(shared.instantiate());
+   b.add_module(shared.instantiate());
+
+   EXPECT_EQ(call(a, "value"), 5);
+   EXPECT_EQ(call(b, "value"), 5);
+   EXPECT_EQ(a.execute("test", "patch"), std::nullopt);
+   EXPECT_EQ(call(a, "value"), 9);
+   EXPECT_EQ(call(b, "value"), 5);
+
+   vm::Machine c(platform);
+   c.add_module(shared.instantiate());
+   EXPECT_EQ(call(c, "value"), 5);
+}
+
+TEST(SharedModule, Instances_ShareTheImage) {
+   auto builder = counter_module();
+   auto bytes = builder.build();
+   auto shared = vm::SharedModule::load(bytes).value();
+#if MODULE_HAS_SHARED_PAGES
+   EXPECT_TRUE(shared.is_shared());
+#endif
+
+   auto first = shared.instantiate();
+   auto second = shared.instantiate();
+   EXPECT_EQ(first.name(), "test");
+   EXPECT_EQ(first.name().data(), second.name().data());
+   EXPECT_EQ(first.code().size(), builder.address_of("scratch") + 64);
+   EXPECT_NE(first.code().data(), second.code().data());
+
+   // a copy of an instance shares it too
+   auto copy = first;
+   EXPECT_EQ(copy.name().data(), first.name().data());
+}
+
+TEST(SharedModule, InvalidModule_FailsToLoad) {
+   std::vector<unsigned char> bytes = {0, 7};
+   EXPECT_EQ(vm::SharedModule::load(bytes).error(), vm::Error::InvalidHeader);
+}
@@ -0,0 +1,117 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "SnapshotRing.hpp"
+#include "TestPlatform.hpp"
+#include <gtest/gtest.h>
+#include <optional>
+
+namespace {
+
+/// @brief a machine whose `frame` bumps a counter in a module with a few
+/// pages of memory
+class SnapshotRingTest : public testing::Test {
+protected:
+   NullPlatform m_platform;
+   vm::Machine m_machine{m_platform};
+
+   void SetUp() override {
+      BytecodeBuilder b("test");
+      b.label("frame")
+         .push_addr("counter")
+         .op(vm::I_LOAD_WORD)
+         .op(vm::I_INC)
+         .push_addr("counter")
+         .op(vm::I_STORE_WORD)
+         .op(vm::I_RETURN)
+         .export_fn("frame");
+      b.data().label("counter").word(0).bss("scratch", 2048);
+      auto bytes = b.build();
+      m_counter = b.address_of("counter");
+      m_machine.add_module(*vm::BytecodeModule::load(bytes));
+   }
+
+   void frame() {
+      EXPECT_EQ(m_machine.execute("test", "frame"), std::nullopt);
+   }
+
+   int counter() {
+      auto code = m_machine.module_by_index(0).code();
+      return code[m_counter] | code[m_counter + 1] << 8;
+   }
+
+private:
+   int m_counter = 0;
+};
+
+} // namespace
+
+TEST_F(SnapshotRingTest, Push_DropsOldestPastCapacity) {
+   vm::SnapshotRing ring(3);
+   for(int i = 0; i < 5; ++i) {
+      frame();
+      ring.push(m_machine);
+   }
+   ASSERT_EQ(ring.size(), 3);
+   EXPECT_TRUE(ring.restore(m_machine, 0));
+   EXPECT_EQ(counter(), 3);
+   EXPECT_TRUE(ring.restore(m_machine, 2));
+   EXPECT_EQ(counter(), 5);
+   EXPECT_FALSE(ring.restore(m_machine, 3));
+}
+
+TEST_F(SnapshotRingTest, MemoryBytes_CountsOnlyWrittenPages) {
+   vm::SnapshotRing ring;
+   ring.push(m_machine);
+   auto first = ring.memory_bytes();
+   EXPECT_GT(first, m_machine.module_by_index(0).code().size());
+
+   for(int i = 0; i < 10; ++i) {
+      frame();
+      ring.push(m_machine);
+   }
+   // each frame wrote the one page holding the counter
+   auto per_frame = (ring.memory_bytes() - first) / 10;
+   EXPECT_GE(per_frame, vm::Machine::Snapshot::PAGE_SIZE);
+   EXPECT_LT(per_frame, first);
+
+   ring.truncate(1);
+   EXPECT_EQ(ring.memory_bytes(), first);
+   ring.clear();
+   EXPECT_EQ(ring.memory_bytes(), 0);
+}
+
+TEST_F(SnapshotRingTest, MaxBytes_BoundsMemory) {
+   vm::SnapshotRing probe;
+   probe.push(m_machine);
+   auto max_bytes = probe.memory_bytes() * 2;
+
+   vm::SnapshotRing ring(vm::SnapshotRing::DEFAULT_CAPACITY, max_bytes);
+   for(int i = 0; i < 100; ++i) {
+      frame();
+      ring.push(m_machine);
+      EXPECT_LE(ring.memory_bytes(), max_bytes);
+   }
+   EXPECT_GT(ring.size(), 1);
+   EXPECT_LT(ring.size(), 100);
+
+   // dropping old snapshots kept the pages newer ones share
+   EXPECT_TRUE(ring.restore(m_machine, 0));
+   EXPECT_EQ(counter(), 100 - ring.size() + 1);
+}
+
+TEST_F(SnapshotRingTest, Rewind_ContinuesFromRestoredFrame) {
+   vm::SnapshotRing ring;
+   for(int i = 0; i < 5; ++i) {
+      frame();
+      ring.push(m_machine);
+   }
+   EXPECT_TRUE(ring.restore(m_machine, 1));
+   ring.truncate(2);
+   frame();
+   ring.push(m_machine);
+
+   ASSERT_EQ(ring.size(), 3);
+   EXPECT_EQ(counter(), 3);
+   EXPECT_TRUE(ring.restore(m_machine, 2));
+   EXPECT_EQ(counter(), 3);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+#include "BytecodeModule.hpp"
+#include "IPlatform.hpp"
+
+/// @brief Platform with no modules, for tests that add every module they
+/// need themselves
+class NullPlatform final : public vm::IPlatform {
+public:
+   std::optional<vm::BytecodeModule> get_module(std::string_view) override {
+      return std::nullopt;
+   }
+};
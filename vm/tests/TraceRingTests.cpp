@@ -0,0 +1,107 @@
+#include "BytecodeBuilder.hpp"
+#include "Machine.hpp"
+#include "TestPlatform.hpp"
+#include "TraceRing.hpp"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+TEST(TraceRing, Wraparound_KeepsLatestInOrder) {
+   vm::TraceRing ring(4);
+   ASSERT_EQ(ring.capacity(), 7);
+   for(int i = 0; i < 10; ++i) {
+      ring.record(vm::TraceRecord{static_cast<std::uint16_t>(i)});
+   }
+
+   EXPECT_EQ(ring.recorded(), 10);
+   auto records = ring.snapshot();
+   ASSERT_EQ(records.size(), 7);
+   for(int i = 0; i < 7; ++i) {
+      EXPECT_EQ(records[i].pc, 3 + i);
+   }
+   EXPECT_EQ(ring.snapshot(2).front().pc, 8);
+}
+
+TEST(TraceRing, Dump_RoundTripsAndDecodes) {
+   BytecodeBuilder b("test");
+   b.label("entry").push(-5).op(vm::I_RETURN).export_fn("entry");
+   auto bytes = b.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   ASSERT_TRUE(mod.has_value());
+   auto entry = b.address_of("entry");
+
+   vm::TraceRing ring(16);
+   vm::TraceRecord push{static_cast<std::uint16_t>(entry), vm::I_PUSH_IMM};
+   vm::TraceRecord ret{
+      static_cast<std::uint16_t>(entry + 3), vm::I_RETURN, 0, -5, 1
+   };
+   ring.record(push);
+   ring.record(ret);
+
+   std::stringstream out;
+   std::vector<std::string_view> names = {"test"};
+   ring.write(out, names);
+   auto dump = vm::read_trace(out);
+   ASSERT_TRUE(dump.has_value());
+   EXPECT_EQ(dump->recorded, 2);
+   EXPECT_EQ(dump->module_names, std::vector<std::string>{"test"});
+   EXPECT_EQ(dump->records, (std::vector<vm::TraceRecord>{push, ret}));
+
+   char expected[64];
+   std::snprintf(
+      expected, sizeof(expected), "test:0x%04x push_imm -5   ( )", entry
+   );
+   EXPECT_EQ(
+      vm::format_trace_record(push, dump->module_names, mod->code()),
+      expected
+   );
+   std::snprintf(
+      expected, sizeof(expected), "test:0x%04x return   ( 1 items, tos -5 )",
+      entry + 3
+   );
+   EXPECT_EQ(vm::format_trace_record(ret, dump->module_names), expected);
+
+   std::stringstream garbage("not a trace");
+   EXPECT_EQ(vm::read_trace(garbage).error(), vm::Error::InvalidHeader);
+}
+
+#if MACHINE_TRACE
+TEST(TraceRing, Machine_RecordsInstructionsUpToFault) {
+   BytecodeBuilder b("test");
+   b.label("entry")
+      .push(0)
+      .push(0)
+      .push(3)
+      .for_loop([](BytecodeBuilder& body) { body.op(vm::I_INC); })
+      .op(vm::I_DROP)
+      .op(vm::I_DROP)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+   auto bytes = b.build();
+
+   NullPlatform platform;
+   auto machine = vm::Machine(platform);
+   machine.set_engine(vm::Engine::Threaded);
+   machine.add_module(*vm::BytecodeModule::load(bytes));
+   vm::TraceRing ring(7);
+   machine.set_trace(&ring);
+   EXPECT_EQ(machine.execute("test", "entry"), vm::Error::StackUnderflow);
+
+   auto records = ring.snapshot();
+   ASSERT_EQ(records.size(), 7);
+   // the fault is the second drop, on an empty stack
+   EXPECT_EQ(records.back().opcode, vm::I_DROP);
+   EXPECT_EQ(records.back().depth, 0);
+   EXPECT_EQ(records[records.size() - 2].opcode, vm::I_DROP);
+   EXPECT_EQ(records[records.size() - 2].depth, 1);
+   EXPECT_EQ(records[records.size() - 2].tos, 3);
+
+   machine.set_trace(nullptr);
+   ring.clear();
+   EXPECT_EQ(machine.execute("test", "entry"), vm::Error::StackUnderflow);
+   EXPECT_EQ(ring.recorded(), 0);
+}
+#endif
@@ -0,0 +1,166 @@
+#include "BytecodeBuilder.hpp"
+#include "BytecodeModule.hpp"
+#include "Verifier.hpp"
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace {
+
+using VerifyResult =
+   std::expected<std::vector<vm::FunctionSummary>, vm::VerifyError>;
+
+VerifyResult verify_exports(
+   BytecodeBuilder const& builder, vm::ExternSummary const& extern_summary =
+                                      [](int, int) { return std::nullopt; }
+) {
+   auto bytes = builder.build();
+   auto mod = vm::BytecodeModule::load(bytes);
+   EXPECT_TRUE(mod.has_value());
+   std::vector<int> entries;
+   for(int i = 0; auto entry = mod->nth_export(i); ++i) {
+      entries.push_back(entry->bytecode_offset);
+   }
+   return vm::verify(mod->code(), entries, extern_summary);
+}
+
+} // namespace
+
+TEST(Verifier, StraightLineCode_SummarisesStackUse) {
+   BytecodeBuilder b("m");
+   b.label("entry")
+      .push(1)
+      .push(2)
+      .push(3)
+      .op(vm::I_ADD)
+      .op(vm::I_ADD)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = verify_exports(b);
+   ASSERT_TRUE(result.has_value());
+   auto summary = (*result)[0];
+   EXPECT_EQ(summary.inputs, 0);
+   EXPECT_EQ(summary.net, 1);
+   EXPECT_EQ(summary.max_depth, 3);
+   EXPECT_EQ(summary.max_return_depth, 0);
+}
+
+TEST(Verifier, LoopsAndCalls_AddCalleeUsage) {
+   BytecodeBuilder b("m");
+   b.label("square").op(vm::I_DUP).op(vm::I_MUL).op(vm::I_RETURN);
+   b.label("entry")
+      .push(0)
+      .push(0)
+      .push(4)
+      .for_loop([](BytecodeBuilder& body) {
+         body.op(vm::I_RCOPY).call("square").op(vm::I_ADD);
+      })
+      .op(vm::I_RETURN)
+      .export_fn("entry")
+      .export_fn("square");
+
+   auto result = verify_exports(b);
+   ASSERT_TRUE(result.has_value());
+   auto entry = (*result)[0];
+   EXPECT_EQ(entry.inputs, 0);
+   EXPECT_EQ(entry.net, 1);
+   EXPECT_EQ(entry.max_depth, 3);
+   // loop bounds plus the return address of the call
+   EXPECT_EQ(entry.max_return_depth, 3);
+   auto square = (*result)[1];
+   EXPECT_EQ(square.inputs, 1);
+   EXPECT_EQ(square.net, 0);
+   EXPECT_EQ(square.max_depth, 1);
+}
+
+TEST(Verifier, GrowingLoop_IsRejected) {
+   BytecodeBuilder b("m");
+   b.label("entry").push(1).jump("entry").export_fn("entry");
+
+   auto result = verify_exports(b);
+   ASSERT_FALSE(result.has_value());
+   EXPECT_EQ(result.error().pc, b.address_of("entry"));
+   EXPECT_EQ(result.error().reason, "stack depth differs between paths");
+}
+
+TEST(Verifier, Recursion_IsRejected) {
+   BytecodeBuilder b("m");
+   b.label("down")
+      .op(vm::I_DUP)
+      .bfalse("done")
+      .op(vm::I_DEC)
+      .call("down")
+      .label("done")
+      .op(vm::I_RETURN);
+   b.label("entry").push(3).call("down").op(vm::I_RETURN).export_fn("entry");
+
+   auto result = verify_exports(b);
+   ASSERT_FALSE(result.has_value());
+   EXPECT_EQ(result.error().reason, "recursive call");
+}
+
+TEST(Verifier, PopPastReturnAddress_IsRejected) {
+   BytecodeBuilder b("m");
+   b.label("entry").op(vm::I_RPOP).op(vm::I_RETURN).export_fn("entry");
+
+   auto result = verify_exports(b);
+   ASSERT_FALSE(result.has_value());
+   EXPECT_EQ(result.error().reason, "return stack pop past the return address");
+}
+
+TEST(Verifier, BranchOutsideCode_IsRejected) {
+   BytecodeBuilder b("m");
+   b.label("entry").push(0).op(vm::I_BTRUE_IMM).word(0x7000);
+   b.op(vm::I_RETURN).export_fn("entry");
+
+   auto result = verify_exports(b);
+   ASSERT_FALSE(result.has_value());
+   EXPECT_EQ(result.error().pc, b.address_of("entry") + 3);
+   EXPECT_EQ(result.error().reason, "branch outside the code");
+}
+
+TEST(Verifier, ExternCall_UsesCalleeSummary) {
+   BytecodeBuilder b("m");
+   b.label("entry")
+      .push(1)
+      .push(2)
+      .push_module("lib")
+      .push(5)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   std::vector<std::pair<int, int>> calls;
+   auto result = verify_exports(b, [&](int import_index, int fn_id) {
+      calls.emplace_back(import_index, fn_id);
+      return vm::FunctionSummary{2, -1, 4, 2};
+   });
+   ASSERT_TRUE(result.has_value());
+   EXPECT_EQ(calls, (std::vector<std::pair<int, int>>{{0, 5}}));
+   auto summary = (*result)[0];
+   EXPECT_EQ(summary.net, 1);
+   EXPECT_EQ(summary.max_depth, 6);
+   EXPECT_EQ(summary.max_return_depth, 2);
+
+   auto unknown = verify_exports(b);
+   ASSERT_FALSE(unknown.has_value());
+   EXPECT_EQ(unknown.error().reason, "extern_call with unknown stack effect");
+}
+
+TEST(Verifier, LoadModuleExternCall_IsRejected) {
+   BytecodeBuilder b("m");
+   b.label("name").byte('l').byte('i').byte('b').byte(0);
+   b.label("entry")
+      .push_addr("name")
+      .op(vm::I_LOAD_MODULE)
+      .push(0)
+      .op(vm::I_EXTERN_CALL)
+      .op(vm::I_RETURN)
+      .export_fn("entry");
+
+   auto result = verify_exports(b, [](int, int) {
+      return vm::FunctionSummary{};
+   });
+   ASSERT_FALSE(result.has_value());
+   EXPECT_EQ(result.error().reason, "extern_call target only known at runtime");
+}
@@ -0,0 +1,193 @@
+// Opcode n-gram and branch miner, for choosing superinstructions and new
+// opcodes from real runs.
+//
+// usage: vm_mine program.bin [module.bin ...] [--frames n] [--top n]
+//                [--ring records] [--replay keys.log] [-o out.json]
+//
+// Runs `entry` of program.bin and then `frame` n times (default 600, ten
+// seconds of pc_port) with a trace attached, without a window: keys are never
+// down, unless played back from a `pc_port --record` log, and graphics only
+// write to module memory. Other modules are served to
+// load_module and push_module by name. Every call is fed to a
+// vm::OpcodeMiner, and its JSON goes to stdout or out.json.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "HeadlessModules.hpp"
+#include "IPlatform.hpp"
+#include "InputLog.hpp"
+#include "Machine.hpp"
+#include "OpcodeMiner.hpp"
+#include "TraceRing.hpp"
+
+namespace {
+
+std::vector<unsigned char> read_file(char const* filename) {
+   std::ifstream file(filename, std::ios::binary);
+   return {std::istreambuf_iterator<char>(file), {}};
+}
+
+/// @brief serves the modules given after program.bin
+class FilePlatform final : public vm::IPlatform {
+public:
+   std::optional<vm::BytecodeModule> get_module(std::string_view name
+   ) override {
+      for(auto const& bytes : modules) {
+         auto mod = vm::BytecodeModule::load(bytes);
+         if(mod.has_value() && mod->name() == name) {
+            return std::move(*mod);
+         }
+      }
+      return std::nullopt;
+   }
+
+   std::vector<std::vector<unsigned char>> modules;
+};
+
+void usage() {
+   std::printf(
+      "usage: vm_mine program.bin [module.bin ...] [--frames n] [--top n]\n"
+      "               [--ring records] [--replay keys.log] [-o out.json]\n"
+   );
+   std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+   char const* program = nullptr;
+   char const* output = nullptr;
+   int frames = 600;
+   int top = 20;
+   std::size_t ring_size = (1 << 20) - 1;
+   char const* replay_path = nullptr;
+   FilePlatform platform;
+   for(int i = 1; i < argc; ++i) {
+      auto arg = std::string_view(argv[i]);
+      if(arg == "--frames" && i + 1 < argc) {
+         frames = std::atoi(argv[++i]);
+      } else if(arg == "--top" && i + 1 < argc) {
+         top = std::atoi(argv[++i]);
+      } else if(arg == "--ring" && i + 1 < argc) {
+         ring_size = std::strtoull(argv[++i], nullptr, 10);
+      } else if(arg == "--replay" && i + 1 < argc) {
+         replay_path = argv[++i];
+      } else if(arg == "-o" && i + 1 < argc) {
+         output = argv[++i];
+      } else if(arg.starts_with("-")) {
+         usage();
+      } else if(!program) {
+         program = argv[i];
+      } else {
+         platform.modules.push_back(read_file(argv[i]));
+      }
+   }
+   if(!program) {
+      usage();
+   }
+
+#if MODULE_HAS_MMAP
+   auto mod = vm::BytecodeModule::load_file(program);
+#else
+   auto mod = vm::BytecodeModule::load(read_file(program));
+#endif
+   if(!mod.has_value()) {
+      std::printf("%s: %s\n", program, vm::error_to_str(mod.error()).data());
+      return 1;
+   }
+   auto name = std::string(mod->name());
+
+   vm::HeadlessSystem system;
+   vm::HeadlessGraphics graphics;
+   vm::InputLog replay;
+   if(replay_path) {
+      std::ifstream in(replay_path, std::ios::binary);
+      auto log = vm::InputLog::read(in);
+      if(!log.has_value()) {
+         std::printf(
+            "%s: %s\n", replay_path, vm::error_to_str(log.error()).data()
+         );
+         return 1;
+      }
+      replay = std::move(*log);
+      graphics.keys = [&replay](int frame, int key) {
+         return replay.is_down(frame, key);
+      };
+   }
+   vm::Machine machine(platform);
+   machine.add_system_module(&system);
+   machine.add_system_module(&graphics);
+   machine.add_module(std::move(*mod));
+
+   vm::TraceRing ring(ring_size);
+   vm::OpcodeMiner miner;
+   machine.set_trace(&ring);
+
+   std::uint64_t lost = 0;
+   auto run = [&](vm::FunctionHandle const& fn) {
+      ring.clear();
+      auto error = machine.execute(fn);
+      if(ring.recorded() > ring.capacity()) {
+         // the start of the call is gone, so is the call stack
+         lost += ring.recorded() - ring.capacity();
+      }
+      miner.add(ring.snapshot());
+      miner.end_call();
+      if(error.has_value()) {
+         std::printf("%s\n", vm::error_to_str(*error).data());
+         std::exit(1);
+      }
+   };
+
+   auto entry = machine.resolve(name, "entry");
+   if(!entry.has_value()) {
+      std::printf("%s\n", vm::error_to_str(entry.error()).data());
+      return 1;
+   }
+   run(*entry);
+   if(auto frame = machine.resolve(name, "frame"); frame.has_value()) {
+      for(int i = 0; i < frames; ++i) {
+         graphics.frame = i + 1;
+         run(*frame);
+      }
+   }
+   if(lost != 0) {
+      std::fprintf(
+         stderr, "%llu instructions didn't fit in the ring, use --ring\n",
+         static_cast<unsigned long long>(lost)
+      );
+   }
+
+   std::vector<std::string> module_names;
+   for(int i = 0; i < machine.module_count(); ++i) {
+      module_names.emplace_back(machine.module_by_index(i).name());
+   }
+   auto name_function = [&](int module, int pc) {
+      auto const& mod = machine.module_by_index(module);
+      for(int i = 0; auto entry = mod.nth_export(i); ++i) {
+         if(entry->bytecode_offset == pc) {
+            return module_names[module] + ":" + std::string(entry->name);
+         }
+      }
+      char buf[16];
+      std::snprintf(buf, sizeof(buf), ":0x%04x", pc);
+      return module_names[module] + buf;
+   };
+
+   if(output) {
+      std::ofstream out(output);
+      miner.write_json(out, module_names, name_function, top);
+      return out ? 0 : 1;
+   }
+   miner.write_json(std::cout, module_names, name_function, top);
+   return 0;
+}
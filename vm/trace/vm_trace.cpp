@@ -0,0 +1,101 @@
+// Decoder for traces written by vm::TraceRing::write().
+//
+// usage: vm_trace trace.bin [module.bin ...] [--last n]
+//
+// Prints one instruction per line, oldest first, numbered from the start of
+// the run. Immediates are read from whichever module.bin has the same name as
+// the traced module, if given; code the program patched since shows its
+// current value.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "BytecodeModule.hpp"
+#include "TraceRing.hpp"
+
+namespace {
+
+void usage() {
+   std::printf("usage: vm_trace trace.bin [module.bin ...] [--last n]\n");
+   std::exit(1);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+   char const* trace_file = nullptr;
+   std::vector<char const*> module_files;
+   std::size_t last = static_cast<std::size_t>(-1);
+   for(int i = 1; i < argc; ++i) {
+      auto arg = std::string_view(argv[i]);
+      if(arg == "--last" && i + 1 < argc) {
+         last = std::strtoull(argv[++i], nullptr, 10);
+      } else if(arg.starts_with("--")) {
+         usage();
+      } else if(!trace_file) {
+         trace_file = argv[i];
+      } else {
+         module_files.push_back(argv[i]);
+      }
+   }
+   if(!trace_file) {
+      usage();
+   }
+
+   std::ifstream in(trace_file, std::ios::binary);
+   auto dump = vm::read_trace(in);
+   if(!dump.has_value()) {
+      std::printf(
+         "%s: %s\n", trace_file, vm::error_to_str(dump.error()).data()
+      );
+      return 1;
+   }
+
+   std::vector<vm::BytecodeModule> modules;
+   for(auto filename : module_files) {
+      std::ifstream file(filename, std::ios::binary);
+      std::vector<unsigned char> bytes(
+         std::istreambuf_iterator<char>(file), {}
+      );
+      auto module = vm::BytecodeModule::load(bytes);
+      if(!module.has_value()) {
+         std::printf(
+            "%s: %s\n", filename, vm::error_to_str(module.error()).data()
+         );
+         return 1;
+      }
+      modules.push_back(std::move(*module));
+   }
+   std::unordered_map<std::string_view, std::span<unsigned char const>> code;
+   for(auto const& module : modules) {
+      code.emplace(module.name(), module.code());
+   }
+
+   auto records = std::span(dump->records);
+   if(records.size() > last) {
+      records = records.last(last);
+   }
+   auto number = dump->recorded - records.size();
+   for(auto const& record : records) {
+      std::span<unsigned char const> module_code;
+      if(record.module < dump->module_names.size()) {
+         auto it = code.find(dump->module_names[record.module]);
+         if(it != code.end()) {
+            module_code = it->second;
+         }
+      }
+      std::printf(
+         "%10llu  %s\n", static_cast<unsigned long long>(number++),
+         vm::format_trace_record(record, dump->module_names, module_code)
+            .c_str()
+      );
+   }
+   return 0;
+}